@@ -0,0 +1,1710 @@
+#include "audioengine.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QHostAddress>
+#include <QStringList>
+
+#include <math.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "trace.h"
+
+// reconnect attempts back off exponentially, each delay jittered by up to
+// half so a room full of clients doesn't hammer a rebooted camera in step
+static const int kReconnectMinMillis = 20;
+static const int kReconnectMaxMillis = 2000;
+static const int kStallCheckIntervalMillis = 100;
+static const int kStallTimeoutMillis = 300;
+static const int kStatsIntervalMillis = 250;
+static const int kLevelsIntervalMillis = 33;
+static const int kClipHoldTicks = 15;
+static const int kFilePacingIntervalMillis = 10;
+static const int kConversionReportMillis = 10000;
+static const int kProbeTimeoutMillis = 3000;
+static const int kProbeMillis = 5;
+static const qint16 kProbeAmplitude = 24000;
+static const int kProbeHz = 1000;
+static const float kProbeMatch = 0.6f;
+static const float kProbeMinLevel = 500.0f;
+
+// device hand over: the crossfade length, how long the next device may
+// wait on a running one that stopped taking or delivering audio, and how
+// long a replaced output device gets past its queue before it's closed
+static const int kCrossfadeMillis = 10;
+static const int kInputSwitchStallMillis = 100;
+static const int kOutputSwitchStallMillis = 500;
+static const int kRetireGraceMillis = 50;
+
+struct LatencyProfileSettings
+{
+  char const* name;
+  int periodMillis;
+  int periodCount;
+};
+
+// device buffers are sized to periodCount periods of the negotiated format
+// and the notify/playout cadence follows the period
+static const LatencyProfileSettings kLatencyProfiles[] =
+{
+  { "standard", 20, 4 },
+  { "low latency", 5, 3 }
+};
+static const int kNumLatencyProfiles = sizeof(kLatencyProfiles) / sizeof(kLatencyProfiles[0]);
+
+static bool
+is_s16(QAudioFormat const& format)
+{
+  return (format.sampleSize() == 16) && (format.sampleType() == QAudioFormat::SignedInt);
+}
+
+// the round trip probe is written and read as plain 16 bit samples
+static bool
+is_probe_format(QAudioFormat const& format)
+{
+  return is_s16(format) && (format.byteOrder() == QAudioFormat::LittleEndian) && (format.channelCount() > 0)
+    && (format.sampleRate() >= (2 * kProbeHz));
+}
+
+// the probe's square wave at frame i of a stream at rate
+static qint16
+probe_sample(qint64 i, int rate)
+{
+  return (((i * 2 * kProbeHz) / rate) % 2) ? kProbeAmplitude : -kProbeAmplitude;
+}
+
+// the stream format as xaudio knows it, false if it can't send it
+static bool
+to_xaudio_format(QAudioFormat const& format, xaudio_format* out)
+{
+  if (format.byteOrder() != QAudioFormat::LittleEndian)
+    return false;
+
+  if (is_s16(format))
+    out->sample_format = XAUDIO_S16LE;
+  else if ((format.sampleSize() == 32) && (format.sampleType() == QAudioFormat::Float))
+    out->sample_format = XAUDIO_F32LE;
+  else
+    return false;
+
+  out->sample_rate = static_cast<uint32_t>(format.sampleRate());
+  out->channels = static_cast<uint8_t>(format.channelCount());
+  return true;
+}
+
+static QAudioFormat
+from_xaudio_format(xaudio_format const& format)
+{
+  QAudioFormat f;
+  f.setSampleRate(static_cast<int>(format.sample_rate));
+  f.setChannelCount(format.channels);
+  f.setCodec("audio/pcm");
+  f.setByteOrder(QAudioFormat::LittleEndian);
+  f.setSampleSize((format.sample_format == XAUDIO_F32LE) ? 32 : 16);
+  f.setSampleType((format.sample_format == XAUDIO_F32LE) ? QAudioFormat::Float : QAudioFormat::SignedInt);
+  return f;
+}
+
+// frames [pos, pos + frames) of a linear crossfade over total frames, from
+// fading out and to fading in. Either side may be null for silence.
+static void
+crossfade_s16(qint16 const* from, qint16 const* to, qint16* dst, qint64 frames, int channels,
+  qint64 pos, qint64 total)
+{
+  for (qint64 i = 0; i < frames; ++i)
+  {
+    qint32 const gain = static_cast<qint32>(((pos + i) << 15) / total);
+    for (int c = 0; c < channels; ++c)
+    {
+      qint64 const k = (i * channels) + c;
+      qint32 const a = from ? from[k] : 0;
+      qint32 const b = to ? to[k] : 0;
+      dst[k] = static_cast<qint16>(((a * (32768 - gain)) + (b * gain)) >> 15);
+    }
+  }
+}
+
+AudioEngineStats::AudioEngineStats()
+  : timestamp(0)
+  , bytesReceived(0)
+  , bytesSent(0)
+  , outputUnderruns(0)
+  , inputOverruns(0)
+  , concealmentEvents(0)
+  , droppedFrames(0)
+  , concealedFrames(0)
+  , playoutDelayMillis(0)
+  , roundTripMillis(-1)
+  , timeToAudioMillis(-1)
+  , deviceSwitchMillis(-1)
+  , comfortNoiseFrames(0)
+  , formatSwitches(0)
+  , fileUnderruns(0)
+  , reconnects(0)
+  , receiveBitsPerSecond(0)
+  , sendBitsPerSecond(0)
+  , socketBacklogBytes(0)
+  , socketSendBacklogBytes(0)
+  , outputBytesFree(0)
+{
+}
+
+QString
+AudioEngineStats::csvHeader()
+{
+  return QString("timestamp,rx_bps,tx_bps,rx_bytes,tx_bytes,socket_backlog,socket_send_backlog,"
+    "output_bytes_free,playout_delay_ms,underruns,concealments,dropped_frames,concealed_frames,"
+    "input_overruns,file_underruns,reconnects,round_trip_ms,time_to_audio_ms,device_switch_ms,"
+    "comfort_noise_frames,format_switches");
+}
+
+QString
+AudioEngineStats::toCsv() const
+{
+  QStringList fields;
+  fields << QDateTime::fromMSecsSinceEpoch(timestamp).toString("yyyy-MM-ddTHH:mm:ss.zzz")
+    << QString::number(receiveBitsPerSecond)
+    << QString::number(sendBitsPerSecond)
+    << QString::number(bytesReceived)
+    << QString::number(bytesSent)
+    << QString::number(socketBacklogBytes)
+    << QString::number(socketSendBacklogBytes)
+    << QString::number(outputBytesFree)
+    << QString::number(playoutDelayMillis)
+    << QString::number(outputUnderruns)
+    << QString::number(concealmentEvents)
+    << QString::number(droppedFrames)
+    << QString::number(concealedFrames)
+    << QString::number(inputOverruns)
+    << QString::number(fileUnderruns)
+    << QString::number(reconnects)
+    << QString::number(roundTripMillis)
+    << QString::number(timeToAudioMillis)
+    << QString::number(deviceSwitchMillis)
+    << QString::number(comfortNoiseFrames)
+    << QString::number(formatSwitches);
+  return fields.join(',');
+}
+
+AudioEngine::AudioEngine()
+  : m_socket()
+  , m_host()
+  , m_port(0)
+  , m_shouldBeConnected(false)
+
+  , m_sessionToken(0)
+  , m_sessionBytesReceived(0)
+  , m_helloPending(false)
+  , m_helloBuffer()
+  , m_reconnectDelayMillis(kReconnectMinMillis)
+  , m_reconnectJitter(static_cast<std::minstd_rand::result_type>(QDateTime::currentMSecsSinceEpoch()))
+  , m_stallTimer(nullptr)
+  , m_lastAudioClock()
+  , m_audioFlowing(false)
+  , m_linkDownClock()
+  , m_awaitingAudio(false)
+  , m_dtx(false)
+  , m_dtxHeader()
+  , m_dtxPcmRemaining(0)
+  , m_comfortNoise()
+  , m_comfortNoiseRandom(1)
+  , m_wireFormat()
+  , m_wireConverter()
+  , m_wirePartialFrame()
+  , m_wireConverted()
+
+  , m_audioOutput()
+  , m_audioOutDevice(nullptr)
+  , m_audioOutputFormat()
+  , m_outputDeviceFormat()
+  , m_outputConverter()
+  , m_convertedPlayout()
+  , m_convertedPlayoutBytes(0)
+  , m_audioReadBuffer(32768, 0)
+  , m_playoutBuffer()
+  , m_jitterBuffer()
+  , m_playoutTimer(nullptr)
+  , m_audioOutMute(true)
+
+  , m_audioInput()
+  , m_audioInputDevice(nullptr)
+  , m_audioWriteBuffer(32768, 0)
+  , m_audioInMute(true)
+  , m_audioFromFile(false)
+  , m_audioInputFormat()
+  , m_inputDeviceFormat()
+  , m_inputConverter()
+  , m_audioDeviceReadBuffer()
+  , m_inputVolume(1.0)
+
+  , m_nextAudioOutput()
+  , m_nextAudioOutDevice(nullptr)
+  , m_nextOutputDeviceFormat()
+  , m_nextOutputConverter()
+  , m_retiringAudioOutput()
+  , m_outputSwitchClock()
+  , m_nextAudioInput()
+  , m_nextAudioInputDevice(nullptr)
+  , m_nextInputDeviceFormat()
+  , m_nextInputConverter()
+  , m_nextAudioDeviceReadBuffer()
+  , m_nextInputStarted(false)
+  , m_inputFading(false)
+  , m_inputFadeFrames(0)
+  , m_switchOldInput()
+  , m_switchNewInput()
+  , m_inputSwitchClock()
+
+  , m_fileSource(nullptr)
+  , m_fileSourceThread(new QThread())
+  , m_filePacingTimer(nullptr)
+  , m_fileClock()
+  , m_fileFormat()
+  , m_fileFramesSent(0)
+  , m_fileLoop(false)
+  , m_fileEnded(false)
+
+  , m_latencyProfile(StandardLatency)
+  , m_probePending(false)
+  , m_probeSent(false)
+  , m_probeTimer()
+  , m_probePattern()
+  , m_probeWindow()
+  , m_probeWindowEnd(0)
+  , m_probeFrames(0)
+  , m_probeBestMatch(0)
+  , m_probeBestFrame(0)
+  , m_probeBestMillis(0)
+  , m_inputQueuedBytes(0)
+
+  , m_recorder(nullptr)
+
+  , m_statsTimer(nullptr)
+  , m_statsClock()
+  , m_conversionReportClock()
+  , m_statsLastBytesReceived(0)
+  , m_statsLastBytesSent(0)
+  , m_hasConnected(false)
+  , m_levelsTimer(nullptr)
+  , m_inLevelMeter()
+  , m_outLevelMeter()
+  , m_inClipHold(0)
+  , m_outClipHold(0)
+  , m_stats()
+{
+  qRegisterMetaType<AudioEngineStats>();
+  qRegisterMetaType<AudioLevels>();
+  qRegisterMetaType<QAudioFormat>();
+  qRegisterMetaType<QAudioDeviceInfo>();
+
+  // parented so it follows the engine onto the audio thread
+  m_statsTimer = new QTimer(this);
+  m_statsTimer->setInterval(kStatsIntervalMillis);
+  connect(m_statsTimer, SIGNAL(timeout()), this, SLOT(publishStats()));
+
+  m_levelsTimer = new QTimer(this);
+  m_levelsTimer->setInterval(kLevelsIntervalMillis);
+  connect(m_levelsTimer, SIGNAL(timeout()), this, SLOT(publishLevels()));
+
+  // a half-open connection can sit in ConnectedState for minutes, so a
+  // stream that stops mid-flight is treated as a dead link
+  m_stallTimer = new QTimer(this);
+  m_stallTimer->setInterval(kStallCheckIntervalMillis);
+  connect(m_stallTimer, SIGNAL(timeout()), this, SLOT(checkForStall()));
+
+  // the jitter buffer is drained at device pace, independent of arrivals
+  m_playoutTimer = new QTimer(this);
+  m_playoutTimer->setTimerType(Qt::PreciseTimer);
+  m_playoutTimer->setInterval(kLatencyProfiles[m_latencyProfile].periodMillis / 2);
+  connect(m_playoutTimer, SIGNAL(timeout()), this, SLOT(playAudioData()));
+
+  m_filePacingTimer = new QTimer(this);
+  m_filePacingTimer->setTimerType(Qt::PreciseTimer);
+  m_filePacingTimer->setInterval(kFilePacingIntervalMillis);
+  connect(m_filePacingTimer, SIGNAL(timeout()), this, SLOT(sendFileAudio()));
+
+  m_fileSource = new FileSource();
+  m_fileSource->moveToThread(m_fileSourceThread.data());
+  m_fileSourceThread->setObjectName("decoder");
+  m_fileSourceThread->start();
+  connect(m_fileSource, &FileSource::logMessage, this, &AudioEngine::logMessage);
+  connect(m_fileSource, &FileSource::finished, this, &AudioEngine::onFileFinished);
+}
+
+AudioEngine::~AudioEngine()
+{
+  delete m_fileSource;
+}
+
+QString
+AudioEngine::latencyProfileName(int profile)
+{
+  if ((profile < 0) || (profile >= kNumLatencyProfiles))
+    return QString();
+  return QString(kLatencyProfiles[profile].name);
+}
+
+void
+AudioEngine::shutdown()
+{
+  m_statsTimer->stop();
+  m_levelsTimer->stop();
+  m_playoutTimer->stop();
+  m_filePacingTimer->stop();
+  m_stallTimer->stop();
+  m_shouldBeConnected = false;
+  m_socket.reset();
+
+  if (m_recorder)
+  {
+    // at shutdown it's fine to wait for the final flush
+    m_recorder->requestStop();
+    m_recorder->wait();
+    delete m_recorder;
+    m_recorder = nullptr;
+  }
+
+  m_fileSource->abort();
+  QMetaObject::invokeMethod(m_fileSource, "stop", Qt::BlockingQueuedConnection);
+  m_fileSourceThread->quit();
+  m_fileSourceThread->wait();
+
+  cancelInputSwitch();
+  if (m_audioInput)
+    m_audioInput->stop();
+  m_audioInput.reset();
+  m_audioInputDevice = nullptr;
+
+  cancelOutputSwitch();
+  retireOutput();
+  if (m_audioOutput)
+    m_audioOutput->stop();
+  m_audioOutput.reset();
+  m_audioOutDevice = nullptr;
+}
+
+void
+AudioEngine::connectToHost(QString const& host, quint16 port)
+{
+  emit logMessage(QString("connecting to host %1:%2").arg(host, QString::number(port)));
+
+  m_host = host;
+  m_port = port;
+  m_socket.reset(new QTcpSocket());
+  connect(m_socket.data(), SIGNAL(connected()), this, SLOT(onSocketConnected()));
+  connect(m_socket.data(), SIGNAL(readyRead()), this, SLOT(onSocketReadyRead()));
+  connect(m_socket.data(), SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(onSocketError(QAbstractSocket::SocketError)));
+  m_shouldBeConnected = true;
+  m_sessionToken = 0;
+  m_sessionBytesReceived = 0;
+  m_helloPending = false;
+  m_audioFlowing = false;
+  m_awaitingAudio = false;
+  m_reconnectDelayMillis = kReconnectMinMillis;
+  m_socket->connectToHost(m_host, m_port);
+  m_hasConnected = false;
+  m_statsClock.start();
+  m_statsTimer->start();
+  m_stallTimer->start();
+}
+
+void
+AudioEngine::disconnectFromHost()
+{
+  emit logMessage("closing socket");
+
+  m_shouldBeConnected = false;
+  if (m_socket)
+  {
+    m_socket->close();
+    m_socket.reset();
+  }
+  m_statsTimer->stop();
+  m_stallTimer->stop();
+  publishStats();
+}
+
+void
+AudioEngine::reconnectToHost()
+{
+  if (!m_shouldBeConnected || !m_socket)
+    return;
+
+  // a stall and the error that follows it can both have queued a retry
+  QAbstractSocket::SocketState const state = m_socket->state();
+  if ((state == QAbstractSocket::HostLookupState) || (state == QAbstractSocket::ConnectingState)
+    || (state == QAbstractSocket::ConnectedState))
+    return;
+
+  m_socket->abort();
+  m_socket->connectToHost(m_host, m_port);
+}
+
+void
+AudioEngine::scheduleReconnect()
+{
+  int const delay = m_reconnectDelayMillis;
+  int const jittered = (delay / 2) + static_cast<int>(m_reconnectJitter() % static_cast<unsigned>((delay / 2) + 1));
+  m_reconnectDelayMillis = qMin(delay * 2, kReconnectMaxMillis);
+  QTimer::singleShot(jittered, this, SLOT(reconnectToHost()));
+}
+
+void
+AudioEngine::linkDown(QString const& reason)
+{
+  // time to audio is measured from the first sign of trouble, retries
+  // that fail along the way don't restart the clock
+  if (m_audioFlowing || !m_awaitingAudio)
+  {
+    m_linkDownClock.start();
+    m_awaitingAudio = m_hasConnected;
+  }
+  m_audioFlowing = false;
+  m_helloPending = false;
+  emit logMessage(reason);
+}
+
+void
+AudioEngine::checkForStall()
+{
+  if (!m_socket || !m_audioFlowing || (m_lastAudioClock.elapsed() < kStallTimeoutMillis))
+    return;
+
+  linkDown(QString("no audio for %1 ms, reconnecting").arg(m_lastAudioClock.elapsed()));
+  m_socket->abort();
+  if (m_shouldBeConnected)
+    scheduleReconnect();
+}
+
+void
+AudioEngine::startOutput(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& format)
+{
+  emit logMessage(QString("Initialize audio out with device: %1").arg(deviceInfo.deviceName()));
+
+  m_playoutTimer->stop();
+  cancelOutputSwitch();
+  if (m_audioOutput)
+    m_audioOutput->stop();
+
+  m_audioOutputFormat = format;
+  m_jitterBuffer.setFormat(format);
+
+  m_outputDeviceFormat = FormatConverter::negotiateDeviceFormat(deviceInfo, format);
+  if (!m_outputConverter.setFormats(format, m_outputDeviceFormat))
+  {
+    emit logMessage(QString("audio out: can't convert to %1, trying %2 as is")
+      .arg(FormatConverter::formatName(m_outputDeviceFormat), FormatConverter::formatName(format)));
+    m_outputDeviceFormat = format;
+    m_outputConverter.setFormats(format, format);
+  }
+  m_convertedPlayoutBytes = 0;
+  emit logMessage(QString("audio out format: %1").arg(m_outputConverter.describe()));
+
+  // latency is managed by the jitter buffer, keep the device queue to a
+  // few periods
+  LatencyProfileSettings const& profile = kLatencyProfiles[m_latencyProfile];
+  QAudioFormat const& deviceFormat = m_outputDeviceFormat;
+  m_audioOutput.reset(new QAudioOutput(deviceInfo, deviceFormat));
+  m_audioOutput->setBufferSize(deviceFormat.bytesForDuration(profile.periodMillis * profile.periodCount * 1000));
+  m_audioOutput->setNotifyInterval(profile.periodMillis);
+  connect(m_audioOutput.data(), SIGNAL(stateChanged(QAudio::State)), this, SLOT(onOutputStateChanged(QAudio::State)));
+  m_audioOutDevice = m_audioOutput->start();
+
+  m_playoutTimer->setInterval(qMax(1, profile.periodMillis / 2));
+  m_playoutTimer->start();
+  m_levelsTimer->start();
+
+  emit logMessage(QString("audio out (%1) buffer:%2 period:%3 bytes")
+    .arg(profile.name, QString::number(m_audioOutput->bufferSize()), QString::number(m_audioOutput->periodSize())));
+}
+
+void
+AudioEngine::startInput(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& format)
+{
+  emit logMessage(QString("Initialize audio in with: %1").arg(deviceInfo.deviceName()));
+
+  cancelInputSwitch();
+  if (m_audioInput)
+    m_audioInput->stop();
+  m_inputQueuedBytes = 0;
+
+  LatencyProfileSettings const& profile = kLatencyProfiles[m_latencyProfile];
+  m_audioInputFormat = format;
+
+  m_inputDeviceFormat = FormatConverter::negotiateDeviceFormat(deviceInfo, format);
+  if (!m_inputConverter.setFormats(m_inputDeviceFormat, format))
+  {
+    emit logMessage(QString("audio in: can't convert from %1, trying %2 as is")
+      .arg(FormatConverter::formatName(m_inputDeviceFormat), FormatConverter::formatName(format)));
+    m_inputDeviceFormat = format;
+    m_inputConverter.setFormats(format, format);
+  }
+  emit logMessage(QString("audio in format: %1").arg(m_inputConverter.describe()));
+
+  QAudioFormat const& deviceFormat = m_inputDeviceFormat;
+  m_audioInput.reset(new QAudioInput(deviceInfo, deviceFormat));
+  m_audioInput->setBufferSize(deviceFormat.bytesForDuration(profile.periodMillis * profile.periodCount * 1000));
+  m_audioInput->setNotifyInterval(profile.periodMillis);
+  m_audioInput->setVolume(m_inputVolume);
+  m_audioInputDevice = m_audioInput->start();
+  connect(m_audioInputDevice, SIGNAL(readyRead()), this, SLOT(onIncomingSoundData()));
+  m_levelsTimer->start();
+
+  // a read must always be able to take everything the device can hold,
+  // and the write buffer everything that converts to
+  int const bufferSize = m_audioInput->bufferSize();
+  if (!m_inputConverter.isPassthrough() && (m_audioDeviceReadBuffer.size() < bufferSize))
+    m_audioDeviceReadBuffer.resize(bufferSize);
+  int const convertedSize = static_cast<int>(m_inputConverter.maxOutputBytes(bufferSize));
+  if (m_audioWriteBuffer.size() < convertedSize)
+    m_audioWriteBuffer.resize(convertedSize);
+
+  emit logMessage(QString("audio in (%1) buffer:%2 period:%3 bytes")
+    .arg(profile.name, QString::number(bufferSize), QString::number(m_audioInput->periodSize())));
+}
+
+void
+AudioEngine::switchOutputDevice(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& format)
+{
+  // nothing to hand over from, or the stream itself changes
+  if (!m_audioOutput || !m_audioOutDevice || (format != m_audioOutputFormat))
+  {
+    startOutput(deviceInfo, format);
+    return;
+  }
+
+  emit logMessage(QString("switching audio out to: %1").arg(deviceInfo.deviceName()));
+  cancelOutputSwitch();
+  m_outputSwitchClock.start();
+
+  // top up the running device, it has to cover for the open
+  playAudioData();
+
+  m_nextOutputDeviceFormat = FormatConverter::negotiateDeviceFormat(deviceInfo, format);
+  if (!m_nextOutputConverter.setFormats(format, m_nextOutputDeviceFormat))
+  {
+    m_nextOutputDeviceFormat = format;
+    m_nextOutputConverter.setFormats(format, format);
+  }
+
+  LatencyProfileSettings const& profile = kLatencyProfiles[m_latencyProfile];
+  m_nextAudioOutput.reset(new QAudioOutput(deviceInfo, m_nextOutputDeviceFormat));
+  m_nextAudioOutput->setBufferSize(m_nextOutputDeviceFormat.bytesForDuration(profile.periodMillis * profile.periodCount * 1000));
+  m_nextAudioOutput->setNotifyInterval(profile.periodMillis);
+  m_nextAudioOutDevice = m_nextAudioOutput->start();
+  if (!m_nextAudioOutDevice || (m_nextAudioOutput->error() != QAudio::NoError))
+  {
+    emit logMessage(QString("audio out: failed to open %1, staying on the current device").arg(deviceInfo.deviceName()));
+    cancelOutputSwitch();
+    return;
+  }
+
+  emit logMessage(QString("audio out format: %1, opened in %2 ms")
+    .arg(m_nextOutputConverter.describe(), QString::number(m_outputSwitchClock.elapsed())));
+}
+
+void
+AudioEngine::cancelOutputSwitch()
+{
+  if (m_nextAudioOutput)
+    m_nextAudioOutput->stop();
+  m_nextAudioOutput.reset();
+  m_nextAudioOutDevice = nullptr;
+}
+
+void
+AudioEngine::retireOutput()
+{
+  if (m_retiringAudioOutput)
+    m_retiringAudioOutput->stop();
+  m_retiringAudioOutput.reset();
+}
+
+// Hands playout over to the next device on a period boundary. The tail of
+// the running device and the head of the next one are the same audio,
+// faded against each other. The next device is primed with silence for as
+// long as the running one still has queued, so the crossfade lines up and
+// nothing is skipped or played twice.
+bool
+AudioEngine::handOverOutput()
+{
+  int const bytesPerFrame = m_audioOutputFormat.bytesPerFrame();
+  int const fadeMillis = qMin(kCrossfadeMillis, kLatencyProfiles[m_latencyProfile].periodMillis);
+  qint64 const fadeFrames = qMax<qint64>(1, m_audioOutputFormat.framesForDuration(fadeMillis * 1000));
+  qint64 const fadeBytes = fadeFrames * bytesPerFrame;
+
+  // wait for the running device to have room for its last block, unless
+  // it stopped playing altogether
+  qint64 const tailBytes = m_convertedPlayoutBytes + m_outputConverter.maxOutputBytes(fadeBytes);
+  bool const stalled = (m_audioOutput->state() == QAudio::StoppedState)
+    || m_outputSwitchClock.hasExpired(kOutputSwitchStallMillis);
+  if (!stalled && (m_audioOutput->bytesFree() < tailBytes))
+    return false;
+
+  QByteArray fade(static_cast<int>(fadeBytes), 0);
+  pullPlayoutPeriod(fade.data(), fadeBytes);
+  bool const canFade = is_s16(m_audioOutputFormat);
+  int const channels = m_audioOutputFormat.channelCount();
+
+  qint64 queuedMicros = 0;
+  if (!stalled)
+  {
+    QByteArray tail(fade);
+    if (canFade)
+      crossfade_s16(reinterpret_cast<qint16 const *>(fade.constData()), nullptr,
+        reinterpret_cast<qint16 *>(tail.data()), fadeFrames, channels, 0, fadeFrames);
+    if (m_convertedPlayout.size() < tailBytes)
+      m_convertedPlayout.resize(static_cast<int>(tailBytes));
+    m_convertedPlayoutBytes += m_outputConverter.convert(tail.constData(), fadeBytes,
+      m_convertedPlayout.data() + m_convertedPlayoutBytes);
+    m_audioOutDevice->write(m_convertedPlayout.constData(), m_convertedPlayoutBytes);
+    queuedMicros = m_outputDeviceFormat.durationForBytes(m_audioOutput->bufferSize() - m_audioOutput->bytesFree());
+  }
+  m_convertedPlayoutBytes = 0;
+
+  qint64 const fadeMicros = m_audioOutputFormat.durationForFrames(fadeFrames);
+  qint64 const silenceFrames = m_audioOutputFormat.framesForDuration(qMax<qint64>(0, queuedMicros - fadeMicros));
+
+  QByteArray head(static_cast<int>((silenceFrames * bytesPerFrame) + fadeBytes), 0);
+  char* headFade = head.data() + (silenceFrames * bytesPerFrame);
+  memcpy(headFade, fade.constData(), fadeBytes);
+  if (canFade)
+    crossfade_s16(nullptr, reinterpret_cast<qint16 const *>(fade.constData()),
+      reinterpret_cast<qint16 *>(headFade), fadeFrames, channels, 0, fadeFrames);
+
+  // a next device with a smaller queue starts further into the silence
+  QByteArray converted(static_cast<int>(m_nextOutputConverter.maxOutputBytes(head.size())), 0);
+  qint64 n = m_nextOutputConverter.convert(head.constData(), head.size(), converted.data());
+  int const nextFrameBytes = m_nextOutputDeviceFormat.bytesPerFrame();
+  qint64 const skip = qMax<qint64>(0, n - m_nextAudioOutput->bytesFree());
+  qint64 const skipBytes = ((skip + nextFrameBytes - 1) / nextFrameBytes) * nextFrameBytes;
+  m_nextAudioOutDevice->write(converted.constData() + skipBytes, n - skipBytes);
+
+  retireOutput();
+  m_retiringAudioOutput.swap(m_audioOutput);
+  disconnect(m_retiringAudioOutput.data(), nullptr, this, nullptr);
+  m_audioOutput.swap(m_nextAudioOutput);
+  m_audioOutDevice = m_nextAudioOutDevice;
+  m_nextAudioOutDevice = nullptr;
+  m_outputDeviceFormat = m_nextOutputDeviceFormat;
+  m_outputConverter = m_nextOutputConverter;
+  connect(m_audioOutput.data(), SIGNAL(stateChanged(QAudio::State)), this, SLOT(onOutputStateChanged(QAudio::State)));
+  QTimer::singleShot(static_cast<int>(queuedMicros / 1000) + kRetireGraceMillis, this, SLOT(retireOutput()));
+
+  // latency is until the next device is the one that's heard
+  m_stats.deviceSwitchMillis = static_cast<int>(m_outputSwitchClock.elapsed() + (qMax<qint64>(0, queuedMicros - fadeMicros) / 1000));
+  emit logMessage(QString("audio out switched, audible on the new device after %1 ms, %2")
+    .arg(QString::number(m_stats.deviceSwitchMillis), stalled ? QString("the old device had stopped playing")
+      : QString("%1 ms crossfade").arg(canFade ? fadeMillis : 0)));
+  return true;
+}
+
+void
+AudioEngine::switchInputDevice(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& format)
+{
+  // nothing is being sent from the device, or the stream itself changes
+  if (!m_audioInput || !m_audioInputDevice || m_audioFromFile || (format != m_audioInputFormat))
+  {
+    startInput(deviceInfo, format);
+    return;
+  }
+
+  emit logMessage(QString("switching audio in to: %1").arg(deviceInfo.deviceName()));
+  cancelInputSwitch();
+  m_inputSwitchClock.start();
+
+  m_nextInputDeviceFormat = FormatConverter::negotiateDeviceFormat(deviceInfo, format);
+  if (!m_nextInputConverter.setFormats(m_nextInputDeviceFormat, format))
+  {
+    m_nextInputDeviceFormat = format;
+    m_nextInputConverter.setFormats(format, format);
+  }
+
+  LatencyProfileSettings const& profile = kLatencyProfiles[m_latencyProfile];
+  m_nextAudioInput.reset(new QAudioInput(deviceInfo, m_nextInputDeviceFormat));
+  m_nextAudioInput->setBufferSize(m_nextInputDeviceFormat.bytesForDuration(profile.periodMillis * profile.periodCount * 1000));
+  m_nextAudioInput->setNotifyInterval(profile.periodMillis);
+  m_nextAudioInput->setVolume(m_inputVolume);
+  m_nextAudioInputDevice = m_nextAudioInput->start();
+  if (!m_nextAudioInputDevice || (m_nextAudioInput->error() != QAudio::NoError))
+  {
+    emit logMessage(QString("audio in: failed to open %1, staying on the current device").arg(deviceInfo.deviceName()));
+    cancelInputSwitch();
+    return;
+  }
+  connect(m_nextAudioInputDevice, SIGNAL(readyRead()), this, SLOT(onNextInputSoundData()));
+
+  int const bufferSize = m_nextAudioInput->bufferSize();
+  if (m_nextAudioDeviceReadBuffer.size() < bufferSize)
+    m_nextAudioDeviceReadBuffer.resize(bufferSize);
+  int const convertedSize = static_cast<int>(m_nextInputConverter.maxOutputBytes(bufferSize));
+  if (m_audioWriteBuffer.size() < convertedSize)
+    m_audioWriteBuffer.resize(convertedSize);
+
+  emit logMessage(QString("audio in format: %1, opened in %2 ms")
+    .arg(m_nextInputConverter.describe(), QString::number(m_inputSwitchClock.elapsed())));
+}
+
+void
+AudioEngine::cancelInputSwitch()
+{
+  if (m_nextAudioInput)
+    m_nextAudioInput->stop();
+  m_nextAudioInput.reset();
+  m_nextAudioInputDevice = nullptr;
+  m_nextInputStarted = false;
+  m_inputFading = false;
+  m_switchOldInput.clear();
+  m_switchNewInput.clear();
+}
+
+void
+AudioEngine::onNextInputSoundData()
+{
+  if (!m_nextAudioInput)
+    return;
+
+  qint64 bytesRead;
+  while ((bytesRead = m_nextAudioInputDevice->read(m_nextAudioDeviceReadBuffer.data(), m_nextAudioDeviceReadBuffer.size())) > 0)
+  {
+    // the first block is whatever built up while the device started, it
+    // overlaps what the running device has already sent
+    if (!m_nextInputStarted)
+    {
+      m_nextInputStarted = true;
+      onIncomingSoundData();
+      m_inputFading = true;
+      m_inputFadeFrames = 0;
+      continue;
+    }
+
+    bytesRead = m_nextInputConverter.convert(m_nextAudioDeviceReadBuffer.constData(), bytesRead, m_audioWriteBuffer.data());
+    m_switchNewInput.append(m_audioWriteBuffer.constData(), static_cast<int>(bytesRead));
+  }
+
+  if (m_inputFading)
+    mixInputSwitch();
+}
+
+// From the moment the next device delivers, both devices are captured side
+// by side and what goes out is the crossfade between them.
+void
+AudioEngine::mixInputSwitch()
+{
+  int const bytesPerFrame = m_audioInputFormat.bytesPerFrame();
+  qint64 const fadeFrames = is_s16(m_audioInputFormat) ? m_audioInputFormat.framesForDuration(kCrossfadeMillis * 1000) : 0;
+
+  qint64 frames = qMin(m_switchOldInput.size(), m_switchNewInput.size()) / bytesPerFrame;
+  frames = qMin(frames, fadeFrames - m_inputFadeFrames);
+  if (frames > 0)
+  {
+    crossfade_s16(reinterpret_cast<qint16 const *>(m_switchOldInput.constData()),
+      reinterpret_cast<qint16 const *>(m_switchNewInput.constData()), reinterpret_cast<qint16 *>(m_switchNewInput.data()),
+      frames, m_audioInputFormat.channelCount(), m_inputFadeFrames, fadeFrames);
+    if (!m_audioFromFile)
+      sendCapturedAudio(m_switchNewInput.data(), frames * bytesPerFrame);
+    m_switchOldInput.remove(0, static_cast<int>(frames * bytesPerFrame));
+    m_switchNewInput.remove(0, static_cast<int>(frames * bytesPerFrame));
+    m_inputFadeFrames += frames;
+  }
+
+  // the running device may well have died, which is why it's replaced
+  bool const stalled = m_switchNewInput.size() > m_audioInputFormat.bytesForDuration(kInputSwitchStallMillis * 1000);
+  if ((m_inputFadeFrames >= fadeFrames) || stalled)
+    finishInputSwitch(stalled);
+}
+
+void
+AudioEngine::finishInputSwitch(bool stalled)
+{
+  // this can run from the old device's own signal, so it's deleted later
+  m_audioInput->stop();
+  disconnect(m_audioInputDevice, nullptr, this, nullptr);
+  m_audioInput.take()->deleteLater();
+
+  m_audioInput.swap(m_nextAudioInput);
+  m_audioInputDevice = m_nextAudioInputDevice;
+  m_inputQueuedBytes = 0;
+  m_nextAudioInputDevice = nullptr;
+  disconnect(m_audioInputDevice, nullptr, this, nullptr);
+  connect(m_audioInputDevice, SIGNAL(readyRead()), this, SLOT(onIncomingSoundData()));
+  m_inputDeviceFormat = m_nextInputDeviceFormat;
+  m_inputConverter = m_nextInputConverter;
+  m_audioDeviceReadBuffer.swap(m_nextAudioDeviceReadBuffer);
+  m_inputFading = false;
+  m_nextInputStarted = false;
+
+  if (!m_audioFromFile && !m_switchNewInput.isEmpty())
+    sendCapturedAudio(m_switchNewInput.data(), m_switchNewInput.size());
+  m_switchOldInput.clear();
+  m_switchNewInput.clear();
+
+  m_stats.deviceSwitchMillis = static_cast<int>(m_inputSwitchClock.elapsed());
+  emit logMessage(QString("audio in switched in %1 ms, %2")
+    .arg(QString::number(m_stats.deviceSwitchMillis), stalled ? QString("the old device had stopped delivering")
+      : QString("%1 ms crossfade").arg(is_s16(m_audioInputFormat) ? kCrossfadeMillis : 0)));
+}
+
+void
+AudioEngine::setInputMuted(bool muted)
+{
+  m_audioInMute = muted;
+}
+
+void
+AudioEngine::setOutputMuted(bool muted)
+{
+  m_audioOutMute = muted;
+}
+
+void
+AudioEngine::setInputFromFile(bool fromFile)
+{
+  m_audioFromFile = fromFile;
+  if (!fromFile)
+  {
+    m_filePacingTimer->stop();
+    m_fileSource->abort();
+    QMetaObject::invokeMethod(m_fileSource, "stop");
+  }
+}
+
+void
+AudioEngine::startFileInput(QString const& fileName, QAudioFormat const& format)
+{
+  m_fileSource->abort();
+  QMetaObject::invokeMethod(m_fileSource, "start", Q_ARG(QString, fileName),
+    Q_ARG(QAudioFormat, format), Q_ARG(bool, m_fileLoop));
+
+  m_fileFormat = format;
+  m_fileClock.invalidate();
+  m_fileEnded = false;
+  m_filePacingTimer->start();
+}
+
+// Everything the decoder produced is in the source by now, what's left of
+// it still goes out before the file input stops.
+void
+AudioEngine::onFileFinished()
+{
+  m_fileEnded = true;
+}
+
+void
+AudioEngine::setFileLooping(bool loop)
+{
+  m_fileLoop = loop;
+  QMetaObject::invokeMethod(m_fileSource, "setLooping", Q_ARG(bool, loop));
+}
+
+void
+AudioEngine::sendFileAudio()
+{
+  if (!m_audioFromFile || !m_socket || (m_socket->state() != QAbstractSocket::ConnectedState))
+  {
+    m_fileClock.invalidate();
+    return;
+  }
+
+  // the clock starts with the first decoded audio so decoder start-up
+  // isn't counted as an underrun
+  if (!m_fileClock.isValid())
+  {
+    if (m_fileSource->bytesAvailable() == 0)
+      return;
+    m_fileClock.start();
+    m_fileFramesSent = 0;
+  }
+
+  // what is due is derived from the monotonic clock rather than from the
+  // timer cadence, so late ticks are caught up and nothing drifts
+  qint64 const bytesPerFrame = m_fileFormat.bytesPerFrame();
+  qint64 const framesDue = ((m_fileClock.nsecsElapsed() / 1000) * m_fileFormat.sampleRate()) / 1000000;
+  qint64 bytesDue = (framesDue - m_fileFramesSent) * bytesPerFrame;
+  qint64 const chunkSize = m_audioWriteBuffer.size() - (m_audioWriteBuffer.size() % bytesPerFrame);
+
+  while (bytesDue > 0)
+  {
+    qint64 len = qMin(bytesDue, chunkSize);
+    qint64 n = m_fileSource->read(m_audioWriteBuffer.data(), len);
+    bool const ended = (n < len) && m_fileEnded;
+    if (ended)
+    {
+      len = n - (n % bytesPerFrame);
+    }
+    else if (n < len)
+    {
+      // decoder fell behind, keep the timeline and fill with silence
+      memset(m_audioWriteBuffer.data() + n, 0, len - n);
+      m_stats.fileUnderruns++;
+    }
+    meter(&m_inLevelMeter, m_fileFormat, m_audioWriteBuffer.constData(), len);
+
+    bool const probe = m_probePending && (len > 0);
+    if (probe)
+      insertRoundTripProbe(m_audioWriteBuffer.data(), len, m_fileFormat);
+    if (probe || !m_audioInMute)
+    {
+      qint64 written = m_socket->write(m_audioWriteBuffer.constData(), len);
+      if (written > 0)
+        m_stats.bytesSent += written;
+      if (m_recorder)
+        m_recorder->write(WavRecorder::Sent, m_audioWriteBuffer.constData(), len);
+    }
+
+    m_fileFramesSent += len / bytesPerFrame;
+    bytesDue -= len;
+
+    if (ended)
+    {
+      m_filePacingTimer->stop();
+      emit logMessage(QString("file input ended after %1 ms, %2 underruns")
+        .arg(m_fileClock.elapsed()).arg(m_stats.fileUnderruns));
+      m_fileClock.invalidate();
+      return;
+    }
+  }
+}
+
+void
+AudioEngine::setInputVolume(qreal volume)
+{
+  m_inputVolume = volume;
+  if (m_nextAudioInput)
+    m_nextAudioInput->setVolume(volume);
+  if (m_audioInput)
+    m_audioInput->setVolume(volume);
+}
+
+void
+AudioEngine::setTargetLatency(int millis)
+{
+  m_jitterBuffer.setTargetLatency(millis);
+  emit logMessage(QString("playout target latency %1ms").arg(m_jitterBuffer.targetLatency()));
+}
+
+void
+AudioEngine::setLatencyProfile(int profile)
+{
+  if ((profile < 0) || (profile >= kNumLatencyProfiles))
+    return;
+
+  m_latencyProfile = profile;
+  emit logMessage(QString("latency profile: %1").arg(kLatencyProfiles[profile].name));
+}
+
+void
+AudioEngine::measureRoundTrip()
+{
+  if (!m_socket || (m_socket->state() != QAbstractSocket::ConnectedState))
+  {
+    emit logMessage("round trip: not connected");
+    return;
+  }
+
+  QAudioFormat const& sentFormat = m_audioFromFile ? m_fileFormat : m_audioInputFormat;
+  if (!is_probe_format(sentFormat) || !is_probe_format(m_audioOutputFormat))
+  {
+    emit logMessage("round trip: the probe needs 16 bit little endian PCM in both directions");
+    return;
+  }
+
+  m_stats.roundTripMillis = -1;
+  m_probePending = true;
+  m_probeSent = false;
+  emit logMessage("round trip: sending probe, the camera has to loop its speaker back into its microphone");
+}
+
+void
+AudioEngine::startRecording(QString const& prefix)
+{
+  if (m_recorder)
+    stopRecording();
+
+  QAudioFormat const& sentFormat = m_audioFromFile ? m_fileFormat : m_audioInputFormat;
+  m_recorder = new WavRecorder(prefix, m_audioOutputFormat, sentFormat);
+  connect(m_recorder, &WavRecorder::logMessage, this, &AudioEngine::logMessage);
+  connect(m_recorder, SIGNAL(finished()), m_recorder, SLOT(deleteLater()));
+  m_recorder->start(QThread::LowPriority);
+}
+
+void
+AudioEngine::stopRecording()
+{
+  if (!m_recorder)
+    return;
+
+  // the recorder flushes, patches its headers and deletes itself
+  m_recorder->requestStop();
+  m_recorder = nullptr;
+}
+
+void
+AudioEngine::onSocketConnected()
+{
+  if (m_hasConnected)
+    m_stats.reconnects++;
+  m_hasConnected = true;
+
+  // the jitter buffer is kept until the server says whether the stream
+  // continues where it left off. The server converts its capture to the
+  // stream format, so it no longer has to be configured to match.
+  xaudio_hello hello;
+  hello.version_or_flags = XAUDIO_PROTOCOL_VERSION;
+  hello.session_token = m_sessionToken;
+  hello.offset = m_sessionBytesReceived;
+
+  // silent periods come as comfort noise, which is only generated in the
+  // formats a format request can name, and so is a cheaper format when the
+  // link can't keep up
+  xaudio_format format;
+  bool const requestFormat = to_xaudio_format(m_audioOutputFormat, &format);
+  if (requestFormat)
+    hello.version_or_flags |= XAUDIO_HELLO_FORMAT | XAUDIO_HELLO_DTX | XAUDIO_HELLO_ADAPT;
+
+  uint8_t buff[XAUDIO_HELLO_SIZE + XAUDIO_FORMAT_SIZE];
+  xaudio_encode_hello(hello, buff);
+  if (requestFormat)
+    xaudio_encode_format(format, buff + XAUDIO_HELLO_SIZE);
+  m_socket->write(reinterpret_cast<char const *>(buff), requestFormat ? sizeof(buff) : XAUDIO_HELLO_SIZE);
+  m_helloPending = true;
+  m_helloBuffer.clear();
+  m_dtx = false;
+  m_dtxHeader.clear();
+  m_dtxPcmRemaining = 0;
+  m_wireFormat = m_audioOutputFormat;
+  m_wireConverter.setFormats(m_audioOutputFormat, m_audioOutputFormat);
+  m_wirePartialFrame.clear();
+
+  emit logMessage(QString("connected to %1:%2")
+    .arg(m_socket->peerAddress().toString(), QString::number(m_socket->peerPort())));
+}
+
+qint64
+AudioEngine::readServerHello(char const* data, qint64 len)
+{
+  qint64 n = qBound<qint64>(0, XAUDIO_HELLO_SIZE - m_helloBuffer.size(), len);
+  m_helloBuffer.append(data, static_cast<int>(n));
+
+  uint8_t const* buff = reinterpret_cast<uint8_t const *>(m_helloBuffer.constData());
+  if (!xaudio_is_hello_prefix(buff, m_helloBuffer.size()))
+  {
+    // an older xaudio, everything it sends is audio
+    emit logMessage("server doesn't support session resume");
+    m_helloPending = false;
+    m_sessionToken = 0;
+    m_sessionBytesReceived = 0;
+    m_jitterBuffer.reset();
+    QByteArray const audio = m_helloBuffer;
+    m_helloBuffer.clear();
+    receiveAudio(audio.constData(), audio.size() - n);
+    return 0;
+  }
+
+  if (m_helloBuffer.size() < XAUDIO_HELLO_SIZE)
+    return n;
+
+  xaudio_hello hello;
+  xaudio_decode_hello(buff, &hello);
+  if (hello.version_or_flags & XAUDIO_FLAG_FORMAT)
+  {
+    // followed by the format the server granted
+    qint64 const more = qMin<qint64>(len - n, (XAUDIO_HELLO_SIZE + XAUDIO_FORMAT_SIZE) - m_helloBuffer.size());
+    m_helloBuffer.append(data + n, static_cast<int>(more));
+    n += more;
+    if (m_helloBuffer.size() < (XAUDIO_HELLO_SIZE + XAUDIO_FORMAT_SIZE))
+      return n;
+
+    buff = reinterpret_cast<uint8_t const *>(m_helloBuffer.constData());
+    xaudio_format wanted;
+    xaudio_format granted;
+    xaudio_decode_format(buff + XAUDIO_HELLO_SIZE, &granted);
+    if (to_xaudio_format(m_audioOutputFormat, &wanted) && !xaudio_format_equal(wanted, granted))
+    {
+      // the stream is decoded as what was granted, converted for playout
+      emit logMessage(QString("server can't send %1, it sends %2 Hz %3 channel %4 instead")
+        .arg(FormatConverter::formatName(m_audioOutputFormat)).arg(granted.sample_rate)
+        .arg(granted.channels).arg((granted.sample_format == XAUDIO_F32LE) ? "float" : "16 bit"));
+      if (!switchWireFormat(from_xaudio_format(granted)))
+        return len;
+    }
+  }
+  m_helloPending = false;
+  m_helloBuffer.clear();
+
+  bool const resumed = (hello.version_or_flags & XAUDIO_FLAG_RESUMED) && (hello.session_token == m_sessionToken);
+  if (resumed && (hello.offset == m_sessionBytesReceived))
+  {
+    emit logMessage("session resumed, nothing lost");
+  }
+  else
+  {
+    // whatever is still queued doesn't join up with what comes next
+    if (resumed)
+      emit logMessage(QString("session resumed, skipped %1 bytes")
+        .arg(static_cast<qint64>(hello.offset - m_sessionBytesReceived)));
+    else
+      emit logMessage("new session");
+    m_jitterBuffer.reset();
+  }
+
+  m_dtx = (hello.version_or_flags & XAUDIO_FLAG_DTX) != 0;
+  m_sessionToken = hello.session_token;
+  m_sessionBytesReceived = hello.offset;
+  m_reconnectDelayMillis = kReconnectMinMillis;
+  return n;
+}
+
+void
+AudioEngine::receiveAudio(char const* data, qint64 len)
+{
+  if (len <= 0)
+    return;
+
+  m_sessionBytesReceived += len;
+  m_lastAudioClock.start();
+  m_audioFlowing = true;
+  if (m_awaitingAudio)
+  {
+    m_awaitingAudio = false;
+    m_reconnectDelayMillis = kReconnectMinMillis;
+    m_stats.timeToAudioMillis = static_cast<int>(m_linkDownClock.elapsed());
+    emit logMessage(QString("audio back %1 ms after the link went down").arg(m_stats.timeToAudioMillis));
+  }
+
+  if (m_probeSent)
+    detectRoundTripProbe(data, len);
+  m_jitterBuffer.push(data, len);
+}
+
+void
+AudioEngine::receiveFrames(char const* data, qint64 len)
+{
+  while (len > 0)
+  {
+    if (m_dtxPcmRemaining > 0)
+    {
+      qint64 const n = qMin(len, m_dtxPcmRemaining);
+      receivePcm(data, n);
+      m_dtxPcmRemaining -= n;
+      data += n;
+      len -= n;
+      continue;
+    }
+
+    // a format frame carries the format right after its header
+    bool const formatFrame = (m_dtxHeader.size() >= XAUDIO_DTX_HEADER_SIZE) && (m_dtxHeader.at(0) == XAUDIO_DTX_FORMAT);
+    int const size = XAUDIO_DTX_HEADER_SIZE + (formatFrame ? XAUDIO_FORMAT_SIZE : 0);
+    int const n = static_cast<int>(qMin<qint64>(len, size - m_dtxHeader.size()));
+    m_dtxHeader.append(data, n);
+    data += n;
+    len -= n;
+    if ((m_dtxHeader.size() < size) || (!formatFrame && (m_dtxHeader.at(0) == XAUDIO_DTX_FORMAT)))
+      continue;
+
+    uint8_t const* buff = reinterpret_cast<uint8_t const *>(m_dtxHeader.constData());
+    xaudio_dtx_header header;
+    xaudio_format format;
+    xaudio_decode_dtx_header(buff, &header);
+    if (header.type == XAUDIO_DTX_FORMAT)
+      xaudio_decode_format(buff + XAUDIO_DTX_HEADER_SIZE, &format);
+    m_dtxHeader.clear();
+
+    if (header.type == XAUDIO_DTX_PCM)
+    {
+      m_dtxPcmRemaining = header.length;
+    }
+    else if (header.type == XAUDIO_DTX_NOISE)
+    {
+      // counted in frames of what the server sends
+      qint64 const frames = (static_cast<qint64>(header.length) * m_audioOutputFormat.sampleRate())
+        / qMax(1, m_wireFormat.sampleRate());
+      playComfortNoise(static_cast<int>(frames), header.level);
+    }
+    else if ((header.type == XAUDIO_DTX_FORMAT) && (header.length == XAUDIO_FORMAT_SIZE))
+    {
+      if (!switchWireFormat(from_xaudio_format(format)))
+        return;
+    }
+    else
+    {
+      linkDown(QString("unknown frame type %1 from server").arg(header.type));
+      return;
+    }
+  }
+}
+
+// Audio in the format the server sends right now. Conversion only takes
+// whole frames, a frame split across reads waits for its other half.
+void
+AudioEngine::receivePcm(char const* data, qint64 len)
+{
+  if (m_wireConverter.isPassthrough())
+  {
+    receiveAudio(data, len);
+    return;
+  }
+
+  int const bytesPerFrame = m_wireFormat.bytesPerFrame();
+  if (!m_wirePartialFrame.isEmpty())
+  {
+    int const n = static_cast<int>(qMin<qint64>(len, bytesPerFrame - m_wirePartialFrame.size()));
+    m_wirePartialFrame.append(data, n);
+    data += n;
+    len -= n;
+    if (m_wirePartialFrame.size() < bytesPerFrame)
+      return;
+  }
+
+  qint64 const whole = (len / bytesPerFrame) * bytesPerFrame;
+  qint64 const needed = m_wireConverter.maxOutputBytes(bytesPerFrame + whole);
+  if (m_wireConverted.size() < needed)
+    m_wireConverted.resize(static_cast<int>(needed));
+
+  qint64 out = 0;
+  if (!m_wirePartialFrame.isEmpty())
+  {
+    out += m_wireConverter.convert(m_wirePartialFrame.constData(), bytesPerFrame, m_wireConverted.data());
+    m_wirePartialFrame.clear();
+  }
+  out += m_wireConverter.convert(data, whole, m_wireConverted.data() + out);
+  m_wirePartialFrame.append(data + whole, static_cast<int>(len - whole));
+  receiveAudio(m_wireConverted.constData(), out);
+}
+
+bool
+AudioEngine::switchWireFormat(QAudioFormat const& wireFormat)
+{
+  m_wirePartialFrame.clear();
+  if ((wireFormat.bytesPerFrame() <= 0) || !m_wireConverter.setFormats(wireFormat, m_audioOutputFormat))
+  {
+    // nothing more from this connection can be played, try again later
+    linkDown(QString("server switched to %1, which can't be converted").arg(FormatConverter::formatName(wireFormat)));
+    m_socket->abort();
+    if (m_shouldBeConnected)
+      scheduleReconnect();
+    return false;
+  }
+
+  m_wireFormat = wireFormat;
+  m_stats.formatSwitches++;
+  emit logMessage(QString("server switched to %1 (%2)")
+    .arg(FormatConverter::formatName(wireFormat), m_wireConverter.describe()));
+  return true;
+}
+
+// White noise at the level of the room the server measured, standing in
+// for the silent periods it didn't send. It goes through the jitter buffer
+// like received audio so playout timing doesn't change.
+void
+AudioEngine::playComfortNoise(int frames, int levelDb)
+{
+  bool const isFloat = (m_audioOutputFormat.sampleType() == QAudioFormat::Float);
+  int const samples = frames * m_audioOutputFormat.channelCount();
+  int const bytes = samples * (isFloat ? 4 : 2);
+  if (m_comfortNoise.size() < bytes)
+    m_comfortNoise.resize(bytes);
+
+  // uniform noise has an RMS of its peak over sqrt(3)
+  float const peak = powf(10.0f, -levelDb / 20.0f) * 1.7320508f;
+  float const scale = (2.0f * peak) / static_cast<float>(std::minstd_rand::max() - std::minstd_rand::min());
+  float* f32 = reinterpret_cast<float *>(m_comfortNoise.data());
+  qint16* s16 = reinterpret_cast<qint16 *>(m_comfortNoise.data());
+  for (int i = 0; i < samples; ++i)
+  {
+    float const v = (static_cast<float>(m_comfortNoiseRandom() - std::minstd_rand::min()) * scale) - peak;
+    if (isFloat)
+      f32[i] = v;
+    else
+      s16[i] = static_cast<qint16>(qBound(-32768.0f, v * 32768.0f, 32767.0f));
+  }
+
+  m_stats.comfortNoiseFrames += frames;
+  receiveAudio(m_comfortNoise.constData(), bytes);
+}
+
+void
+AudioEngine::onSocketReadyRead()
+{
+  if (!m_socket)
+    return;
+
+  XAUDIO_TRACE_SPAN("socket read");
+
+  // always drain the socket, backlog is the jitter buffer's problem now
+  // rather than growing unbounded in the kernel and QTcpSocket buffers
+  qint64 n;
+  while ((n = m_socket->read(m_audioReadBuffer.data(), m_audioReadBuffer.size())) > 0)
+  {
+    m_stats.bytesReceived += n;
+
+    qint64 offset = 0;
+    if (m_helloPending)
+      offset = readServerHello(m_audioReadBuffer.constData(), n);
+    if (!m_helloPending && m_dtx)
+      receiveFrames(m_audioReadBuffer.constData() + offset, n - offset);
+    else if (!m_helloPending)
+      receivePcm(m_audioReadBuffer.constData() + offset, n - offset);
+  }
+}
+
+void
+AudioEngine::playAudioData()
+{
+  if (!m_audioOutput || !m_audioOutDevice)
+    return;
+
+  XAUDIO_TRACE_SPAN("playout");
+
+  // while a switch is pending the running device is only topped up by the
+  // hand over itself, the next tick fills the new one
+  if (m_nextAudioOutput)
+  {
+    handOverOutput();
+    return;
+  }
+
+  qint64 const periodSize = m_audioOutput->periodSize();
+  if (periodSize <= 0)
+    return;
+
+  if (m_outputConverter.isPassthrough())
+  {
+    if (m_playoutBuffer.size() != periodSize)
+      m_playoutBuffer.resize(static_cast<int>(periodSize));
+
+    while (m_audioOutput->bytesFree() >= periodSize)
+    {
+      pullPlayoutPeriod(m_playoutBuffer.data(), periodSize);
+      m_audioOutDevice->write(m_playoutBuffer.constData(), periodSize);
+    }
+    return;
+  }
+
+  // the jitter buffer is pulled in the wire format, about one device
+  // period at a time, and whatever the conversion produces beyond a period
+  // is carried over to the next one
+  qint64 const wireFrames = ((periodSize / m_outputDeviceFormat.bytesPerFrame()) * m_audioOutputFormat.sampleRate())
+    / m_outputDeviceFormat.sampleRate();
+  qint64 const wirePeriodSize = qMax<qint64>(1, wireFrames) * m_audioOutputFormat.bytesPerFrame();
+  if (m_playoutBuffer.size() != wirePeriodSize)
+    m_playoutBuffer.resize(static_cast<int>(wirePeriodSize));
+
+  qint64 const convertedSize = periodSize + m_outputConverter.maxOutputBytes(wirePeriodSize);
+  if (m_convertedPlayout.size() < convertedSize)
+    m_convertedPlayout.resize(static_cast<int>(convertedSize));
+
+  while (m_audioOutput->bytesFree() >= periodSize)
+  {
+    while (m_convertedPlayoutBytes < periodSize)
+    {
+      pullPlayoutPeriod(m_playoutBuffer.data(), wirePeriodSize);
+      m_convertedPlayoutBytes += m_outputConverter.convert(m_playoutBuffer.constData(), wirePeriodSize,
+        m_convertedPlayout.data() + m_convertedPlayoutBytes);
+    }
+
+    m_audioOutDevice->write(m_convertedPlayout.constData(), periodSize);
+    m_convertedPlayoutBytes -= periodSize;
+    memmove(m_convertedPlayout.data(), m_convertedPlayout.constData() + periodSize, m_convertedPlayoutBytes);
+  }
+}
+
+void
+AudioEngine::pullPlayoutPeriod(char* data, qint64 len)
+{
+  m_jitterBuffer.pull(data, len);
+  meter(&m_outLevelMeter, m_audioOutputFormat, data, len);
+  if (m_recorder)
+    m_recorder->write(WavRecorder::Received, data, len);
+  if (m_audioOutMute)
+    memset(data, 0, len);
+}
+
+int
+AudioEngine::playoutDelayMillis() const
+{
+  int delay = m_jitterBuffer.bufferedMillis();
+  if (m_audioOutput)
+  {
+    qint32 queued = m_audioOutput->bufferSize() - m_audioOutput->bytesFree();
+    queued += static_cast<qint32>(m_convertedPlayoutBytes);
+    delay += static_cast<int>(m_outputDeviceFormat.durationForBytes(queued) / 1000);
+  }
+  return delay;
+}
+
+int
+AudioEngine::inputDelayMillis() const
+{
+  if (!m_audioInput || m_audioFromFile)
+    return 0;
+  return static_cast<int>(m_inputDeviceFormat.durationForBytes(m_inputQueuedBytes) / 1000);
+}
+
+void
+AudioEngine::insertRoundTripProbe(char* data, qint64 len, QAudioFormat const& format)
+{
+  // a short loud kProbeHz square burst at the head of the block in the
+  // format it's sent in, everything after it is silence
+  memset(data, 0, len);
+
+  int const channels = format.channelCount();
+  qint64 const frames = qMin<qint64>(len / format.bytesPerFrame(), format.framesForDuration(kProbeMillis * 1000));
+  qint16* out = reinterpret_cast<qint16 *>(data);
+  for (qint64 i = 0; i < frames; ++i)
+  {
+    qint16 const v = probe_sample(i, format.sampleRate());
+    for (int c = 0; c < channels; ++c)
+      out[(i * channels) + c] = v;
+  }
+
+  // what the echo should look like at the rate it comes back in, with unit
+  // energy so a window's match with it is a normalized correlation
+  int const rate = m_audioOutputFormat.sampleRate();
+  int const n = qMax(1, static_cast<int>(m_audioOutputFormat.framesForDuration(kProbeMillis * 1000)));
+  m_probePattern.resize(n);
+  for (int i = 0; i < n; ++i)
+    m_probePattern[i] = probe_sample(i, rate) / (kProbeAmplitude * sqrtf(static_cast<float>(n)));
+  m_probeWindow.fill(0.0f, 2 * n);
+  m_probeWindowEnd = n;
+  m_probeFrames = 0;
+  m_probeBestMatch = 0;
+
+  m_probeTimer.start();
+  m_probePending = false;
+  m_probeSent = true;
+}
+
+void
+AudioEngine::detectRoundTripProbe(char const* data, qint64 len)
+{
+  if (m_probeTimer.elapsed() > kProbeTimeoutMillis)
+  {
+    m_probeSent = false;
+    emit logMessage("round trip: no probe echo detected");
+    return;
+  }
+
+  // The first channel slides through a window as long as the probe. The
+  // echo is where the window matches the square wave best, past
+  // kProbeMatch, however loud it came back: speech or a knock doesn't keep
+  // that shape for the whole window. The best match is only taken once the
+  // window has moved a whole probe past it.
+  int const channels = m_audioOutputFormat.channelCount();
+  int const n = m_probePattern.size();
+  float const minEnergy = n * kProbeMinLevel * kProbeMinLevel;
+  qint16 const* in = reinterpret_cast<qint16 const *>(data);
+  qint64 const frames = len / m_audioOutputFormat.bytesPerFrame();
+  for (qint64 i = 0; i < frames; ++i)
+  {
+    if (m_probeWindowEnd == m_probeWindow.size())
+    {
+      memmove(m_probeWindow.data(), m_probeWindow.data() + n, n * sizeof(float));
+      m_probeWindowEnd = n;
+    }
+    m_probeWindow[m_probeWindowEnd++] = in[i * channels];
+    m_probeFrames++;
+
+    float const* window = m_probeWindow.constData() + (m_probeWindowEnd - n);
+    float dot = 0;
+    float energy = 0;
+    for (int k = 0; k < n; ++k)
+    {
+      dot += window[k] * m_probePattern[k];
+      energy += window[k] * window[k];
+    }
+
+    // the speaker and microphone may well turn it upside down
+    float const match = (energy > minEnergy) ? (qAbs(dot) / sqrtf(energy)) : 0;
+    if ((match >= kProbeMatch) && (match > m_probeBestMatch))
+    {
+      m_probeBestMatch = match;
+      m_probeBestFrame = m_probeFrames;
+      m_probeBestMillis = m_probeTimer.elapsed();
+    }
+    else if ((m_probeBestMatch > 0) && ((m_probeFrames - m_probeBestFrame) >= n))
+    {
+      // the window ends with the probe, which started kProbeMillis before
+      int network = static_cast<int>(qMax<qint64>(0, m_probeBestMillis - kProbeMillis));
+      int playout = playoutDelayMillis();
+      int capture = inputDelayMillis();
+
+      m_probeSent = false;
+      m_stats.roundTripMillis = network + playout + capture;
+      emit logMessage(QString("round trip (%1): %2ms = capture %3ms + network/server %4ms + playout %5ms, match %6")
+        .arg(kLatencyProfiles[m_latencyProfile].name, QString::number(m_stats.roundTripMillis),
+             QString::number(capture), QString::number(network), QString::number(playout),
+             QString::number(m_probeBestMatch, 'f', 2)));
+      return;
+    }
+  }
+}
+
+void
+AudioEngine::onIncomingSoundData()
+{
+  if (!m_audioInput)
+    return;
+
+  XAUDIO_TRACE_SPAN("capture");
+
+  // a full device buffer means the backend has started dropping audio,
+  // and what is waiting when it's drained is how long the oldest of it
+  // sat in the device, averaged for the round trip's capture delay
+  qint64 const ready = m_audioInput->bytesReady();
+  if (ready >= m_audioInput->bufferSize())
+    m_stats.inputOverruns++;
+  m_inputQueuedBytes += (ready - m_inputQueuedBytes) / 8;
+
+  // never trust bytesReady() to size the read, drain in buffer sized
+  // chunks; unless the device runs at the wire format it is read into a
+  // separate buffer and converted into the write buffer
+  bool const convert = !m_inputConverter.isPassthrough();
+  QByteArray& readBuffer = convert ? m_audioDeviceReadBuffer : m_audioWriteBuffer;
+  qint64 bytesRead;
+  while ((bytesRead = m_audioInputDevice->read(readBuffer.data(), readBuffer.size())) > 0)
+  {
+    if (m_audioFromFile)
+      continue;
+
+    if (convert)
+    {
+      bytesRead = m_inputConverter.convert(m_audioDeviceReadBuffer.constData(), bytesRead, m_audioWriteBuffer.data());
+      if (bytesRead <= 0)
+        continue;
+    }
+
+    // during a switch the old device only feeds the crossfade
+    if (m_inputFading)
+      m_switchOldInput.append(m_audioWriteBuffer.constData(), static_cast<int>(bytesRead));
+    else
+      sendCapturedAudio(m_audioWriteBuffer.data(), bytesRead);
+  }
+
+  if (m_inputFading)
+    mixInputSwitch();
+}
+
+void
+AudioEngine::sendCapturedAudio(char* data, qint64 len)
+{
+  meter(&m_inLevelMeter, m_audioInputFormat, data, len);
+  if (!m_socket)
+    return;
+
+  if (m_probePending)
+    insertRoundTripProbe(data, len, m_audioInputFormat);
+  else if (m_audioInMute)
+    return;
+
+  qint64 n = m_socket->write(data, len);
+  if (n > 0)
+    m_stats.bytesSent += n;
+  if (m_recorder)
+    m_recorder->write(WavRecorder::Sent, data, len);
+}
+
+void
+AudioEngine::onOutputStateChanged(QAudio::State state)
+{
+  if ((state == QAudio::IdleState) && (m_audioOutput->error() == QAudio::UnderrunError))
+  {
+    if (m_socket && m_socket->state() == QAbstractSocket::ConnectedState && !m_audioOutMute)
+      m_stats.outputUnderruns++;
+  }
+}
+
+void
+AudioEngine::onSocketError(QAbstractSocket::SocketError /*socketError*/)
+{
+  if (!m_socket)
+    return;
+
+  linkDown(QString("socket error: %1").arg(m_socket->errorString()));
+  if (m_shouldBeConnected)
+    scheduleReconnect();
+}
+
+void
+AudioEngine::meter(LevelMeter* levelMeter, QAudioFormat const& format, char const* data, qint64 len)
+{
+  // metering is only done for the native 16 bit wire format
+  if ((format.sampleSize() != 16) || (format.sampleType() != QAudioFormat::SignedInt))
+    return;
+
+  levelMeter->process(reinterpret_cast<qint16 const *>(data), len / 2);
+}
+
+void
+AudioEngine::publishLevels()
+{
+  AudioLevels levels;
+  levels.in = m_inLevelMeter.take();
+  levels.out = m_outLevelMeter.take();
+
+  // hold the clip indicator long enough to be seen
+  m_inClipHold = levels.in.clipped ? kClipHoldTicks : qMax(0, m_inClipHold - 1);
+  m_outClipHold = levels.out.clipped ? kClipHoldTicks : qMax(0, m_outClipHold - 1);
+  levels.in.clipped = (m_inClipHold > 0);
+  levels.out.clipped = (m_outClipHold > 0);
+
+  emit levelsUpdated(levels);
+}
+
+void
+AudioEngine::publishStats()
+{
+  m_stats.concealmentEvents = m_jitterBuffer.concealmentEvents();
+  m_stats.droppedFrames = m_jitterBuffer.droppedFrames();
+  m_stats.concealedFrames = m_jitterBuffer.concealedFrames();
+  m_stats.playoutDelayMillis = playoutDelayMillis();
+  m_stats.timestamp = QDateTime::currentMSecsSinceEpoch();
+
+  qint64 const elapsed = m_statsClock.isValid() ? m_statsClock.restart() : 0;
+  if (elapsed > 0)
+  {
+    m_stats.receiveBitsPerSecond = ((m_stats.bytesReceived - m_statsLastBytesReceived) * 8000) / elapsed;
+    m_stats.sendBitsPerSecond = ((m_stats.bytesSent - m_statsLastBytesSent) * 8000) / elapsed;
+  }
+  m_statsLastBytesReceived = m_stats.bytesReceived;
+  m_statsLastBytesSent = m_stats.bytesSent;
+
+  m_stats.socketBacklogBytes = m_socket ? m_socket->bytesAvailable() : 0;
+  m_stats.socketSendBacklogBytes = m_socket ? m_socket->bytesToWrite() : 0;
+  m_stats.outputBytesFree = m_audioOutput ? m_audioOutput->bytesFree() : 0;
+
+  emit statsUpdated(m_stats);
+
+  // asked for with SIGUSR1 while connected, see trace.h
+  if (xaudio_trace_take_request())
+  {
+    QString const path = QDir(QDir::tempPath()).filePath(QString("soundtest-trace-%1.json")
+      .arg(QCoreApplication::applicationPid()));
+    long const spans = xaudio_trace_dump(qPrintable(path));
+    if (spans < 0)
+      emit logMessage(QString("failed to write the trace to %1").arg(path));
+    else
+      emit logMessage(QString("wrote %1 trace spans to %2").arg(spans).arg(path));
+  }
+
+  if (!m_conversionReportClock.isValid())
+    m_conversionReportClock.start();
+  else if (m_conversionReportClock.hasExpired(kConversionReportMillis))
+    reportConversionLoad();
+}
+
+void
+AudioEngine::reportConversionLoad()
+{
+  m_conversionReportClock.restart();
+
+  if (m_audioOutput && !m_outputConverter.isPassthrough())
+    emit logMessage(QString("audio out conversion %1: %2% of a core")
+      .arg(m_outputConverter.describe(), QString::number(m_outputConverter.takeCpuPercent(), 'f', 3)));
+
+  if (m_audioInput && !m_inputConverter.isPassthrough() && !m_audioFromFile)
+    emit logMessage(QString("audio in conversion %1: %2% of a core")
+      .arg(m_inputConverter.describe(), QString::number(m_inputConverter.takeCpuPercent(), 'f', 3)));
+}
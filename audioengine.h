@@ -0,0 +1,269 @@
+#ifndef AUDIOENGINE_H
+#define AUDIOENGINE_H
+
+#include <QObject>
+
+#include <QAudioDeviceInfo>
+#include <QAudioFormat>
+#include <QAudioInput>
+#include <QAudioOutput>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QMetaType>
+#include <QScopedPointer>
+#include <QTcpSocket>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+
+#include "filesource.h"
+#include "formatconverter.h"
+#include "jitterbuffer.h"
+#include "levelmeter.h"
+#include "wavrecorder.h"
+
+#include <random>
+
+// Snapshot of the counters kept on the audio thread. Published to the GUI
+// at a fixed, low rate so the GUI never has to touch the hot path.
+struct AudioEngineStats
+{
+  AudioEngineStats();
+
+  static QString csvHeader();
+  QString toCsv() const;
+
+  qint64 timestamp;
+  quint64 bytesReceived;
+  quint64 bytesSent;
+  quint64 outputUnderruns;
+  quint64 inputOverruns;
+  quint64 concealmentEvents;
+  quint64 droppedFrames;
+  quint64 concealedFrames;
+  int playoutDelayMillis;
+  int roundTripMillis;
+  int timeToAudioMillis;
+  int deviceSwitchMillis;
+  quint64 comfortNoiseFrames;
+  quint64 formatSwitches;
+  quint64 fileUnderruns;
+  quint64 reconnects;
+  qint64 receiveBitsPerSecond;
+  qint64 sendBitsPerSecond;
+  qint64 socketBacklogBytes;
+  qint64 socketSendBacklogBytes;
+  qint64 outputBytesFree;
+};
+
+Q_DECLARE_METATYPE(AudioEngineStats)
+
+// Decimated meter readings for both directions, in dBFS.
+struct AudioLevels
+{
+  LevelMeter::Reading in;
+  LevelMeter::Reading out;
+};
+
+Q_DECLARE_METATYPE(AudioLevels)
+
+// Owns the client socket and both audio devices. Lives on its own thread,
+// all public slots are expected to be invoked through queued connections.
+class AudioEngine : public QObject
+{
+  Q_OBJECT
+
+public:
+  // device buffering presets, see kLatencyProfiles
+  enum LatencyProfile
+  {
+    StandardLatency = 0,
+    LowLatency = 1
+  };
+
+  AudioEngine();
+  ~AudioEngine();
+
+  static QString latencyProfileName(int profile);
+
+public slots:
+  void connectToHost(QString const& host, quint16 port);
+  void disconnectFromHost();
+  void startOutput(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& format);
+  void startInput(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& format);
+  void switchOutputDevice(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& format);
+  void switchInputDevice(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& format);
+  void setInputMuted(bool muted);
+  void setOutputMuted(bool muted);
+  void setInputFromFile(bool fromFile);
+  void startFileInput(QString const& fileName, QAudioFormat const& format);
+  void setFileLooping(bool loop);
+  void setInputVolume(qreal volume);
+  void setTargetLatency(int millis);
+  void setLatencyProfile(int profile);
+  void measureRoundTrip();
+  void startRecording(QString const& prefix);
+  void stopRecording();
+  void shutdown();
+
+signals:
+  void logMessage(QString const& message);
+  void statsUpdated(AudioEngineStats const& stats);
+  void levelsUpdated(AudioLevels const& levels);
+
+private slots:
+  void reconnectToHost();
+  void onIncomingSoundData();
+  void onNextInputSoundData();
+  void retireOutput();
+  void onOutputStateChanged(QAudio::State state);
+  void onSocketConnected();
+  void onSocketReadyRead();
+  void onSocketError(QAbstractSocket::SocketError socketError);
+  void playAudioData();
+  void sendFileAudio();
+  void onFileFinished();
+  void publishStats();
+  void publishLevels();
+  void checkForStall();
+
+private:
+  void scheduleReconnect();
+  void linkDown(QString const& reason);
+  qint64 readServerHello(char const* data, qint64 len);
+  void receiveAudio(char const* data, qint64 len);
+  void receiveFrames(char const* data, qint64 len);
+  void receivePcm(char const* data, qint64 len);
+  bool switchWireFormat(QAudioFormat const& wireFormat);
+  void playComfortNoise(int frames, int levelDb);
+  void cancelOutputSwitch();
+  bool handOverOutput();
+  void cancelInputSwitch();
+  void mixInputSwitch();
+  void finishInputSwitch(bool stalled);
+  void sendCapturedAudio(char* data, qint64 len);
+  void pullPlayoutPeriod(char* data, qint64 len);
+  void reportConversionLoad();
+  void meter(LevelMeter* levelMeter, QAudioFormat const& format, char const* data, qint64 len);
+  int playoutDelayMillis() const;
+  int inputDelayMillis() const;
+  void insertRoundTripProbe(char* data, qint64 len, QAudioFormat const& format);
+  void detectRoundTripProbe(char const* data, qint64 len);
+
+private:
+  QScopedPointer<QTcpSocket>    m_socket;
+  QString                       m_host;
+  quint16                       m_port;
+  bool                          m_shouldBeConnected;
+
+  // session resume, see protocol.h
+  quint64                       m_sessionToken;
+  quint64                       m_sessionBytesReceived;
+  bool                          m_helloPending;
+  QByteArray                    m_helloBuffer;
+  int                           m_reconnectDelayMillis;
+  std::minstd_rand              m_reconnectJitter;
+  QTimer*                       m_stallTimer;
+  QElapsedTimer                 m_lastAudioClock;
+  bool                          m_audioFlowing;
+  QElapsedTimer                 m_linkDownClock;
+  bool                          m_awaitingAudio;
+
+  // silence suppression, see protocol.h
+  bool                          m_dtx;
+  QByteArray                    m_dtxHeader;
+  qint64                        m_dtxPcmRemaining;
+  QByteArray                    m_comfortNoise;
+  std::minstd_rand              m_comfortNoiseRandom;
+
+  // the format the server sends right now, converted back to the one
+  // asked for so playout never notices
+  QAudioFormat                  m_wireFormat;
+  FormatConverter               m_wireConverter;
+  QByteArray                    m_wirePartialFrame;
+  QByteArray                    m_wireConverted;
+
+  QScopedPointer<QAudioOutput>  m_audioOutput;
+  QIODevice*                    m_audioOutDevice;
+  QAudioFormat                  m_audioOutputFormat;
+  QAudioFormat                  m_outputDeviceFormat;
+  FormatConverter               m_outputConverter;
+  QByteArray                    m_convertedPlayout;
+  qint64                        m_convertedPlayoutBytes;
+  QByteArray                    m_audioReadBuffer;
+  QByteArray                    m_playoutBuffer;
+  JitterBuffer                  m_jitterBuffer;
+  QTimer*                       m_playoutTimer;
+  bool                          m_audioOutMute;
+
+  QScopedPointer<QAudioInput>   m_audioInput;
+  QIODevice*                    m_audioInputDevice;
+  QByteArray                    m_audioWriteBuffer;
+  bool                          m_audioInMute;
+  bool                          m_audioFromFile;
+  QAudioFormat                  m_audioInputFormat;
+  QAudioFormat                  m_inputDeviceFormat;
+  FormatConverter               m_inputConverter;
+  QByteArray                    m_audioDeviceReadBuffer;
+  qreal                         m_inputVolume;
+
+  // hot switching: the next device is opened while the running one keeps
+  // playing or capturing, and takes over with a short crossfade
+  QScopedPointer<QAudioOutput>  m_nextAudioOutput;
+  QIODevice*                    m_nextAudioOutDevice;
+  QAudioFormat                  m_nextOutputDeviceFormat;
+  FormatConverter               m_nextOutputConverter;
+  QScopedPointer<QAudioOutput>  m_retiringAudioOutput;
+  QElapsedTimer                 m_outputSwitchClock;
+  QScopedPointer<QAudioInput>   m_nextAudioInput;
+  QIODevice*                    m_nextAudioInputDevice;
+  QAudioFormat                  m_nextInputDeviceFormat;
+  FormatConverter               m_nextInputConverter;
+  QByteArray                    m_nextAudioDeviceReadBuffer;
+  bool                          m_nextInputStarted;
+  bool                          m_inputFading;
+  qint64                        m_inputFadeFrames;
+  QByteArray                    m_switchOldInput;
+  QByteArray                    m_switchNewInput;
+  QElapsedTimer                 m_inputSwitchClock;
+
+  // file input, decoded ahead on its own thread and paced by m_fileClock
+  FileSource*                   m_fileSource;
+  QScopedPointer<QThread>       m_fileSourceThread;
+  QTimer*                       m_filePacingTimer;
+  QElapsedTimer                 m_fileClock;
+  QAudioFormat                  m_fileFormat;
+  qint64                        m_fileFramesSent;
+  bool                          m_fileLoop;
+  bool                          m_fileEnded;
+
+  int                           m_latencyProfile;
+  bool                          m_probePending;
+  bool                          m_probeSent;
+  QElapsedTimer                 m_probeTimer;
+  QVector<float>                m_probePattern;
+  QVector<float>                m_probeWindow;
+  int                           m_probeWindowEnd;
+  qint64                        m_probeFrames;
+  float                         m_probeBestMatch;
+  qint64                        m_probeBestFrame;
+  qint64                        m_probeBestMillis;
+  qint64                        m_inputQueuedBytes;
+
+  WavRecorder*                  m_recorder;
+
+  QTimer*                       m_statsTimer;
+  QElapsedTimer                 m_statsClock;
+  QElapsedTimer                 m_conversionReportClock;
+  quint64                       m_statsLastBytesReceived;
+  quint64                       m_statsLastBytesSent;
+  bool                          m_hasConnected;
+  QTimer*                       m_levelsTimer;
+  LevelMeter                    m_inLevelMeter;
+  LevelMeter                    m_outLevelMeter;
+  int                           m_inClipHold;
+  int                           m_outClipHold;
+  AudioEngineStats              m_stats;
+};
+
+#endif // AUDIOENGINE_H
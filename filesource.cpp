@@ -0,0 +1,168 @@
+#include "filesource.h"
+
+#include <QAudioBuffer>
+#include <QMutexLocker>
+
+#include <string.h>
+
+static const int kDecodeAheadMillis = 2000;
+static const int kSpaceWaitMillis = 100;
+
+FileSource::FileSource()
+  : m_decoder(nullptr)
+  , m_fileName()
+  , m_format()
+  , m_loop(false)
+  , m_loops(0)
+  , m_lock()
+  , m_spaceAvailable()
+  , m_ring()
+  , m_readPos(0)
+  , m_size(0)
+  , m_abort(0)
+{
+}
+
+FileSource::~FileSource()
+{
+}
+
+void
+FileSource::abort()
+{
+  m_abort.storeRelease(1);
+
+  QMutexLocker lock(&m_lock);
+  m_spaceAvailable.wakeAll();
+}
+
+void
+FileSource::start(QString const& fileName, QAudioFormat const& format, bool loop)
+{
+  stop();
+
+  // created here so it belongs to the worker thread
+  if (!m_decoder)
+  {
+    m_decoder = new QAudioDecoder(this);
+    connect(m_decoder, SIGNAL(bufferReady()), this, SLOT(onBufferReady()));
+    connect(m_decoder, SIGNAL(finished()), this, SLOT(onFinished()));
+    connect(m_decoder, SIGNAL(error(QAudioDecoder::Error)), this, SLOT(onError(QAudioDecoder::Error)));
+  }
+
+  {
+    QMutexLocker lock(&m_lock);
+    m_ring.fill(0, format.bytesForDuration(kDecodeAheadMillis * 1000));
+    m_readPos = 0;
+    m_size = 0;
+  }
+
+  m_abort.storeRelease(0);
+  m_fileName = fileName;
+  m_format = format;
+  m_loop = loop;
+  m_loops = 0;
+
+  emit logMessage(QString("streaming file %1%2").arg(fileName, loop ? " (looping)" : ""));
+
+  m_decoder->setAudioFormat(format);
+  m_decoder->setSourceFilename(fileName);
+  m_decoder->start();
+}
+
+void
+FileSource::stop()
+{
+  if (m_decoder)
+    m_decoder->stop();
+
+  QMutexLocker lock(&m_lock);
+  m_readPos = 0;
+  m_size = 0;
+}
+
+void
+FileSource::setLooping(bool loop)
+{
+  m_loop = loop;
+}
+
+qint64
+FileSource::bytesAvailable() const
+{
+  QMutexLocker lock(&m_lock);
+  return m_size;
+}
+
+qint64
+FileSource::read(char* data, qint64 maxLen)
+{
+  QMutexLocker lock(&m_lock);
+
+  qint64 const capacity = m_ring.size();
+  qint64 const len = qMin(maxLen, m_size);
+  if (len <= 0)
+    return 0;
+
+  qint64 first = qMin(len, capacity - m_readPos);
+  memcpy(data, m_ring.constData() + m_readPos, first);
+  memcpy(data + first, m_ring.constData(), len - first);
+
+  m_readPos = (m_readPos + len) % capacity;
+  m_size -= len;
+  m_spaceAvailable.wakeAll();
+
+  return len;
+}
+
+void
+FileSource::onBufferReady()
+{
+  QAudioBuffer buffer = m_decoder->read();
+  char const* data = reinterpret_cast<char const *>(buffer.constData());
+  qint64 len = buffer.byteCount();
+
+  QMutexLocker lock(&m_lock);
+  qint64 const capacity = m_ring.size();
+
+  while ((len > 0) && !m_abort.loadAcquire())
+  {
+    // blocking here stalls the decoder, which is exactly the back pressure
+    // we want once we're far enough ahead
+    if (m_size == capacity)
+    {
+      m_spaceAvailable.wait(&m_lock, kSpaceWaitMillis);
+      continue;
+    }
+
+    qint64 writePos = (m_readPos + m_size) % capacity;
+    qint64 n = qMin(len, qMin(capacity - m_size, capacity - writePos));
+    memcpy(m_ring.data() + writePos, data, n);
+    m_size += n;
+    data += n;
+    len -= n;
+  }
+}
+
+void
+FileSource::onFinished()
+{
+  if (m_loop && !m_abort.loadAcquire())
+  {
+    m_loops++;
+    emit logMessage(QString("looping %1 (%2)").arg(m_fileName, QString::number(m_loops)));
+    m_decoder->stop();
+    m_decoder->setSourceFilename(m_fileName);
+    m_decoder->start();
+    return;
+  }
+
+  emit logMessage(QString("finished streaming %1").arg(m_fileName));
+  emit finished();
+}
+
+void
+FileSource::onError(QAudioDecoder::Error /*error*/)
+{
+  emit logMessage(QString("audio decoder error: %1").arg(m_decoder->errorString()));
+}
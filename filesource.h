@@ -0,0 +1,60 @@
+#ifndef FILESOURCE_H
+#define FILESOURCE_H
+
+#include <QObject>
+
+#include <QAtomicInt>
+#include <QAudioDecoder>
+#include <QAudioFormat>
+#include <QByteArray>
+#include <QMutex>
+#include <QWaitCondition>
+
+// Decodes an audio file ahead of time into a bounded buffer. Lives on its
+// own worker thread; the decoder is throttled by blocking that thread while
+// the buffer is full. read() is non-blocking and may be called from any
+// thread, pacing is entirely up to the consumer.
+class FileSource : public QObject
+{
+  Q_OBJECT
+
+public:
+  FileSource();
+  ~FileSource();
+
+  qint64 read(char* data, qint64 maxLen);
+  qint64 bytesAvailable() const;
+
+  // unblocks a decoder thread waiting for space, call before stop()
+  void abort();
+
+public slots:
+  void start(QString const& fileName, QAudioFormat const& format, bool loop);
+  void stop();
+  void setLooping(bool loop);
+
+signals:
+  void logMessage(QString const& message);
+  void finished();
+
+private slots:
+  void onBufferReady();
+  void onFinished();
+  void onError(QAudioDecoder::Error error);
+
+private:
+  QAudioDecoder*        m_decoder;
+  QString               m_fileName;
+  QAudioFormat          m_format;
+  bool                  m_loop;
+  quint64               m_loops;
+
+  mutable QMutex        m_lock;
+  QWaitCondition        m_spaceAvailable;
+  QByteArray            m_ring;
+  qint64                m_readPos;
+  qint64                m_size;
+  QAtomicInt            m_abort;
+};
+
+#endif // FILESOURCE_H
@@ -0,0 +1,451 @@
+#include "formatconverter.h"
+
+#include <QStringList>
+#include <QSysInfo>
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+static const float kS16Scale = 32768.0f;
+static const double kS32Scale = 2147483648.0;
+
+static bool
+is_native_endian(QAudioFormat const& format)
+{
+  return (format.sampleSize() == 8)
+    || (format.byteOrder() == static_cast<QAudioFormat::Endian>(QSysInfo::ByteOrder));
+}
+
+static bool
+is_native_s16(QAudioFormat const& format)
+{
+  return (format.sampleSize() == 16) && (format.sampleType() == QAudioFormat::SignedInt)
+    && is_native_endian(format);
+}
+
+static bool
+is_native_f32(QAudioFormat const& format)
+{
+  return (format.sampleSize() == 32) && (format.sampleType() == QAudioFormat::Float)
+    && is_native_endian(format);
+}
+
+static void
+decode_s16(qint16 const* in, float* out, qint64 count)
+{
+  qint64 i = 0;
+  float const scale = 1.0f / kS16Scale;
+
+#if defined(__SSE2__)
+  __m128 const vscale = _mm_set1_ps(scale);
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+    // widen with sign by unpacking into the high half and shifting down
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  for (; i + 8 <= count; i += 8)
+  {
+    int16x8_t v = vld1q_s16(in + i);
+    vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), scale));
+    vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), scale));
+  }
+#endif
+
+  for (; i < count; ++i)
+    out[i] = in[i] * scale;
+}
+
+static void
+encode_s16(float const* in, qint16* out, qint64 count)
+{
+  qint64 i = 0;
+
+#if defined(__SSE2__)
+  __m128 const vscale = _mm_set1_ps(kS16Scale);
+  __m128 const vmax = _mm_set1_ps(1.0f);
+  __m128 const vmin = _mm_set1_ps(-1.0f);
+  for (; i + 8 <= count; i += 8)
+  {
+    // clamp before scaling so out of range input can't wrap in the
+    // conversion, the pack saturates the +1.0 case
+    __m128 a = _mm_max_ps(vmin, _mm_min_ps(vmax, _mm_loadu_ps(in + i)));
+    __m128 b = _mm_max_ps(vmin, _mm_min_ps(vmax, _mm_loadu_ps(in + i + 4)));
+    __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(a, vscale));
+    __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(b, vscale));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packs_epi32(lo, hi));
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  float32x4_t const vmax = vdupq_n_f32(1.0f);
+  float32x4_t const vmin = vdupq_n_f32(-1.0f);
+  for (; i + 8 <= count; i += 8)
+  {
+    float32x4_t a = vmaxq_f32(vmin, vminq_f32(vmax, vld1q_f32(in + i)));
+    float32x4_t b = vmaxq_f32(vmin, vminq_f32(vmax, vld1q_f32(in + i + 4)));
+    int32x4_t lo = vcvtq_s32_f32(vmulq_n_f32(a, kS16Scale));
+    int32x4_t hi = vcvtq_s32_f32(vmulq_n_f32(b, kS16Scale));
+    vst1q_s16(out + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+  }
+#endif
+
+  for (; i < count; ++i)
+  {
+    float v = qBound(-1.0f, in[i], 1.0f) * kS16Scale;
+    out[i] = static_cast<qint16>(qBound(-32768.0f, v + ((v < 0.0f) ? -0.5f : 0.5f), 32767.0f));
+  }
+}
+
+// any other integer layout is left aligned into 32 bits, unsigned formats
+// get their top bit flipped to become signed
+static void
+decode_generic(QAudioFormat const& format, uchar const* in, float* out, qint64 count)
+{
+  int const bytes = format.sampleSize() / 8;
+  int const shift = 32 - format.sampleSize();
+  bool const little = (format.byteOrder() == QAudioFormat::LittleEndian);
+  bool const isFloat = (format.sampleType() == QAudioFormat::Float);
+  bool const isUnsigned = (format.sampleType() == QAudioFormat::UnSignedInt);
+
+  for (qint64 i = 0; i < count; ++i, in += bytes)
+  {
+    quint32 raw = 0;
+    for (int b = 0; b < bytes; ++b)
+      raw |= static_cast<quint32>(in[little ? b : (bytes - 1 - b)]) << (8 * b);
+
+    if (isFloat)
+    {
+      memcpy(&out[i], &raw, sizeof(float));
+      continue;
+    }
+
+    raw <<= shift;
+    if (isUnsigned)
+      raw ^= 0x80000000u;
+    out[i] = static_cast<float>(static_cast<qint32>(raw) / kS32Scale);
+  }
+}
+
+static void
+encode_generic(QAudioFormat const& format, float const* in, uchar* out, qint64 count)
+{
+  int const bytes = format.sampleSize() / 8;
+  int const shift = 32 - format.sampleSize();
+  bool const little = (format.byteOrder() == QAudioFormat::LittleEndian);
+  bool const isFloat = (format.sampleType() == QAudioFormat::Float);
+  bool const isUnsigned = (format.sampleType() == QAudioFormat::UnSignedInt);
+
+  for (qint64 i = 0; i < count; ++i, out += bytes)
+  {
+    quint32 raw;
+    if (isFloat)
+    {
+      memcpy(&raw, &in[i], sizeof(float));
+    }
+    else
+    {
+      double v = qBound(-kS32Scale, in[i] * kS32Scale, kS32Scale - 1.0);
+      raw = static_cast<quint32>(static_cast<qint32>(v));
+      if (isUnsigned)
+        raw ^= 0x80000000u;
+      raw >>= shift;
+    }
+
+    for (int b = 0; b < bytes; ++b)
+      out[little ? b : (bytes - 1 - b)] = static_cast<uchar>(raw >> (8 * b));
+  }
+}
+
+static void
+decode(QAudioFormat const& format, char const* in, float* out, qint64 count)
+{
+  if (is_native_s16(format))
+    decode_s16(reinterpret_cast<qint16 const *>(in), out, count);
+  else if (is_native_f32(format))
+    memcpy(out, in, count * sizeof(float));
+  else
+    decode_generic(format, reinterpret_cast<uchar const *>(in), out, count);
+}
+
+static void
+encode(QAudioFormat const& format, float const* in, char* out, qint64 count)
+{
+  if (is_native_s16(format))
+    encode_s16(in, reinterpret_cast<qint16 *>(out), count);
+  else if (is_native_f32(format))
+    memcpy(out, in, count * sizeof(float));
+  else
+    encode_generic(format, in, reinterpret_cast<uchar *>(out), count);
+}
+
+// downmix averages every input channel onto output channel (in % out),
+// upmix repeats the input channels
+static void
+mix_channels(float const* in, int inChannels, float* out, int outChannels, qint64 frames)
+{
+  if (outChannels == 1)
+  {
+    float const scale = 1.0f / inChannels;
+    for (qint64 f = 0; f < frames; ++f, in += inChannels)
+    {
+      float sum = 0.0f;
+      for (int c = 0; c < inChannels; ++c)
+        sum += in[c];
+      out[f] = sum * scale;
+    }
+    return;
+  }
+
+  if (inChannels < outChannels)
+  {
+    for (qint64 f = 0; f < frames; ++f, in += inChannels, out += outChannels)
+      for (int c = 0; c < outChannels; ++c)
+        out[c] = in[c % inChannels];
+    return;
+  }
+
+  for (qint64 f = 0; f < frames; ++f, in += inChannels, out += outChannels)
+  {
+    for (int c = 0; c < outChannels; ++c)
+    {
+      float sum = 0.0f;
+      int n = 0;
+      for (int k = c; k < inChannels; k += outChannels, ++n)
+        sum += in[k];
+      out[c] = sum / n;
+    }
+  }
+}
+
+FormatConverter::FormatConverter()
+  : m_from()
+  , m_to()
+  , m_passthrough(true)
+  , m_inChannels(0)
+  , m_outChannels(0)
+  , m_step(0)
+  , m_phase(0)
+  , m_lastFrame()
+  , m_decoded()
+  , m_mixed()
+  , m_resampled()
+  , m_timer()
+  , m_busyNanos(0)
+  , m_framesIn(0)
+{
+}
+
+bool
+FormatConverter::canConvert(QAudioFormat const& format)
+{
+  if ((format.codec() != "audio/pcm") || (format.sampleRate() <= 0) || (format.channelCount() <= 0))
+    return false;
+
+  switch (format.sampleType())
+  {
+  case QAudioFormat::SignedInt:
+  case QAudioFormat::UnSignedInt:
+    return (format.sampleSize() == 8) || (format.sampleSize() == 16)
+      || (format.sampleSize() == 24) || (format.sampleSize() == 32);
+  case QAudioFormat::Float:
+    return (format.sampleSize() == 32);
+  default:
+    return false;
+  }
+}
+
+// devices are opened at a format they actually support rather than
+// leaving it to the backend: the wire format when it is supported as is,
+// otherwise the nearest (or preferred) format we can convert to ourselves
+QAudioFormat
+FormatConverter::negotiateDeviceFormat(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& wireFormat)
+{
+  if (deviceInfo.isFormatSupported(wireFormat))
+    return wireFormat;
+
+  QAudioFormat nearest = deviceInfo.nearestFormat(wireFormat);
+  if (canConvert(nearest))
+    return nearest;
+
+  QAudioFormat preferred = deviceInfo.preferredFormat();
+  if (canConvert(preferred))
+    return preferred;
+
+  return wireFormat;
+}
+
+QString
+FormatConverter::formatName(QAudioFormat const& format)
+{
+  char type = 's';
+  if (format.sampleType() == QAudioFormat::UnSignedInt)
+    type = 'u';
+  else if (format.sampleType() == QAudioFormat::Float)
+    type = 'f';
+
+  QString name = QString("%1Hz %2ch %3%4").arg(QString::number(format.sampleRate()),
+    QString::number(format.channelCount()), QString(type), QString::number(format.sampleSize()));
+  if (format.sampleSize() > 8)
+    name += (format.byteOrder() == QAudioFormat::LittleEndian) ? "le" : "be";
+  return name;
+}
+
+bool
+FormatConverter::setFormats(QAudioFormat const& from, QAudioFormat const& to)
+{
+  m_from = from;
+  m_to = to;
+  m_passthrough = (from == to);
+  m_inChannels = from.channelCount();
+  m_outChannels = to.channelCount();
+  reset();
+
+  if (m_passthrough)
+    return true;
+  if (!canConvert(from) || !canConvert(to))
+    return false;
+
+  m_step = (static_cast<quint64>(from.sampleRate()) << 32) / static_cast<quint64>(to.sampleRate());
+  return true;
+}
+
+void
+FormatConverter::reset()
+{
+  m_phase = 0;
+  m_lastFrame.fill(0.0f, qMax(0, m_outChannels));
+  m_busyNanos = 0;
+  m_framesIn = 0;
+}
+
+QString
+FormatConverter::describe() const
+{
+  if (m_passthrough)
+    return QString("native %1, no conversion").arg(formatName(m_from));
+
+  QStringList steps;
+  if ((m_from.sampleSize() != m_to.sampleSize()) || (m_from.sampleType() != m_to.sampleType())
+    || (m_from.byteOrder() != m_to.byteOrder()))
+    steps << "sample format";
+  if (m_inChannels != m_outChannels)
+    steps << "channels";
+  if (m_from.sampleRate() != m_to.sampleRate())
+    steps << "resample";
+
+  return QString("%1 -> %2 (%3)").arg(formatName(m_from), formatName(m_to), steps.join(", "));
+}
+
+qint64
+FormatConverter::maxOutputBytes(qint64 inputBytes) const
+{
+  int const inFrameBytes = m_from.bytesPerFrame();
+  if (inFrameBytes <= 0)
+    return 0;
+  if (m_passthrough)
+    return inputBytes;
+
+  qint64 frames = inputBytes / inFrameBytes;
+  if (m_from.sampleRate() != m_to.sampleRate())
+    frames = ((frames * m_to.sampleRate()) / m_from.sampleRate()) + 2;
+  return frames * m_to.bytesPerFrame();
+}
+
+qint64
+FormatConverter::convert(char const* in, qint64 len, char* out)
+{
+  int const inFrameBytes = m_from.bytesPerFrame();
+  qint64 const frames = (inFrameBytes > 0) ? (len / inFrameBytes) : 0;
+  if (frames <= 0)
+    return 0;
+
+  m_timer.start();
+
+  if (m_passthrough)
+  {
+    memcpy(out, in, frames * inFrameBytes);
+    m_busyNanos += m_timer.nsecsElapsed();
+    m_framesIn += frames;
+    return frames * inFrameBytes;
+  }
+
+  qint64 const inSamples = frames * m_inChannels;
+  if (m_decoded.size() < inSamples)
+    m_decoded.resize(static_cast<int>(inSamples));
+  decode(m_from, in, m_decoded.data(), inSamples);
+
+  float* samples = m_decoded.data();
+  if (m_inChannels != m_outChannels)
+  {
+    qint64 const mixedSamples = frames * m_outChannels;
+    if (m_mixed.size() < mixedSamples)
+      m_mixed.resize(static_cast<int>(mixedSamples));
+    mix_channels(samples, m_inChannels, m_mixed.data(), m_outChannels, frames);
+    samples = m_mixed.data();
+  }
+
+  qint64 outFrames = frames;
+  if (m_from.sampleRate() != m_to.sampleRate())
+  {
+    qint64 const maxSamples = (maxOutputBytes(len) / m_to.bytesPerFrame()) * m_outChannels;
+    if (m_resampled.size() < maxSamples)
+      m_resampled.resize(static_cast<int>(maxSamples));
+    outFrames = resample(samples, frames, m_resampled.data());
+    samples = m_resampled.data();
+  }
+
+  encode(m_to, samples, out, outFrames * m_outChannels);
+
+  m_busyNanos += m_timer.nsecsElapsed();
+  m_framesIn += frames;
+  return outFrames * m_to.bytesPerFrame();
+}
+
+qint64
+FormatConverter::resample(float const* in, qint64 frames, float* out)
+{
+  // the input is seen as the last frame of the previous block followed by
+  // this block, so interpolation is continuous across block boundaries
+  int const channels = m_outChannels;
+  quint64 const end = static_cast<quint64>(frames) << 32;
+  float const* last = m_lastFrame.constData();
+  qint64 produced = 0;
+
+  for (; m_phase < end; m_phase += m_step, ++produced, out += channels)
+  {
+    qint64 const i = static_cast<qint64>(m_phase >> 32);
+    float const frac = static_cast<float>(m_phase & 0xffffffffu) * (1.0f / 4294967296.0f);
+    float const* a = (i == 0) ? last : (in + ((i - 1) * channels));
+    float const* b = in + (i * channels);
+
+    for (int c = 0; c < channels; ++c)
+      out[c] = a[c] + (frac * (b[c] - a[c]));
+  }
+
+  m_phase -= end;
+  memcpy(m_lastFrame.data(), in + ((frames - 1) * channels), channels * sizeof(float));
+  return produced;
+}
+
+double
+FormatConverter::takeCpuPercent()
+{
+  double percent = 0.0;
+  if ((m_framesIn > 0) && (m_from.sampleRate() > 0))
+  {
+    double audioNanos = (m_framesIn * 1e9) / m_from.sampleRate();
+    percent = (100.0 * m_busyNanos) / audioNanos;
+  }
+
+  m_busyNanos = 0;
+  m_framesIn = 0;
+  return percent;
+}
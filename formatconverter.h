@@ -0,0 +1,73 @@
+#ifndef FORMATCONVERTER_H
+#define FORMATCONVERTER_H
+
+#include <QAudioDeviceInfo>
+#include <QAudioFormat>
+#include <QElapsedTimer>
+#include <QString>
+#include <QVector>
+
+// Converts linear PCM between the wire format and whatever format a device
+// was actually opened with: sample type/size/byte order, channel count and
+// sample rate. Everything goes through an interleaved float stage; the
+// common 16 bit and float cases are converted with SSE2/NEON. Resampling is
+// linear interpolation, which is what the jitter buffer does as well.
+//
+// convert() runs on the audio thread. It doesn't allocate once the scratch
+// buffers have grown to the block size in use, and it keeps track of the
+// time spent so the cost of the conversion can be reported.
+class FormatConverter
+{
+public:
+  FormatConverter();
+
+  static bool canConvert(QAudioFormat const& format);
+  static QAudioFormat negotiateDeviceFormat(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& wireFormat);
+  static QString formatName(QAudioFormat const& format);
+
+  bool setFormats(QAudioFormat const& from, QAudioFormat const& to);
+  void reset();
+
+  bool isPassthrough() const
+    { return m_passthrough; }
+  QAudioFormat const& inputFormat() const
+    { return m_from; }
+  QAudioFormat const& outputFormat() const
+    { return m_to; }
+  QString describe() const;
+
+  // worst case output for a block of inputBytes, size the output with it
+  qint64 maxOutputBytes(qint64 inputBytes) const;
+
+  // converts whole frames of the input format, returns the bytes written
+  qint64 convert(char const* in, qint64 len, char* out);
+
+  // percentage of one core spent converting, relative to the duration of
+  // the audio converted since the previous call
+  double takeCpuPercent();
+
+private:
+  qint64 resample(float const* in, qint64 frames, float* out);
+
+private:
+  QAudioFormat    m_from;
+  QAudioFormat    m_to;
+  bool            m_passthrough;
+  int             m_inChannels;
+  int             m_outChannels;
+
+  // resampler position in 32.32 fixed point, relative to m_lastFrame
+  quint64         m_step;
+  quint64         m_phase;
+  QVector<float>  m_lastFrame;
+
+  QVector<float>  m_decoded;
+  QVector<float>  m_mixed;
+  QVector<float>  m_resampled;
+
+  QElapsedTimer   m_timer;
+  qint64          m_busyNanos;
+  qint64          m_framesIn;
+};
+
+#endif // FORMATCONVERTER_H
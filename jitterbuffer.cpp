@@ -0,0 +1,261 @@
+#include "jitterbuffer.h"
+
+#include <string.h>
+
+static const int kDefaultTargetMillis = 100;
+static const int kMinTargetMillis = 10;
+static const int kMaxTargetMillis = 2000;
+static const int kMinToleranceMillis = 20;
+static const int kMaxBacklogFactor = 3;
+static const int kCapacityHeadroomMillis = 500;
+
+// playout rate is nudged by 1/kAdjustDivisor (5%) while out of tolerance
+static const int kAdjustDivisor = 20;
+
+JitterBuffer::JitterBuffer()
+  : m_format()
+  , m_bytesPerFrame(0)
+  , m_canInterpolate(false)
+  , m_canConceal(false)
+  , m_targetMillis(kDefaultTargetMillis)
+  , m_ring()
+  , m_readPos(0)
+  , m_size(0)
+  , m_buffering(true)
+  , m_scratch()
+  , m_plc()
+  , m_played(false)
+  , m_droppedFrames(0)
+  , m_concealedFrames(0)
+  , m_concealmentEvents(0)
+{
+}
+
+void
+JitterBuffer::setFormat(QAudioFormat const& format)
+{
+  m_format = format;
+  m_bytesPerFrame = format.bytesPerFrame();
+  m_canInterpolate = (format.sampleSize() == 16)
+    && (format.sampleType() == QAudioFormat::SignedInt)
+    && (format.byteOrder() == QAudioFormat::LittleEndian);
+  m_canConceal = m_canInterpolate && (format.channelCount() <= XAUDIO_PLC_MAX_CHANNELS);
+  if (m_canConceal)
+    xaudio_plc_init(&m_plc, format.sampleRate(), format.channelCount());
+  reset();
+}
+
+void
+JitterBuffer::setTargetLatency(int millis)
+{
+  m_targetMillis = qBound(kMinTargetMillis, millis, kMaxTargetMillis);
+  reset();
+}
+
+void
+JitterBuffer::reset()
+{
+  qint64 capacity = bytesForMillis((m_targetMillis * (kMaxBacklogFactor + 1)) + kCapacityHeadroomMillis);
+  m_ring.fill(0, static_cast<int>(capacity));
+  m_readPos = 0;
+  m_size = 0;
+  m_buffering = true;
+  if (m_canConceal)
+    xaudio_plc_reset(&m_plc);
+  m_played = false;
+}
+
+qint64
+JitterBuffer::bytesForMillis(int millis) const
+{
+  if (m_bytesPerFrame == 0)
+    return 0;
+
+  qint64 frames = (static_cast<qint64>(m_format.sampleRate()) * millis) / 1000;
+  return frames * m_bytesPerFrame;
+}
+
+int
+JitterBuffer::bufferedMillis() const
+{
+  if ((m_bytesPerFrame == 0) || (m_format.sampleRate() <= 0))
+    return 0;
+
+  return static_cast<int>(((m_size / m_bytesPerFrame) * 1000) / m_format.sampleRate());
+}
+
+void
+JitterBuffer::push(char const* data, qint64 len)
+{
+  qint64 const capacity = m_ring.size();
+  if ((capacity == 0) || (len <= 0))
+    return;
+
+  if (len > capacity)
+  {
+    m_droppedFrames += (len - capacity) / m_bytesPerFrame;
+    data += (len - capacity);
+    len = capacity;
+  }
+
+  qint64 const overflow = (m_size + len) - capacity;
+  if (overflow > 0)
+  {
+    // keep whole frames, the oldest audio goes first
+    qint64 n = overflow + ((m_bytesPerFrame - (overflow % m_bytesPerFrame)) % m_bytesPerFrame);
+    discard(n);
+    m_droppedFrames += n / m_bytesPerFrame;
+  }
+
+  qint64 writePos = (m_readPos + m_size) % capacity;
+  qint64 first = qMin(len, capacity - writePos);
+  memcpy(m_ring.data() + writePos, data, first);
+  memcpy(m_ring.data(), data + first, len - first);
+  m_size += len;
+}
+
+qint64
+JitterBuffer::read(char* data, qint64 len)
+{
+  qint64 const capacity = m_ring.size();
+  len = qMin(len, m_size);
+
+  qint64 first = qMin(len, capacity - m_readPos);
+  memcpy(data, m_ring.constData() + m_readPos, first);
+  memcpy(data + first, m_ring.constData(), len - first);
+
+  m_readPos = (m_readPos + len) % capacity;
+  m_size -= len;
+  return len;
+}
+
+void
+JitterBuffer::discard(qint64 len)
+{
+  len = qMin(len, m_size);
+  m_readPos = (m_readPos + len) % m_ring.size();
+  m_size -= len;
+}
+
+void
+JitterBuffer::pull(char* data, qint64 len)
+{
+  if ((m_bytesPerFrame == 0) || (m_ring.isEmpty()))
+  {
+    memset(data, 0, len);
+    return;
+  }
+
+  len -= (len % m_bytesPerFrame);
+
+  if (m_buffering)
+  {
+    if (m_size < bytesForMillis(m_targetMillis))
+    {
+      conceal(data, len);
+      return;
+    }
+    m_buffering = false;
+  }
+
+  int const buffered = bufferedMillis();
+  int const tolerance = qMax(m_targetMillis / 2, kMinToleranceMillis);
+
+  if (buffered > ((m_targetMillis * kMaxBacklogFactor) + tolerance))
+  {
+    // way too far behind to catch up by time-compression
+    qint64 excess = m_size - bytesForMillis(m_targetMillis);
+    excess -= (excess % m_bytesPerFrame);
+    discard(excess);
+    m_droppedFrames += excess / m_bytesPerFrame;
+  }
+
+  if (m_size < len)
+  {
+    qint64 n = read(data, m_size);
+    n -= (n % m_bytesPerFrame);
+    if (m_canConceal && (n > 0))
+      xaudio_plc_good(&m_plc, reinterpret_cast<qint16 *>(data), static_cast<int>(n / m_bytesPerFrame));
+    conceal(data + n, len - n);
+    m_concealmentEvents++;
+    m_buffering = true;
+    return;
+  }
+
+  qint64 const outFrames = len / m_bytesPerFrame;
+  qint64 const adjust = outFrames / kAdjustDivisor;
+
+  if ((adjust > 0) && (buffered > (m_targetMillis + tolerance)))
+  {
+    if (m_canInterpolate && (m_size >= ((outFrames + adjust) * m_bytesPerFrame)))
+    {
+      resample(data, outFrames, outFrames + adjust);
+    }
+    else
+    {
+      discard(adjust * m_bytesPerFrame);
+      m_droppedFrames += adjust;
+      read(data, len);
+    }
+  }
+  else if (m_canInterpolate && (adjust > 0) && (buffered < (m_targetMillis / 2)))
+  {
+    resample(data, outFrames, outFrames - adjust);
+  }
+  else
+  {
+    read(data, len);
+  }
+
+  if (m_canConceal)
+    xaudio_plc_good(&m_plc, reinterpret_cast<qint16 *>(data), static_cast<int>(outFrames));
+  m_played = true;
+}
+
+void
+JitterBuffer::resample(char* data, qint64 outFrames, qint64 inFrames)
+{
+  int const channels = m_format.channelCount();
+  qint64 const inBytes = inFrames * m_bytesPerFrame;
+  if (m_scratch.size() < inBytes)
+    m_scratch.resize(static_cast<int>(inBytes));
+
+  read(m_scratch.data(), inBytes);
+
+  qint16 const* in = reinterpret_cast<qint16 const *>(m_scratch.constData());
+  qint16* out = reinterpret_cast<qint16 *>(data);
+
+  // 16.16 fixed point walk across the input, linear interpolation between
+  // neighbouring frames
+  qint64 const step = ((inFrames - 1) << 16) / qMax<qint64>(outFrames - 1, 1);
+  qint64 pos = 0;
+  for (qint64 i = 0; i < outFrames; ++i, pos += step)
+  {
+    qint64 idx = pos >> 16;
+    qint32 frac = static_cast<qint32>(pos & 0xffff);
+    qint64 next = qMin(idx + 1, inFrames - 1);
+    for (int c = 0; c < channels; ++c)
+    {
+      qint32 a = in[(idx * channels) + c];
+      qint32 b = in[(next * channels) + c];
+      out[(i * channels) + c] = static_cast<qint16>(a + (((b - a) * frac) >> 16));
+    }
+  }
+}
+
+void
+JitterBuffer::conceal(char* data, qint64 len)
+{
+  if (len <= 0)
+    return;
+
+  // extrapolated from what was played last so a short gap is hardly heard,
+  // fading to silence over 60ms
+  if (m_canConceal)
+    xaudio_plc_conceal(&m_plc, reinterpret_cast<qint16 *>(data), static_cast<int>(len / m_bytesPerFrame));
+  else
+    memset(data, 0, len);
+
+  if (m_played)
+    m_concealedFrames += len / m_bytesPerFrame;
+}
@@ -0,0 +1,72 @@
+#ifndef JITTERBUFFER_H
+#define JITTERBUFFER_H
+
+#include <QAudioFormat>
+#include <QByteArray>
+
+#include "plc.h"
+
+// Adaptive playout buffer between the network and the output device.
+//
+// The network side pushes whatever arrived, the device side pulls exactly
+// what it can take. The buffer steers itself toward the target latency: it
+// time-compresses playback when it runs too far behind (and hard drops when
+// it is hopelessly behind), stretches when it is running low and conceals
+// when it runs dry, after which it re-buffers up to the target again.
+// Interpolation and concealment (see plc.h) are only done for 16 bit signed
+// PCM, other formats fall back to dropping frames and inserting silence.
+class JitterBuffer
+{
+public:
+  JitterBuffer();
+
+  void setFormat(QAudioFormat const& format);
+  void setTargetLatency(int millis);
+  int targetLatency() const
+    { return m_targetMillis; }
+
+  void reset();
+
+  void push(char const* data, qint64 len);
+  void pull(char* data, qint64 len);
+
+  qint64 bufferedBytes() const
+    { return m_size; }
+  int bufferedMillis() const;
+
+  quint64 droppedFrames() const
+    { return m_droppedFrames; }
+  quint64 concealedFrames() const
+    { return m_concealedFrames; }
+  quint64 concealmentEvents() const
+    { return m_concealmentEvents; }
+
+private:
+  qint64 bytesForMillis(int millis) const;
+  qint64 read(char* data, qint64 len);
+  void discard(qint64 len);
+  void resample(char* data, qint64 outFrames, qint64 inFrames);
+  void conceal(char* data, qint64 len);
+
+private:
+  QAudioFormat  m_format;
+  int           m_bytesPerFrame;
+  bool          m_canInterpolate;
+  bool          m_canConceal;
+  int           m_targetMillis;
+
+  QByteArray    m_ring;
+  qint64        m_readPos;
+  qint64        m_size;
+  bool          m_buffering;
+
+  QByteArray    m_scratch;
+  xaudio_plc    m_plc;
+  bool          m_played;
+
+  quint64       m_droppedFrames;
+  quint64       m_concealedFrames;
+  quint64       m_concealmentEvents;
+};
+
+#endif // JITTERBUFFER_H
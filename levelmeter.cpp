@@ -0,0 +1,138 @@
+#include "levelmeter.h"
+
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+static const float kSilenceDb = -96.0f;
+static const qint32 kFullScale = 32768;
+
+// sum of squares and the most positive/negative sample of a block, eight
+// samples at a time where the CPU allows it
+static void
+measure_s16(qint16 const* samples, qint64 count, quint64* sumSquares, qint32* maxSample, qint32* minSample)
+{
+  qint64 i = 0;
+  quint64 sum = 0;
+  qint32 hi = 0;
+  qint32 lo = 0;
+
+#if defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+  __m128i vmax = _mm_setzero_si128();
+  __m128i vmin = _mm_setzero_si128();
+  __m128i const zero = _mm_setzero_si128();
+
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(samples + i));
+
+    // pairs of squares fit an unsigned 32 bit lane, widen before summing
+    __m128i sq = _mm_madd_epi16(v, v);
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+
+    vmax = _mm_max_epi16(vmax, v);
+    vmin = _mm_min_epi16(vmin, v);
+  }
+
+  quint64 lanes64[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes64), acc);
+  sum = lanes64[0] + lanes64[1];
+
+  qint16 lanes16[8];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes16), vmax);
+  for (int k = 0; k < 8; ++k)
+    hi = qMax<qint32>(hi, lanes16[k]);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes16), vmin);
+  for (int k = 0; k < 8; ++k)
+    lo = qMin<qint32>(lo, lanes16[k]);
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  uint64x2_t acc = vdupq_n_u64(0);
+  int16x8_t vmax = vdupq_n_s16(0);
+  int16x8_t vmin = vdupq_n_s16(0);
+
+  for (; i + 8 <= count; i += 8)
+  {
+    int16x8_t v = vld1q_s16(samples + i);
+    int16x4_t l = vget_low_s16(v);
+    int16x4_t h = vget_high_s16(v);
+
+    acc = vpadalq_u32(acc, vreinterpretq_u32_s32(vmull_s16(l, l)));
+    acc = vpadalq_u32(acc, vreinterpretq_u32_s32(vmull_s16(h, h)));
+
+    vmax = vmaxq_s16(vmax, v);
+    vmin = vminq_s16(vmin, v);
+  }
+
+  sum = vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+
+  qint16 lanes16[8];
+  vst1q_s16(lanes16, vmax);
+  for (int k = 0; k < 8; ++k)
+    hi = qMax<qint32>(hi, lanes16[k]);
+  vst1q_s16(lanes16, vmin);
+  for (int k = 0; k < 8; ++k)
+    lo = qMin<qint32>(lo, lanes16[k]);
+#endif
+
+  for (; i < count; ++i)
+  {
+    qint32 s = samples[i];
+    sum += static_cast<quint64>(s * s);
+    hi = qMax(hi, s);
+    lo = qMin(lo, s);
+  }
+
+  *sumSquares += sum;
+  *maxSample = hi;
+  *minSample = lo;
+}
+
+static float
+to_db(double linear)
+{
+  if (linear <= 0.0)
+    return kSilenceDb;
+  return qMax(kSilenceDb, static_cast<float>(20.0 * log10(linear)));
+}
+
+LevelMeter::LevelMeter()
+  : m_sumSquares(0)
+  , m_count(0)
+  , m_peak(0)
+{
+}
+
+void
+LevelMeter::process(qint16 const* samples, qint64 count)
+{
+  qint32 hi = 0;
+  qint32 lo = 0;
+
+  measure_s16(samples, count, &m_sumSquares, &hi, &lo);
+  m_count += count;
+  m_peak = qMax(m_peak, qMax(hi, -lo));
+}
+
+LevelMeter::Reading
+LevelMeter::take()
+{
+  Reading reading;
+  double meanSquare = m_count ? (static_cast<double>(m_sumSquares) / m_count) : 0.0;
+
+  reading.rmsDb = to_db(sqrt(meanSquare) / kFullScale);
+  reading.peakDb = to_db(static_cast<double>(m_peak) / kFullScale);
+  reading.clipped = (m_peak >= (kFullScale - 1));
+
+  m_sumSquares = 0;
+  m_count = 0;
+  m_peak = 0;
+
+  return reading;
+}
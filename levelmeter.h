@@ -0,0 +1,30 @@
+#ifndef LEVELMETER_H
+#define LEVELMETER_H
+
+#include <QtGlobal>
+
+// Accumulates RMS and peak over 16 bit signed PCM. process() runs on the
+// audio thread and only does arithmetic; take() hands back what was seen
+// since the previous call and starts a new window.
+class LevelMeter
+{
+public:
+  struct Reading
+  {
+    float rmsDb;
+    float peakDb;
+    bool clipped;
+  };
+
+  LevelMeter();
+
+  void process(qint16 const* samples, qint64 count);
+  Reading take();
+
+private:
+  quint64 m_sumSquares;
+  quint64 m_count;
+  qint32  m_peak;
+};
+
+#endif // LEVELMETER_H
@@ -0,0 +1,25 @@
+QT += core
+QT -= gui
+QT += network
+QT += multimedia
+
+
+CONFIG += console debug
+CONFIG -= app_bundle
+TARGET = xaudio-loadgen
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += main.cpp \
+    loadsession.cpp \
+    wireplayout.cpp \
+    ../formatconverter.cpp \
+    ../jitterbuffer.cpp
+HEADERS  += loadsession.h \
+    wireplayout.h \
+    ../formatconverter.h \
+    ../jitterbuffer.h \
+    ../plc.h \
+    ../protocol.h \
+    ../wirelog.h
@@ -0,0 +1,213 @@
+#include "loadsession.h"
+
+static const int kTickIntervalMillis = 10;
+static const int kReportIntervalMillis = 1000;
+static const int kReconnectIntervalMillis = 1000;
+static const int kReadBufferSize = 32768;
+static const int kPlayoutChunkFrames = 1024;
+
+LoadSessionReport::LoadSessionReport()
+  : id(0)
+  , peer()
+  , connected(false)
+  , elapsedMillis(0)
+  , connectMillis(-1)
+  , firstAudioMillis(-1)
+  , bytesReceived(0)
+  , bytesSent(0)
+  , expectedBytesReceived(0)
+  , playoutDelayMillis(0)
+  , maxArrivalGapMillis(0)
+  , concealmentEvents(0)
+  , concealedFrames(0)
+  , droppedFrames(0)
+  , reconnects(0)
+{
+}
+
+LoadSession::LoadSession(int id, QString const& host, quint16 port, QAudioFormat const& format,
+  QByteArray const& sendAudio, int targetLatencyMillis)
+  : m_id(id)
+  , m_host(host)
+  , m_port(port)
+  , m_format(format)
+  , m_targetLatencyMillis(targetLatencyMillis)
+  , m_socket(nullptr)
+  , m_tickTimer(nullptr)
+  , m_reportTimer(nullptr)
+  , m_running(false)
+  , m_sendAudio(sendAudio)
+  , m_sendPos(0)
+  , m_framesSent(0)
+  , m_framesPlayed(0)
+  , m_jitterBuffer()
+  , m_readBuffer(kReadBufferSize, 0)
+  , m_playoutBuffer(kPlayoutChunkFrames * format.bytesPerFrame(), 0)
+  , m_report()
+{
+  m_report.id = id;
+  m_report.peer = QString("%1:%2").arg(host, QString::number(port));
+
+  // spread sessions across the source so they aren't sample aligned
+  if (!m_sendAudio.isEmpty())
+  {
+    m_sendPos = (static_cast<qint64>(id) * format.bytesForDuration(37000)) % m_sendAudio.size();
+    m_sendPos -= (m_sendPos % format.bytesPerFrame());
+  }
+
+  m_jitterBuffer.setFormat(format);
+  m_jitterBuffer.setTargetLatency(targetLatencyMillis);
+}
+
+void
+LoadSession::start()
+{
+  // created here so they belong to whatever thread we were moved to
+  m_socket = new QTcpSocket(this);
+  connect(m_socket, SIGNAL(connected()), this, SLOT(onConnected()));
+  connect(m_socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+  connect(m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(onError(QAbstractSocket::SocketError)));
+
+  m_tickTimer = new QTimer(this);
+  m_tickTimer->setTimerType(Qt::PreciseTimer);
+  m_tickTimer->setInterval(kTickIntervalMillis);
+  connect(m_tickTimer, SIGNAL(timeout()), this, SLOT(tick()));
+
+  m_reportTimer = new QTimer(this);
+  m_reportTimer->setInterval(kReportIntervalMillis);
+  connect(m_reportTimer, SIGNAL(timeout()), this, SLOT(publishReport()));
+
+  m_running = true;
+  m_sessionClock.start();
+  m_tickTimer->start();
+  m_reportTimer->start();
+  reconnect();
+}
+
+void
+LoadSession::stop()
+{
+  m_running = false;
+  if (m_tickTimer)
+    m_tickTimer->stop();
+  if (m_reportTimer)
+    m_reportTimer->stop();
+
+  publishReport();
+  if (m_socket)
+    m_socket->abort();
+}
+
+void
+LoadSession::reconnect()
+{
+  if (!m_running)
+    return;
+
+  m_connectClock.start();
+  m_socket->connectToHost(m_host, m_port);
+}
+
+void
+LoadSession::onConnected()
+{
+  if (m_report.connectMillis >= 0)
+    m_report.reconnects++;
+  m_report.connectMillis = m_connectClock.restart();
+  m_report.connected = true;
+
+  m_jitterBuffer.reset();
+  m_streamClock.start();
+  m_firstAudioClock.invalidate();
+  m_lastArrival.invalidate();
+  m_framesSent = 0;
+  m_framesPlayed = 0;
+}
+
+void
+LoadSession::onReadyRead()
+{
+  qint64 n;
+  while ((n = m_socket->read(m_readBuffer.data(), m_readBuffer.size())) > 0)
+  {
+    m_report.bytesReceived += n;
+    m_jitterBuffer.push(m_readBuffer.constData(), n);
+  }
+
+  if (!m_firstAudioClock.isValid())
+  {
+    m_firstAudioClock.start();
+    m_report.firstAudioMillis = m_connectClock.elapsed();
+  }
+
+  if (m_lastArrival.isValid())
+    m_report.maxArrivalGapMillis = qMax(m_report.maxArrivalGapMillis, static_cast<int>(m_lastArrival.restart()));
+  else
+    m_lastArrival.start();
+}
+
+void
+LoadSession::onError(QAbstractSocket::SocketError /*socketError*/)
+{
+  m_report.connected = false;
+  m_streamClock.invalidate();
+  if (m_running)
+    QTimer::singleShot(kReconnectIntervalMillis, this, SLOT(reconnect()));
+}
+
+void
+LoadSession::tick()
+{
+  if (!m_streamClock.isValid() || (m_socket->state() != QAbstractSocket::ConnectedState))
+    return;
+
+  qint64 const bytesPerFrame = m_format.bytesPerFrame();
+  qint64 const framesDue = ((m_streamClock.nsecsElapsed() / 1000) * m_format.sampleRate()) / 1000000;
+
+  if (!m_sendAudio.isEmpty())
+  {
+    qint64 bytes = (framesDue - m_framesSent) * bytesPerFrame;
+    while (bytes > 0)
+    {
+      qint64 len = qMin(bytes, m_sendAudio.size() - m_sendPos);
+      qint64 n = m_socket->write(m_sendAudio.constData() + m_sendPos, len);
+      if (n <= 0)
+        break;
+
+      m_report.bytesSent += n;
+      m_sendPos = (m_sendPos + n) % m_sendAudio.size();
+      bytes -= n;
+    }
+    m_framesSent = framesDue;
+  }
+
+  // the virtual output device consumes at exactly the nominal rate
+  qint64 frames = framesDue - m_framesPlayed;
+  while (frames > 0)
+  {
+    qint64 chunk = qMin<qint64>(frames, kPlayoutChunkFrames);
+    m_jitterBuffer.pull(m_playoutBuffer.data(), chunk * bytesPerFrame);
+    frames -= chunk;
+  }
+  m_framesPlayed = framesDue;
+}
+
+void
+LoadSession::publishReport()
+{
+  m_report.elapsedMillis = m_sessionClock.elapsed();
+  m_report.playoutDelayMillis = m_jitterBuffer.bufferedMillis();
+  m_report.concealmentEvents = m_jitterBuffer.concealmentEvents();
+  m_report.concealedFrames = m_jitterBuffer.concealedFrames();
+  m_report.droppedFrames = m_jitterBuffer.droppedFrames();
+
+  if (m_firstAudioClock.isValid())
+  {
+    qint64 frames = (m_firstAudioClock.elapsed() * m_format.sampleRate()) / 1000;
+    m_report.expectedBytesReceived += frames * m_format.bytesPerFrame();
+    m_firstAudioClock.restart();
+  }
+
+  emit report(m_report);
+  m_report.maxArrivalGapMillis = 0;
+}
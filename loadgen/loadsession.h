@@ -0,0 +1,95 @@
+#ifndef LOADSESSION_H
+#define LOADSESSION_H
+
+#include <QObject>
+
+#include <QAudioFormat>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QMetaType>
+#include <QTcpSocket>
+#include <QTimer>
+
+#include "jitterbuffer.h"
+
+// Per session counters, published once per report interval.
+struct LoadSessionReport
+{
+  LoadSessionReport();
+
+  int id;
+  QString peer;
+  bool connected;
+  qint64 elapsedMillis;
+  qint64 connectMillis;
+  qint64 firstAudioMillis;
+  quint64 bytesReceived;
+  quint64 bytesSent;
+  qint64 expectedBytesReceived;
+  int playoutDelayMillis;
+  int maxArrivalGapMillis;
+  quint64 concealmentEvents;
+  quint64 concealedFrames;
+  quint64 droppedFrames;
+  quint64 reconnects;
+};
+
+Q_DECLARE_METATYPE(LoadSessionReport)
+
+// One simulated operator: a socket to xaudio that sends audio paced to real
+// time and plays the received stream out through the same JitterBuffer the
+// GUI client uses, against a virtual device clock instead of a sound card.
+class LoadSession : public QObject
+{
+  Q_OBJECT
+
+public:
+  LoadSession(int id, QString const& host, quint16 port, QAudioFormat const& format,
+    QByteArray const& sendAudio, int targetLatencyMillis);
+
+public slots:
+  void start();
+  void stop();
+
+signals:
+  void report(LoadSessionReport const& report);
+
+private slots:
+  void onConnected();
+  void onReadyRead();
+  void onError(QAbstractSocket::SocketError socketError);
+  void reconnect();
+  void tick();
+  void publishReport();
+
+private:
+  int                 m_id;
+  QString             m_host;
+  quint16             m_port;
+  QAudioFormat        m_format;
+  int                 m_targetLatencyMillis;
+
+  QTcpSocket*         m_socket;
+  QTimer*             m_tickTimer;
+  QTimer*             m_reportTimer;
+  bool                m_running;
+
+  QElapsedTimer       m_sessionClock;
+  QElapsedTimer       m_connectClock;
+  QElapsedTimer       m_streamClock;
+  QElapsedTimer       m_firstAudioClock;
+  QElapsedTimer       m_lastArrival;
+
+  QByteArray          m_sendAudio;
+  qint64              m_sendPos;
+  qint64              m_framesSent;
+  qint64              m_framesPlayed;
+
+  JitterBuffer        m_jitterBuffer;
+  QByteArray          m_readBuffer;
+  QByteArray          m_playoutBuffer;
+
+  LoadSessionReport   m_report;
+};
+
+#endif // LOADSESSION_H
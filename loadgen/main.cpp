@@ -0,0 +1,271 @@
+#include "loadsession.h"
+#include "wireplayout.h"
+
+#include <QAudioBuffer>
+#include <QAudioDecoder>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QMap>
+#include <QStringList>
+#include <QThread>
+#include <QVector>
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+
+static const int kDefaultSampleRate = 16000;
+static const int kDefaultChannels = 1;
+static const int kDefaultTargetLatencyMillis = 100;
+static const int kDefaultReportSeconds = 5;
+static const double kToneHz = 440.0;
+
+// Latest report of every session, printed as a table plus an aggregate.
+class Reporter : public QObject
+{
+  Q_OBJECT
+
+public:
+  Reporter()
+    : m_reports()
+    , m_lastBytes(0)
+    , m_lastElapsed(0)
+  {
+  }
+
+public slots:
+  void onReport(LoadSessionReport const& report)
+    { m_reports[report.id] = report; }
+
+  void printAggregate()
+  {
+    quint64 bytes = 0;
+    qint64 elapsed = 0;
+    int connected = 0;
+    quint64 concealments = 0;
+
+    for (LoadSessionReport const& r : m_reports)
+    {
+      bytes += r.bytesReceived + r.bytesSent;
+      elapsed = qMax(elapsed, r.elapsedMillis);
+      concealments += r.concealmentEvents;
+      if (r.connected)
+        connected++;
+    }
+
+    qint64 interval = elapsed - m_lastElapsed;
+    double mbps = (interval > 0) ? ((bytes - m_lastBytes) * 8.0 / 1000.0 / interval) : 0.0;
+    printf("[%6.1fs] sessions:%d/%d aggregate:%.2f Mbit/s underruns:%llu\n", elapsed / 1000.0,
+      connected, m_reports.size(), mbps, static_cast<unsigned long long>(concealments));
+    fflush(stdout);
+
+    m_lastBytes = bytes;
+    m_lastElapsed = elapsed;
+  }
+
+  void printSessions()
+  {
+    printf("%4s %-22s %4s %8s %8s %9s %8s %7s %6s %9s %6s\n", "id", "peer", "up", "rx kb/s", "tx kb/s",
+      "connect", "delay", "gap", "loss%", "underrun", "recon");
+
+    for (LoadSessionReport const& r : m_reports)
+    {
+      double seconds = qMax<qint64>(r.elapsedMillis, 1) / 1000.0;
+      double loss = 0.0;
+      if (r.expectedBytesReceived > 0)
+        loss = qMax(0.0, 100.0 * (r.expectedBytesReceived - static_cast<qint64>(r.bytesReceived))
+          / r.expectedBytesReceived);
+
+      printf("%4d %-22s %4s %8.1f %8.1f %7lldms %6dms %5dms %6.2f %9llu %6llu\n", r.id,
+        qPrintable(r.peer), r.connected ? "yes" : "no",
+        r.bytesReceived * 8.0 / 1000.0 / seconds, r.bytesSent * 8.0 / 1000.0 / seconds,
+        static_cast<long long>(r.connectMillis), r.playoutDelayMillis, r.maxArrivalGapMillis, loss,
+        static_cast<unsigned long long>(r.concealmentEvents), static_cast<unsigned long long>(r.reconnects));
+    }
+    fflush(stdout);
+  }
+
+private:
+  QMap<int, LoadSessionReport> m_reports;
+  quint64 m_lastBytes;
+  qint64 m_lastElapsed;
+};
+
+static QByteArray
+makeTone(QAudioFormat const& format)
+{
+  // exactly one second of a whole number of cycles loops without a click
+  int const frames = format.sampleRate();
+  int const channels = format.channelCount();
+  QByteArray audio(frames * format.bytesPerFrame(), 0);
+  qint16* out = reinterpret_cast<qint16 *>(audio.data());
+
+  for (int i = 0; i < frames; ++i)
+  {
+    qint16 v = static_cast<qint16>(8000.0 * sin((2.0 * M_PI * kToneHz * i) / frames));
+    for (int c = 0; c < channels; ++c)
+      out[(i * channels) + c] = v;
+  }
+  return audio;
+}
+
+static QByteArray
+decodeFile(QString const& fileName, QAudioFormat const& format)
+{
+  // decoded once up front and shared (implicitly) by every session
+  QByteArray audio;
+  QAudioDecoder decoder;
+  QEventLoop loop;
+
+  decoder.setAudioFormat(format);
+  decoder.setSourceFilename(fileName);
+  QObject::connect(&decoder, &QAudioDecoder::bufferReady, [&]()
+  {
+    QAudioBuffer buffer = decoder.read();
+    audio.append(reinterpret_cast<char const *>(buffer.constData()), buffer.byteCount());
+  });
+  QObject::connect(&decoder, SIGNAL(finished()), &loop, SLOT(quit()));
+  QObject::connect(&decoder, SIGNAL(error(QAudioDecoder::Error)), &loop, SLOT(quit()));
+  decoder.start();
+  loop.exec();
+
+  if (decoder.error() != QAudioDecoder::NoError)
+    fprintf(stderr, "failed to decode %s: %s\n", qPrintable(fileName), qPrintable(decoder.errorString()));
+
+  audio.truncate(audio.size() - (audio.size() % format.bytesPerFrame()));
+  return audio;
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void
+onSignal(int /*signo*/)
+{
+  interrupted = 1;
+}
+
+int main(int argc, char* argv[])
+{
+  QCoreApplication app(argc, argv);
+  app.setApplicationName("xaudio-loadgen");
+
+  qRegisterMetaType<LoadSessionReport>();
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Opens many concurrent audio sessions against xaudio and reports "
+    "per-session and aggregate statistics.");
+  parser.addHelpOption();
+  parser.addOption({ { "H", "host" }, "xaudio instance as host:port, may be repeated.", "host:port" });
+  parser.addOption({ { "n", "sessions" }, "Number of concurrent sessions.", "n", "1" });
+  parser.addOption({ { "t", "threads" }, "Worker threads the sessions are spread across.", "n", "1" });
+  parser.addOption({ { "d", "duration" }, "Seconds to run, 0 runs until interrupted.", "seconds", "0" });
+  parser.addOption({ { "r", "rate" }, "Sample rate.", "hz", QString::number(kDefaultSampleRate) });
+  parser.addOption({ { "c", "channels" }, "Number of channels.", "n", QString::number(kDefaultChannels) });
+  parser.addOption({ { "f", "file" }, "Stream this file instead of a synthetic tone.", "path" });
+  parser.addOption({ "receive-only", "Don't send any audio." });
+  parser.addOption({ "target-latency", "Jitter buffer target latency.", "ms",
+    QString::number(kDefaultTargetLatencyMillis) });
+  parser.addOption({ "report", "Seconds between per-session tables.", "seconds",
+    QString::number(kDefaultReportSeconds) });
+  parser.addOption({ "replay", "Play out the streams of an xaudio wire log instead of connecting.", "path" });
+  parser.addOption({ "fast", "With --replay, run as fast as possible instead of in real time." });
+  parser.process(app);
+
+  if (parser.isSet("replay"))
+    return replayPlayout(parser.value("replay"), parser.value("target-latency").toInt(), parser.isSet("fast"));
+
+  QStringList hosts = parser.values("host");
+  if (hosts.isEmpty())
+  {
+    fprintf(stderr, "at least one --host=<host:port> is required\n");
+    parser.showHelp(1);
+  }
+
+  QAudioFormat format;
+  format.setSampleRate(parser.value("rate").toInt());
+  format.setChannelCount(parser.value("channels").toInt());
+  format.setSampleSize(16);
+  format.setCodec("audio/pcm");
+  format.setByteOrder(QAudioFormat::LittleEndian);
+  format.setSampleType(QAudioFormat::SignedInt);
+
+  QByteArray sendAudio;
+  if (!parser.isSet("receive-only"))
+    sendAudio = parser.isSet("file") ? decodeFile(parser.value("file"), format) : makeTone(format);
+
+  int const numSessions = qMax(1, parser.value("sessions").toInt());
+  int const numThreads = qBound(1, parser.value("threads").toInt(), numSessions);
+  int const targetLatency = parser.value("target-latency").toInt();
+
+  Reporter reporter;
+  QVector<QThread *> threads;
+  QVector<LoadSession *> sessions;
+
+  for (int i = 0; i < numThreads; ++i)
+  {
+    threads.append(new QThread());
+    threads.last()->start();
+  }
+
+  for (int i = 0; i < numSessions; ++i)
+  {
+    QStringList hostPort = hosts[i % hosts.size()].split(':');
+    QString host = hostPort.value(0);
+    quint16 port = static_cast<quint16>(hostPort.value(1).toUInt());
+
+    LoadSession* session = new LoadSession(i, host, port, format, sendAudio, targetLatency);
+    session->moveToThread(threads[i % numThreads]);
+    QObject::connect(session, &LoadSession::report, &reporter, &Reporter::onReport);
+    QMetaObject::invokeMethod(session, "start");
+    sessions.append(session);
+  }
+
+  printf("%d sessions over %d threads to %s, %d Hz %d ch, %s\n", numSessions, numThreads,
+    qPrintable(hosts.join(' ')), format.sampleRate(), format.channelCount(),
+    sendAudio.isEmpty() ? "receive only" : (parser.isSet("file") ? "file" : "tone"));
+
+  QTimer aggregateTimer;
+  QObject::connect(&aggregateTimer, &QTimer::timeout, &reporter, &Reporter::printAggregate);
+  aggregateTimer.start(1000);
+
+  QTimer sessionTimer;
+  QObject::connect(&sessionTimer, &QTimer::timeout, &reporter, &Reporter::printSessions);
+  sessionTimer.start(qMax(1, parser.value("report").toInt()) * 1000);
+
+  int const duration = parser.value("duration").toInt();
+  if (duration > 0)
+    QTimer::singleShot(duration * 1000, &app, SLOT(quit()));
+
+  // the handler only sets a flag, quitting happens on the event loop
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  QTimer interruptTimer;
+  QObject::connect(&interruptTimer, &QTimer::timeout, [&app]()
+  {
+    if (interrupted)
+      app.quit();
+  });
+  interruptTimer.start(100);
+
+  int ret = app.exec();
+
+  for (LoadSession* session : sessions)
+    QMetaObject::invokeMethod(session, "stop", Qt::BlockingQueuedConnection);
+
+  // pick up the final reports before printing the summary
+  QCoreApplication::processEvents();
+  reporter.printSessions();
+
+  for (QThread* thread : threads)
+  {
+    thread->quit();
+    thread->wait();
+  }
+  qDeleteAll(sessions);
+  qDeleteAll(threads);
+
+  return ret;
+}
+
+#include "main.moc"
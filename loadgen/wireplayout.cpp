@@ -0,0 +1,405 @@
+#include "wireplayout.h"
+
+#include "formatconverter.h"
+#include "jitterbuffer.h"
+#include "protocol.h"
+#include "wirelog.h"
+
+#include <QAudioFormat>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QSharedPointer>
+#include <QThread>
+#include <QVector>
+
+#include <stdio.h>
+#include <sys/resource.h>
+
+static const int kTickIntervalMillis = 10;
+static const int kPlayoutChunkFrames = 1024;
+
+namespace
+{
+
+struct Arrival
+{
+  qint64 atMicros;
+  QByteArray data;
+};
+
+// One recorded connection and the client playing it out.
+struct Playout
+{
+  Playout()
+    : openMicros(0)
+    , closeMicros(-1)
+    , hello(false)
+    , nextArrival(0)
+    , headSize(0)
+    , dtx(false)
+    , dtxPcmRemaining(0)
+    , formatSwitches(0)
+    , startMicros(-1)
+    , framesPlayed(0)
+    , ticks(0)
+    , delaySum(0)
+    , maxDelay(0)
+  {
+  }
+
+  QString peer;
+  qint64 openMicros;
+  qint64 closeMicros;
+  bool hello;
+  QVector<Arrival> arrivals;
+  int nextArrival;
+
+  // the server hello and its trailers, then audio, framed if dtx
+  QByteArray head;
+  int headSize;
+  QAudioFormat format;
+  bool dtx;
+  QByteArray dtxHeader;
+  qint64 dtxPcmRemaining;
+
+  // what xaudio sends after stepping down, converted back to the format
+  // playout started in
+  QAudioFormat wireFormat;
+  FormatConverter converter;
+  QByteArray partialFrame;
+  QByteArray converted;
+  int formatSwitches;
+
+  // the device starts with the first audio
+  QSharedPointer<JitterBuffer> jitterBuffer;
+  QByteArray playoutBuffer;
+  QByteArray silence;
+  qint64 startMicros;
+  qint64 framesPlayed;
+
+  quint64 ticks;
+  qint64 delaySum;
+  int maxDelay;
+};
+
+}
+
+static QAudioFormat
+toAudioFormat(xaudio_format const& format)
+{
+  QAudioFormat f;
+  f.setSampleRate(static_cast<int>(format.sample_rate));
+  f.setChannelCount(format.channels);
+  f.setCodec("audio/pcm");
+  f.setByteOrder(QAudioFormat::LittleEndian);
+  if (format.sample_format == XAUDIO_F32LE)
+  {
+    f.setSampleSize(32);
+    f.setSampleType(QAudioFormat::Float);
+  }
+  else
+  {
+    f.setSampleSize(16);
+    f.setSampleType(QAudioFormat::SignedInt);
+  }
+  return f;
+}
+
+static double
+cpuMicros()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static bool
+loadLog(QString const& path, xaudio_wire_header* header, QVector<Playout>* playouts, qint64* endMicros)
+{
+  FILE* f = fopen(qPrintable(path), "rb");
+  if (!f)
+  {
+    fprintf(stderr, "failed to open %s\n", qPrintable(path));
+    return false;
+  }
+  if (!xaudio_wire_read_header(f, header))
+  {
+    fprintf(stderr, "%s isn't a wire log\n", qPrintable(path));
+    fclose(f);
+    return false;
+  }
+
+  xaudio_wire_conns open;
+  QByteArray payload;
+  xaudio_wire_record r;
+  r.t_us = 0;
+  while (xaudio_wire_read_record(f, &r))
+  {
+    payload.resize(xaudio_wire_has_payload(r) ? static_cast<int>(r.length) : 0);
+    if (!payload.isEmpty() && (fread(payload.data(), 1, payload.size(), f) != static_cast<size_t>(payload.size())))
+      break;
+    *endMicros = r.t_us;
+
+    int const index = xaudio_wire_conn_of(&open, r, playouts->size());
+    if (r.type == XAUDIO_WIRE_OPEN)
+    {
+      Playout p;
+      p.peer = QString::fromLatin1(payload);
+      p.openMicros = r.t_us;
+      playouts->append(p);
+      continue;
+    }
+
+    if (index < 0)
+      continue;
+    Playout& p = (*playouts)[index];
+
+    if (r.type == XAUDIO_WIRE_RX)
+    {
+      if (p.arrivals.isEmpty() && !p.hello)
+        p.hello = xaudio_is_hello_prefix(reinterpret_cast<uint8_t const *>(payload.constData()),
+          qMin(payload.size(), static_cast<int>(XAUDIO_HELLO_MAGIC_SIZE)));
+    }
+    else if (r.type == XAUDIO_WIRE_TX)
+    {
+      Arrival a;
+      a.atMicros = r.t_us;
+      a.data = payload;
+      p.arrivals.append(a);
+    }
+    else if (r.type == XAUDIO_WIRE_CLOSE)
+    {
+      p.closeMicros = r.t_us;
+    }
+  }
+  fclose(f);
+
+  for (Playout& p : *playouts)
+  {
+    if (p.closeMicros < 0)
+      p.closeMicros = *endMicros;
+    p.headSize = p.hello ? XAUDIO_HELLO_SIZE : 0;
+    p.format = toAudioFormat(header->capture);
+    p.wireFormat = p.format;
+  }
+  return true;
+}
+
+static void
+startPlayout(Playout* p, int targetLatencyMillis, qint64 nowMicros)
+{
+  p->jitterBuffer.reset(new JitterBuffer());
+  p->jitterBuffer->setFormat(p->format);
+  p->jitterBuffer->setTargetLatency(targetLatencyMillis);
+  p->playoutBuffer.resize(kPlayoutChunkFrames * p->format.bytesPerFrame());
+  p->startMicros = nowMicros;
+  p->converter.setFormats(p->format, p->format);
+}
+
+// audio in the current wire format, whole frames converted at a time
+static void
+receivePcm(Playout* p, char const* data, qint64 len)
+{
+  if (p->converter.isPassthrough())
+  {
+    p->jitterBuffer->push(data, len);
+    return;
+  }
+
+  p->partialFrame.append(data, static_cast<int>(len));
+  int const bytesPerFrame = p->wireFormat.bytesPerFrame();
+  qint64 const whole = (p->partialFrame.size() / bytesPerFrame) * bytesPerFrame;
+  qint64 const needed = p->converter.maxOutputBytes(whole);
+  if (p->converted.size() < needed)
+    p->converted.resize(static_cast<int>(needed));
+
+  qint64 const out = p->converter.convert(p->partialFrame.constData(), whole, p->converted.data());
+  p->partialFrame.remove(0, static_cast<int>(whole));
+  p->jitterBuffer->push(p->converted.constData(), out);
+}
+
+// the server hello first, then audio as received, or unpacked from its
+// frames with comfort noise standing in as silence and format changes
+// converted away
+static void
+receive(Playout* p, char const* data, qint64 len, int targetLatencyMillis, qint64 nowMicros)
+{
+  while ((len > 0) && (p->head.size() < p->headSize))
+  {
+    int const n = static_cast<int>(qMin<qint64>(len, p->headSize - p->head.size()));
+    p->head.append(data, n);
+    data += n;
+    len -= n;
+
+    uint8_t const* head = reinterpret_cast<uint8_t const *>(p->head.constData());
+    if (p->head.size() == XAUDIO_HELLO_SIZE)
+    {
+      xaudio_hello hello;
+      xaudio_decode_hello(head, &hello);
+      p->dtx = (hello.version_or_flags & XAUDIO_FLAG_DTX) != 0;
+      p->headSize += ((hello.version_or_flags & XAUDIO_FLAG_FORMAT) ? XAUDIO_FORMAT_SIZE : 0)
+        + ((hello.version_or_flags & XAUDIO_FLAG_REPLAY) ? XAUDIO_REPLAY_SIZE : 0);
+    }
+    else if (p->head.size() == (XAUDIO_HELLO_SIZE + XAUDIO_FORMAT_SIZE))
+    {
+      xaudio_hello hello;
+      xaudio_decode_hello(head, &hello);
+      if (hello.version_or_flags & XAUDIO_FLAG_FORMAT)
+      {
+        xaudio_format format;
+        xaudio_decode_format(head + XAUDIO_HELLO_SIZE, &format);
+        p->format = toAudioFormat(format);
+        p->wireFormat = p->format;
+      }
+    }
+  }
+
+  if ((len > 0) && !p->jitterBuffer)
+    startPlayout(p, targetLatencyMillis, nowMicros);
+
+  while (len > 0)
+  {
+    if (!p->dtx || (p->dtxPcmRemaining > 0))
+    {
+      qint64 const n = p->dtx ? qMin(len, p->dtxPcmRemaining) : len;
+      receivePcm(p, data, n);
+      if (p->dtx)
+        p->dtxPcmRemaining -= n;
+      data += n;
+      len -= n;
+      continue;
+    }
+
+    // a format frame carries the format right after its header
+    bool const formatFrame = (p->dtxHeader.size() >= XAUDIO_DTX_HEADER_SIZE) && (p->dtxHeader.at(0) == XAUDIO_DTX_FORMAT);
+    int const size = XAUDIO_DTX_HEADER_SIZE + (formatFrame ? XAUDIO_FORMAT_SIZE : 0);
+    int const n = static_cast<int>(qMin<qint64>(len, size - p->dtxHeader.size()));
+    p->dtxHeader.append(data, n);
+    data += n;
+    len -= n;
+    if ((p->dtxHeader.size() < size) || (!formatFrame && (p->dtxHeader.at(0) == XAUDIO_DTX_FORMAT)))
+      continue;
+
+    uint8_t const* buff = reinterpret_cast<uint8_t const *>(p->dtxHeader.constData());
+    xaudio_dtx_header header;
+    xaudio_decode_dtx_header(buff, &header);
+
+    if (header.type == XAUDIO_DTX_PCM)
+    {
+      p->dtxPcmRemaining = header.length;
+    }
+    else if (header.type == XAUDIO_DTX_FORMAT)
+    {
+      xaudio_format format;
+      xaudio_decode_format(buff + XAUDIO_DTX_HEADER_SIZE, &format);
+      p->wireFormat = toAudioFormat(format);
+      p->converter.setFormats(p->wireFormat, p->format);
+      p->partialFrame.clear();
+      p->formatSwitches++;
+    }
+    else
+    {
+      // counted in frames of the wire format
+      qint64 const frames = (static_cast<qint64>(header.length) * p->format.sampleRate()) / p->wireFormat.sampleRate();
+      int const bytes = static_cast<int>(frames) * p->format.bytesPerFrame();
+      if (p->silence.size() < bytes)
+        p->silence.fill(0, bytes);
+      p->jitterBuffer->push(p->silence.constData(), bytes);
+    }
+    p->dtxHeader.clear();
+  }
+}
+
+// what arrived up to now goes in, what the device is due comes out
+static void
+tick(Playout* p, int targetLatencyMillis, qint64 nowMicros)
+{
+  qint64 const sinceOpen = nowMicros - p->openMicros;
+  while ((p->nextArrival < p->arrivals.size()) && (p->arrivals[p->nextArrival].atMicros <= nowMicros))
+  {
+    Arrival const& a = p->arrivals[p->nextArrival++];
+    receive(p, a.data.constData(), a.data.size(), targetLatencyMillis, sinceOpen);
+  }
+
+  if (!p->jitterBuffer)
+    return;
+
+  qint64 const bytesPerFrame = p->format.bytesPerFrame();
+  qint64 const framesDue = ((sinceOpen - p->startMicros) * p->format.sampleRate()) / 1000000;
+  qint64 frames = framesDue - p->framesPlayed;
+  while (frames > 0)
+  {
+    qint64 const chunk = qMin<qint64>(frames, kPlayoutChunkFrames);
+    p->jitterBuffer->pull(p->playoutBuffer.data(), chunk * bytesPerFrame);
+    frames -= chunk;
+  }
+  p->framesPlayed = framesDue;
+
+  int const delay = p->jitterBuffer->bufferedMillis();
+  p->ticks++;
+  p->delaySum += delay;
+  p->maxDelay = qMax(p->maxDelay, delay);
+}
+
+int
+replayPlayout(QString const& path, int targetLatencyMillis, bool fast)
+{
+  xaudio_wire_header header;
+  QVector<Playout> playouts;
+  qint64 endMicros = 0;
+  if (!loadLog(path, &header, &playouts, &endMicros))
+    return 1;
+
+  printf("%s: %.1fs, %d connections, target latency %dms, %s\n", qPrintable(path), endMicros / 1e6,
+    playouts.size(), targetLatencyMillis, fast ? "as fast as possible" : "real time");
+
+  double const cpuStart = cpuMicros();
+  QElapsedTimer clock;
+  clock.start();
+
+  // one virtual clock for all connections, like a client per connection
+  // ticking in parallel
+  qint64 const step = kTickIntervalMillis * 1000;
+  for (qint64 now = 0; now <= (endMicros + step); now += step)
+  {
+    if (!fast)
+    {
+      qint64 const ahead = now - (clock.nsecsElapsed() / 1000);
+      if (ahead > 0)
+        QThread::usleep(static_cast<unsigned long>(ahead));
+    }
+
+    for (Playout& p : playouts)
+    {
+      if ((now >= p.openMicros) && (now <= p.closeMicros))
+        tick(&p, targetLatencyMillis, now);
+    }
+  }
+
+  double const cpu = cpuMicros() - cpuStart;
+  double audioSeconds = 0;
+
+  printf("%4s %-22s %8s %8s %9s %9s %9s %9s %10s %8s\n", "id", "peer", "start", "length", "delay", "max delay",
+    "underrun", "concealed", "dropped", "switches");
+  for (int i = 0; i < playouts.size(); ++i)
+  {
+    Playout const& p = playouts[i];
+    if (!p.jitterBuffer)
+    {
+      printf("%4d %-22s %7.1fs %7.1fs   no audio\n", i, qPrintable(p.peer), p.openMicros / 1e6,
+        (p.closeMicros - p.openMicros) / 1e6);
+      continue;
+    }
+
+    audioSeconds += static_cast<double>(p.framesPlayed) / p.format.sampleRate();
+    printf("%4d %-22s %7.1fs %7.1fs %7lldms %7dms %9llu %9llu %10llu %8d\n", i, qPrintable(p.peer), p.openMicros / 1e6,
+      (p.closeMicros - p.openMicros) / 1e6, static_cast<long long>(p.ticks ? (p.delaySum / static_cast<qint64>(p.ticks)) : 0),
+      p.maxDelay, static_cast<unsigned long long>(p.jitterBuffer->concealmentEvents()),
+      static_cast<unsigned long long>(p.jitterBuffer->concealedFrames()),
+      static_cast<unsigned long long>(p.jitterBuffer->droppedFrames()), p.formatSwitches);
+  }
+
+  printf("%.1fs of audio played in %.2fs, %.2fus cpu per second of audio\n", audioSeconds, clock.elapsed() / 1000.0,
+    (audioSeconds > 0) ? (cpu / audioSeconds) : 0.0);
+  return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef WIREPLAYOUT_H
+#define WIREPLAYOUT_H
+
+#include <QString>
+
+// Plays what xaudio sent in a wire log (xaudio --wire-log) through the
+// JitterBuffer against a virtual device clock, paced to real time or as
+// fast as it goes. Every chunk goes in at the time it was recorded, so a
+// log gives the same delay and underruns on every run and playout changes
+// can be measured against a fixed network. Returns the process exit code.
+int replayPlayout(QString const& path, int targetLatencyMillis, bool fast);
+
+#endif // WIREPLAYOUT_H
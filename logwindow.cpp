@@ -1,19 +1,110 @@
 #include "logwindow.h"
 
 #include <QDateTime>
+#include <QMutexLocker>
 #include <QScrollBar>
+#include <QStringList>
+
+static const int kMaxPendingEntries = 1024;
+static const int kMaxBlockCount = 5000;
+static const int kFlushIntervalMillis = 100;
 
 LogWindow::LogWindow()
+  : m_lock()
+  , m_pending(kMaxPendingEntries)
+  , m_flushing(kMaxPendingEntries)
+  , m_pendingHead(0)
+  , m_pendingCount(0)
+  , m_dropped(0)
+  , m_lastFlushedMessage()
+  , m_flushTimer(nullptr)
 {
   setReadOnly(true);
+  setMaximumBlockCount(kMaxBlockCount);
+
+  m_flushTimer = new QTimer(this);
+  m_flushTimer->setInterval(kFlushIntervalMillis);
+  connect(m_flushTimer, SIGNAL(timeout()), this, SLOT(flush()));
+  m_flushTimer->start();
 }
 
 void
 LogWindow::appendMessage(QString const& message)
 {
-  QDateTime const now = QDateTime::currentDateTime();
-  QString text = QString("%1 : %2").arg(now.toString()).arg(message);
+  QMutexLocker lock(&m_lock);
+
+  if (m_pendingCount > 0)
+  {
+    Entry& last = m_pending[(m_pendingHead + m_pendingCount - 1) % kMaxPendingEntries];
+    if (last.message == message)
+    {
+      last.repeats++;
+      return;
+    }
+  }
+
+  if (m_pendingCount == kMaxPendingEntries)
+  {
+    // flooded faster than we flush, lose the oldest
+    m_pendingHead = (m_pendingHead + 1) % kMaxPendingEntries;
+    m_pendingCount--;
+    m_dropped++;
+  }
+
+  Entry& entry = m_pending[(m_pendingHead + m_pendingCount) % kMaxPendingEntries];
+  entry.timestamp = QDateTime::currentMSecsSinceEpoch();
+  entry.message = message;
+  entry.repeats = 0;
+  m_pendingCount++;
+}
+
+void
+LogWindow::flush()
+{
+  QStringList lines;
+  quint64 dropped = 0;
+  int head;
+  int count;
+
+  // the writers only wait for the swap, formatting happens without the lock
+  {
+    QMutexLocker lock(&m_lock);
+    if ((m_pendingCount == 0) && (m_dropped == 0))
+      return;
+
+    m_pending.swap(m_flushing);
+    head = m_pendingHead;
+    count = m_pendingCount;
+    m_pendingHead = 0;
+    m_pendingCount = 0;
+    dropped = m_dropped;
+    m_dropped = 0;
+  }
+
+  for (int i = 0; i < count; ++i)
+  {
+    Entry& entry = m_flushing[(head + i) % kMaxPendingEntries];
+    QString const timestamp = QDateTime::fromMSecsSinceEpoch(entry.timestamp).toString();
+
+    if (entry.message == m_lastFlushedMessage)
+      lines << QString("%1 : last message repeated %2 times").arg(timestamp, QString::number(entry.repeats + 1));
+    else if (entry.repeats > 0)
+      lines << QString("%1 : %2 (repeated %3 times)").arg(timestamp, entry.message, QString::number(entry.repeats + 1));
+    else
+      lines << QString("%1 : %2").arg(timestamp, entry.message);
+
+    m_lastFlushedMessage = entry.message;
+    entry.message.clear();
+  }
+
+  if (dropped > 0)
+    lines.prepend(QString("%1 log messages dropped").arg(dropped));
+
+  // only follow the tail if the user hasn't scrolled up to read something
+  QScrollBar* scrollBar = verticalScrollBar();
+  bool const atBottom = (scrollBar->value() == scrollBar->maximum());
 
-  appendPlainText(text);
-  verticalScrollBar()->setValue(verticalScrollBar()->maximum());
+  appendPlainText(lines.join('\n'));
+  if (atBottom)
+    scrollBar->setValue(scrollBar->maximum());
 }
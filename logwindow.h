@@ -3,7 +3,15 @@
 
 #include <QWidget>
 #include <QPlainTextEdit>
+#include <QMutex>
+#include <QTimer>
+#include <QVector>
 
+// Bounded log view. appendMessage() may be called from any thread, it only
+// queues the entry into a fixed size ring; the GUI picks entries up in one
+// batch per flush interval. Identical consecutive messages are collapsed
+// into a repeat count and the widget keeps at most kMaxBlockCount lines, so
+// memory stays flat however long the session runs.
 class LogWindow : public QPlainTextEdit
 {
   Q_OBJECT
@@ -11,6 +19,27 @@ class LogWindow : public QPlainTextEdit
 public:
   LogWindow();
   void appendMessage(QString const& message);
+
+private slots:
+  void flush();
+
+private:
+  struct Entry
+  {
+    qint64  timestamp;
+    QString message;
+    int     repeats;
+  };
+
+  QMutex          m_lock;
+  QVector<Entry>  m_pending;
+  // the ring flush() swapped out, only touched by the GUI thread
+  QVector<Entry>  m_flushing;
+  int             m_pendingHead;
+  int             m_pendingCount;
+  quint64         m_dropped;
+  QString         m_lastFlushedMessage;
+  QTimer*         m_flushTimer;
 };
 
 #endif // LOGWINDOW_H
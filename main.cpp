@@ -1,9 +1,12 @@
 #include "mainwindow.h"
+#include "trace.h"
 #include <QApplication>
 
 int main(int argc, char *argv[])
 {
   QApplication a(argc, argv);
+  // the audio thread writes the trace, see AudioEngine::publishStats
+  xaudio_trace_dump_on(SIGUSR1);
   MainWindow w;
   w.show();
 
@@ -1,5 +1,6 @@
 #include "mainwindow.h"
 #include "logwindow.h"
+#include "monitorwindow.h"
 
 #include <QAudioInput>
 #include <QHostAddress>
@@ -9,9 +10,29 @@
 
 static const qint32 kDefaultSamplingRate = 16000;
 static const qint32 kDefaultNumberOfChannels = 1;
+static const int kGuiLoadIntervalMillis = 50;
+static const int kGuiLoadBusyMillis = 40;
+static const int kDefaultTargetLatencyMillis = 100;
+static const int kMeterFloorDb = -60;
+static const int kStatisticsHistoryLimit = 4 * 60 * 60 * 4;
 
+void
+updateLevelMeter(QProgressBar* progressBar, LevelMeter::Reading const& reading)
+{
+  // bar shows RMS, the text the peak
+  progressBar->setValue(qBound(0, static_cast<int>(reading.rmsDb) - kMeterFloorDb, -kMeterFloorDb));
+  progressBar->setFormat(reading.clipped
+    ? QString("CLIP")
+    : QString("%1 dB").arg(static_cast<double>(reading.peakDb), 0, 'f', 1));
+
+  bool const wasClipped = progressBar->property("clipped").toBool();
+  if (wasClipped != reading.clipped)
+  {
+    progressBar->setProperty("clipped", reading.clipped);
+    progressBar->setStyleSheet(reading.clipped ? "QProgressBar::chunk { background-color: red; }" : "");
+  }
+}
 
-#define PUSHMODE 1
 
 AudioSource::AudioSource()
 {
@@ -46,32 +67,33 @@ MainWindow::MainWindow()
   , m_connectButton(nullptr)
   , m_serverAddressLineEdit(nullptr)
   , m_serverPortLineEdit(nullptr)
+  , m_latencyProfileSelector(nullptr)
+  , m_measureRoundTripButton(nullptr)
+  , m_roundTripLabel(nullptr)
+  , m_recordButton(nullptr)
+  , m_monitorButton(nullptr)
+  , m_glitchCountLabel(nullptr)
+  , m_guiLoadCheckBox(nullptr)
+  , m_guiLoadTimer(nullptr)
 
   , m_audioInGroupBox(nullptr)
   , m_audioInMuteButton(nullptr)
   , m_audioInProgressBar(nullptr)
   , m_audioInSelector(nullptr)
   , m_audioInMute(true)
-  , m_audioFromFile(false)
   , m_audioInDeviceInfo(QAudioDeviceInfo::defaultInputDevice())
-  , m_audioInput()
-  , m_audioInputDevice(nullptr)
-  , m_audioWriteBuffer(32768, 0)
   , m_audioInFromDeviceRadioButton(nullptr)
   , m_audioInFromFileRadioButton(nullptr)
   , m_audioInOpenFilePushButton(nullptr)
+  , m_audioInLoopFileCheckBox(nullptr)
 
   , m_audioOutGroupBox(nullptr)
   , m_audioOutMuteButton(nullptr)
   , m_audioOutProgressBar(nullptr)
   , m_audioOutSelector(nullptr)
+  , m_audioOutTargetLatencySpinBox(nullptr)
+  , m_audioOutPlayoutDelayLabel(nullptr)
   , m_audioOutMute(true)
-  , m_audioOutput()
-  , m_audioOutputFormat()
-  , m_audioOutDevice(nullptr)
-  , m_audioReadBuffer(32768, 0)
-  , m_audioBytesReceived(0)
-  , m_audioReadRateLastReported(QDateTime::currentMSecsSinceEpoch())
 
   , m_audioDecodeGroupBox(nullptr)
   , m_audioDecodeSampleRateLabel(nullptr)
@@ -87,18 +109,43 @@ MainWindow::MainWindow()
   , m_audioDecodeSampleTypeLabel(nullptr)
   , m_audioDecodeSampleTypeSelector(nullptr)
 
+  , m_statisticsGroupBox(nullptr)
+  , m_statisticsReceiveRateLabel(nullptr)
+  , m_statisticsSendRateLabel(nullptr)
+  , m_statisticsSocketBacklogLabel(nullptr)
+  , m_statisticsOutputBytesFreeLabel(nullptr)
+  , m_statisticsUnderrunsLabel(nullptr)
+  , m_statisticsReconnectsLabel(nullptr)
+  , m_statisticsPlayoutDelayLabel(nullptr)
+  , m_statisticsExportButton(nullptr)
+  , m_statisticsHistory()
+
   , m_logWindow(nullptr)
   , m_dialogButtonBox(nullptr)
 
-  , m_socket()
-  , m_audioSourceBuffer()
+  , m_audioEngine(nullptr)
+  , m_audioThread(new QThread())
   , m_shouldBeConnected(false)
 {
+  m_audioEngine = new AudioEngine();
+  m_audioEngine->moveToThread(m_audioThread.data());
+  m_audioThread->setObjectName("audio");
+  m_audioThread->start(QThread::TimeCriticalPriority);
+
+  connect(m_audioEngine, &AudioEngine::statsUpdated, this, &MainWindow::onAudioEngineStatsUpdated);
+  connect(m_audioEngine, &AudioEngine::levelsUpdated, this, &MainWindow::onAudioEngineLevelsUpdated);
+
   createServerGroupBox();
   createAudioInGroupBox();
   createAudioOutGroupBox();
+  createStatisticsGroupBox();
 
   m_logWindow = new LogWindow();
+  // appendMessage only queues, so there's no need to bounce every line
+  // through the GUI event loop
+  connect(m_audioEngine, &AudioEngine::logMessage, m_logWindow, &LogWindow::appendMessage,
+    Qt::DirectConnection);
+
   m_dialogButtonBox = new QDialogButtonBox(QDialogButtonBox::Cancel);
   connect(m_dialogButtonBox, SIGNAL(rejected()), this, SLOT(reject()));
 
@@ -106,61 +153,36 @@ MainWindow::MainWindow()
   mainLayout->addWidget(m_serverGroupBox);
   mainLayout->addWidget(m_audioInGroupBox);
   mainLayout->addWidget(m_audioOutGroupBox);
+  mainLayout->addWidget(m_statisticsGroupBox);
   mainLayout->addWidget(m_logWindow);
   mainLayout->addWidget(m_dialogButtonBox);
 
-  connect(&m_audioInputDecoder, &QAudioDecoder::bufferReady, [this]()
-  {
-    // TODO
-  });
-  connect(&m_audioInputDecoder, QOverload<QAudioDecoder::Error>::of(&QAudioDecoder::error),
-         [this](QAudioDecoder::Error err)
-  {
-    qInfo() << "audio decoder error:" << err;
-    qInfo() << m_audioInputDecoder.errorString();
-  });
-  connect(&m_audioInputDecoder, &QAudioDecoder::stateChanged,
-         [this](QAudioDecoder::State newState)
-  {
-    qInfo() << "audio decoder state change:" << newState;
-  });
-  connect(&m_audioInputDecoder, &QAudioDecoder::finished, [this]()
-  {
-    // TODO
-  });
-
   setLayout(mainLayout);
   setWindowTitle("Sound Test");
 }
 
 MainWindow::~MainWindow()
 {
+  // socket and devices have to be torn down on the thread that created them
+  QMetaObject::invokeMethod(m_audioEngine, "shutdown", Qt::BlockingQueuedConnection);
+  m_audioThread->quit();
+  m_audioThread->wait();
+  delete m_audioEngine;
 }
 
 void
 MainWindow::initializeAudioOutputDevice(QAudioDeviceInfo const& deviceInfo)
 {
   qDebug() << "current deviceInfo:"  << deviceInfo.deviceName();
-  m_logWindow->appendMessage(QString("Initialize audio out with device: %1").arg(deviceInfo.deviceName()));
-  m_audioOutput.reset(new QAudioOutput(deviceInfo, getAudioOutputFormat()));
-  m_audioOutput->setBufferSize(12800 * 10);
-#if PUSHMODE
-  m_audioOutDevice = m_audioOutput->start();
-#else
-  m_audioSourceBuffer.reset(new QBuffer());
-  m_audioSourceBuffer->open(QIODevice::ReadWrite);
-  m_audioOutput->start(m_audioSourceBuffer.data());
-  qDebug() << "audio playback state:" << m_audioOutput->state();
-#endif
+  QMetaObject::invokeMethod(m_audioEngine, "startOutput",
+    Q_ARG(QAudioDeviceInfo, deviceInfo), Q_ARG(QAudioFormat, getAudioOutputFormat()));
 }
 
 void
 MainWindow::initializeAudioInputDevice(QAudioDeviceInfo const& deviceInfo)
 {
-  m_logWindow->appendMessage(QString("Initialize audio in with: %1").arg(deviceInfo.deviceName()));
-  m_audioInput.reset(new QAudioInput(deviceInfo, getAudioInputFormat()));
-  m_audioInputDevice = m_audioInput->start();
-  connect(m_audioInputDevice, SIGNAL(readyRead()), this, SLOT(onIncomingSoundData()));
+  QMetaObject::invokeMethod(m_audioEngine, "startInput",
+    Q_ARG(QAudioDeviceInfo, deviceInfo), Q_ARG(QAudioFormat, getAudioInputFormat()));
 }
 
 QAudioFormat
@@ -174,11 +196,11 @@ MainWindow::getAudioOutputFormat() const
   format.setByteOrder(m_audioDecodeByteOrderSelector->currentData().value<QAudioFormat::Endian>());
   format.setSampleType(m_audioDecodeSampleTypeSelector->currentData().value<QAudioFormat::SampleType>());
 
-  m_logWindow->appendMessage(QString("output format sample_rate:%1 channels:%2 sample_size:%3").
+  m_logWindow->appendMessage(QString("output format sample_rate:%1 channels:%2 sample_size:%3 "
+    "codec:%4 byte_order:%5 sample_type:%6").
     arg(QString::number(format.sampleRate()), QString::number(format.channelCount()),
-        QString::number(format.sampleSize())));
-  m_logWindow->appendMessage(QString("output format codec:%1 byte_order:%2 sample_type:%3").
-    arg(format.codec(), QString::number(format.byteOrder()), QString::number(format.sampleType())));
+        QString::number(format.sampleSize()), format.codec(), QString::number(format.byteOrder()),
+        QString::number(format.sampleType())));
 
   return format;
 }
@@ -194,11 +216,11 @@ MainWindow::getAudioInputFormat() const
   format.setByteOrder(m_audioEncodeByteOrderSelector->currentData().value<QAudioFormat::Endian>());
   format.setSampleType(m_audioEncodeSampleTypeSelector->currentData().value<QAudioFormat::SampleType>());
 
-  m_logWindow->appendMessage(QString("input format sample_rate:%1 channels:%2 sample_size:%3").
+  m_logWindow->appendMessage(QString("input format sample_rate:%1 channels:%2 sample_size:%3 "
+    "codec:%4 byte_order:%5 sample_type:%6").
     arg(QString::number(format.sampleRate()), QString::number(format.channelCount()),
-        QString::number(format.sampleSize())));
-  m_logWindow->appendMessage(QString("input format codec:%1 byte_order:%2 sample_type:%3").
-    arg(format.codec(), QString::number(format.byteOrder()), QString::number(format.sampleType())));
+        QString::number(format.sampleSize()), format.codec(), QString::number(format.byteOrder()),
+        QString::number(format.sampleType())));
 
   return format;
 }
@@ -212,12 +234,52 @@ MainWindow::createServerGroupBox()
   m_connectButton = new QPushButton("Connect");
   m_serverAddressLineEdit = new QLineEdit("10.0.0.245");
   m_serverPortLineEdit = new QLineEdit("10001");
+  m_latencyProfileSelector = new QComboBox();
+  m_latencyProfileSelector->addItem(AudioEngine::latencyProfileName(AudioEngine::StandardLatency),
+    AudioEngine::StandardLatency);
+  m_latencyProfileSelector->addItem(AudioEngine::latencyProfileName(AudioEngine::LowLatency),
+    AudioEngine::LowLatency);
+  m_measureRoundTripButton = new QPushButton("Measure RTT");
+  m_roundTripLabel = new QLabel("round trip: - ms");
+  m_recordButton = new QPushButton("Record");
+  m_recordButton->setCheckable(true);
+  m_monitorButton = new QPushButton("Monitor...");
+  m_glitchCountLabel = new QLabel("glitches: 0");
+  m_guiLoadCheckBox = new QCheckBox("Simulate GUI load");
+  m_guiLoadTimer = new QTimer(this);
+  m_guiLoadTimer->setInterval(kGuiLoadIntervalMillis);
 
   connect(m_connectButton, SIGNAL(released()), this, SLOT(connectButtonReleased()));
+  connect(m_latencyProfileSelector, SIGNAL(activated(int)), this, SLOT(onLatencyProfileChanged(int)));
+  connect(m_measureRoundTripButton, SIGNAL(released()), this, SLOT(measureRoundTripButtonReleased()));
+  connect(m_recordButton, SIGNAL(toggled(bool)), this, SLOT(recordButtonToggled(bool)));
+  connect(m_monitorButton, &QPushButton::released, [this]()
+  {
+    MonitorWindow* monitorWindow = new MonitorWindow(this);
+    monitorWindow->setAttribute(Qt::WA_DeleteOnClose);
+    monitorWindow->show();
+  });
+  connect(m_guiLoadCheckBox, SIGNAL(toggled(bool)), this, SLOT(onGuiLoadToggled(bool)));
+  connect(m_guiLoadTimer, &QTimer::timeout, [this]()
+  {
+    // hog the GUI thread the way a repaint storm or window drag would
+    QElapsedTimer busy;
+    busy.start();
+    while (busy.elapsed() < kGuiLoadBusyMillis)
+      ;
+    update();
+  });
 
   layout->addWidget(m_connectButton);
   layout->addWidget(m_serverAddressLineEdit);
   layout->addWidget(m_serverPortLineEdit);
+  layout->addWidget(m_latencyProfileSelector);
+  layout->addWidget(m_measureRoundTripButton);
+  layout->addWidget(m_roundTripLabel);
+  layout->addWidget(m_recordButton);
+  layout->addWidget(m_monitorButton);
+  layout->addWidget(m_glitchCountLabel);
+  layout->addWidget(m_guiLoadCheckBox);
   m_serverGroupBox->setLayout(layout);
 }
 
@@ -236,11 +298,13 @@ MainWindow::createAudioInGroupBox()
   m_audioInFromFileRadioButton->setChecked(false);
   m_audioInOpenFilePushButton = new QPushButton("Open File");
   m_audioInOpenFilePushButton->setEnabled(false);
+  m_audioInLoopFileCheckBox = new QCheckBox("Loop");
 
   m_audioInGroupBox = new QGroupBox("Audio In (From this computer)");
   m_audioInMuteButton = new QPushButton("un-mute");
   m_audioInProgressBar = new QProgressBar();
-  m_audioInProgressBar->setRange(0, 10);
+  m_audioInProgressBar->setRange(0, -kMeterFloorDb);
+  m_audioInProgressBar->setTextVisible(true);
   m_audioInSelector = new QComboBox();
   m_audioEncodeVolumeSlider = new QSlider();
   m_audioEncodeVolumeSlider->setOrientation(Qt::Horizontal);
@@ -262,21 +326,35 @@ MainWindow::createAudioInGroupBox()
   connect(m_audioInOpenFilePushButton, &QPushButton::released, [this]()
   {
     QString wavFile = QFileDialog::getOpenFileName(this, "Open WAV File");
-    m_audioInputDecoder.setAudioFormat(getAudioInputFormat());
-    m_audioInputDecoder.setSourceFilename(wavFile);
-    m_audioInputDecoder.start();
+    if (wavFile.isEmpty())
+      return;
+
+    // decoded straight into the wire format
+    QMetaObject::invokeMethod(m_audioEngine, "startFileInput", Q_ARG(QString, wavFile),
+      Q_ARG(QAudioFormat, getAudioInputFormat()));
   });
 
-  connect(m_audioInFromDeviceRadioButton, &QRadioButton::toggled, [this]()
+  connect(m_audioInLoopFileCheckBox, &QCheckBox::toggled, [this](bool checked)
   {
-    m_audioFromFile = false;
+    QMetaObject::invokeMethod(m_audioEngine, "setFileLooping", Q_ARG(bool, checked));
+  });
+
+  connect(m_audioInFromDeviceRadioButton, &QRadioButton::toggled, [this](bool checked)
+  {
+    if (!checked)
+      return;
+
+    QMetaObject::invokeMethod(m_audioEngine, "setInputFromFile", Q_ARG(bool, false));
     m_audioInOpenFilePushButton->setEnabled(false);
     m_audioInSelector->setEnabled(true);
   });
 
-  connect(m_audioInFromFileRadioButton, &QRadioButton::toggled, [this]()
+  connect(m_audioInFromFileRadioButton, &QRadioButton::toggled, [this](bool checked)
   {
-    m_audioFromFile = true;
+    if (!checked)
+      return;
+
+    QMetaObject::invokeMethod(m_audioEngine, "setInputFromFile", Q_ARG(bool, true));
     m_audioInOpenFilePushButton->setEnabled(true);
     m_audioInSelector->setEnabled(false);
   });
@@ -288,6 +366,7 @@ MainWindow::createAudioInGroupBox()
   pushButtonLayout->addWidget(m_audioInFromDeviceRadioButton);
   pushButtonLayout->addWidget(m_audioInFromFileRadioButton);
   pushButtonLayout->addWidget(m_audioInOpenFilePushButton);
+  pushButtonLayout->addWidget(m_audioInLoopFileCheckBox);
   vlayout->addLayout(pushButtonLayout);
 
   hlayout->addWidget(m_audioInMuteButton);
@@ -311,8 +390,17 @@ MainWindow::createAudioOutGroupBox()
   m_audioOutGroupBox = new QGroupBox("Audio Out (From camera)");
   m_audioOutMuteButton = new QPushButton("un-mute");
   m_audioOutProgressBar = new QProgressBar();
-  m_audioOutProgressBar->setRange(0, 10);
+  m_audioOutProgressBar->setRange(0, -kMeterFloorDb);
+  m_audioOutProgressBar->setTextVisible(true);
   m_audioOutSelector = new QComboBox();
+  m_audioOutTargetLatencySpinBox = new QSpinBox();
+  m_audioOutTargetLatencySpinBox->setRange(10, 2000);
+  m_audioOutTargetLatencySpinBox->setSingleStep(10);
+  m_audioOutTargetLatencySpinBox->setSuffix(" ms");
+  m_audioOutTargetLatencySpinBox->setPrefix("target latency: ");
+  m_audioOutTargetLatencySpinBox->setValue(kDefaultTargetLatencyMillis);
+  m_audioOutPlayoutDelayLabel = new QLabel("playout delay: 0 ms");
+  QMetaObject::invokeMethod(m_audioEngine, "setTargetLatency", Q_ARG(int, kDefaultTargetLatencyMillis));
 
   QSet<QString> set;
   QAudioDeviceInfo const& defaultDeviceInfo = QAudioDeviceInfo::defaultOutputDevice();
@@ -328,15 +416,60 @@ MainWindow::createAudioOutGroupBox()
 
   connect(m_audioOutMuteButton, SIGNAL(released()), this, SLOT(audioOutMuteButtonReleased()));
   connect(m_audioOutSelector, SIGNAL(activated(int)), this, SLOT(audioOutDeviceChanged(int)));
+  connect(m_audioOutTargetLatencySpinBox, SIGNAL(valueChanged(int)), this, SLOT(onTargetLatencyValueChanged(int)));
 
   hlayout->addWidget(m_audioOutMuteButton);
   hlayout->addWidget(m_audioOutProgressBar);
   vlayout->addLayout(hlayout);
   vlayout->addWidget(m_audioOutSelector);
+
+  QHBoxLayout* latencyLayout = new QHBoxLayout();
+  latencyLayout->addWidget(m_audioOutTargetLatencySpinBox);
+  latencyLayout->addWidget(m_audioOutPlayoutDelayLabel);
+  vlayout->addLayout(latencyLayout);
   vlayout->addWidget(m_audioDecodeGroupBox);
   m_audioOutGroupBox->setLayout(vlayout);
 }
 
+void
+MainWindow::createStatisticsGroupBox()
+{
+  m_statisticsGroupBox = new QGroupBox("Statistics");
+  QGridLayout* gridLayout = new QGridLayout();
+
+  m_statisticsReceiveRateLabel = new QLabel("-");
+  m_statisticsSendRateLabel = new QLabel("-");
+  m_statisticsSocketBacklogLabel = new QLabel("-");
+  m_statisticsOutputBytesFreeLabel = new QLabel("-");
+  m_statisticsUnderrunsLabel = new QLabel("-");
+  m_statisticsReconnectsLabel = new QLabel("-");
+  m_statisticsPlayoutDelayLabel = new QLabel("-");
+  m_statisticsExportButton = new QPushButton("Export CSV");
+
+  gridLayout->addWidget(new QLabel("Receive"), 0, 0, 1, 1);
+  gridLayout->addWidget(m_statisticsReceiveRateLabel, 0, 1, 1, 1);
+  gridLayout->addWidget(new QLabel("Send"), 0, 2, 1, 1);
+  gridLayout->addWidget(m_statisticsSendRateLabel, 0, 3, 1, 1);
+
+  gridLayout->addWidget(new QLabel("Socket backlog"), 1, 0, 1, 1);
+  gridLayout->addWidget(m_statisticsSocketBacklogLabel, 1, 1, 1, 1);
+  gridLayout->addWidget(new QLabel("Output free"), 1, 2, 1, 1);
+  gridLayout->addWidget(m_statisticsOutputBytesFreeLabel, 1, 3, 1, 1);
+
+  gridLayout->addWidget(new QLabel("Underruns"), 2, 0, 1, 1);
+  gridLayout->addWidget(m_statisticsUnderrunsLabel, 2, 1, 1, 1);
+  gridLayout->addWidget(new QLabel("Reconnects"), 2, 2, 1, 1);
+  gridLayout->addWidget(m_statisticsReconnectsLabel, 2, 3, 1, 1);
+
+  gridLayout->addWidget(new QLabel("Playout delay"), 3, 0, 1, 1);
+  gridLayout->addWidget(m_statisticsPlayoutDelayLabel, 3, 1, 1, 1);
+  gridLayout->addWidget(m_statisticsExportButton, 3, 3, 1, 1);
+
+  connect(m_statisticsExportButton, SIGNAL(released()), this, SLOT(exportStatisticsButtonReleased()));
+
+  m_statisticsGroupBox->setLayout(gridLayout);
+}
+
 void
 MainWindow::createAudioDecodeFormatGroupBox()
 {
@@ -430,14 +563,10 @@ MainWindow::createAudioEncodeFormatGroupBox()
 void
 MainWindow::connectButtonReleased()
 {
-  if (m_socket != nullptr)
+  if (m_shouldBeConnected)
   {
-    m_logWindow->appendMessage("closing socket");
-
-    m_socket->close();
-    m_socket.reset();
+    QMetaObject::invokeMethod(m_audioEngine, "disconnectFromHost");
     m_connectButton->setText("Connect");
-    m_audioSourceBuffer.reset();
     m_shouldBeConnected = false;
   }
   else
@@ -448,13 +577,8 @@ MainWindow::connectButtonReleased()
     quint16 port = static_cast<quint16>(m_serverPortLineEdit->text().toUInt());
     QString host = m_serverAddressLineEdit->text();
 
-    m_logWindow->appendMessage(QString("connecting to host %1:%2").arg(host, QString::number(port)));
-    m_socket.reset(new QTcpSocket());
-    connect(m_socket.data(), SIGNAL(connected()), this, SLOT(onSocketConnected()));
-    connect(m_socket.data(), SIGNAL(readyRead()), this, SLOT(onSocketReadyRead()));
-    connect(m_socket.data(), SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(onSocketError(QAbstractSocket::SocketError)));
+    QMetaObject::invokeMethod(m_audioEngine, "connectToHost", Q_ARG(QString, host), Q_ARG(quint16, port));
     m_shouldBeConnected = true;
-    m_socket->connectToHost(host, port);
     m_connectButton->setText("Disconnect");
   }
 }
@@ -466,12 +590,14 @@ MainWindow::audioInMuteButtonReleased()
   {
     m_audioInMuteButton->setText("mute");
     m_audioInMute = false;
+    QMetaObject::invokeMethod(m_audioEngine, "setInputMuted", Q_ARG(bool, false));
     m_logWindow->appendMessage("audio input muted");
   }
   else
   {
     m_audioInMuteButton->setText("un-mute");
     m_audioInMute = true;
+    QMetaObject::invokeMethod(m_audioEngine, "setInputMuted", Q_ARG(bool, true));
     m_logWindow->appendMessage("audio input un-muted");
   }
 }
@@ -483,153 +609,145 @@ MainWindow::audioOutMuteButtonReleased()
   {
     m_audioOutMuteButton->setText("mute");
     m_audioOutMute = false;
+    QMetaObject::invokeMethod(m_audioEngine, "setOutputMuted", Q_ARG(bool, false));
     m_logWindow->appendMessage("audio output un-muted");
-
-#if 0
-    QString prefix = QDateTime::currentDateTime().toString("yyyymmddHHmmss");
-    QString tempPath = QDir().tempPath() + "/" + prefix + "_capture.pcm";
-    m_pcmOutputFile.reset(new QFile(tempPath));
-    m_pcmOutputFile->open(QFile::WriteOnly | QFile::Truncate);
-    m_logWindow->appendMessage(QString("opened for PCM capture:%1").arg(tempPath));
-#endif
-
   }
   else
   {
-    if (m_pcmOutputFile)
-    {
-      m_pcmOutputFile->close();
-      m_pcmOutputFile.reset();
-    }
-
     m_audioOutMuteButton->setText("un-mute");
     m_audioOutMute = true;
+    QMetaObject::invokeMethod(m_audioEngine, "setOutputMuted", Q_ARG(bool, true));
     m_logWindow->appendMessage("audio output muted");
   }
 }
 
 void
-MainWindow::onSocketConnected()
+MainWindow::onGuiLoadToggled(bool enabled)
 {
-  m_logWindow->appendMessage(QString("connected to %1:%2")
-    .arg(m_socket->peerAddress().toString(), QString::number(m_socket->peerPort())));
+  if (enabled)
+    m_guiLoadTimer->start();
+  else
+    m_guiLoadTimer->stop();
 }
 
 void
-MainWindow::onSocketReadyRead()
+MainWindow::onAudioEngineStatsUpdated(AudioEngineStats const& stats)
 {
+  m_glitchCountLabel->setText(QString("glitches: %1").arg(stats.outputUnderruns + stats.inputOverruns
+    + stats.concealmentEvents));
+  m_audioOutPlayoutDelayLabel->setText(QString("playout delay: %1 ms").arg(stats.playoutDelayMillis));
+  if (stats.roundTripMillis >= 0)
+    m_roundTripLabel->setText(QString("round trip: %1 ms").arg(stats.roundTripMillis));
+  else
+    m_roundTripLabel->setText("round trip: - ms");
+
+  m_statisticsReceiveRateLabel->setText(QString("%1 kbit/s").arg(stats.receiveBitsPerSecond / 1000));
+  m_statisticsSendRateLabel->setText(QString("%1 kbit/s").arg(stats.sendBitsPerSecond / 1000));
+  m_statisticsSocketBacklogLabel->setText(QString("%1 B (send %2 B)")
+    .arg(QString::number(stats.socketBacklogBytes), QString::number(stats.socketSendBacklogBytes)));
+  m_statisticsOutputBytesFreeLabel->setText(QString("%1 B").arg(stats.outputBytesFree));
+  m_statisticsUnderrunsLabel->setText(QString("%1 device, %2 concealed")
+    .arg(QString::number(stats.outputUnderruns), QString::number(stats.concealmentEvents)));
+  m_statisticsReconnectsLabel->setText((stats.timeToAudioMillis < 0) ? QString::number(stats.reconnects)
+    : QString("%1 (audio back in %2 ms)").arg(QString::number(stats.reconnects), QString::number(stats.timeToAudioMillis)));
+  m_statisticsPlayoutDelayLabel->setText(QString("%1 ms").arg(stats.playoutDelayMillis));
+
+  if (m_statisticsHistory.size() >= kStatisticsHistoryLimit)
+    m_statisticsHistory.remove(0, kStatisticsHistoryLimit / 4);
+  m_statisticsHistory.append(stats);
+}
 
-  /*
-  static quint64 delayed = QDateTime::currentMSecsSinceEpoch();
-
-  if (delayed != 0)
-  {
-    quint64 now = QDateTime::currentMSecsSinceEpoch();
-    if ((now - delayed) < 2000)
-      return;
-
-    delayed = 0;
-   }
-   */
-
-#if PUSHMODE
-  static qint64 const periodSize = m_audioOutput->periodSize();
-
-  // int bufferSize = m_audioOutput->bufferSize();
-
-  int numFramesFree = m_audioOutput->bytesFree() / periodSize;
-  int numFramesAvailable = m_socket->bytesAvailable() / periodSize;
-
-  int numFramesToRead = qMin(numFramesFree, numFramesAvailable);
-
-  //if (numFramesFree != 0)
-  //{
-  //  qDebug() << "numFramesFree:" << numFramesFree << " numFramesAvailable:"
-  //           << numFramesAvailable;
-  //}
+void
+MainWindow::exportStatisticsButtonReleased()
+{
+  QString prefix = QDateTime::currentDateTime().toString("yyyyMMddHHmmss");
+  QString fileName = QFileDialog::getSaveFileName(this, "Export Statistics",
+    QDir::homePath() + "/" + prefix + "_soundtest_stats.csv", "CSV Files (*.csv)");
+  if (fileName.isEmpty())
+    return;
 
-  qint64 n = m_socket->read(m_audioReadBuffer.data(), (numFramesToRead * periodSize));
-  if (!m_audioOutMute)
+  QFile file(fileName);
+  if (!file.open(QFile::WriteOnly | QFile::Truncate | QFile::Text))
   {
-    m_audioOutDevice->write(m_audioReadBuffer.data(), n);
-    if (m_pcmOutputFile)
-      m_pcmOutputFile->write(m_audioReadBuffer.data(), n);
+    m_logWindow->appendMessage(QString("failed to open %1: %2").arg(fileName, file.errorString()));
+    return;
   }
 
-#if 0
-  while ((m_audioOutput->bytesFree() > periodSize) && (m_socket->bytesAvailable() > periodSize))
-  {
-    // if (m_socket->bytesAvailable() < periodSize)
-    //  return;
+  QTextStream out(&file);
+  out << QString("# host %1:%2\n").arg(m_serverAddressLineEdit->text(), m_serverPortLineEdit->text());
+  out << AudioEngineStats::csvHeader() << "\n";
+  for (AudioEngineStats const& stats : m_statisticsHistory)
+    out << stats.toCsv() << "\n";
 
-    //qint64 len = m_socket->peek(m_audioReadBuffer.data(), periodSize);
-    //if (len < periodSize)
-    //  return;
+  m_logWindow->appendMessage(QString("exported %1 samples to %2")
+    .arg(QString::number(m_statisticsHistory.size()), fileName));
+}
 
-    m_socket->read(m_audioReadBuffer.data(), periodSize);
+void
+MainWindow::onAudioEngineLevelsUpdated(AudioLevels const& levels)
+{
+  updateLevelMeter(m_audioInProgressBar, levels.in);
+  updateLevelMeter(m_audioOutProgressBar, levels.out);
+}
 
-    if (!m_audioOutMute)
-    {
-      m_audioOutDevice->write(m_audioReadBuffer.data(), periodSize);
-      if (m_pcmOutputFile)
-        m_pcmOutputFile->write(m_audioReadBuffer.data(), periodSize);
-    }
+void
+MainWindow::onLatencyProfileChanged(int index)
+{
+  QMetaObject::invokeMethod(m_audioEngine, "setLatencyProfile",
+    Q_ARG(int, m_latencyProfileSelector->itemData(index).toInt()));
 
-    // --chunks;
+  // buffer sizes are fixed when a device is opened, reopen both
+  if (m_shouldBeConnected)
+  {
+    initializeAudioOutputDevice(m_audioOutSelector->currentData().value<QAudioDeviceInfo>());
+    initializeAudioInputDevice(m_audioInSelector->currentData().value<QAudioDeviceInfo>());
   }
-#endif
-#endif
-
 }
 
-
 void
-MainWindow::onIncomingSoundData()
+MainWindow::measureRoundTripButtonReleased()
 {
-  if (m_audioFromFile)
-    return;
-
-  qint64 bytesReady = m_audioInput->bytesReady();
-  qint64 bytesRead = m_audioInputDevice->read(m_audioWriteBuffer.data(), bytesReady);
-
-  // qDebug() << "ready:" << bytesReady << " read:" << bytesRead;
-
-  if (m_socket && !m_audioInMute)
-    m_socket->write(m_audioWriteBuffer.constData(), bytesRead);
+  QMetaObject::invokeMethod(m_audioEngine, "measureRoundTrip");
 }
 
 void
-MainWindow::onSocketError(QAbstractSocket::SocketError /*socketError*/)
+MainWindow::recordButtonToggled(bool checked)
 {
-  static const int kReconnectIntervalMillis = 1000;
-  m_logWindow->appendMessage(QString("socket error: %1").arg(m_socket->errorString()));
-  if (m_shouldBeConnected && m_socket)
+  if (checked)
   {
-    // m_logWindow->appendMessage(QString("reconnecting in %1 milliseconds").arg(kReconnectIntervalMillis));
-    QTimer::singleShot(kReconnectIntervalMillis, this, SLOT(reconnectToHost()));
+    QString prefix = QDateTime::currentDateTime().toString("yyyyMMddHHmmss");
+    QString tempPath = QDir().tempPath() + "/" + prefix + "_capture";
+    QMetaObject::invokeMethod(m_audioEngine, "startRecording", Q_ARG(QString, tempPath));
+    m_recordButton->setText("Stop Recording");
+  }
+  else
+  {
+    QMetaObject::invokeMethod(m_audioEngine, "stopRecording");
+    m_recordButton->setText("Record");
   }
 }
 
 void
-MainWindow::reconnectToHost()
+MainWindow::onTargetLatencyValueChanged(int value)
 {
-  quint16 port = static_cast<quint16>(m_serverPortLineEdit->text().toUInt());
-  QString host = m_serverAddressLineEdit->text();
-  m_socket->connectToHost(host, port);
+  QMetaObject::invokeMethod(m_audioEngine, "setTargetLatency", Q_ARG(int, value));
 }
 
 void
 MainWindow::audioInDeviceChanged(int index)
 {
-  m_audioInput->stop();
-  initializeAudioOutputDevice(m_audioInSelector->itemData(index).value<QAudioDeviceInfo>());
+  // the engine hands over from the running device without a gap
+  QMetaObject::invokeMethod(m_audioEngine, "switchInputDevice",
+    Q_ARG(QAudioDeviceInfo, m_audioInSelector->itemData(index).value<QAudioDeviceInfo>()),
+    Q_ARG(QAudioFormat, getAudioInputFormat()));
 }
 
 void
 MainWindow::audioOutDeviceChanged(int index)
 {
-  m_audioOutput->stop();
-  initializeAudioOutputDevice(m_audioOutSelector->itemData(index).value<QAudioDeviceInfo>());
+  QMetaObject::invokeMethod(m_audioEngine, "switchOutputDevice",
+    Q_ARG(QAudioDeviceInfo, m_audioOutSelector->itemData(index).value<QAudioDeviceInfo>()),
+    Q_ARG(QAudioFormat, getAudioOutputFormat()));
 }
 
 void
@@ -644,9 +762,5 @@ MainWindow::onEncodeVolumeValueChanged(int value)
     QAudio::LogarithmicVolumeScale, QAudio::LinearVolumeScale);
 #endif
 
-  if (m_audioInput)
-    m_audioInput->setVolume(n);
-
-  if (m_audioOutput)
-    m_audioOutput->stop();
+  QMetaObject::invokeMethod(m_audioEngine, "setInputVolume", Q_ARG(qreal, n));
 }
@@ -3,7 +3,6 @@
 
 #include <QtWidgets>
 
-#include <QAudioDecoder>
 #include <QAudioDeviceInfo>
 #include <QAudioFormat>
 #include <QAudioInput>
@@ -13,9 +12,14 @@
 #include <QTcpSocket>
 #include <QUdpSocket>
 
+#include "audioengine.h"
+
 
 class LogWindow;
 
+// shows RMS in the bar and the peak (or CLIP) as its text
+void updateLevelMeter(QProgressBar* progressBar, LevelMeter::Reading const& reading);
+
 class AudioSource : public QIODevice
 {
   Q_OBJECT
@@ -48,8 +52,7 @@ private:
   void createAudioOutGroupBox();
   void createAudioDecodeFormatGroupBox();
   void createAudioEncodeFormatGroupBox();
-
-  void playAudioData();
+  void createStatisticsGroupBox();
 
   void initializeAudioOutputDevice(QAudioDeviceInfo const& deviceInfo);
   void initializeAudioInputDevice(QAudioDeviceInfo const& deviceInfo);
@@ -59,18 +62,19 @@ private:
 
 private slots:
   void connectButtonReleased();
-  void reconnectToHost();
   void audioInMuteButtonReleased();
   void audioOutMuteButtonReleased();
   void audioInDeviceChanged(int index);
   void audioOutDeviceChanged(int index);
   void onEncodeVolumeValueChanged(int value);
-  void onIncomingSoundData();
-
-  // socket states
-  void onSocketConnected();
-  void onSocketReadyRead();
-  void onSocketError(QAbstractSocket::SocketError socketError);
+  void onTargetLatencyValueChanged(int value);
+  void onLatencyProfileChanged(int index);
+  void measureRoundTripButtonReleased();
+  void recordButtonToggled(bool checked);
+  void onGuiLoadToggled(bool enabled);
+  void onAudioEngineStatsUpdated(AudioEngineStats const& stats);
+  void onAudioEngineLevelsUpdated(AudioLevels const& levels);
+  void exportStatisticsButtonReleased();
 
 private:
 
@@ -79,6 +83,14 @@ private:
   QPushButton*                  m_connectButton;
   QLineEdit*                    m_serverAddressLineEdit;
   QLineEdit*                    m_serverPortLineEdit;
+  QComboBox*                    m_latencyProfileSelector;
+  QPushButton*                  m_measureRoundTripButton;
+  QLabel*                       m_roundTripLabel;
+  QPushButton*                  m_recordButton;
+  QPushButton*                  m_monitorButton;
+  QLabel*                       m_glitchCountLabel;
+  QCheckBox*                    m_guiLoadCheckBox;
+  QTimer*                       m_guiLoadTimer;
 
   // audio in
   QGroupBox*                    m_audioInGroupBox;
@@ -86,15 +98,11 @@ private:
   QProgressBar*                 m_audioInProgressBar;
   QComboBox*                    m_audioInSelector;
   bool                          m_audioInMute;
-  bool                          m_audioFromFile;
   QAudioDeviceInfo              m_audioInDeviceInfo;
-  QScopedPointer<QAudioInput>   m_audioInput;
-  QIODevice*                    m_audioInputDevice;
-  QByteArray                    m_audioWriteBuffer;
   QRadioButton*                 m_audioInFromDeviceRadioButton;
   QRadioButton*                 m_audioInFromFileRadioButton;
   QPushButton*                  m_audioInOpenFilePushButton;
-  QAudioDecoder                 m_audioInputDecoder;
+  QCheckBox*                    m_audioInLoopFileCheckBox;
 
   // audio decode format settings
   QGroupBox*                    m_audioEncodeGroupBox;
@@ -118,13 +126,9 @@ private:
   QPushButton*                  m_audioOutMuteButton;
   QProgressBar*                 m_audioOutProgressBar;
   QComboBox*                    m_audioOutSelector;
+  QSpinBox*                     m_audioOutTargetLatencySpinBox;
+  QLabel*                       m_audioOutPlayoutDelayLabel;
   bool                          m_audioOutMute;
-  QScopedPointer<QAudioOutput>  m_audioOutput;
-  QAudioFormat                  m_audioOutputFormat;
-  QIODevice*                    m_audioOutDevice;
-  QByteArray                    m_audioReadBuffer;
-  quint64                       m_audioBytesReceived;
-  quint64                       m_audioReadRateLastReported;
 
   // audio decode format settings
   QGroupBox*                    m_audioDecodeGroupBox;
@@ -141,16 +145,26 @@ private:
   QLabel*                       m_audioDecodeSampleTypeLabel;
   QComboBox*                    m_audioDecodeSampleTypeSelector;
 
+  // statistics
+  QGroupBox*                    m_statisticsGroupBox;
+  QLabel*                       m_statisticsReceiveRateLabel;
+  QLabel*                       m_statisticsSendRateLabel;
+  QLabel*                       m_statisticsSocketBacklogLabel;
+  QLabel*                       m_statisticsOutputBytesFreeLabel;
+  QLabel*                       m_statisticsUnderrunsLabel;
+  QLabel*                       m_statisticsReconnectsLabel;
+  QLabel*                       m_statisticsPlayoutDelayLabel;
+  QPushButton*                  m_statisticsExportButton;
+  QVector<AudioEngineStats>     m_statisticsHistory;
+
   // feedback box
   LogWindow*                    m_logWindow;
   QDialogButtonBox*             m_dialogButtonBox;
 
-  // client socket
-  QSharedPointer<QTcpSocket>    m_socket;
-  QScopedPointer<QFile>         m_pcmOutputFile;
-  QScopedPointer<QThread>       m_socketReader;
-  // QScopedPointer<AudioSource>   m_audioSourceBuffer;
-  QScopedPointer<QBuffer>       m_audioSourceBuffer;
+  // socket and audio devices live on m_audioThread, the GUI only talks to
+  // the engine through queued invocations
+  AudioEngine*                  m_audioEngine;
+  QScopedPointer<QThread>       m_audioThread;
   bool                          m_shouldBeConnected;
 };
 
@@ -0,0 +1,446 @@
+#include "monitorengine.h"
+
+#include <QHostAddress>
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+static const int kReconnectIntervalMillis = 1000;
+static const int kStatusIntervalMillis = 100;
+static const int kLoadReportMillis = 10000;
+static const int kReadBufferSize = 32768;
+static const int kPeriodMillis = 20;
+static const int kPeriodCount = 4;
+static const int kDefaultTargetLatencyMillis = 100;
+
+// stream gains are 8.8 fixed point, the mix bus has room for hundreds of
+// full scale streams at unity before it could overflow
+static const int kGainShift = 8;
+static const qint32 kUnityGain = 1 << kGainShift;
+static const int kMaxGainPercent = 400;
+
+// bus += in * gain, eight samples at a time where the CPU allows it
+static void
+mix_s16(qint32* bus, qint16 const* in, qint16 gain, qint64 count)
+{
+  qint64 i = 0;
+
+#if defined(__SSE2__)
+  __m128i const vgain = _mm_set1_epi16(gain);
+  for (; i + 8 <= count; i += 8)
+  {
+    // full 32 bit products from the low and high halves of the 16 bit ones
+    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+    __m128i lo = _mm_mullo_epi16(v, vgain);
+    __m128i hi = _mm_mulhi_epi16(v, vgain);
+    __m128i a0 = _mm_loadu_si128(reinterpret_cast<__m128i const *>(bus + i));
+    __m128i a1 = _mm_loadu_si128(reinterpret_cast<__m128i const *>(bus + i + 4));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(bus + i), _mm_add_epi32(a0, _mm_unpacklo_epi16(lo, hi)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(bus + i + 4), _mm_add_epi32(a1, _mm_unpackhi_epi16(lo, hi)));
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  for (; i + 8 <= count; i += 8)
+  {
+    int16x8_t v = vld1q_s16(in + i);
+    vst1q_s32(bus + i, vmlal_n_s16(vld1q_s32(bus + i), vget_low_s16(v), gain));
+    vst1q_s32(bus + i + 4, vmlal_n_s16(vld1q_s32(bus + i + 4), vget_high_s16(v), gain));
+  }
+#endif
+
+  for (; i < count; ++i)
+    bus[i] += static_cast<qint32>(in[i]) * gain;
+}
+
+// scale the bus back down and saturate to 16 bit
+static void
+store_s16(qint32 const* bus, qint16* out, qint64 count)
+{
+  qint64 i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i a0 = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const *>(bus + i)), kGainShift);
+    __m128i a1 = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const *>(bus + i + 4)), kGainShift);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packs_epi32(a0, a1));
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  for (; i + 8 <= count; i += 8)
+  {
+    int16x4_t lo = vqshrn_n_s32(vld1q_s32(bus + i), kGainShift);
+    int16x4_t hi = vqshrn_n_s32(vld1q_s32(bus + i + 4), kGainShift);
+    vst1q_s16(out + i, vcombine_s16(lo, hi));
+  }
+#endif
+
+  for (; i < count; ++i)
+    out[i] = static_cast<qint16>(qBound<qint32>(-32768, bus[i] >> kGainShift, 32767));
+}
+
+MonitorStreamStatus::MonitorStreamStatus()
+  : id(0)
+  , peer()
+  , connected(false)
+  , audible(false)
+  , level()
+  , bufferedMillis(0)
+  , bytesReceived(0)
+  , concealmentEvents(0)
+  , reconnects(0)
+{
+}
+
+MonitorEngine::MonitorEngine()
+  : m_streams()
+  , m_format()
+  , m_targetLatencyMillis(kDefaultTargetLatencyMillis)
+  , m_readBuffer(kReadBufferSize, 0)
+
+  , m_audioOutput()
+  , m_audioOutDevice(nullptr)
+  , m_outputDeviceFormat()
+  , m_outputConverter()
+  , m_playoutTimer(nullptr)
+
+  , m_mixBus()
+  , m_streamBuffer()
+  , m_mixBuffer()
+  , m_convertedPlayout()
+  , m_convertedPlayoutBytes(0)
+
+  , m_statusTimer(nullptr)
+  , m_mixClock()
+  , m_mixNanos(0)
+  , m_mixedFrames(0)
+  , m_loadReportClock()
+{
+  qRegisterMetaType<MonitorStatus>();
+  qRegisterMetaType<QAudioFormat>();
+  qRegisterMetaType<QAudioDeviceInfo>();
+
+  // parented so they follow the engine onto the audio thread
+  m_playoutTimer = new QTimer(this);
+  m_playoutTimer->setTimerType(Qt::PreciseTimer);
+  m_playoutTimer->setInterval(kPeriodMillis / 2);
+  connect(m_playoutTimer, SIGNAL(timeout()), this, SLOT(playAudioData()));
+
+  m_statusTimer = new QTimer(this);
+  m_statusTimer->setInterval(kStatusIntervalMillis);
+  connect(m_statusTimer, SIGNAL(timeout()), this, SLOT(publishStatus()));
+}
+
+MonitorEngine::~MonitorEngine()
+{
+  qDeleteAll(m_streams);
+}
+
+void
+MonitorEngine::shutdown()
+{
+  m_playoutTimer->stop();
+  m_statusTimer->stop();
+
+  for (Stream* stream : m_streams)
+  {
+    disconnect(stream->socket, nullptr, this, nullptr);
+    stream->socket->abort();
+    delete stream->socket;
+  }
+  qDeleteAll(m_streams);
+  m_streams.clear();
+
+  if (m_audioOutput)
+    m_audioOutput->stop();
+  m_audioOutput.reset();
+  m_audioOutDevice = nullptr;
+}
+
+MonitorEngine::Stream*
+MonitorEngine::findStream(int id) const
+{
+  for (Stream* stream : m_streams)
+  {
+    if (stream->id == id)
+      return stream;
+  }
+  return nullptr;
+}
+
+void
+MonitorEngine::addStream(int id, QString const& host, quint16 port)
+{
+  if (findStream(id))
+    return;
+
+  Stream* stream = new Stream();
+  stream->id = id;
+  stream->host = host;
+  stream->port = port;
+  stream->gain = kUnityGain;
+  stream->muted = false;
+  stream->solo = false;
+  stream->hasConnected = false;
+  stream->bytesReceived = 0;
+  stream->reconnects = 0;
+  stream->jitterBuffer.setFormat(m_format);
+  stream->jitterBuffer.setTargetLatency(m_targetLatencyMillis);
+
+  stream->socket = new QTcpSocket(this);
+  connect(stream->socket, &QTcpSocket::connected, this, [this, stream]()
+  {
+    if (stream->hasConnected)
+      stream->reconnects++;
+    stream->hasConnected = true;
+    stream->jitterBuffer.reset();
+    emit logMessage(QString("monitor %1: connected to %2:%3").arg(QString::number(stream->id),
+      stream->socket->peerAddress().toString(), QString::number(stream->socket->peerPort())));
+  });
+  connect(stream->socket, &QTcpSocket::readyRead, this, [this, stream]()
+  {
+    onStreamReadyRead(stream);
+  });
+  connect(stream->socket, static_cast<void (QAbstractSocket::*)(QAbstractSocket::SocketError)>(&QAbstractSocket::error),
+    this, [this, stream](QAbstractSocket::SocketError)
+  {
+    onStreamError(stream);
+  });
+
+  m_streams.append(stream);
+  emit logMessage(QString("monitor %1: connecting to %2:%3").arg(QString::number(id), host, QString::number(port)));
+  stream->socket->connectToHost(host, port);
+
+  if (!m_statusTimer->isActive())
+    m_statusTimer->start();
+}
+
+void
+MonitorEngine::removeStream(int id)
+{
+  Stream* stream = findStream(id);
+  if (!stream)
+    return;
+
+  m_streams.removeOne(stream);
+  disconnect(stream->socket, nullptr, this, nullptr);
+  stream->socket->abort();
+  delete stream->socket;
+  delete stream;
+
+  emit logMessage(QString("monitor %1: removed").arg(id));
+}
+
+void
+MonitorEngine::setStreamGain(int id, int percent)
+{
+  if (Stream* stream = findStream(id))
+    stream->gain = (qBound(0, percent, kMaxGainPercent) * kUnityGain) / 100;
+}
+
+void
+MonitorEngine::setStreamMuted(int id, bool muted)
+{
+  if (Stream* stream = findStream(id))
+    stream->muted = muted;
+}
+
+void
+MonitorEngine::setStreamSolo(int id, bool solo)
+{
+  if (Stream* stream = findStream(id))
+    stream->solo = solo;
+}
+
+void
+MonitorEngine::setTargetLatency(int millis)
+{
+  m_targetLatencyMillis = millis;
+  for (Stream* stream : m_streams)
+    stream->jitterBuffer.setTargetLatency(millis);
+}
+
+void
+MonitorEngine::startOutput(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& format)
+{
+  if ((format.sampleSize() != 16) || (format.sampleType() != QAudioFormat::SignedInt)
+    || (format.byteOrder() != QAudioFormat::LittleEndian))
+  {
+    emit logMessage("monitor: only 16 bit signed little endian PCM can be mixed");
+    return;
+  }
+
+  emit logMessage(QString("monitor: output to %1").arg(deviceInfo.deviceName()));
+
+  m_playoutTimer->stop();
+  if (m_audioOutput)
+    m_audioOutput->stop();
+
+  m_format = format;
+  for (Stream* stream : m_streams)
+  {
+    stream->jitterBuffer.setFormat(format);
+    stream->jitterBuffer.setTargetLatency(m_targetLatencyMillis);
+  }
+
+  m_outputDeviceFormat = FormatConverter::negotiateDeviceFormat(deviceInfo, format);
+  if (!m_outputConverter.setFormats(format, m_outputDeviceFormat))
+  {
+    m_outputDeviceFormat = format;
+    m_outputConverter.setFormats(format, format);
+  }
+  m_convertedPlayoutBytes = 0;
+  emit logMessage(QString("monitor: output format %1").arg(m_outputConverter.describe()));
+
+  m_audioOutput.reset(new QAudioOutput(deviceInfo, m_outputDeviceFormat));
+  m_audioOutput->setBufferSize(m_outputDeviceFormat.bytesForDuration(kPeriodMillis * kPeriodCount * 1000));
+  m_audioOutput->setNotifyInterval(kPeriodMillis);
+  m_audioOutDevice = m_audioOutput->start();
+
+  m_mixNanos = 0;
+  m_mixedFrames = 0;
+  m_loadReportClock.start();
+  m_playoutTimer->start();
+  m_statusTimer->start();
+}
+
+void
+MonitorEngine::onStreamReadyRead(Stream* stream)
+{
+  // one read buffer is enough for every stream, they all share a thread
+  qint64 n;
+  while ((n = stream->socket->read(m_readBuffer.data(), m_readBuffer.size())) > 0)
+  {
+    stream->bytesReceived += n;
+    stream->jitterBuffer.push(m_readBuffer.constData(), n);
+  }
+}
+
+void
+MonitorEngine::onStreamError(Stream* stream)
+{
+  emit logMessage(QString("monitor %1: %2").arg(QString::number(stream->id), stream->socket->errorString()));
+
+  // the socket is the context, so a removed stream never reconnects
+  QTcpSocket* socket = stream->socket;
+  QTimer::singleShot(kReconnectIntervalMillis, socket, [socket, stream]()
+  {
+    socket->connectToHost(stream->host, stream->port);
+  });
+}
+
+void
+MonitorEngine::playAudioData()
+{
+  if (!m_audioOutput || !m_audioOutDevice)
+    return;
+
+  qint64 const periodSize = m_audioOutput->periodSize();
+  if (periodSize <= 0)
+    return;
+
+  // mixed in the monitor format, about one device period at a time
+  qint64 const mixFrames = ((periodSize / m_outputDeviceFormat.bytesPerFrame()) * m_format.sampleRate())
+    / m_outputDeviceFormat.sampleRate();
+  qint64 const mixPeriodSize = qMax<qint64>(1, mixFrames) * m_format.bytesPerFrame();
+  if (m_mixBuffer.size() != mixPeriodSize)
+    m_mixBuffer.resize(static_cast<int>(mixPeriodSize));
+
+  qint64 const convertedSize = periodSize + m_outputConverter.maxOutputBytes(mixPeriodSize);
+  if (m_convertedPlayout.size() < convertedSize)
+    m_convertedPlayout.resize(static_cast<int>(convertedSize));
+
+  while (m_audioOutput->bytesFree() >= periodSize)
+  {
+    while (m_convertedPlayoutBytes < periodSize)
+    {
+      mixPeriod(m_mixBuffer.data(), mixPeriodSize);
+      m_convertedPlayoutBytes += m_outputConverter.convert(m_mixBuffer.constData(), mixPeriodSize,
+        m_convertedPlayout.data() + m_convertedPlayoutBytes);
+    }
+
+    m_audioOutDevice->write(m_convertedPlayout.constData(), periodSize);
+    m_convertedPlayoutBytes -= periodSize;
+    memmove(m_convertedPlayout.data(), m_convertedPlayout.constData() + periodSize, m_convertedPlayoutBytes);
+  }
+}
+
+void
+MonitorEngine::mixPeriod(char* data, qint64 len)
+{
+  m_mixClock.start();
+
+  qint64 const samples = len / 2;
+  if (m_mixBus.size() < samples)
+    m_mixBus.resize(static_cast<int>(samples));
+  if (m_streamBuffer.size() < len)
+    m_streamBuffer.resize(static_cast<int>(len));
+
+  qint32* bus = m_mixBus.data();
+  memset(bus, 0, samples * sizeof(qint32));
+
+  bool solo = false;
+  for (Stream const* stream : m_streams)
+    solo = solo || stream->solo;
+
+  for (Stream* stream : m_streams)
+  {
+    if (stream->socket->state() != QAbstractSocket::ConnectedState)
+      continue;
+
+    // every connected stream is pulled each period, audible or not, so its
+    // jitter buffer keeps tracking real time and unmuting is instant
+    qint16 const* pcm = reinterpret_cast<qint16 const *>(m_streamBuffer.constData());
+    stream->jitterBuffer.pull(m_streamBuffer.data(), len);
+    stream->levelMeter.process(pcm, samples);
+
+    bool const audible = solo ? stream->solo : !stream->muted;
+    if (audible && (stream->gain > 0))
+      mix_s16(bus, pcm, static_cast<qint16>(stream->gain), samples);
+  }
+
+  store_s16(bus, reinterpret_cast<qint16 *>(data), samples);
+
+  m_mixNanos += m_mixClock.nsecsElapsed();
+  m_mixedFrames += len / m_format.bytesPerFrame();
+}
+
+void
+MonitorEngine::publishStatus()
+{
+  bool solo = false;
+  for (Stream const* stream : m_streams)
+    solo = solo || stream->solo;
+
+  MonitorStatus status;
+  status.reserve(m_streams.size());
+  for (Stream* stream : m_streams)
+  {
+    MonitorStreamStatus s;
+    s.id = stream->id;
+    s.peer = QString("%1:%2").arg(stream->host, QString::number(stream->port));
+    s.connected = (stream->socket->state() == QAbstractSocket::ConnectedState);
+    s.audible = solo ? stream->solo : !stream->muted;
+    s.level = stream->levelMeter.take();
+    s.bufferedMillis = stream->jitterBuffer.bufferedMillis();
+    s.bytesReceived = stream->bytesReceived;
+    s.concealmentEvents = stream->jitterBuffer.concealmentEvents();
+    s.reconnects = stream->reconnects;
+    status.append(s);
+  }
+  emit statusUpdated(status);
+
+  if (m_loadReportClock.isValid() && m_loadReportClock.hasExpired(kLoadReportMillis) && (m_mixedFrames > 0))
+  {
+    double audioNanos = (m_mixedFrames * 1e9) / m_format.sampleRate();
+    emit logMessage(QString("monitor: mixing %1 streams, %2% of a core, output %3")
+      .arg(QString::number(m_streams.size()), QString::number((100.0 * m_mixNanos) / audioNanos, 'f', 2),
+           m_outputConverter.describe()));
+    m_mixNanos = 0;
+    m_mixedFrames = 0;
+    m_loadReportClock.restart();
+  }
+}
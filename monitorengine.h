@@ -0,0 +1,124 @@
+#ifndef MONITORENGINE_H
+#define MONITORENGINE_H
+
+#include <QObject>
+
+#include <QAudioDeviceInfo>
+#include <QAudioFormat>
+#include <QAudioOutput>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QMetaType>
+#include <QScopedPointer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QVector>
+
+#include "formatconverter.h"
+#include "jitterbuffer.h"
+#include "levelmeter.h"
+
+// What the GUI shows for one monitored camera.
+struct MonitorStreamStatus
+{
+  MonitorStreamStatus();
+
+  int id;
+  QString peer;
+  bool connected;
+  bool audible;
+  LevelMeter::Reading level;
+  int bufferedMillis;
+  quint64 bytesReceived;
+  quint64 concealmentEvents;
+  quint64 reconnects;
+};
+
+typedef QVector<MonitorStreamStatus> MonitorStatus;
+
+Q_DECLARE_METATYPE(MonitorStatus)
+
+// Receive-only sessions to many cameras, mixed into a single output device.
+//
+// Every stream has its own socket and jitter buffer, but they all live on
+// one thread and share one playout timer: each device period every stream
+// is pulled once and the audible ones are accumulated with their gain into
+// a 32 bit mix bus, which is saturated back to 16 bit and converted to the
+// device format. Soloing any stream silences every stream that isn't
+// soloed. All streams share the monitor format, which has to be 16 bit
+// signed little endian PCM.
+class MonitorEngine : public QObject
+{
+  Q_OBJECT
+
+public:
+  MonitorEngine();
+  ~MonitorEngine();
+
+public slots:
+  void addStream(int id, QString const& host, quint16 port);
+  void removeStream(int id);
+  void setStreamGain(int id, int percent);
+  void setStreamMuted(int id, bool muted);
+  void setStreamSolo(int id, bool solo);
+  void startOutput(QAudioDeviceInfo const& deviceInfo, QAudioFormat const& format);
+  void setTargetLatency(int millis);
+  void shutdown();
+
+signals:
+  void logMessage(QString const& message);
+  void statusUpdated(MonitorStatus const& status);
+
+private slots:
+  void playAudioData();
+  void publishStatus();
+
+private:
+  struct Stream
+  {
+    int             id;
+    QString         host;
+    quint16         port;
+    QTcpSocket*     socket;
+    JitterBuffer    jitterBuffer;
+    LevelMeter      levelMeter;
+    qint32          gain;
+    bool            muted;
+    bool            solo;
+    bool            hasConnected;
+    quint64         bytesReceived;
+    quint64         reconnects;
+  };
+
+  Stream* findStream(int id) const;
+  void onStreamReadyRead(Stream* stream);
+  void onStreamError(Stream* stream);
+  void mixPeriod(char* data, qint64 len);
+
+private:
+  QVector<Stream *>             m_streams;
+  QAudioFormat                  m_format;
+  int                           m_targetLatencyMillis;
+  QByteArray                    m_readBuffer;
+
+  QScopedPointer<QAudioOutput>  m_audioOutput;
+  QIODevice*                    m_audioOutDevice;
+  QAudioFormat                  m_outputDeviceFormat;
+  FormatConverter               m_outputConverter;
+  QTimer*                       m_playoutTimer;
+
+  // mix bus and per stream scratch, sized to the largest period seen
+  QVector<qint32>               m_mixBus;
+  QByteArray                    m_streamBuffer;
+  QByteArray                    m_mixBuffer;
+  QByteArray                    m_convertedPlayout;
+  qint64                        m_convertedPlayoutBytes;
+
+  QTimer*                       m_statusTimer;
+  QElapsedTimer                 m_mixClock;
+  qint64                        m_mixNanos;
+  qint64                        m_mixedFrames;
+  QElapsedTimer                 m_loadReportClock;
+};
+
+#endif // MONITORENGINE_H
@@ -0,0 +1,270 @@
+#include "monitorwindow.h"
+#include "mainwindow.h"
+#include "logwindow.h"
+
+#include <QSet>
+
+static const int kDefaultSampleRate = 16000;
+static const int kDefaultChannels = 1;
+static const int kDefaultTargetLatencyMillis = 100;
+static const int kMaxGainPercent = 400;
+static const int kMeterRange = 60;
+
+MonitorWindow::MonitorWindow(QWidget* parent)
+  : QDialog(parent)
+  , m_camerasGroupBox(nullptr)
+  , m_hostsLineEdit(nullptr)
+  , m_addButton(nullptr)
+  , m_streamsScrollArea(nullptr)
+  , m_streamsLayout(nullptr)
+  , m_rows()
+  , m_nextStreamId(0)
+
+  , m_outputGroupBox(nullptr)
+  , m_outputSelector(nullptr)
+  , m_sampleRateInput(nullptr)
+  , m_channelsInput(nullptr)
+  , m_targetLatencySpinBox(nullptr)
+  , m_startOutputButton(nullptr)
+
+  , m_logWindow(nullptr)
+
+  , m_monitorEngine(nullptr)
+  , m_audioThread(new QThread())
+{
+  m_monitorEngine = new MonitorEngine();
+  m_monitorEngine->moveToThread(m_audioThread.data());
+  m_audioThread->setObjectName("monitor");
+  m_audioThread->start(QThread::TimeCriticalPriority);
+
+  connect(m_monitorEngine, &MonitorEngine::statusUpdated, this, &MonitorWindow::onStatusUpdated);
+
+  createCamerasGroupBox();
+  createOutputGroupBox();
+
+  m_logWindow = new LogWindow();
+  connect(m_monitorEngine, &MonitorEngine::logMessage, m_logWindow, &LogWindow::appendMessage,
+    Qt::DirectConnection);
+
+  QVBoxLayout* mainLayout = new QVBoxLayout();
+  mainLayout->addWidget(m_outputGroupBox);
+  mainLayout->addWidget(m_camerasGroupBox, 1);
+  mainLayout->addWidget(m_logWindow);
+  setLayout(mainLayout);
+  setWindowTitle("Camera Monitor");
+
+  startOutputButtonReleased();
+}
+
+MonitorWindow::~MonitorWindow()
+{
+  // sockets and the device have to be torn down on the thread that owns them
+  QMetaObject::invokeMethod(m_monitorEngine, "shutdown", Qt::BlockingQueuedConnection);
+  m_audioThread->quit();
+  m_audioThread->wait();
+  delete m_monitorEngine;
+}
+
+void
+MonitorWindow::createCamerasGroupBox()
+{
+  m_camerasGroupBox = new QGroupBox("Cameras");
+  m_hostsLineEdit = new QLineEdit("10.0.0.245:10001");
+  m_hostsLineEdit->setPlaceholderText("host:port, separate several with spaces or commas");
+  m_addButton = new QPushButton("Add");
+
+  connect(m_addButton, SIGNAL(released()), this, SLOT(addButtonReleased()));
+  connect(m_hostsLineEdit, SIGNAL(returnPressed()), this, SLOT(addButtonReleased()));
+
+  QWidget* streamsWidget = new QWidget();
+  m_streamsLayout = new QGridLayout();
+  m_streamsLayout->addWidget(new QLabel("camera"), 0, 0);
+  m_streamsLayout->addWidget(new QLabel("level"), 0, 1);
+  m_streamsLayout->addWidget(new QLabel("gain"), 0, 2);
+  m_streamsLayout->setColumnStretch(1, 1);
+  m_streamsLayout->setRowStretch(1024, 1);
+  streamsWidget->setLayout(m_streamsLayout);
+
+  m_streamsScrollArea = new QScrollArea();
+  m_streamsScrollArea->setWidgetResizable(true);
+  m_streamsScrollArea->setWidget(streamsWidget);
+
+  QHBoxLayout* addLayout = new QHBoxLayout();
+  addLayout->addWidget(m_hostsLineEdit, 1);
+  addLayout->addWidget(m_addButton);
+
+  QVBoxLayout* layout = new QVBoxLayout();
+  layout->addLayout(addLayout);
+  layout->addWidget(m_streamsScrollArea, 1);
+  m_camerasGroupBox->setLayout(layout);
+}
+
+void
+MonitorWindow::createOutputGroupBox()
+{
+  m_outputGroupBox = new QGroupBox("Output");
+  m_outputSelector = new QComboBox();
+  m_sampleRateInput = new QLineEdit(QString::number(kDefaultSampleRate));
+  m_channelsInput = new QLineEdit(QString::number(kDefaultChannels));
+  m_targetLatencySpinBox = new QSpinBox();
+  m_targetLatencySpinBox->setRange(10, 2000);
+  m_targetLatencySpinBox->setSingleStep(10);
+  m_targetLatencySpinBox->setSuffix(" ms");
+  m_targetLatencySpinBox->setPrefix("target latency: ");
+  m_targetLatencySpinBox->setValue(kDefaultTargetLatencyMillis);
+  m_startOutputButton = new QPushButton("Apply");
+  QMetaObject::invokeMethod(m_monitorEngine, "setTargetLatency", Q_ARG(int, kDefaultTargetLatencyMillis));
+
+  QSet<QString> set;
+  QAudioDeviceInfo const& defaultDeviceInfo = QAudioDeviceInfo::defaultOutputDevice();
+  m_outputSelector->addItem(defaultDeviceInfo.deviceName(), qVariantFromValue(defaultDeviceInfo));
+  for (auto& deviceInfo : QAudioDeviceInfo::availableDevices(QAudio::AudioOutput))
+  {
+    if ((deviceInfo != defaultDeviceInfo) && !set.contains(deviceInfo.deviceName()))
+    {
+      m_outputSelector->addItem(deviceInfo.deviceName(), qVariantFromValue(deviceInfo));
+      set.insert(deviceInfo.deviceName());
+    }
+  }
+
+  connect(m_startOutputButton, SIGNAL(released()), this, SLOT(startOutputButtonReleased()));
+  connect(m_targetLatencySpinBox, static_cast<void (QSpinBox::*)(int)>(&QSpinBox::valueChanged), [this](int value)
+  {
+    QMetaObject::invokeMethod(m_monitorEngine, "setTargetLatency", Q_ARG(int, value));
+  });
+
+  QHBoxLayout* layout = new QHBoxLayout();
+  layout->addWidget(m_outputSelector, 1);
+  layout->addWidget(new QLabel("rate"));
+  layout->addWidget(m_sampleRateInput);
+  layout->addWidget(new QLabel("channels"));
+  layout->addWidget(m_channelsInput);
+  layout->addWidget(m_targetLatencySpinBox);
+  layout->addWidget(m_startOutputButton);
+  m_outputGroupBox->setLayout(layout);
+}
+
+QAudioFormat
+MonitorWindow::getMonitorFormat() const
+{
+  // the mix bus only handles 16 bit signed PCM, the rest is up to the user
+  QAudioFormat format;
+  format.setSampleRate(m_sampleRateInput->text().toInt());
+  format.setChannelCount(m_channelsInput->text().toInt());
+  format.setSampleSize(16);
+  format.setCodec("audio/pcm");
+  format.setByteOrder(QAudioFormat::LittleEndian);
+  format.setSampleType(QAudioFormat::SignedInt);
+  return format;
+}
+
+void
+MonitorWindow::startOutputButtonReleased()
+{
+  QAudioDeviceInfo deviceInfo = m_outputSelector->currentData().value<QAudioDeviceInfo>();
+  QMetaObject::invokeMethod(m_monitorEngine, "startOutput",
+    Q_ARG(QAudioDeviceInfo, deviceInfo), Q_ARG(QAudioFormat, getMonitorFormat()));
+}
+
+void
+MonitorWindow::addButtonReleased()
+{
+  QStringList hosts = m_hostsLineEdit->text().split(QRegExp("[\\s,]+"), QString::SkipEmptyParts);
+  for (QString const& host : hosts)
+  {
+    QStringList hostPort = host.split(':');
+    quint16 port = static_cast<quint16>(hostPort.value(1).toUInt());
+    if (hostPort.value(0).isEmpty() || (port == 0))
+    {
+      m_logWindow->appendMessage(QString("monitor: ignoring '%1', expected host:port").arg(host));
+      continue;
+    }
+
+    int id = m_nextStreamId++;
+    addStreamRow(id, hostPort.value(0), port);
+    QMetaObject::invokeMethod(m_monitorEngine, "addStream", Q_ARG(int, id),
+      Q_ARG(QString, hostPort.value(0)), Q_ARG(quint16, port));
+  }
+}
+
+void
+MonitorWindow::addStreamRow(int id, QString const& host, quint16 port)
+{
+  Row row;
+  row.peerLabel = new QLabel(QString("%1:%2").arg(host, QString::number(port)));
+  row.levelBar = new QProgressBar();
+  row.levelBar->setRange(0, kMeterRange);
+  row.levelBar->setTextVisible(true);
+  row.gainSlider = new QSlider(Qt::Horizontal);
+  row.gainSlider->setRange(0, kMaxGainPercent);
+  row.gainSlider->setValue(100);
+  row.gainSlider->setToolTip("gain in percent");
+  row.muteCheckBox = new QCheckBox("Mute");
+  row.soloCheckBox = new QCheckBox("Solo");
+  row.statusLabel = new QLabel("connecting");
+  row.removeButton = new QPushButton("Remove");
+
+  connect(row.gainSlider, &QSlider::valueChanged, [this, id](int value)
+  {
+    QMetaObject::invokeMethod(m_monitorEngine, "setStreamGain", Q_ARG(int, id), Q_ARG(int, value));
+  });
+  connect(row.muteCheckBox, &QCheckBox::toggled, [this, id](bool checked)
+  {
+    QMetaObject::invokeMethod(m_monitorEngine, "setStreamMuted", Q_ARG(int, id), Q_ARG(bool, checked));
+  });
+  connect(row.soloCheckBox, &QCheckBox::toggled, [this, id](bool checked)
+  {
+    QMetaObject::invokeMethod(m_monitorEngine, "setStreamSolo", Q_ARG(int, id), Q_ARG(bool, checked));
+  });
+  connect(row.removeButton, &QPushButton::released, [this, id]()
+  {
+    QMetaObject::invokeMethod(m_monitorEngine, "removeStream", Q_ARG(int, id));
+    removeStreamRow(id);
+  });
+
+  // the header takes row 0
+  int const r = id + 1;
+  m_streamsLayout->addWidget(row.peerLabel, r, 0);
+  m_streamsLayout->addWidget(row.levelBar, r, 1);
+  m_streamsLayout->addWidget(row.gainSlider, r, 2);
+  m_streamsLayout->addWidget(row.muteCheckBox, r, 3);
+  m_streamsLayout->addWidget(row.soloCheckBox, r, 4);
+  m_streamsLayout->addWidget(row.statusLabel, r, 5);
+  m_streamsLayout->addWidget(row.removeButton, r, 6);
+  m_rows.insert(id, row);
+}
+
+void
+MonitorWindow::removeStreamRow(int id)
+{
+  if (!m_rows.contains(id))
+    return;
+
+  Row row = m_rows.take(id);
+  for (QWidget* widget : { static_cast<QWidget *>(row.peerLabel), static_cast<QWidget *>(row.levelBar),
+    static_cast<QWidget *>(row.gainSlider), static_cast<QWidget *>(row.muteCheckBox),
+    static_cast<QWidget *>(row.soloCheckBox), static_cast<QWidget *>(row.statusLabel),
+    static_cast<QWidget *>(row.removeButton) })
+  {
+    m_streamsLayout->removeWidget(widget);
+    widget->deleteLater();
+  }
+}
+
+void
+MonitorWindow::onStatusUpdated(MonitorStatus const& status)
+{
+  for (MonitorStreamStatus const& s : status)
+  {
+    auto it = m_rows.find(s.id);
+    if (it == m_rows.end())
+      continue;
+
+    updateLevelMeter(it->levelBar, s.level);
+    it->levelBar->setEnabled(s.audible);
+    it->statusLabel->setText(s.connected
+      ? QString("%1 ms, %2 glitches, %3 reconnects").arg(QString::number(s.bufferedMillis),
+          QString::number(s.concealmentEvents), QString::number(s.reconnects))
+      : QString("disconnected"));
+  }
+}
@@ -0,0 +1,73 @@
+#ifndef MONITORWINDOW_H
+#define MONITORWINDOW_H
+
+#include <QtWidgets>
+
+#include <QAudioDeviceInfo>
+#include <QAudioFormat>
+#include <QMap>
+#include <QScopedPointer>
+
+#include "monitorengine.h"
+
+class LogWindow;
+
+// Multi-camera monitoring: one row per camera with level, gain, mute and
+// solo, all mixed by a single MonitorEngine into one output device.
+class MonitorWindow : public QDialog
+{
+  Q_OBJECT
+
+public:
+  explicit MonitorWindow(QWidget* parent = nullptr);
+  ~MonitorWindow();
+
+private:
+  struct Row
+  {
+    QLabel*         peerLabel;
+    QProgressBar*   levelBar;
+    QSlider*        gainSlider;
+    QCheckBox*      muteCheckBox;
+    QCheckBox*      soloCheckBox;
+    QLabel*         statusLabel;
+    QPushButton*    removeButton;
+  };
+
+  void createCamerasGroupBox();
+  void createOutputGroupBox();
+  void addStreamRow(int id, QString const& host, quint16 port);
+  void removeStreamRow(int id);
+  QAudioFormat getMonitorFormat() const;
+
+private slots:
+  void addButtonReleased();
+  void startOutputButtonReleased();
+  void onStatusUpdated(MonitorStatus const& status);
+
+private:
+  // cameras
+  QGroupBox*                    m_camerasGroupBox;
+  QLineEdit*                    m_hostsLineEdit;
+  QPushButton*                  m_addButton;
+  QScrollArea*                  m_streamsScrollArea;
+  QGridLayout*                  m_streamsLayout;
+  QMap<int, Row>                m_rows;
+  int                           m_nextStreamId;
+
+  // output
+  QGroupBox*                    m_outputGroupBox;
+  QComboBox*                    m_outputSelector;
+  QLineEdit*                    m_sampleRateInput;
+  QLineEdit*                    m_channelsInput;
+  QSpinBox*                     m_targetLatencySpinBox;
+  QPushButton*                  m_startOutputButton;
+
+  LogWindow*                    m_logWindow;
+
+  // every stream lives on m_audioThread, mixed by one engine
+  MonitorEngine*                m_monitorEngine;
+  QScopedPointer<QThread>       m_audioThread;
+};
+
+#endif // MONITORWINDOW_H
@@ -0,0 +1,296 @@
+#ifndef PLC_H
+#define PLC_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+// Packet loss concealment for 16 bit PCM, shared by xaudio's playback and
+// the client's jitter buffer.
+//
+// Everything played goes through xaudio_plc_good, or comes out of
+// xaudio_plc_conceal when audio is missing. That extrapolates it from what
+// was played by waveform similarity, along the lines of G.711 Appendix I:
+// the pitch period is the lag at which the last few milliseconds best
+// match themselves, and the last period is repeated with its ends
+// overlap-added so the repetition doesn't click. After 10ms one period
+// starts to sound buzzy, so two and then three periods are repeated. The
+// result fades by a fifth every 10ms after the first 10ms, and is silence
+// from 60ms on. The first good audio after a loss is cross-faded from the
+// extrapolation, longer the longer the loss was. Up to
+// XAUDIO_PLC_MAX_CHANNELS interleaved channels.
+
+enum
+{
+  XAUDIO_PLC_MAX_CHANNELS = 16,
+  XAUDIO_PLC_MAX_CYCLES = 3,
+  XAUDIO_PLC_MIN_PITCH_HZ = 50,
+  XAUDIO_PLC_MAX_PITCH_HZ = 400
+};
+
+struct xaudio_plc
+{
+  uint32_t sample_rate;
+  int channels;
+  int min_pitch;
+  int max_pitch;
+
+  // the newest history_frames played, interleaved, oldest first, and how
+  // much of it was really played yet
+  std::vector<int16_t> history;
+  int history_frames;
+  int filled;
+  bool primed;
+
+  // the history when the loss began, what the extrapolation repeats
+  std::vector<int16_t> pitch_buffer;
+
+  // the loss being concealed: frames so far, pitch, how many periods are
+  // repeated and where in them the next frame comes from
+  int concealed;
+  int pitch;
+  int cycles;
+  int pos;
+  int fade_from;
+  int fade_left;
+
+  // frames of the cross-fade back to real audio and how many are done
+  int merge;
+  int merged;
+};
+
+static inline void
+xaudio_plc_reset(xaudio_plc* p)
+{
+  p->history.assign(static_cast<size_t>(p->history_frames) * p->channels, 0);
+  p->filled = 0;
+  p->primed = false;
+  p->concealed = 0;
+  p->merge = 0;
+}
+
+static inline void
+xaudio_plc_init(xaudio_plc* p, uint32_t sample_rate, int channels)
+{
+  p->sample_rate = sample_rate;
+  p->channels = channels;
+  p->min_pitch = sample_rate / XAUDIO_PLC_MAX_PITCH_HZ;
+  p->max_pitch = sample_rate / XAUDIO_PLC_MIN_PITCH_HZ;
+
+  // every period repeated and a quarter of one more for the overlap
+  p->history_frames = (XAUDIO_PLC_MAX_CYCLES * p->max_pitch) + (p->max_pitch / 4) + 1;
+  p->pitch_buffer.resize(static_cast<size_t>(p->history_frames) * channels);
+  xaudio_plc_reset(p);
+}
+
+// how alike the last window frames are to the ones lag earlier, every
+// step-th frame of the first channel
+static inline double
+xaudio_plc_match(xaudio_plc const* p, int lag, int window, int step)
+{
+  int const end = p->history_frames;
+  int16_t const* h = &p->history[0];
+  double cross = 0;
+  double energy = 0;
+  for (int i = end - window; i < end; i += step)
+  {
+    double const a = h[i * p->channels];
+    double const b = h[(i - lag) * p->channels];
+    cross += a * b;
+    energy += b * b;
+  }
+  return (energy > 0) ? (cross / sqrt(energy)) : 0;
+}
+
+// the lag in [min_pitch, max_pitch] at which the last max_pitch / 4 frames
+// are most like the frames that far back
+static inline int
+xaudio_plc_find_pitch(xaudio_plc const* p)
+{
+  int const window = p->max_pitch / 4;
+
+  // searched at about 8kHz first, then to the frame around the best lag
+  int const step = (p->sample_rate > 8000) ? static_cast<int>(p->sample_rate / 8000) : 1;
+
+  double best = -1;
+  int best_lag = p->max_pitch;
+  for (int lag = p->min_pitch; lag <= p->max_pitch; lag += step)
+  {
+    double const score = xaudio_plc_match(p, lag, window, step);
+    if (score > best)
+    {
+      best = score;
+      best_lag = lag;
+    }
+  }
+
+  int const coarse = best_lag;
+  best = -1;
+  for (int lag = std::max(p->min_pitch, coarse - step); lag <= std::min(p->max_pitch, coarse + step); ++lag)
+  {
+    double const score = xaudio_plc_match(p, lag, window, 1);
+    if (score > best)
+    {
+      best = score;
+      best_lag = lag;
+    }
+  }
+  return best_lag;
+}
+
+// frame pos of the last cycles periods repeated, with the last quarter
+// period of them blending into the quarter period before the first
+static inline int16_t
+xaudio_plc_sample(xaudio_plc const* p, int cycles, int pos, int channel)
+{
+  int const length = cycles * p->pitch;
+  int const overlap = (p->pitch / 4) + 1;
+  int const idx = pos % length;
+  int const base = p->history_frames - length;
+  int16_t const* h = &p->pitch_buffer[0];
+
+  int32_t v = h[((base + idx) * p->channels) + channel];
+  if (idx >= (length - overlap))
+  {
+    int32_t const w = idx - (length - overlap) + 1;
+    int32_t const before = h[((base + idx - length) * p->channels) + channel];
+    v = ((v * (overlap + 1 - w)) + (before * w)) / (overlap + 1);
+  }
+  return static_cast<int16_t>(v);
+}
+
+// the next frame of the extrapolation into out, and the loss one frame
+// longer
+static inline void
+xaudio_plc_next(xaudio_plc* p, int16_t* out)
+{
+  int const ten_ms = p->sample_rate / 100;
+  if (p->concealed == 0)
+  {
+    p->pitch = xaudio_plc_find_pitch(p);
+    p->pitch_buffer = p->history;
+    p->cycles = 1;
+    p->pos = 0;
+    p->fade_left = 0;
+  }
+  else if (((p->concealed % ten_ms) == 0) && (p->cycles < XAUDIO_PLC_MAX_CYCLES))
+  {
+    // more periods from here on, blended in over a quarter period
+    p->fade_from = p->cycles;
+    p->cycles++;
+    p->fade_left = (p->pitch / 4) + 1;
+  }
+
+  // unity for 10ms, then a fifth less every 10ms
+  int32_t gain = 256;
+  if (p->concealed > ten_ms)
+    gain = std::max(0, 256 - ((256 * (p->concealed - ten_ms)) / (5 * ten_ms)));
+
+  for (int c = 0; c < p->channels; ++c)
+  {
+    int32_t v = xaudio_plc_sample(p, p->cycles, p->pos, c);
+    if (p->fade_left > 0)
+    {
+      int32_t const span = (p->pitch / 4) + 1;
+      int32_t const old = xaudio_plc_sample(p, p->fade_from, p->pos, c);
+      v = ((v * (span - p->fade_left)) + (old * p->fade_left)) / span;
+    }
+    out[c] = static_cast<int16_t>((v * gain) / 256);
+  }
+  if (p->fade_left > 0)
+    p->fade_left--;
+  p->pos++;
+  p->concealed++;
+}
+
+// what was just played onto the end of the history
+static inline void
+xaudio_plc_keep(xaudio_plc* p, int16_t const* pcm, int frames)
+{
+  int const channels = p->channels;
+  int const keep = std::min(frames, p->history_frames);
+  int const shift = p->history_frames - keep;
+  int16_t* h = &p->history[0];
+  memmove(h, h + (keep * channels), static_cast<size_t>(shift) * channels * 2);
+  memcpy(h + (shift * channels), pcm + ((frames - keep) * channels), static_cast<size_t>(keep) * channels * 2);
+}
+
+// Whether the loss has gone on long enough that the extrapolation is only
+// silence.
+static inline bool
+xaudio_plc_faded(xaudio_plc const* p)
+{
+  return p->concealed >= static_cast<int>((6 * p->sample_rate) / 100);
+}
+
+// Fills frames of pcm where audio is missing. Silence until 40ms were
+// played.
+static inline void
+xaudio_plc_conceal(xaudio_plc* p, int16_t* pcm, int frames)
+{
+  if (!p->primed)
+  {
+    memset(pcm, 0, static_cast<size_t>(frames) * p->channels * 2);
+    return;
+  }
+
+  // lost again before the cross-fade was done, extrapolated afresh from
+  // what that played
+  if (p->merge > 0)
+  {
+    p->merge = 0;
+    p->concealed = 0;
+  }
+  for (int i = 0; i < frames; ++i)
+    xaudio_plc_next(p, pcm + (i * p->channels));
+  xaudio_plc_keep(p, pcm, frames);
+}
+
+// Audio about to be played, cross-faded in place from the extrapolation if
+// it ends a loss, then kept as history. The cross-fade carries on over as
+// many calls as it takes.
+static inline void
+xaudio_plc_good(xaudio_plc* p, int16_t* pcm, int frames)
+{
+  int const channels = p->channels;
+  if ((p->concealed > 0) && (p->merge == 0))
+  {
+    // 4ms, and 4ms more for each 10ms lost, up to 10ms
+    int const ten_ms = p->sample_rate / 100;
+    p->merge = std::min(((4 * ten_ms) / 10) + ((4 * ten_ms * (p->concealed / ten_ms)) / 10), ten_ms);
+    p->merged = 0;
+  }
+
+  if (p->merge > 0)
+  {
+    int const n = std::min(p->merge - p->merged, frames);
+    int16_t frame[XAUDIO_PLC_MAX_CHANNELS];
+    for (int i = 0; i < n; ++i)
+    {
+      int32_t const w = p->merged + i + 1;
+      xaudio_plc_next(p, frame);
+      for (int c = 0; c < channels; ++c)
+      {
+        int32_t const real = pcm[(i * channels) + c];
+        pcm[(i * channels) + c] = static_cast<int16_t>(((real * w) + (frame[c] * (p->merge + 1 - w))) / (p->merge + 1));
+      }
+    }
+    p->merged += n;
+    if (p->merged == p->merge)
+    {
+      p->merge = 0;
+      p->concealed = 0;
+    }
+  }
+
+  xaudio_plc_keep(p, pcm, frames);
+
+  // enough to find the longest pitch in
+  p->filled = std::min(p->filled + frames, p->history_frames);
+  p->primed = (p->filled >= (2 * p->max_pitch));
+}
+
+#endif // PLC_H
@@ -0,0 +1,243 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Optional handshake in front of the raw PCM streams, shared by xaudio and
+// the clients.
+//
+// A client that wants session resume starts the connection with a client
+// hello. xaudio answers with a server hello, after which both directions
+// are raw PCM exactly as before. A client that sends no hello gets the
+// legacy behaviour, and a client that receives no hello (an older xaudio)
+// treats whatever arrives as audio.
+//
+// To resume, the client presents the token of its previous session and
+// how many capture bytes it received in it. If that session was dropped
+// recently, xaudio carries on from there out of its capture ring. It skips
+// ahead, keeping the byte phase, when too much has piled up in the
+// meantime. The server hello carries the offset the stream continues at,
+// so the client can tell whether anything was skipped.
+//
+// A client can also ask for the capture in another format by setting
+// XAUDIO_HELLO_FORMAT and following its hello with a format. xaudio then
+// sets XAUDIO_FLAG_FORMAT in its reply and follows it with the format it
+// actually sends, which is the capture format if the request can't be met.
+//
+// With XAUDIO_HELLO_DTX a client offers to take the capture stream framed.
+// If xaudio sets XAUDIO_FLAG_DTX, every chunk it sends starts with a 4 byte
+// frame header. PCM frames carry that many bytes of audio. While the room
+// is silent it sends comfort noise frames instead, which carry no audio,
+// only how many frames of noise to play and at what level. Offsets in the
+// hello still count audio bytes, a noise frame counting as the PCM it
+// stands in for.
+//
+// A client taking the framed stream can also set XAUDIO_HELLO_ADAPT to let
+// xaudio step its stream down to cheaper formats while its link can't keep
+// up, and back up once it recovers. If xaudio sets XAUDIO_FLAG_ADAPT, a
+// format frame, carrying the new format as its XAUDIO_FORMAT_SIZE bytes,
+// comes right before the first audio in another format. A session that
+// changed format can't be resumed. If it took the capture format, the same
+// frame also comes when the capture is switched to another one at runtime;
+// a session that asked for a format keeps it.
+//
+// A client that sets XAUDIO_HELLO_REPLAY, and follows its hello (and
+// format, if any) with a replay request, gets the server's archive from
+// that wall clock time instead of the live capture, at speed_percent of
+// real time or as fast as it can take it with 0. xaudio sets
+// XAUDIO_FLAG_REPLAY and follows its reply with the request as granted,
+// from_ms being the time of the first period sent, 0 if there's nothing to
+// replay. A replay is raw PCM in the capture format, not resumable, and
+// the server closes the connection when it reaches the live edge.
+//
+// All fields are little endian.
+
+#define XAUDIO_HELLO_MAGIC "XAU1"
+#define XAUDIO_PROTOCOL_VERSION 1
+
+enum
+{
+  XAUDIO_HELLO_SIZE = 24,
+  XAUDIO_HELLO_MAGIC_SIZE = 4,
+  XAUDIO_FORMAT_SIZE = 8,
+  XAUDIO_DTX_HEADER_SIZE = 4,
+  XAUDIO_REPLAY_SIZE = 16
+};
+
+// the client's version lives in the low 16 bits, flags above
+enum
+{
+  XAUDIO_VERSION_MASK = 0xffff,
+  XAUDIO_HELLO_FORMAT = 0x10000,
+  XAUDIO_HELLO_DTX = 0x20000,
+  XAUDIO_HELLO_REPLAY = 0x40000,
+  XAUDIO_HELLO_ADAPT = 0x80000
+};
+
+// server hello flags
+enum
+{
+  XAUDIO_FLAG_RESUMED = 0x1,
+  XAUDIO_FLAG_FORMAT = 0x2,
+  XAUDIO_FLAG_DTX = 0x4,
+  XAUDIO_FLAG_REPLAY = 0x8,
+  XAUDIO_FLAG_ADAPT = 0x10
+};
+
+enum
+{
+  XAUDIO_S16LE = 1,
+  XAUDIO_F32LE = 2
+};
+
+// rate, channels and one of the sample formats above, then 2 reserved bytes
+struct xaudio_format
+{
+  uint32_t sample_rate;
+  uint8_t channels;
+  uint8_t sample_format;
+};
+
+enum
+{
+  XAUDIO_DTX_PCM = 0,
+  XAUDIO_DTX_NOISE = 1,
+  XAUDIO_DTX_FORMAT = 2
+};
+
+// type, then for noise its level in -dBFS, then the number of PCM bytes or
+// noise frames that follow, or for a format frame the size of the format
+struct xaudio_dtx_header
+{
+  uint8_t type;
+  uint8_t level;
+  uint16_t length;
+};
+
+// unix time in milliseconds, the speed, then 4 reserved bytes
+struct xaudio_replay
+{
+  int64_t from_ms;
+  uint32_t speed_percent;
+};
+
+// client: magic, version, token (0 for a new session), bytes received
+// server: magic, flags, token, offset the capture stream continues at
+struct xaudio_hello
+{
+  uint32_t version_or_flags;
+  uint64_t session_token;
+  uint64_t offset;
+};
+
+static inline void
+xaudio_put_le(uint8_t* p, uint64_t v, int bytes)
+{
+  for (int i = 0; i < bytes; ++i)
+    p[i] = static_cast<uint8_t>(v >> (8 * i));
+}
+
+static inline uint64_t
+xaudio_get_le(uint8_t const* p, int bytes)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; ++i)
+    v |= static_cast<uint64_t>(p[i]) << (8 * i);
+  return v;
+}
+
+static inline void
+xaudio_encode_hello(xaudio_hello const& hello, uint8_t* buff)
+{
+  memcpy(buff, XAUDIO_HELLO_MAGIC, XAUDIO_HELLO_MAGIC_SIZE);
+  xaudio_put_le(buff + 4, hello.version_or_flags, 4);
+  xaudio_put_le(buff + 8, hello.session_token, 8);
+  xaudio_put_le(buff + 16, hello.offset, 8);
+}
+
+// false as soon as the first len bytes of buff stop matching the magic,
+// which means the peer doesn't speak the handshake
+static inline bool
+xaudio_is_hello_prefix(uint8_t const* buff, int len)
+{
+  int n = (len < XAUDIO_HELLO_MAGIC_SIZE) ? len : XAUDIO_HELLO_MAGIC_SIZE;
+  return memcmp(buff, XAUDIO_HELLO_MAGIC, n) == 0;
+}
+
+static inline void
+xaudio_decode_hello(uint8_t const* buff, xaudio_hello* hello)
+{
+  hello->version_or_flags = static_cast<uint32_t>(xaudio_get_le(buff + 4, 4));
+  hello->session_token = xaudio_get_le(buff + 8, 8);
+  hello->offset = xaudio_get_le(buff + 16, 8);
+}
+
+static inline void
+xaudio_encode_format(xaudio_format const& format, uint8_t* buff)
+{
+  xaudio_put_le(buff, format.sample_rate, 4);
+  buff[4] = format.channels;
+  buff[5] = format.sample_format;
+  buff[6] = 0;
+  buff[7] = 0;
+}
+
+static inline void
+xaudio_decode_format(uint8_t const* buff, xaudio_format* format)
+{
+  format->sample_rate = static_cast<uint32_t>(xaudio_get_le(buff, 4));
+  format->channels = buff[4];
+  format->sample_format = buff[5];
+}
+
+static inline bool
+xaudio_format_equal(xaudio_format const& a, xaudio_format const& b)
+{
+  return (a.sample_rate == b.sample_rate) && (a.channels == b.channels) && (a.sample_format == b.sample_format);
+}
+
+static inline void
+xaudio_encode_dtx_header(xaudio_dtx_header const& header, uint8_t* buff)
+{
+  buff[0] = header.type;
+  buff[1] = header.level;
+  xaudio_put_le(buff + 2, header.length, 2);
+}
+
+static inline void
+xaudio_decode_dtx_header(uint8_t const* buff, xaudio_dtx_header* header)
+{
+  header->type = buff[0];
+  header->level = buff[1];
+  header->length = static_cast<uint16_t>(xaudio_get_le(buff + 2, 2));
+}
+
+static inline void
+xaudio_encode_replay(xaudio_replay const& replay, uint8_t* buff)
+{
+  xaudio_put_le(buff, static_cast<uint64_t>(replay.from_ms), 8);
+  xaudio_put_le(buff + 8, replay.speed_percent, 4);
+  xaudio_put_le(buff + 12, 0, 4);
+}
+
+static inline void
+xaudio_decode_replay(uint8_t const* buff, xaudio_replay* replay)
+{
+  replay->from_ms = static_cast<int64_t>(xaudio_get_le(buff, 8));
+  replay->speed_percent = static_cast<uint32_t>(xaudio_get_le(buff + 8, 4));
+}
+
+// the whole client hello, once its first XAUDIO_HELLO_SIZE bytes are in
+static inline int
+xaudio_client_hello_size(uint8_t const* buff, int len)
+{
+  if (len < XAUDIO_HELLO_SIZE)
+    return XAUDIO_HELLO_SIZE;
+
+  uint64_t const flags = xaudio_get_le(buff + 4, 4);
+  return XAUDIO_HELLO_SIZE + ((flags & XAUDIO_HELLO_FORMAT) ? XAUDIO_FORMAT_SIZE : 0)
+    + ((flags & XAUDIO_HELLO_REPLAY) ? XAUDIO_REPLAY_SIZE : 0);
+}
+
+#endif // PROTOCOL_H
@@ -0,0 +1,556 @@
+#ifndef AEC_H
+#define AEC_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "simd.h"
+
+// Acoustic echo cancellation of the 16 bit mono capture, one period at a
+// time, with what was played as the reference.
+//
+// The echo path is modelled by a partitioned block frequency domain
+// adaptive filter: the tail is cut into partitions one period long, each
+// with its own weights per frequency bin, and the echo estimate is the sum
+// of every partition's weights times the spectrum of the reference that
+// many periods ago. The estimate is taken off the capture and the residue
+// adapts the weights, normalized by the reference power in each bin. One
+// partition a period is constrained back to a linear convolution.
+//
+// Near end speech in the residue would drag the weights away from the
+// echo path. The step is scaled by how much of the residue is echo the
+// filter still misses, and only a background copy of the weights adapts:
+// the foreground copy, the one that cancels, takes them when they clearly
+// do better and gives them back when they clearly do worse, so a burst of
+// double talk costs the background a detour, not the capture its echo
+// cancellation.
+//
+// The FFT butterflies and the per bin kernels run four floats at a time,
+// see simd.h. Spectra are stored as separate real and imaginary arrays so
+// every kernel is a straight vector loop.
+
+static const float kAecMu = 0.5f;
+static const float kAecMinRate = 0.001f;
+static const float kAecSwapMargin = 0.1f;
+static const float kAecLeakSmoothing = 0.01f;
+static const float kAecPowerSmoothing = 0.1f;
+static const float kAecRegularization = 1e-3f;
+
+// quieter references don't adapt the filter, about -60dBFS
+static const float kAecMinReferenceRms = 1e-3f;
+
+// Real FFT of 2n points through a complex one of n, n a power of two and
+// at least 4. Spectra have n + 1 bins.
+struct aec_fft
+{
+  int n;
+  std::vector<int> rev;
+  // twiddles of the stage with butterflies h apart start at h - 1
+  std::vector<float> tw_re;
+  std::vector<float> tw_im;
+  // e^(-i pi k / n) for splitting the real spectrum
+  std::vector<float> split_re;
+  std::vector<float> split_im;
+  std::vector<float> z_re;
+  std::vector<float> z_im;
+};
+
+static inline void
+aec_fft_init(aec_fft* f, int n)
+{
+  f->n = n;
+  int bits = 0;
+  while ((1 << bits) < n)
+    bits++;
+
+  f->rev.resize(n);
+  for (int i = 0; i < n; ++i)
+  {
+    int r = 0;
+    for (int b = 0; b < bits; ++b)
+      r |= ((i >> b) & 1) << (bits - 1 - b);
+    f->rev[i] = r;
+  }
+
+  f->tw_re.resize(n);
+  f->tw_im.resize(n);
+  for (int h = 1; h < n; h <<= 1)
+  {
+    for (int j = 0; j < h; ++j)
+    {
+      f->tw_re[h - 1 + j] = static_cast<float>(cos(-M_PI * j / h));
+      f->tw_im[h - 1 + j] = static_cast<float>(sin(-M_PI * j / h));
+    }
+  }
+
+  f->split_re.resize(n + 1);
+  f->split_im.resize(n + 1);
+  for (int k = 0; k <= n; ++k)
+  {
+    f->split_re[k] = static_cast<float>(cos(-M_PI * k / n));
+    f->split_im[k] = static_cast<float>(sin(-M_PI * k / n));
+  }
+  f->z_re.resize(n);
+  f->z_im.resize(n);
+}
+
+// in place on z, already in bit reversed order
+static inline void
+aec_fft_complex(aec_fft const* f, float* re, float* im)
+{
+  int const n = f->n;
+  for (int i = 0; i < n; i += 2)
+  {
+    float const ar = re[i];
+    float const ai = im[i];
+    re[i] = ar + re[i + 1];
+    im[i] = ai + im[i + 1];
+    re[i + 1] = ar - re[i + 1];
+    im[i + 1] = ai - im[i + 1];
+  }
+  for (int i = 0; i < n; i += 4)
+  {
+    // the second butterfly's twiddle is -i
+    float const ar = re[i];
+    float const ai = im[i];
+    re[i] = ar + re[i + 2];
+    im[i] = ai + im[i + 2];
+    re[i + 2] = ar - re[i + 2];
+    im[i + 2] = ai - im[i + 2];
+
+    float const br = re[i + 1];
+    float const bi = im[i + 1];
+    float const tr = im[i + 3];
+    float const ti = -re[i + 3];
+    re[i + 1] = br + tr;
+    im[i + 1] = bi + ti;
+    re[i + 3] = br - tr;
+    im[i + 3] = bi - ti;
+  }
+
+  for (int h = 4; h < n; h <<= 1)
+  {
+    float const* wr = &f->tw_re[h - 1];
+    float const* wi = &f->tw_im[h - 1];
+    for (int start = 0; start < n; start += 2 * h)
+    {
+      float* ar = re + start;
+      float* ai = im + start;
+      float* br = ar + h;
+      float* bi = ai + h;
+      for (int j = 0; j < h; j += 4)
+      {
+        simd_v4 const xr = simd_load(br + j);
+        simd_v4 const xi = simd_load(bi + j);
+        simd_v4 const twr = simd_load(wr + j);
+        simd_v4 const twi = simd_load(wi + j);
+        simd_v4 const tr = simd_msub(simd_mul(xr, twr), xi, twi);
+        simd_v4 const ti = simd_madd(simd_mul(xr, twi), xi, twr);
+        simd_v4 const yr = simd_load(ar + j);
+        simd_v4 const yi = simd_load(ai + j);
+        simd_store(ar + j, simd_add(yr, tr));
+        simd_store(ai + j, simd_add(yi, ti));
+        simd_store(br + j, simd_sub(yr, tr));
+        simd_store(bi + j, simd_sub(yi, ti));
+      }
+    }
+  }
+}
+
+// 2n real samples to n + 1 bins, unscaled
+static inline void
+aec_rfft(aec_fft* f, float const* x, float* out_re, float* out_im)
+{
+  int const n = f->n;
+  float* zr = &f->z_re[0];
+  float* zi = &f->z_im[0];
+  for (int k = 0; k < n; ++k)
+  {
+    zr[f->rev[k]] = x[2 * k];
+    zi[f->rev[k]] = x[(2 * k) + 1];
+  }
+  aec_fft_complex(f, zr, zi);
+
+  out_re[0] = zr[0] + zi[0];
+  out_im[0] = 0;
+  out_re[n] = zr[0] - zi[0];
+  out_im[n] = 0;
+  for (int k = 1; k < n; ++k)
+  {
+    // even and odd samples' spectra, then the butterfly between them
+    float const er = 0.5f * (zr[k] + zr[n - k]);
+    float const ei = 0.5f * (zi[k] - zi[n - k]);
+    float const or_ = 0.5f * (zi[k] + zi[n - k]);
+    float const oi = -0.5f * (zr[k] - zr[n - k]);
+    out_re[k] = er + (f->split_re[k] * or_) - (f->split_im[k] * oi);
+    out_im[k] = ei + (f->split_re[k] * oi) + (f->split_im[k] * or_);
+  }
+}
+
+// n + 1 bins back to 2n real samples, aec_rfft's inverse
+static inline void
+aec_irfft(aec_fft* f, float const* in_re, float const* in_im, float* x)
+{
+  int const n = f->n;
+  float* zr = &f->z_re[0];
+  float* zi = &f->z_im[0];
+  for (int k = 0; k < n; ++k)
+  {
+    float const er = 0.5f * (in_re[k] + in_re[n - k]);
+    float const ei = 0.5f * (in_im[k] - in_im[n - k]);
+    float const dr = 0.5f * (in_re[k] - in_re[n - k]);
+    float const di = 0.5f * (in_im[k] + in_im[n - k]);
+    float const or_ = (dr * f->split_re[k]) + (di * f->split_im[k]);
+    float const oi = (di * f->split_re[k]) - (dr * f->split_im[k]);
+
+    // the inverse is the forward transform with real and imaginary
+    // swapped on the way in and out
+    zi[f->rev[k]] = er - oi;
+    zr[f->rev[k]] = ei + or_;
+  }
+  aec_fft_complex(f, zr, zi);
+
+  float const scale = 1.0f / n;
+  for (int k = 0; k < n; ++k)
+  {
+    x[2 * k] = zi[k] * scale;
+    x[(2 * k) + 1] = zr[k] * scale;
+  }
+}
+
+struct aec
+{
+  int block;
+  int partitions;
+  // n + 1 bins, stored n + 4 apart so every row starts aligned to a vector
+  int bins;
+  int stride;
+  aec_fft fft;
+
+  // reference spectra, newest first from ring_head
+  std::vector<float> x_re;
+  std::vector<float> x_im;
+  int ring_head;
+
+  // the background filter adapts, the foreground one cancels and only
+  // takes the background's weights once they do better
+  std::vector<float> w_re;
+  std::vector<float> w_im;
+  std::vector<float> fg_re;
+  std::vector<float> fg_im;
+  int constrain_next;
+
+  std::vector<float> power;
+  std::vector<float> prev_ref;
+  std::vector<float> time;
+  std::vector<float> error;
+  std::vector<float> echo;
+  std::vector<float> fg_error;
+  std::vector<float> fg_echo;
+  std::vector<float> y_re;
+  std::vector<float> y_im;
+  std::vector<float> e_re;
+  std::vector<float> e_im;
+
+  // how much of the echo estimate is left in the residue, from the
+  // covariance of their power spectra
+  float leak_cross;
+  float leak_echo;
+  int reference_blocks;
+  bool adapted;
+
+  // how much better the background did than the foreground, short and
+  // long term, and how much that varies
+  float diff_short;
+  float diff_long;
+  float var_short;
+  float var_long;
+
+  // capture and residue energy while there was a reference, for the ERLE
+  double mic_energy;
+  double residue_energy;
+};
+
+// false unless block is a power of two of at least 8 frames
+static inline bool
+aec_init(aec* a, int block, int tail_frames)
+{
+  if ((block < 8) || (block & (block - 1)))
+    return false;
+
+  a->block = block;
+  a->partitions = (tail_frames + block - 1) / block;
+  if (a->partitions < 1)
+    a->partitions = 1;
+  a->bins = block + 1;
+  a->stride = block + 4;
+  aec_fft_init(&a->fft, block);
+
+  size_t const spectra = static_cast<size_t>(a->partitions) * a->stride;
+  a->x_re.assign(spectra, 0.0f);
+  a->x_im.assign(spectra, 0.0f);
+  a->ring_head = 0;
+  a->w_re.assign(spectra, 0.0f);
+  a->w_im.assign(spectra, 0.0f);
+  a->fg_re.assign(spectra, 0.0f);
+  a->fg_im.assign(spectra, 0.0f);
+  a->constrain_next = 0;
+
+  a->power.assign(a->stride, 0.0f);
+  a->prev_ref.assign(block, 0.0f);
+  a->time.assign(2 * block, 0.0f);
+  a->error.assign(block, 0.0f);
+  a->echo.assign(block, 0.0f);
+  a->fg_error.assign(block, 0.0f);
+  a->fg_echo.assign(block, 0.0f);
+  a->y_re.assign(a->stride, 0.0f);
+  a->y_im.assign(a->stride, 0.0f);
+  a->e_re.assign(a->stride, 0.0f);
+  a->e_im.assign(a->stride, 0.0f);
+  a->leak_cross = 0;
+  a->leak_echo = 0;
+  a->reference_blocks = 0;
+  a->adapted = false;
+  a->diff_short = 0;
+  a->diff_long = 0;
+  a->var_short = 0;
+  a->var_long = 0;
+  a->mic_energy = 0;
+  a->residue_energy = 0;
+  return true;
+}
+
+// the echo the weights w predict for the newest block
+static inline void
+aec_estimate(aec* a, float const* w_re, float const* w_im, float* echo)
+{
+  int const stride = a->stride;
+  float* yr = &a->y_re[0];
+  float* yi = &a->y_im[0];
+  memset(yr, 0, stride * sizeof(float));
+  memset(yi, 0, stride * sizeof(float));
+  for (int p = 0; p < a->partitions; ++p)
+  {
+    int const slot = ((a->ring_head + p) % a->partitions) * stride;
+    float const* xr = &a->x_re[slot];
+    float const* xi = &a->x_im[slot];
+    float const* wr = w_re + (p * stride);
+    float const* wi = w_im + (p * stride);
+    for (int k = 0; k < stride; k += 4)
+    {
+      simd_v4 const a_r = simd_load(wr + k);
+      simd_v4 const a_i = simd_load(wi + k);
+      simd_v4 const b_r = simd_load(xr + k);
+      simd_v4 const b_i = simd_load(xi + k);
+      simd_store(yr + k, simd_msub(simd_madd(simd_load(yr + k), a_r, b_r), a_i, b_i));
+      simd_store(yi + k, simd_madd(simd_madd(simd_load(yi + k), a_r, b_i), a_i, b_r));
+    }
+  }
+  aec_irfft(&a->fft, yr, yi, &a->time[0]);
+  memcpy(echo, &a->time[a->block], a->block * sizeof(float));
+}
+
+// Removes the echo of ref from mic, both one block of 16 bit mono.
+static inline void
+aec_run(aec* a, int16_t* mic, int16_t const* ref)
+{
+  int const n = a->block;
+  int const p_count = a->partitions;
+  int const stride = a->stride;
+  float const scale = 1.0f / 32768.0f;
+  float* time = &a->time[0];
+
+  // the newest reference block with the previous one in front
+  float ref_energy = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    float const r = ref[i] * scale;
+    time[i] = a->prev_ref[i];
+    time[n + i] = r;
+    a->prev_ref[i] = r;
+    ref_energy += r * r;
+  }
+  a->ring_head = (a->ring_head + p_count - 1) % p_count;
+  float* xr0 = &a->x_re[a->ring_head * stride];
+  float* xi0 = &a->x_im[a->ring_head * stride];
+  aec_rfft(&a->fft, time, xr0, xi0);
+
+  float* power = &a->power[0];
+  simd_v4 const keep = simd_dup(1.0f - kAecPowerSmoothing);
+  simd_v4 const take = simd_dup(kAecPowerSmoothing);
+  for (int k = 0; k < stride; k += 4)
+  {
+    simd_v4 const r = simd_load(xr0 + k);
+    simd_v4 const i = simd_load(xi0 + k);
+    simd_v4 const p = simd_mul(take, simd_madd(simd_mul(r, r), i, i));
+    simd_store(power + k, simd_madd(p, keep, simd_load(power + k)));
+  }
+
+  aec_estimate(a, &a->w_re[0], &a->w_im[0], &a->echo[0]);
+  aec_estimate(a, &a->fg_re[0], &a->fg_im[0], &a->fg_echo[0]);
+
+  float mic_energy = 0;
+  float residue_energy = 0;
+  float fg_echo_energy = 0;
+  float fg_energy = 0;
+  float between = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    float const d = mic[i] * scale;
+    float const e = d - a->echo[i];
+    float const fy = a->fg_echo[i];
+    float const fe = d - fy;
+    mic_energy += d * d;
+    residue_energy += e * e;
+    fg_echo_energy += fy * fy;
+    fg_energy += fe * fe;
+    between += (fe - e) * (fe - e);
+    a->error[i] = e;
+    a->fg_error[i] = fe;
+
+    float const s = fe * 32768.0f;
+    float const r = (s >= 0.0f) ? (s + 0.5f) : (s - 0.5f);
+    mic[i] = static_cast<int16_t>((r > 32767.0f) ? 32767.0f : ((r < -32768.0f) ? -32768.0f : r));
+  }
+
+  if (ref_energy < (kAecMinReferenceRms * kAecMinReferenceRms * n))
+    return;
+  a->mic_energy += mic_energy;
+  a->residue_energy += fg_energy;
+
+  // Double talk throws the background filter off, the foreground keeps
+  // cancelling with the last weights that did well. The background is
+  // copied over when it does clearly better, short or long term, and
+  // reset to the foreground when it does clearly worse.
+  float const diff = fg_energy - residue_energy;
+  float const spread = (fg_energy * between) + (kAecSwapMargin * kAecSwapMargin * fg_energy * fg_energy);
+  a->diff_short = (0.6f * a->diff_short) + (0.4f * diff);
+  a->var_short = (0.36f * a->var_short) + (0.16f * spread);
+  a->diff_long = (0.85f * a->diff_long) + (0.15f * diff);
+  a->var_long = (0.7225f * a->var_long) + (0.0225f * spread);
+  if (((diff * fabsf(diff)) > spread) || ((a->diff_short * fabsf(a->diff_short)) > (0.25f * a->var_short))
+    || ((a->diff_long * fabsf(a->diff_long)) > (0.25f * a->var_long)))
+  {
+    a->fg_re = a->w_re;
+    a->fg_im = a->w_im;
+    a->diff_short = a->diff_long = a->var_short = a->var_long = 0;
+  }
+  else if (((-diff * fabsf(diff)) > (4.0f * spread)) || ((-a->diff_short * fabsf(a->diff_short)) > (4.0f * a->var_short))
+    || ((-a->diff_long * fabsf(a->diff_long)) > (4.0f * a->var_long)))
+  {
+    a->w_re = a->fg_re;
+    a->w_im = a->fg_im;
+    a->diff_short = a->diff_long = a->var_short = a->var_long = 0;
+    a->error = a->fg_error;
+    residue_energy = fg_energy;
+  }
+
+  // the foreground's residue and echo estimate spectra, zero padded in
+  // front
+  float* er = &a->e_re[0];
+  float* ei = &a->e_im[0];
+  float* yr = &a->y_re[0];
+  float* yi = &a->y_im[0];
+  memset(time, 0, n * sizeof(float));
+  memcpy(time + n, &a->fg_error[0], n * sizeof(float));
+  aec_rfft(&a->fft, time, er, ei);
+  memcpy(time + n, &a->fg_echo[0], n * sizeof(float));
+  aec_rfft(&a->fft, time, yr, yi);
+
+  // Near end speech adds to the residue's power in bins the echo estimate
+  // doesn't follow, echo the filter still misses follows it. The step is
+  // the share of the residue that is echo, measured on the foreground so
+  // the background can't talk itself into following the near end.
+  float mean_e = 0;
+  float mean_y = 0;
+  for (int k = 0; k < a->bins; ++k)
+  {
+    mean_e += (er[k] * er[k]) + (ei[k] * ei[k]);
+    mean_y += (yr[k] * yr[k]) + (yi[k] * yi[k]);
+  }
+  mean_e /= a->bins;
+  mean_y /= a->bins;
+  float cross = 0;
+  float echo_var = 0;
+  for (int k = 0; k < a->bins; ++k)
+  {
+    float const de = (er[k] * er[k]) + (ei[k] * ei[k]) - mean_e;
+    float const dy = (yr[k] * yr[k]) + (yi[k] * yi[k]) - mean_y;
+    cross += de * dy;
+    echo_var += dy * dy;
+  }
+  // and tracks slower the more the residue outweighs the estimate, near
+  // end speech can't talk it up
+  float smoothing = (kAecLeakSmoothing * 4.0f * fg_echo_energy) / (fg_energy + 1e-10f);
+  smoothing = (smoothing > kAecLeakSmoothing) ? kAecLeakSmoothing : smoothing;
+  a->leak_cross = ((1.0f - smoothing) * a->leak_cross) + (smoothing * cross);
+  a->leak_echo = ((1.0f - smoothing) * a->leak_echo) + (smoothing * echo_var);
+
+  // until the filter takes a first bite out of the echo there's no estimate
+  // to compare with, it adapts at full speed
+  float rate = 1.0f;
+  a->reference_blocks++;
+  if (!a->adapted && (a->reference_blocks > (2 * p_count)) && ((2 * residue_energy) < mic_energy))
+    a->adapted = true;
+  if (a->adapted)
+  {
+    float leak = (a->leak_echo > 0) ? (a->leak_cross / a->leak_echo) : 0.0f;
+    leak = (leak > 1.0f) ? 1.0f : ((leak < 0.0f) ? 0.0f : leak);
+    rate = (leak * fg_echo_energy) / (fg_energy + 1e-10f);
+    rate = (rate > 1.0f) ? 1.0f : ((rate < kAecMinRate) ? kAecMinRate : rate);
+  }
+
+  // the background's residue, normalized, is the step
+  memcpy(time + n, &a->error[0], n * sizeof(float));
+  aec_rfft(&a->fft, time, er, ei);
+  float const norm = static_cast<float>(p_count);
+  for (int k = 0; k < a->bins; ++k)
+  {
+    float const step = (kAecMu * rate) / ((norm * power[k]) + kAecRegularization);
+    er[k] *= step;
+    ei[k] *= step;
+  }
+
+  for (int p = 0; p < p_count; ++p)
+  {
+    int const slot = ((a->ring_head + p) % p_count) * stride;
+    float const* xr = &a->x_re[slot];
+    float const* xi = &a->x_im[slot];
+    float* wr = &a->w_re[p * stride];
+    float* wi = &a->w_im[p * stride];
+    for (int k = 0; k < stride; k += 4)
+    {
+      simd_v4 const b_r = simd_load(xr + k);
+      simd_v4 const b_i = simd_load(xi + k);
+      simd_v4 const g_r = simd_load(er + k);
+      simd_v4 const g_i = simd_load(ei + k);
+      // conj(x) * g
+      simd_store(wr + k, simd_madd(simd_madd(simd_load(wr + k), b_r, g_r), b_i, g_i));
+      simd_store(wi + k, simd_msub(simd_madd(simd_load(wi + k), b_r, g_i), b_i, g_r));
+    }
+  }
+
+  // keep one partition a causal block long, round robin
+  float* wr = &a->w_re[a->constrain_next * stride];
+  float* wi = &a->w_im[a->constrain_next * stride];
+  aec_irfft(&a->fft, wr, wi, time);
+  memset(time + n, 0, n * sizeof(float));
+  aec_rfft(&a->fft, time, wr, wi);
+  a->constrain_next = (a->constrain_next + 1) % p_count;
+}
+
+// echo return loss enhancement since the last call, in dB, while there was
+// something to cancel
+static inline float
+aec_take_erle(aec* a)
+{
+  float const erle = (a->residue_energy > 0) ? static_cast<float>(10.0 * log10(a->mic_energy / a->residue_energy)) : 0.0f;
+  a->mic_energy = 0;
+  a->residue_energy = 0;
+  return erle;
+}
+
+#endif // AEC_H
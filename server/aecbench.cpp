@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "../protocol.h"
+#include "aec.h"
+#include "wavfile.h"
+
+// Runs xaudio's echo canceller over a far end recording, what was played,
+// and the microphone recording of it, and reports the echo return loss
+// enhancement a second at a time and what a capture period costs. Both
+// files are 16 bit mono PCM WAV at the same rate, aligned to the sample.
+// --synthetic makes up a pair instead: bursts of shaped noise played
+// through a decaying room response, with a few seconds of double talk.
+
+static bool read_wav(char const* path, xaudio_wav* wav)
+{
+  int const err = xaudio_wav_read(path, wav);
+  if (err < 0)
+  {
+    printf("failed to read %s. %s\n", path, (err == -EINVAL) ? "not a 16 bit PCM WAV" : strerror(-err));
+    return false;
+  }
+  if (wav->channels != 1)
+  {
+    printf("%s: only mono recordings are supported\n", path);
+    return false;
+  }
+  return true;
+}
+
+static bool write_wav(char const* path, uint32_t sample_rate, std::vector<int16_t> const& samples)
+{
+  FILE* f = fopen(path, "wb");
+  if (!f)
+  {
+    printf("failed to open %s\n", path);
+    return false;
+  }
+
+  uint32_t const data = static_cast<uint32_t>(samples.size() * 2);
+  uint8_t header[44];
+  memcpy(header, "RIFF", 4);
+  xaudio_put_le(header + 4, 36 + data, 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  xaudio_put_le(header + 16, 16, 4);
+  xaudio_put_le(header + 20, 1, 2);
+  xaudio_put_le(header + 22, 1, 2);
+  xaudio_put_le(header + 24, sample_rate, 4);
+  xaudio_put_le(header + 28, sample_rate * 2, 4);
+  xaudio_put_le(header + 32, 2, 2);
+  xaudio_put_le(header + 34, 16, 2);
+  memcpy(header + 36, "data", 4);
+  xaudio_put_le(header + 40, data, 4);
+
+  bool ok = (fwrite(header, 1, sizeof(header), f) == sizeof(header))
+    && (fwrite(&samples[0], 2, samples.size(), f) == samples.size());
+  return (fclose(f) == 0) && ok;
+}
+
+static int16_t clamp16(double s)
+{
+  return static_cast<int16_t>((s > 32767) ? 32767 : ((s < -32768) ? -32768 : s));
+}
+
+static double noise(uint32_t* seed)
+{
+  *seed = (*seed * 1664525u) + 1013904223u;
+  return (static_cast<int32_t>(*seed) / 2147483648.0);
+}
+
+// 2/3 of a second of far end out of every second, someone talking over it
+// from 12 to 14s, echo through a 40ms room response half as loud as what was played
+static void make_synthetic(uint32_t sample_rate, int seconds, xaudio_wav* far, xaudio_wav* mic)
+{
+  uint32_t seed = 1;
+  size_t const frames = static_cast<size_t>(sample_rate) * seconds;
+  far->sample_rate = mic->sample_rate = sample_rate;
+  far->channels = mic->channels = 1;
+  far->samples.resize(frames);
+  mic->samples.resize(frames);
+
+  double lp = 0;
+  for (size_t i = 0; i < frames; ++i)
+  {
+    lp = (0.7 * lp) + (0.3 * noise(&seed));
+    bool const on = (i % sample_rate) < ((2 * sample_rate) / 3);
+    far->samples[i] = on ? clamp16(lp * 12000) : 0;
+  }
+
+  size_t const delay = sample_rate / 200;
+  std::vector<double> rir(sample_rate / 25);
+  for (size_t i = 0; i < rir.size(); ++i)
+    rir[i] = (i < delay) ? 0 : (0.15 * noise(&seed) * exp(-6.0 * (i - delay) / rir.size()));
+  rir[delay] = 0.5;
+
+  for (size_t i = 0; i < frames; ++i)
+  {
+    double echo = 0;
+    for (size_t j = 0; (j < rir.size()) && (j <= i); ++j)
+      echo += rir[j] * far->samples[i - j];
+
+    // a voice, harmonics of a wandering pitch, over a faint hiss
+    double near = noise(&seed) * 10;
+    if ((i >= (12 * sample_rate)) && (i < (14 * sample_rate)))
+    {
+      double const t = static_cast<double>(i) / sample_rate;
+      double const pitch = 140 + (30 * sin(2 * M_PI * 0.7 * t));
+      for (int h = 1; h <= 12; ++h)
+        near += (3000.0 / h) * sin(2 * M_PI * pitch * h * t);
+    }
+    mic->samples[i] = clamp16(echo + near);
+  }
+}
+
+static int open_cycle_counter()
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+static double seconds_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void print_help()
+{
+  printf("\n");
+  printf("\tUsage xaudio-aecbench [OPTIONS] <far.wav> <mic.wav>\n");
+  printf("\t\t--synthetic             Make up 20s of echo at 16kHz instead of reading files\n");
+  printf("\t\t--frames=<n>            Frames per period, xaudio's --capture-frames (128)\n");
+  printf("\t\t--tail=<ms>             xaudio's --aec-tail (64)\n");
+  printf("\t\t--out=<file.wav>        Write what the canceller left of mic.wav\n");
+  printf("\t\t--help                  Print this help and exit\n");
+  printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+  int period_frames = 128;
+  int tail_ms = 64;
+  bool synthetic = false;
+  char const* out_path = NULL;
+
+  struct option long_options[] =
+  {
+    { "frames", required_argument, NULL, 10000 },
+    { "tail", required_argument, NULL, 10001 },
+    { "out", required_argument, NULL, 10002 },
+    { "synthetic", no_argument, NULL, 10003 },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+  {
+    switch (c)
+    {
+      case 10000:
+        period_frames = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10001:
+        tail_ms = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10002:
+        out_path = optarg;
+        break;
+      case 10003:
+        synthetic = true;
+        break;
+      default:
+        print_help();
+        exit(0);
+        break;
+    }
+  }
+
+  xaudio_wav far;
+  xaudio_wav mic;
+  if (synthetic)
+  {
+    make_synthetic(16000, 20, &far, &mic);
+  }
+  else if ((optind + 2) > argc)
+  {
+    printf("failed to provide a far end and a mic recording\n");
+    print_help();
+    exit(1);
+  }
+  else if (!read_wav(argv[optind], &far) || !read_wav(argv[optind + 1], &mic))
+  {
+    exit(1);
+  }
+  else if (far.sample_rate != mic.sample_rate)
+  {
+    printf("%s and %s aren't at the same rate\n", argv[optind], argv[optind + 1]);
+    exit(1);
+  }
+
+  aec a;
+  if (!aec_init(&a, period_frames, (tail_ms * static_cast<int>(mic.sample_rate)) / 1000))
+  {
+    printf("--frames has to be a power of two of at least 8\n");
+    exit(1);
+  }
+
+  int const counter = open_cycle_counter();
+  if (counter >= 0)
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+
+  size_t const frames = std::min(far.samples.size(), mic.samples.size());
+  std::vector<int16_t> residue(mic.samples.begin(), mic.samples.begin() + frames);
+  uint64_t periods = 0;
+  uint64_t next_second = mic.sample_rate;
+  double busy = 0;
+  std::vector<float> converged;
+  printf("erle/s:");
+  for (size_t pos = 0; (pos + period_frames) <= frames; pos += period_frames)
+  {
+    double const start = seconds_now();
+    if (counter >= 0)
+      ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    aec_run(&a, &residue[pos], &far.samples[pos]);
+    if (counter >= 0)
+      ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    busy += seconds_now() - start;
+    periods++;
+
+    if ((pos + period_frames) >= next_second)
+    {
+      float const erle = aec_take_erle(&a);
+      printf(" %.1f", erle);
+
+      // the first two seconds are the filter converging
+      if (next_second > (2 * mic.sample_rate))
+        converged.push_back(erle);
+      next_second += mic.sample_rate;
+    }
+  }
+  printf(" dB\n");
+
+  long long cycles = -1;
+  if ((counter < 0) || (read(counter, &cycles, sizeof(cycles)) != sizeof(cycles)))
+    cycles = -1;
+
+  double const period_us = (periods ? ((busy * 1e6) / periods) : 0);
+  double const budget_us = (period_frames * 1e6) / mic.sample_rate;
+  printf("simd:%s rate:%u period:%d tail:%dms partitions:%d\n", XAUDIO_SIMD, mic.sample_rate, period_frames, tail_ms,
+    a.partitions);
+  std::sort(converged.begin(), converged.end());
+  printf("median erle after 2s:%.1fdB aec/period:%.2fus (%.2f%% of real time) cycles/period:",
+    converged.empty() ? 0.0f : converged[converged.size() / 2], period_us, (100.0 * period_us) / budget_us);
+  if ((cycles >= 0) && periods)
+    printf("%lld\n", cycles / static_cast<long long>(periods));
+  else
+    printf("n/a\n");
+
+  if (out_path && !write_wav(out_path, mic.sample_rate, residue))
+    exit(1);
+  return 0;
+}
@@ -0,0 +1,365 @@
+#ifndef ALSASTUB_H
+#define ALSASTUB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <alloca.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+
+// Stands in for <alsa/asoundlib.h> when xaudio is built with
+// -DXAUDIO_ALSA_STUB, so it can run where there's no sound card, to replay
+// wire logs against it (see server/wirereplay.cpp) or on a build box.
+//
+// Only what xaudio calls is here. Capture is paced by the monotonic clock
+// like a real device and always produces the same signal: a second of
+// 440Hz tone every three seconds over quiet noise, so both voice and
+// silence go through the VAD. A read that comes more than a buffer late
+// overruns like the hardware would. Playback never blocks, it plays what
+// was written at the device rate and starts over once it ran dry. With
+// ALSASTUB_PLAYBACK set, everything written is appended to that file.
+// Devices named hw:<something> can only be opened once at a time, like
+// the hardware without dmix or dsnoop in front of it.
+// ALSASTUB_ECHO=<gain> adds what's being played to the capture, 2ms late
+// with a fainter reflection 12ms late, when both run at the same rate.
+
+enum
+{
+  ALSASTUB_BUFFER_PERIODS = 4,
+  ALSASTUB_HISTORY_FRAMES = 1 << 16,
+  ALSASTUB_MAX_OPEN = 8
+};
+
+enum
+{
+  SND_PCM_NONBLOCK = 1
+};
+
+typedef unsigned long snd_pcm_uframes_t;
+typedef long snd_pcm_sframes_t;
+typedef struct timeval snd_timestamp_t;
+typedef struct _snd_output snd_output_t;
+
+typedef enum { SND_PCM_STREAM_PLAYBACK = 0, SND_PCM_STREAM_CAPTURE } snd_pcm_stream_t;
+typedef enum { SND_PCM_ACCESS_RW_INTERLEAVED = 3 } snd_pcm_access_t;
+typedef enum { SND_PCM_FORMAT_S16_LE = 2 } snd_pcm_format_t;
+typedef enum
+{
+  SND_PCM_STATE_OPEN,
+  SND_PCM_STATE_SETUP,
+  SND_PCM_STATE_PREPARED,
+  SND_PCM_STATE_RUNNING,
+  SND_PCM_STATE_XRUN,
+  SND_PCM_STATE_DRAINING
+} snd_pcm_state_t;
+
+typedef struct
+{
+  snd_pcm_stream_t stream;
+  char name[64];
+  unsigned int rate;
+  unsigned int channels;
+  snd_pcm_state_t state;
+  struct timespec next;
+  snd_timestamp_t trigger;
+  uint64_t frames;
+  uint32_t noise;
+  FILE* playback;
+
+  // what playback played, mono, by frame of the monotonic clock from
+  // origin on
+  int16_t* history;
+  uint64_t origin;
+} snd_pcm_t;
+
+typedef struct
+{
+  unsigned int rate;
+  unsigned int channels;
+} snd_pcm_hw_params_t;
+
+typedef struct
+{
+  snd_pcm_state_t state;
+  snd_timestamp_t trigger;
+} snd_pcm_status_t;
+
+#define snd_pcm_hw_params_alloca(p) (*(p) = static_cast<snd_pcm_hw_params_t *>(alloca(sizeof(snd_pcm_hw_params_t))))
+#define snd_pcm_status_alloca(p) (*(p) = static_cast<snd_pcm_status_t *>(alloca(sizeof(snd_pcm_status_t))))
+
+static inline char const* snd_asoundlib_version()
+  { return "stub"; }
+static inline char const* snd_strerror(int)
+  { return "stub error"; }
+static inline int snd_output_stdio_attach(snd_output_t** out, FILE*, int)
+  { *out = NULL; return 0; }
+static inline int snd_pcm_format_width(snd_pcm_format_t)
+  { return 16; }
+static inline int snd_pcm_dump(snd_pcm_t*, snd_output_t*)
+  { return 0; }
+
+// the playback device, whose echo the capture picks up
+static inline snd_pcm_t*&
+alsastub_speaker()
+{
+  static snd_pcm_t* speaker = NULL;
+  return speaker;
+}
+
+static inline uint64_t
+alsastub_clock_frames(struct timespec const& ts, unsigned int rate)
+{
+  return (static_cast<uint64_t>(ts.tv_sec) * rate) + ((static_cast<uint64_t>(ts.tv_nsec) * rate) / 1000000000);
+}
+
+// every PCM that's open
+static inline snd_pcm_t**
+alsastub_open_pcms()
+{
+  static snd_pcm_t* open[ALSASTUB_MAX_OPEN] = { NULL };
+  return open;
+}
+
+static inline int
+snd_pcm_open(snd_pcm_t** pcm, char const* name, snd_pcm_stream_t stream, int)
+{
+  snd_pcm_t** open = alsastub_open_pcms();
+  int slot = -1;
+  for (int i = 0; i < ALSASTUB_MAX_OPEN; ++i)
+  {
+    if (!open[i])
+      slot = i;
+    else if ((open[i]->stream == stream) && !strncmp(name, "hw:", 3) && !strcmp(open[i]->name, name))
+      return -EBUSY;
+  }
+  if (slot == -1)
+    return -ENOMEM;
+
+  *pcm = static_cast<snd_pcm_t *>(calloc(1, sizeof(snd_pcm_t)));
+  open[slot] = *pcm;
+  (*pcm)->stream = stream;
+  snprintf((*pcm)->name, sizeof((*pcm)->name), "%s", name);
+  (*pcm)->rate = 16000;
+  (*pcm)->channels = 1;
+  (*pcm)->state = SND_PCM_STATE_OPEN;
+  (*pcm)->noise = 1;
+  if ((stream == SND_PCM_STREAM_PLAYBACK) && getenv("ALSASTUB_PLAYBACK"))
+    (*pcm)->playback = fopen(getenv("ALSASTUB_PLAYBACK"), "ab");
+  if (stream == SND_PCM_STREAM_PLAYBACK)
+  {
+    (*pcm)->history = static_cast<int16_t *>(calloc(ALSASTUB_HISTORY_FRAMES, sizeof(int16_t)));
+    alsastub_speaker() = *pcm;
+  }
+  return 0;
+}
+
+static inline int
+snd_pcm_close(snd_pcm_t* pcm)
+{
+  if (pcm->playback)
+    fclose(pcm->playback);
+  if (alsastub_speaker() == pcm)
+    alsastub_speaker() = NULL;
+  snd_pcm_t** open = alsastub_open_pcms();
+  for (int i = 0; i < ALSASTUB_MAX_OPEN; ++i)
+  {
+    if (open[i] == pcm)
+      open[i] = NULL;
+  }
+  free(pcm->history);
+  free(pcm);
+  return 0;
+}
+
+static inline int snd_pcm_hw_params_malloc(snd_pcm_hw_params_t** params)
+  { *params = static_cast<snd_pcm_hw_params_t *>(calloc(1, sizeof(snd_pcm_hw_params_t))); return 0; }
+static inline void snd_pcm_hw_params_free(snd_pcm_hw_params_t* params)
+  { free(params); }
+static inline int snd_pcm_hw_params_any(snd_pcm_t* pcm, snd_pcm_hw_params_t* params)
+  { params->rate = pcm->rate; params->channels = pcm->channels; return 0; }
+static inline int snd_pcm_hw_params_set_access(snd_pcm_t*, snd_pcm_hw_params_t*, snd_pcm_access_t)
+  { return 0; }
+static inline int snd_pcm_hw_params_set_format(snd_pcm_t*, snd_pcm_hw_params_t*, snd_pcm_format_t)
+  { return 0; }
+static inline int snd_pcm_hw_params_set_rate_near(snd_pcm_t*, snd_pcm_hw_params_t* params, unsigned int* rate, int*)
+  { params->rate = *rate; return 0; }
+static inline int snd_pcm_hw_params_set_channels(snd_pcm_t*, snd_pcm_hw_params_t* params, unsigned int channels)
+  { params->channels = channels; return 0; }
+static inline int snd_pcm_hw_params_set_period_size(snd_pcm_t*, snd_pcm_hw_params_t*, snd_pcm_uframes_t, int)
+  { return 0; }
+
+static inline int
+snd_pcm_hw_params(snd_pcm_t* pcm, snd_pcm_hw_params_t* params)
+{
+  pcm->rate = params->rate;
+  pcm->channels = params->channels;
+  pcm->state = SND_PCM_STATE_SETUP;
+  return 0;
+}
+
+static inline int
+snd_pcm_prepare(snd_pcm_t* pcm)
+{
+  // the clock starts with the first read
+  pcm->state = SND_PCM_STATE_PREPARED;
+  pcm->next.tv_sec = 0;
+  pcm->next.tv_nsec = 0;
+  return 0;
+}
+
+static inline int snd_pcm_nonblock(snd_pcm_t*, int)
+  { return 0; }
+
+// capture runs from here, before the first read
+static inline int
+snd_pcm_start(snd_pcm_t* pcm)
+{
+  pcm->state = SND_PCM_STATE_RUNNING;
+  clock_gettime(CLOCK_MONOTONIC, &pcm->next);
+  return 0;
+}
+
+static inline int
+snd_pcm_status(snd_pcm_t* pcm, snd_pcm_status_t* status)
+{
+  status->state = pcm->state;
+  status->trigger = pcm->trigger;
+  return 0;
+}
+
+static inline int snd_pcm_status_dump(snd_pcm_status_t*, snd_output_t*)
+  { return 0; }
+static inline snd_pcm_state_t snd_pcm_status_get_state(snd_pcm_status_t const* status)
+  { return status->state; }
+static inline void snd_pcm_status_get_tstamp(snd_pcm_status_t const*, snd_timestamp_t* tstamp)
+  { gettimeofday(tstamp, NULL); }
+static inline void snd_pcm_status_get_trigger_tstamp(snd_pcm_status_t const* status, snd_timestamp_t* tstamp)
+  { *tstamp = status->trigger; }
+
+static inline char const*
+snd_pcm_state_name(snd_pcm_state_t state)
+{
+  static char const* const names[] = { "OPEN", "SETUP", "PREPARED", "RUNNING", "XRUN", "DRAINING" };
+  return names[state];
+}
+
+static inline snd_pcm_sframes_t
+snd_pcm_readi(snd_pcm_t* pcm, void* buff, snd_pcm_uframes_t frames)
+{
+  int64_t const period_ns = (static_cast<int64_t>(frames) * 1000000000) / pcm->rate;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (pcm->state != SND_PCM_STATE_RUNNING)
+  {
+    pcm->state = SND_PCM_STATE_RUNNING;
+    pcm->next = now;
+  }
+
+  int64_t const late = ((now.tv_sec - pcm->next.tv_sec) * 1000000000LL) + (now.tv_nsec - pcm->next.tv_nsec);
+  if (late > (period_ns * ALSASTUB_BUFFER_PERIODS))
+  {
+    pcm->state = SND_PCM_STATE_XRUN;
+    gettimeofday(&pcm->trigger, NULL);
+    return -EPIPE;
+  }
+
+  int64_t const next_ns = pcm->next.tv_nsec + period_ns;
+  pcm->next.tv_sec += next_ns / 1000000000;
+  pcm->next.tv_nsec = next_ns % 1000000000;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &pcm->next, NULL);
+
+  char const* echo = getenv("ALSASTUB_ECHO");
+  snd_pcm_t const* speaker = alsastub_speaker();
+  double const gain = (echo && speaker && (speaker->rate == pcm->rate)) ? strtod(echo, NULL) : 0.0;
+  uint64_t const end = alsastub_clock_frames(pcm->next, pcm->rate);
+
+  int16_t* out = static_cast<int16_t *>(buff);
+  for (snd_pcm_uframes_t i = 0; i < frames; ++i, ++pcm->frames)
+  {
+    double const t = static_cast<double>(pcm->frames) / pcm->rate;
+    double v = (fmod(t, 3.0) < 1.0) ? (8000.0 * sin(2.0 * M_PI * 440.0 * t)) : 0.0;
+    if (gain != 0.0)
+    {
+      uint64_t const now = end - frames + i;
+      uint64_t const taps[2] = { now - (pcm->rate / 500), now - ((pcm->rate * 12) / 1000) };
+      for (int k = 0; k < 2; ++k)
+      {
+        if ((taps[k] >= speaker->origin) && (taps[k] < (speaker->origin + speaker->frames)))
+          v += ((k == 0) ? gain : (gain * 0.3)) * speaker->history[taps[k] & (ALSASTUB_HISTORY_FRAMES - 1)];
+      }
+    }
+    for (unsigned int c = 0; c < pcm->channels; ++c)
+    {
+      pcm->noise = (pcm->noise * 1103515245u) + 12345u;
+      double const s = v + static_cast<int>((pcm->noise >> 16) % 200) - 100;
+      *out++ = static_cast<int16_t>((s > 32767) ? 32767 : ((s < -32768) ? -32768 : s));
+    }
+  }
+  return frames;
+}
+
+// frames written and not played yet, playback started at next
+static inline snd_pcm_sframes_t
+alsastub_queued(snd_pcm_t* pcm)
+{
+  if (pcm->state != SND_PCM_STATE_RUNNING)
+    return 0;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t const played = (((now.tv_sec - pcm->next.tv_sec) * 1000000000LL) + (now.tv_nsec - pcm->next.tv_nsec))
+    * pcm->rate / 1000000000;
+  return (played < static_cast<int64_t>(pcm->frames)) ? static_cast<snd_pcm_sframes_t>(pcm->frames - played) : 0;
+}
+
+// played and not written yet, captured and not read yet
+static inline int
+snd_pcm_delay(snd_pcm_t* pcm, snd_pcm_sframes_t* delay)
+{
+  if (pcm->stream == SND_PCM_STREAM_PLAYBACK)
+  {
+    *delay = alsastub_queued(pcm);
+    return 0;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t const ahead = alsastub_clock_frames(now, pcm->rate) - alsastub_clock_frames(pcm->next, pcm->rate);
+  *delay = ((pcm->state == SND_PCM_STATE_RUNNING) && (ahead > 0)) ? static_cast<snd_pcm_sframes_t>(ahead) : 0;
+  return 0;
+}
+
+static inline snd_pcm_sframes_t
+snd_pcm_writei(snd_pcm_t* pcm, void const* buff, snd_pcm_uframes_t frames)
+{
+  if (alsastub_queued(pcm) == 0)
+  {
+    pcm->state = SND_PCM_STATE_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &pcm->next);
+    pcm->frames = 0;
+    pcm->origin = alsastub_clock_frames(pcm->next, pcm->rate);
+  }
+
+  int16_t const* in = static_cast<int16_t const *>(buff);
+  for (snd_pcm_uframes_t i = 0; i < frames; ++i)
+  {
+    int32_t mono = 0;
+    for (unsigned int c = 0; c < pcm->channels; ++c)
+      mono += *in++;
+    uint64_t const at = pcm->origin + pcm->frames + i;
+    pcm->history[at & (ALSASTUB_HISTORY_FRAMES - 1)] = static_cast<int16_t>(mono / static_cast<int32_t>(pcm->channels));
+  }
+  pcm->frames += frames;
+  if (pcm->playback)
+  {
+    fwrite(buff, 2 * pcm->channels, frames, pcm->playback);
+    fflush(pcm->playback);
+  }
+  return frames;
+}
+
+#endif // ALSASTUB_H
@@ -0,0 +1,463 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// On disk archive of the capture, so the last hours can be heard again
+// even if nobody was connected at the time.
+//
+// The archive is a fixed set of segment files in one directory, used as a
+// ring: when the newest segment is full the oldest one is reused. Every
+// file is preallocated once, so the flash sees the same blocks rewritten
+// in order and never a file being grown or fragmented. A segment is a
+// header page, a time index and then capture periods back to back. The
+// index holds the wall clock time of every index_every'th period, about
+// one a second, and times in between are counted from the period size.
+//
+// The segment being written is mapped, periods are copied in as they're
+// captured and left to the page cache. Every sync_ms the dirty pages are
+// handed to writeback in one go, without waiting for it, so the capture
+// loop never blocks on the flash. At the next sync, when that write has
+// long finished, the header claims those periods. A crash loses at most
+// two sync intervals and never leaves the header pointing at garbage.
+// Periods not yet on disk can already be replayed.
+
+#define XAUDIO_ARCHIVE_MAGIC 0x52414158u // "XAAR"
+#define XAUDIO_ARCHIVE_VERSION 1
+
+enum
+{
+  XAUDIO_ARCHIVE_HEADER_SIZE = 4096
+};
+
+struct xaudio_archive_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sample_rate;
+  uint32_t channels;
+  uint32_t bytes_per_frame;
+  uint32_t period_bytes;
+  uint32_t slot_count;
+  uint32_t index_every;
+  uint64_t index_offset;
+  uint64_t data_offset;
+  uint64_t file_size;
+
+  // segments ever started when this one was, 0 while unused, and how many
+  // periods of it are safely on disk
+  uint64_t sequence;
+  uint64_t periods;
+  int64_t first_ns;
+  int64_t last_ns;
+};
+
+// what the writer knows about each segment, durable or not
+struct xaudio_archive_segment
+{
+  uint64_t sequence;
+  uint64_t periods;
+  int64_t first_ns;
+};
+
+struct xaudio_archive
+{
+  std::string dir;
+  xaudio_archive_header layout;
+  std::vector<xaudio_archive_segment> segments;
+  int64_t period_ns;
+  int sync_ms;
+
+  // the segment being written
+  int current;
+  int fd;
+  uint8_t* map;
+  uint64_t written_periods;
+  int64_t last_sync_ns;
+  int64_t last_ns;
+
+  // handed to writeback at the last sync, for the header to claim at the
+  // next. A finished segment is unmapped once claimed.
+  int claim_fd;
+  uint8_t* claim_map;
+  uint64_t claim_periods;
+  uint64_t claim_end;
+  int64_t claim_ns;
+  bool claim_retire;
+};
+
+static inline int64_t
+xaudio_archive_now_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (static_cast<int64_t>(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+static inline std::string
+xaudio_archive_path(xaudio_archive const* a, int segment)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/segment-%04d.xar", segment);
+  return a->dir + name;
+}
+
+static inline uint64_t
+xaudio_archive_page_up(uint64_t n)
+{
+  return (n + 4095) & ~static_cast<uint64_t>(4095);
+}
+
+// Sets up segment_count segments of segment_periods each in dir, keeping
+// what's there if it was written in the same format. Returns 0 or -errno.
+static inline int
+xaudio_archive_open(xaudio_archive* a, char const* dir, uint32_t sample_rate, uint32_t channels,
+  uint32_t bytes_per_frame, uint32_t period_bytes, uint32_t segment_periods, int segment_count, int sync_ms)
+{
+  xaudio_archive_header& l = a->layout;
+  memset(&l, 0, sizeof(l));
+  l.magic = XAUDIO_ARCHIVE_MAGIC;
+  l.version = XAUDIO_ARCHIVE_VERSION;
+  l.sample_rate = sample_rate;
+  l.channels = channels;
+  l.bytes_per_frame = bytes_per_frame;
+  l.period_bytes = period_bytes;
+  l.slot_count = segment_periods;
+  l.index_every = std::max<uint32_t>(1, (sample_rate * bytes_per_frame) / period_bytes);
+  l.index_offset = XAUDIO_ARCHIVE_HEADER_SIZE;
+  l.data_offset = l.index_offset + xaudio_archive_page_up((((segment_periods / l.index_every) + 1) * sizeof(int64_t)));
+  l.file_size = l.data_offset + (static_cast<uint64_t>(period_bytes) * segment_periods);
+
+  a->dir = dir;
+  a->period_ns = (static_cast<int64_t>(period_bytes / bytes_per_frame) * 1000000000) / sample_rate;
+  a->sync_ms = sync_ms;
+  a->current = -1;
+  a->fd = -1;
+  a->map = NULL;
+  a->claim_fd = -1;
+  a->claim_map = NULL;
+  a->last_sync_ns = xaudio_archive_now_ns(CLOCK_MONOTONIC);
+  a->segments.assign(segment_count, xaudio_archive_segment());
+
+  if ((mkdir(dir, 0755) < 0) && (errno != EEXIST))
+    return -errno;
+
+  for (int i = 0; i < segment_count; ++i)
+  {
+    std::string const path = xaudio_archive_path(a, i);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      return -errno;
+
+    xaudio_archive_header h;
+    bool const same = (pread(fd, &h, sizeof(h), 0) == static_cast<ssize_t>(sizeof(h)))
+      && (h.magic == l.magic) && (h.version == l.version) && (h.sample_rate == l.sample_rate)
+      && (h.channels == l.channels) && (h.period_bytes == l.period_bytes) && (h.slot_count == l.slot_count)
+      && (h.file_size == l.file_size);
+
+    if (same)
+    {
+      a->segments[i].sequence = h.sequence;
+      a->segments[i].periods = h.periods;
+      a->segments[i].first_ns = h.first_ns;
+    }
+    else
+    {
+      // a new or reconfigured archive, claim all the space up front
+      int err = (ftruncate(fd, 0) < 0) ? errno : posix_fallocate(fd, 0, static_cast<off_t>(l.file_size));
+      if ((err == 0) && (pwrite(fd, &l, sizeof(l), 0) != static_cast<ssize_t>(sizeof(l))))
+        err = errno;
+      if (err != 0)
+      {
+        close(fd);
+        return -err;
+      }
+    }
+    close(fd);
+  }
+  return 0;
+}
+
+// the segment holding the newest periods, -1 if nothing was archived yet
+static inline int
+xaudio_archive_newest(xaudio_archive const* a)
+{
+  int newest = -1;
+  for (size_t i = 0; i < a->segments.size(); ++i)
+  {
+    if ((a->segments[i].sequence != 0) && ((newest == -1) || (a->segments[i].sequence > a->segments[newest].sequence)))
+      newest = static_cast<int>(i);
+  }
+  return newest;
+}
+
+static inline int
+xaudio_archive_oldest(xaudio_archive const* a)
+{
+  int oldest = -1;
+  for (size_t i = 0; i < a->segments.size(); ++i)
+  {
+    if ((a->segments[i].sequence != 0) && ((oldest == -1) || (a->segments[i].sequence < a->segments[oldest].sequence)))
+      oldest = static_cast<int>(i);
+  }
+  return oldest;
+}
+
+// lets the header claim what the last sync handed to writeback
+static inline void
+xaudio_archive_finish_claim(xaudio_archive* a)
+{
+  if (!a->claim_map)
+    return;
+
+  // written a sync interval ago, this only queues what the flusher may
+  // have redirtied since, without waiting for it
+  uint64_t const from = a->layout.index_offset;
+  sync_file_range(a->claim_fd, from, a->claim_end - from, SYNC_FILE_RANGE_WRITE);
+
+  xaudio_archive_header* h = reinterpret_cast<xaudio_archive_header *>(a->claim_map);
+  h->periods = a->claim_periods;
+  h->last_ns = a->claim_ns;
+  sync_file_range(a->claim_fd, 0, XAUDIO_ARCHIVE_HEADER_SIZE, SYNC_FILE_RANGE_WRITE);
+
+  if (a->claim_retire)
+  {
+    munmap(a->claim_map, a->layout.file_size);
+    close(a->claim_fd);
+  }
+  a->claim_map = NULL;
+  a->claim_fd = -1;
+}
+
+// hands what was appended since the last sync to writeback
+static inline void
+xaudio_archive_start_write(xaudio_archive* a, bool retire)
+{
+  xaudio_archive_segment const& s = a->segments[a->current];
+  uint64_t const from = (a->layout.data_offset + (a->written_periods * a->layout.period_bytes))
+    & ~static_cast<uint64_t>(4095);
+  uint64_t const to = a->layout.data_offset + (s.periods * a->layout.period_bytes);
+  sync_file_range(a->fd, a->layout.index_offset, a->layout.data_offset - a->layout.index_offset, SYNC_FILE_RANGE_WRITE);
+  sync_file_range(a->fd, from, to - from, SYNC_FILE_RANGE_WRITE);
+
+  a->claim_fd = a->fd;
+  a->claim_map = a->map;
+  a->claim_periods = s.periods;
+  a->claim_end = to;
+  a->claim_ns = a->last_ns;
+  a->claim_retire = retire;
+  a->written_periods = s.periods;
+}
+
+static inline void
+xaudio_archive_sync(xaudio_archive* a)
+{
+  xaudio_archive_finish_claim(a);
+  if (a->map && (a->segments[a->current].periods != a->written_periods))
+    xaudio_archive_start_write(a, false);
+  a->last_sync_ns = xaudio_archive_now_ns(CLOCK_MONOTONIC);
+}
+
+// reuses the oldest segment, or an unused one, for what comes next
+static inline int
+xaudio_archive_start_segment(xaudio_archive* a, int64_t now_ns)
+{
+  // the full segment is claimed and let go at the next sync. A claim the
+  // last sync left on it is folded into that one, only a claim on the
+  // segment before, a whole segment old, is finished now
+  if (a->map)
+  {
+    if (a->claim_map != a->map)
+      xaudio_archive_finish_claim(a);
+    xaudio_archive_start_write(a, true);
+    a->map = NULL;
+    a->fd = -1;
+  }
+
+  int next = -1;
+  uint64_t sequence = 0;
+  for (size_t i = 0; i < a->segments.size(); ++i)
+  {
+    sequence = std::max(sequence, a->segments[i].sequence);
+    if ((next == -1) || (a->segments[i].sequence < a->segments[next].sequence))
+      next = static_cast<int>(i);
+  }
+
+  std::string const path = xaudio_archive_path(a, next);
+  a->fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (a->fd < 0)
+    return -errno;
+
+  void* p = mmap(NULL, a->layout.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, a->fd, 0);
+  if (p == MAP_FAILED)
+  {
+    int err = errno;
+    close(a->fd);
+    a->fd = -1;
+    return -err;
+  }
+
+  // forget the old contents before overwriting them, a page once a
+  // segment, queued for writeback well ahead of the periods at the next sync
+  a->map = static_cast<uint8_t *>(p);
+  xaudio_archive_header* h = reinterpret_cast<xaudio_archive_header *>(a->map);
+  *h = a->layout;
+  h->sequence = sequence + 1;
+  h->first_ns = now_ns;
+  h->last_ns = now_ns;
+  sync_file_range(a->fd, 0, XAUDIO_ARCHIVE_HEADER_SIZE, SYNC_FILE_RANGE_WRITE);
+  madvise(a->map + a->layout.data_offset, a->layout.file_size - a->layout.data_offset, MADV_SEQUENTIAL);
+
+  a->current = next;
+  a->segments[next].sequence = h->sequence;
+  a->segments[next].periods = 0;
+  a->segments[next].first_ns = now_ns;
+  a->written_periods = 0;
+  return 0;
+}
+
+// Appends a period captured at wall clock time now_ns. Returns 0 or
+// -errno, after which the archive is off until reopened.
+static inline int
+xaudio_archive_append(xaudio_archive* a, void const* data, int64_t now_ns)
+{
+  if (!a->map || (a->segments[a->current].periods == a->layout.slot_count))
+  {
+    int err = xaudio_archive_start_segment(a, now_ns);
+    if (err < 0)
+      return err;
+  }
+
+  xaudio_archive_segment& s = a->segments[a->current];
+  if ((s.periods % a->layout.index_every) == 0)
+  {
+    int64_t* index = reinterpret_cast<int64_t *>(a->map + a->layout.index_offset);
+    index[s.periods / a->layout.index_every] = now_ns;
+  }
+
+  memcpy(a->map + a->layout.data_offset + (s.periods * a->layout.period_bytes), data, a->layout.period_bytes);
+  s.periods++;
+  a->last_ns = now_ns;
+
+  if ((xaudio_archive_now_ns(CLOCK_MONOTONIC) - a->last_sync_ns) >= (static_cast<int64_t>(a->sync_ms) * 1000000))
+    xaudio_archive_sync(a);
+  return 0;
+}
+
+// reader side, works on any segment including the one being written
+
+struct xaudio_archive_cursor
+{
+  int segment;
+  uint64_t sequence;
+  uint64_t period;
+};
+
+// Wall clock time of a period, from the nearest index entry before it.
+static inline int64_t
+xaudio_archive_time(xaudio_archive const* a, int fd, uint64_t period)
+{
+  int64_t stamp;
+  uint64_t const entry = period / a->layout.index_every;
+  if (pread(fd, &stamp, sizeof(stamp), a->layout.index_offset + (entry * sizeof(int64_t))) != sizeof(stamp))
+    return 0;
+  return stamp + (static_cast<int64_t>(period - (entry * a->layout.index_every)) * a->period_ns);
+}
+
+// the segment after the cursor's, false when it was the newest
+static inline bool
+xaudio_archive_next_segment(xaudio_archive const* a, xaudio_archive_cursor* cursor)
+{
+  int next = -1;
+  for (size_t i = 0; i < a->segments.size(); ++i)
+  {
+    xaudio_archive_segment const& s = a->segments[i];
+    if ((s.sequence > cursor->sequence) && ((next == -1) || (s.sequence < a->segments[next].sequence)))
+      next = static_cast<int>(i);
+  }
+
+  if (next == -1)
+    return false;
+
+  cursor->segment = next;
+  cursor->sequence = a->segments[next].sequence;
+  cursor->period = 0;
+  return true;
+}
+
+// Where a replay from wall clock time at_ns starts: the period holding it,
+// the oldest one if it's older than the archive, or the first one after a
+// gap. False if there's nothing archived at or after at_ns.
+static inline bool
+xaudio_archive_seek(xaudio_archive const* a, int64_t at_ns, xaudio_archive_cursor* cursor)
+{
+  int best = -1;
+  for (size_t i = 0; i < a->segments.size(); ++i)
+  {
+    xaudio_archive_segment const& s = a->segments[i];
+    if ((s.sequence == 0) || (s.periods == 0))
+      continue;
+
+    // the newest segment that started at or before at_ns, or failing that the oldest one
+    bool const before = s.first_ns <= at_ns;
+    if (best == -1)
+    {
+      best = static_cast<int>(i);
+      continue;
+    }
+
+    xaudio_archive_segment const& b = a->segments[best];
+    bool const best_before = b.first_ns <= at_ns;
+    if ((before && (!best_before || (s.sequence > b.sequence))) || (!before && !best_before && (s.sequence < b.sequence)))
+      best = static_cast<int>(i);
+  }
+
+  if (best == -1)
+    return false;
+
+  xaudio_archive_segment const& s = a->segments[best];
+  cursor->segment = best;
+  cursor->sequence = s.sequence;
+  cursor->period = 0;
+  if (s.first_ns >= at_ns)
+    return true;
+
+  std::string const path = xaudio_archive_path(a, best);
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  // the last index entry at or before at_ns, then count periods from it
+  uint64_t lo = 0;
+  uint64_t hi = (s.periods + a->layout.index_every - 1) / a->layout.index_every;
+  while ((hi - lo) > 1)
+  {
+    uint64_t const mid = lo + ((hi - lo) / 2);
+    if (xaudio_archive_time(a, fd, mid * a->layout.index_every) <= at_ns)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  uint64_t const base = lo * a->layout.index_every;
+  uint64_t const offset = static_cast<uint64_t>((at_ns - xaudio_archive_time(a, fd, base)) / a->period_ns);
+  close(fd);
+
+  // past the end of the segment means at_ns fell in a gap
+  cursor->period = base + std::min<uint64_t>(offset, a->layout.index_every);
+  return (cursor->period < s.periods) || xaudio_archive_next_segment(a, cursor);
+}
+
+#endif // ARCHIVE_H
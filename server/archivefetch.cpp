@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <string>
+
+#include "../protocol.h"
+
+// Fetches audio from a camera's archive into a WAV file: connects to
+// xaudio, asks for a replay from a wall clock time and writes whatever
+// comes until the replay reaches the live capture or enough is saved.
+
+static bool recv_all(int fd, uint8_t* buff, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t ret = recv(fd, buff, n, 0);
+    if (ret <= 0)
+      return false;
+    buff += ret;
+    n -= ret;
+  }
+  return true;
+}
+
+static void write_wav_header(FILE* f, xaudio_format const& format, uint32_t data_bytes)
+{
+  uint8_t h[44];
+  uint32_t const frame_bytes = format.channels * 2;
+  memcpy(h, "RIFF", 4);
+  xaudio_put_le(h + 4, 36 + data_bytes, 4);
+  memcpy(h + 8, "WAVEfmt ", 8);
+  xaudio_put_le(h + 16, 16, 4);
+  xaudio_put_le(h + 20, 1, 2);
+  xaudio_put_le(h + 22, format.channels, 2);
+  xaudio_put_le(h + 24, format.sample_rate, 4);
+  xaudio_put_le(h + 28, format.sample_rate * frame_bytes, 4);
+  xaudio_put_le(h + 32, frame_bytes, 2);
+  xaudio_put_le(h + 34, 16, 2);
+  memcpy(h + 36, "data", 4);
+  xaudio_put_le(h + 40, data_bytes, 4);
+  fwrite(h, 1, sizeof(h), f);
+}
+
+static void print_help()
+{
+  printf("\n");
+  printf("\tUsage xaudio-fetch [OPTIONS]\n");
+  printf("\t\t--host=<host:port>      xaudio's TCP port\n");
+  printf("\t\t--ago=<s>               Start this many seconds back\n");
+  printf("\t\t--from=<unix ms>        Or start at this wall clock time\n");
+  printf("\t\t--seconds=<n>           Stop after this much audio, default up to the live capture\n");
+  printf("\t\t--speed=<percent>       Replay speed, 0 is as fast as possible (0)\n");
+  printf("\t\t--out=<file.wav>        Where to write it (archive.wav)\n");
+  printf("\t\t--help                  Print this help and exit\n");
+  printf("\n");
+  printf("Examples:\n");
+  printf("\txaudio-fetch --host=10.0.0.245:10100 --ago=3600 --seconds=300 --out=hour-ago.wav\n");
+  printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+  std::string host;
+  int port = -1;
+  int64_t from_ms = -1;
+  double seconds = 0;
+  uint32_t speed = 0;
+  char const* out = "archive.wav";
+
+  struct option long_options[] =
+  {
+    { "host", required_argument, NULL, 10000 },
+    { "ago", required_argument, NULL, 10001 },
+    { "from", required_argument, NULL, 10002 },
+    { "seconds", required_argument, NULL, 10003 },
+    { "speed", required_argument, NULL, 10004 },
+    { "out", required_argument, NULL, 10005 },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  int64_t const now_ms = (static_cast<int64_t>(now.tv_sec) * 1000) + (now.tv_usec / 1000);
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+  {
+    switch (c)
+    {
+      case 10000:
+      {
+        std::string s(optarg);
+        size_t colon = s.rfind(':');
+        host = s.substr(0, colon);
+        port = (colon == std::string::npos) ? -1 : static_cast<int>(strtol(s.c_str() + colon + 1, NULL, 10));
+        break;
+      }
+      case 10001:
+        from_ms = now_ms - static_cast<int64_t>(strtod(optarg, NULL) * 1000);
+        break;
+      case 10002:
+        from_ms = strtoll(optarg, NULL, 10);
+        break;
+      case 10003:
+        seconds = strtod(optarg, NULL);
+        break;
+      case 10004:
+        speed = static_cast<uint32_t>(strtoul(optarg, NULL, 10));
+        break;
+      case 10005:
+        out = optarg;
+        break;
+      default:
+        print_help();
+        exit(0);
+        break;
+    }
+  }
+
+  if ((port <= 0) || (from_ms < 0))
+  {
+    printf("failed to provide --host=<host:port> and --ago or --from\n");
+    print_help();
+    exit(1);
+  }
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_aton(host.c_str(), &addr.sin_addr);
+  if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+  {
+    printf("failed to connect to %s:%d. %s\n", host.c_str(), port, strerror(errno));
+    exit(1);
+  }
+
+  // any format will do, asking for one makes xaudio say what the capture is
+  xaudio_hello hello;
+  hello.version_or_flags = XAUDIO_PROTOCOL_VERSION | XAUDIO_HELLO_FORMAT | XAUDIO_HELLO_REPLAY;
+  hello.session_token = 0;
+  hello.offset = 0;
+  xaudio_format format;
+  format.sample_rate = 16000;
+  format.channels = 1;
+  format.sample_format = XAUDIO_S16LE;
+  xaudio_replay replay;
+  replay.from_ms = from_ms;
+  replay.speed_percent = speed;
+
+  uint8_t buff[XAUDIO_HELLO_SIZE + XAUDIO_FORMAT_SIZE + XAUDIO_REPLAY_SIZE];
+  xaudio_encode_hello(hello, buff);
+  xaudio_encode_format(format, buff + XAUDIO_HELLO_SIZE);
+  xaudio_encode_replay(replay, buff + XAUDIO_HELLO_SIZE + XAUDIO_FORMAT_SIZE);
+  if (send(sock, buff, sizeof(buff), MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(buff)))
+  {
+    printf("failed to send the replay request. %s\n", strerror(errno));
+    exit(1);
+  }
+
+  xaudio_hello reply;
+  if (!recv_all(sock, buff, XAUDIO_HELLO_SIZE) || !xaudio_is_hello_prefix(buff, XAUDIO_HELLO_SIZE))
+  {
+    printf("xaudio didn't answer with a hello, it's too old to replay\n");
+    exit(1);
+  }
+  xaudio_decode_hello(buff, &reply);
+
+  if (!(reply.version_or_flags & XAUDIO_FLAG_REPLAY) || !(reply.version_or_flags & XAUDIO_FLAG_FORMAT)
+    || !recv_all(sock, buff, XAUDIO_FORMAT_SIZE + XAUDIO_REPLAY_SIZE))
+  {
+    printf("xaudio doesn't replay\n");
+    exit(1);
+  }
+  xaudio_decode_format(buff, &format);
+  xaudio_decode_replay(buff + XAUDIO_FORMAT_SIZE, &replay);
+  if (replay.from_ms == 0)
+  {
+    printf("nothing archived from then on\n");
+    exit(1);
+  }
+
+  FILE* f = fopen(out, "wb");
+  if (!f)
+  {
+    printf("failed to open %s. %s\n", out, strerror(errno));
+    exit(1);
+  }
+  write_wav_header(f, format, 0);
+
+  uint32_t const frame_bytes = format.channels * 2;
+  uint64_t const limit = (seconds > 0) ? (static_cast<uint64_t>(seconds * format.sample_rate) * frame_bytes) : UINT32_MAX - 44;
+  uint64_t total = 0;
+  std::string data(64 * 1024, '\0');
+  while (total < limit)
+  {
+    ssize_t n = recv(sock, &data[0], std::min<uint64_t>(data.size(), limit - total), 0);
+    if (n <= 0)
+      break;
+    fwrite(data.data(), 1, n, f);
+    total += n;
+  }
+  close(sock);
+
+  total -= total % frame_bytes;
+  fseek(f, 0, SEEK_SET);
+  write_wav_header(f, format, static_cast<uint32_t>(total));
+  fclose(f);
+
+  printf("%s: %.1fs of %uHz %dch from %.3fs ago\n", out, static_cast<double>(total) / (format.sample_rate * frame_bytes),
+    format.sample_rate, format.channels, (now_ms - replay.from_ms) / 1000.0);
+  return 0;
+}
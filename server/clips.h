@@ -0,0 +1,243 @@
+#ifndef CLIPS_H
+#define CLIPS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../protocol.h"
+#include "transcoder.h"
+#include "wavfile.h"
+
+// Announcements and chimes xaudio plays on its own, mixed into whatever a
+// client is playing or into silence when nobody is.
+//
+// Every 16 bit PCM WAV in the clip directory is decoded and converted to
+// the playback format once, at startup, into its own read only mapping
+// that is populated and locked so playing it never faults. Triggering a
+// clip only claims one of XAUDIO_CLIP_VOICES voices: nothing is decoded,
+// allocated or sent over the network.
+//
+// Clips are placed on the playback clock, the frames written to the device
+// since xaudio started. A voice starts at a frame of that clock, or as
+// soon as possible if that frame was already written, and the mixer adds
+// it into each block on its way to the device, so the start is exact to
+// the sample whether the block came from a client or is silence.
+
+enum
+{
+  XAUDIO_CLIP_VOICES = 8,
+  XAUDIO_CLIP_NAME_SIZE = 32
+};
+
+struct xaudio_clip
+{
+  char name[XAUDIO_CLIP_NAME_SIZE];
+  int16_t const* pcm;
+  size_t map_bytes;
+  uint64_t frames;
+};
+
+struct xaudio_clip_voice
+{
+  int clip;
+  uint64_t start;
+};
+
+struct xaudio_clip_mixer
+{
+  uint32_t sample_rate;
+  int channels;
+  std::vector<xaudio_clip> clips;
+  xaudio_clip_voice voices[XAUDIO_CLIP_VOICES];
+
+  // the playback clock
+  uint64_t position;
+};
+
+// Decodes path into the mixer's format, returns 0 or -errno, -EINVAL for
+// anything that isn't a 16 bit PCM WAV.
+static inline int
+xaudio_clip_load(xaudio_clip_mixer* m, char const* path, char const* name)
+{
+  xaudio_wav wav;
+  int err = xaudio_wav_read(path, &wav);
+  if (err < 0)
+    return err;
+
+  uint32_t const rate = wav.sample_rate;
+  int const channels = wav.channels;
+  std::vector<int16_t>& samples = wav.samples;
+  size_t const in_frames = samples.size() / channels;
+  std::vector<int16_t> converted;
+  if ((rate == m->sample_rate) && (channels == m->channels))
+  {
+    converted.swap(samples);
+  }
+  else
+  {
+    xaudio_format out;
+    out.sample_rate = m->sample_rate;
+    out.channels = static_cast<uint8_t>(m->channels);
+    out.sample_format = XAUDIO_S16LE;
+
+    transcoder t;
+    transcoder_init(&t, rate, channels, out);
+    converted.resize(transcoder_max_output(&t, in_frames) / 2);
+    size_t const bytes = transcoder_run(&t, &samples[0], in_frames, reinterpret_cast<uint8_t *>(&converted[0]));
+    converted.resize(bytes / 2);
+  }
+
+  if (converted.empty())
+    return -EINVAL;
+
+  xaudio_clip clip;
+  snprintf(clip.name, sizeof(clip.name), "%s", name);
+  clip.frames = converted.size() / m->channels;
+  clip.map_bytes = converted.size() * 2;
+  void* p = mmap(NULL, clip.map_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (p == MAP_FAILED)
+    return -errno;
+
+  memcpy(p, &converted[0], converted.size() * 2);
+  mprotect(p, clip.map_bytes, PROT_READ);
+
+  // best effort, without the privilege it's only populated
+  mlock(p, clip.map_bytes);
+  clip.pcm = static_cast<int16_t const *>(p);
+  m->clips.push_back(clip);
+  return 0;
+}
+
+// Loads every .wav in dir, named after the file without the extension.
+// Returns the number of clips loaded or -errno if dir can't be read, the
+// path and -errno of each file it couldn't load go into skipped.
+static inline int
+xaudio_clip_load_dir(xaudio_clip_mixer* m, char const* dir, uint32_t sample_rate, int channels,
+  std::vector<std::pair<std::string, int> >* skipped)
+{
+  m->sample_rate = sample_rate;
+  m->channels = channels;
+  m->position = 0;
+  for (int i = 0; i < XAUDIO_CLIP_VOICES; ++i)
+    m->voices[i].clip = -1;
+
+  DIR* d = opendir(dir);
+  if (!d)
+    return -errno;
+
+  std::vector<std::string> names;
+  while (struct dirent* e = readdir(d))
+  {
+    size_t const n = strlen(e->d_name);
+    if ((n > 4) && !strcmp(e->d_name + n - 4, ".wav"))
+      names.push_back(e->d_name);
+  }
+  closedir(d);
+  std::sort(names.begin(), names.end());
+
+  int loaded = 0;
+  for (size_t i = 0; i < names.size(); ++i)
+  {
+    std::string const path = std::string(dir) + "/" + names[i];
+    std::string const name = names[i].substr(0, names[i].size() - 4);
+    int err = xaudio_clip_load(m, path.c_str(), name.c_str());
+    if (err < 0)
+      skipped->push_back(std::make_pair(path, err));
+    else
+      loaded++;
+  }
+  return loaded;
+}
+
+static inline int
+xaudio_clip_find(xaudio_clip_mixer const* m, char const* name)
+{
+  for (size_t i = 0; i < m->clips.size(); ++i)
+  {
+    if (!strcmp(m->clips[i].name, name))
+      return static_cast<int>(i);
+  }
+  return -1;
+}
+
+// Starts clip at start on the playback clock, or at the next frame written
+// if that has passed. Returns the frame it starts at, or -1 when every
+// voice is busy.
+static inline int64_t
+xaudio_clip_trigger(xaudio_clip_mixer* m, int clip, uint64_t start)
+{
+  for (int i = 0; i < XAUDIO_CLIP_VOICES; ++i)
+  {
+    xaudio_clip_voice& v = m->voices[i];
+    if (v.clip != -1)
+      continue;
+    v.clip = clip;
+    v.start = std::max(start, m->position);
+    return static_cast<int64_t>(v.start);
+  }
+  return -1;
+}
+
+static inline void
+xaudio_clip_stop_all(xaudio_clip_mixer* m)
+{
+  for (int i = 0; i < XAUDIO_CLIP_VOICES; ++i)
+    m->voices[i].clip = -1;
+}
+
+static inline bool
+xaudio_clip_active(xaudio_clip_mixer const* m)
+{
+  for (int i = 0; i < XAUDIO_CLIP_VOICES; ++i)
+  {
+    if (m->voices[i].clip != -1)
+      return true;
+  }
+  return false;
+}
+
+// Adds every voice playing during the next frames of the playback clock
+// into pcm, saturating, and moves the clock past them.
+static inline void
+xaudio_clip_mix(xaudio_clip_mixer* m, int16_t* pcm, size_t frames)
+{
+  uint64_t const begin = m->position;
+  uint64_t const end = begin + frames;
+  m->position = end;
+
+  for (int i = 0; i < XAUDIO_CLIP_VOICES; ++i)
+  {
+    xaudio_clip_voice& v = m->voices[i];
+    if ((v.clip == -1) || (v.start >= end))
+      continue;
+
+    xaudio_clip const& clip = m->clips[v.clip];
+    uint64_t const from = std::max(begin, v.start);
+    uint64_t const to = std::min(end, v.start + clip.frames);
+    if (from < to)
+    {
+      int16_t* out = pcm + ((from - begin) * m->channels);
+      int16_t const* in = clip.pcm + ((from - v.start) * m->channels);
+      size_t const samples = (to - from) * m->channels;
+      for (size_t j = 0; j < samples; ++j)
+      {
+        int32_t const s = static_cast<int32_t>(out[j]) + in[j];
+        out[j] = static_cast<int16_t>((s > 32767) ? 32767 : ((s < -32768) ? -32768 : s));
+      }
+    }
+
+    if ((v.start + clip.frames) <= end)
+      v.clip = -1;
+  }
+}
+
+#endif // CLIPS_H
@@ -0,0 +1,47 @@
+#ifndef CPUUSAGE_H
+#define CPUUSAGE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// CPU time the benches charge to themselves and to the xaudio they measure.
+
+// user + system time of this process
+static inline double
+xaudio_cpu_self_us()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// utime + stime of another process, -1 if it can't be read
+static inline double
+xaudio_cpu_process_us(int pid)
+{
+  if (pid <= 0)
+    return -1;
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return -1;
+
+  char buff[1024];
+  size_t n = fread(buff, 1, sizeof(buff) - 1, f);
+  fclose(f);
+  buff[n] = '\0';
+
+  // the fields after the command name, which may contain spaces
+  char const* p = strrchr(buff, ')');
+  unsigned long utime = 0;
+  unsigned long stime = 0;
+  if (!p || (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2))
+    return -1;
+  return (utime + stime) * (1e6 / sysconf(_SC_CLK_TCK));
+}
+
+#endif // CPUUSAGE_H
@@ -0,0 +1,340 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "simd.h"
+
+// A chain of processing stages run in place on 16 bit periods, one chain
+// for the capture and one for playback, given as a list like
+// "dc,highpass:100,gain:6,limit:-1":
+//
+//   gain:<dB>       a fixed gain
+//   dc              takes the DC offset out, a one pole high-pass at 10Hz
+//   highpass:<Hz>   second order Butterworth high-pass
+//   limit:<dBFS>    keeps peaks under the level, releasing over 50ms
+//
+// A period goes through in blocks of DSP_BLOCK_FRAMES frames converted to
+// floats in 16 bit units, every stage runs over the block and it is
+// converted back, clamped, at the end. Nothing is allocated after
+// dsp_parse. Gain, the limiter and the conversions run four floats at a
+// time, see simd.h. The filters are recursive, every sample depends on the
+// one before it, so they run in plain C, the channels of a frame side by
+// side.
+//
+// Each stage's time is added up for the CPU report, and so is the
+// conversion's.
+
+enum
+{
+  DSP_MAX_STAGES = 8,
+  DSP_MAX_CHANNELS = 8,
+  DSP_BLOCK_FRAMES = 256,
+  // frames the limiter takes one gain for
+  DSP_LIMIT_FRAMES = 8
+};
+
+enum
+{
+  DSP_GAIN,
+  DSP_FILTER,
+  DSP_LIMIT
+};
+
+static const float kDspDcHz = 10.0f;
+static const float kDspLimitReleaseMs = 50.0f;
+static const float kDspMaxGainDb = 40.0f;
+
+struct dsp_stage
+{
+  int kind;
+  char name[24];
+
+  // gain, and the limiter's current one
+  float gain;
+
+  // filters, transposed direct form II with a state per channel
+  float b0;
+  float b1;
+  float b2;
+  float a1;
+  float a2;
+  float z1[DSP_MAX_CHANNELS];
+  float z2[DSP_MAX_CHANNELS];
+
+  // limiter
+  float threshold;
+  float release;
+
+  int64_t busy_ns;
+};
+
+struct dsp_chain
+{
+  int channels;
+  int count;
+  dsp_stage stages[DSP_MAX_STAGES];
+  float block[DSP_BLOCK_FRAMES * DSP_MAX_CHANNELS];
+  int64_t convert_ns;
+  uint64_t periods;
+};
+
+static inline void
+dsp_filter_init(dsp_stage* s, float b0, float b1, float b2, float a1, float a2)
+{
+  s->kind = DSP_FILTER;
+  s->b0 = b0;
+  s->b1 = b1;
+  s->b2 = b2;
+  s->a1 = a1;
+  s->a2 = a2;
+  memset(s->z1, 0, sizeof(s->z1));
+  memset(s->z2, 0, sizeof(s->z2));
+}
+
+// the number after the colon of a stage, false when there is none or it
+// isn't all number
+static inline bool
+dsp_arg(char const* stage, size_t len, float* value)
+{
+  char const* colon = static_cast<char const *>(memchr(stage, ':', len));
+  if (!colon || ((colon + 1) == (stage + len)))
+    return false;
+
+  char arg[16];
+  size_t const n = (stage + len) - (colon + 1);
+  if (n >= sizeof(arg))
+    return false;
+  memcpy(arg, colon + 1, n);
+  arg[n] = 0;
+
+  char* end;
+  *value = static_cast<float>(strtod(arg, &end));
+  return (*end == 0);
+}
+
+static inline bool
+dsp_is(char const* stage, size_t len, char const* name)
+{
+  size_t const n = strlen(name);
+  return (len >= n) && !memcmp(stage, name, n) && ((len == n) || (stage[n] == ':'));
+}
+
+// One stage of the list, false when it isn't one or its setting is out of
+// range.
+static inline bool
+dsp_parse_stage(dsp_stage* s, char const* stage, size_t len, uint32_t sample_rate)
+{
+  if ((len == 0) || (len >= sizeof(s->name)))
+    return false;
+  memcpy(s->name, stage, len);
+  s->name[len] = 0;
+  s->busy_ns = 0;
+
+  float value;
+  if (dsp_is(stage, len, "gain"))
+  {
+    if (!dsp_arg(stage, len, &value) || (fabsf(value) > kDspMaxGainDb))
+      return false;
+    s->kind = DSP_GAIN;
+    s->gain = powf(10.0f, value / 20.0f);
+    return true;
+  }
+
+  if ((len == 2) && !memcmp(stage, "dc", 2))
+  {
+    // y[n] = x[n] - x[n - 1] + r * y[n - 1]
+    float const r = 1.0f - ((2.0f * static_cast<float>(M_PI) * kDspDcHz) / sample_rate);
+    dsp_filter_init(s, 1.0f, -1.0f, 0.0f, -r, 0.0f);
+    return true;
+  }
+
+  if (dsp_is(stage, len, "highpass"))
+  {
+    if (!dsp_arg(stage, len, &value) || (value <= 0) || (value >= (sample_rate / 2.0f)))
+      return false;
+
+    // the bilinear transform of a Butterworth high-pass, Q = 1 / sqrt(2)
+    double const w = (2 * M_PI * value) / sample_rate;
+    double const alpha = sin(w) / (2 * M_SQRT1_2);
+    double const a0 = 1 + alpha;
+    double const c = cos(w);
+    dsp_filter_init(s, static_cast<float>(((1 + c) / 2) / a0), static_cast<float>(-(1 + c) / a0),
+      static_cast<float>(((1 + c) / 2) / a0), static_cast<float>((-2 * c) / a0), static_cast<float>((1 - alpha) / a0));
+    return true;
+  }
+
+  if (dsp_is(stage, len, "limit"))
+  {
+    if (!dsp_arg(stage, len, &value) || (value > 0) || (value < -60))
+      return false;
+    s->kind = DSP_LIMIT;
+    s->threshold = 32767.0f * powf(10.0f, value / 20.0f);
+    s->gain = 1.0f;
+    // back from no gain at all to unity within the release time
+    s->release = (1000.0f * DSP_LIMIT_FRAMES) / (kDspLimitReleaseMs * sample_rate);
+    return true;
+  }
+  return false;
+}
+
+// The chain for a comma separated list of stages, false when any of them
+// is wrong or there are more than DSP_MAX_STAGES. An empty list is no
+// processing at all.
+static inline bool
+dsp_parse(dsp_chain* d, char const* list, uint32_t sample_rate, int channels)
+{
+  d->channels = channels;
+  d->count = 0;
+  d->convert_ns = 0;
+  d->periods = 0;
+  if ((channels < 1) || (channels > DSP_MAX_CHANNELS))
+    return false;
+
+  char const* p = list;
+  while (*p)
+  {
+    char const* comma = strchr(p, ',');
+    size_t const len = comma ? static_cast<size_t>(comma - p) : strlen(p);
+    if ((d->count == DSP_MAX_STAGES) || !dsp_parse_stage(&d->stages[d->count], p, len, sample_rate))
+      return false;
+    d->count++;
+    p += len + (comma ? 1 : 0);
+  }
+  return true;
+}
+
+static inline int64_t
+dsp_nanos_since(struct timespec const& then)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - then.tv_sec) * 1000000000LL) + (now.tv_nsec - then.tv_nsec);
+}
+
+static inline void
+dsp_gain(float* x, size_t n, float gain)
+{
+  simd_v4 const g = simd_dup(gain);
+  size_t i = 0;
+  for (; (i + 4) <= n; i += 4)
+    simd_store(x + i, simd_mul(simd_load(x + i), g));
+  for (; i < n; ++i)
+    x[i] *= gain;
+}
+
+static inline void
+dsp_filter(dsp_stage* s, float* x, size_t frames, int channels)
+{
+  // frame by frame, so the channels' recursions overlap in the pipeline
+  float const b0 = s->b0;
+  float const b1 = s->b1;
+  float const b2 = s->b2;
+  float const a1 = s->a1;
+  float const a2 = s->a2;
+  float z1[DSP_MAX_CHANNELS];
+  float z2[DSP_MAX_CHANNELS];
+  memcpy(z1, s->z1, sizeof(z1));
+  memcpy(z2, s->z2, sizeof(z2));
+  for (size_t i = 0; i < frames; ++i)
+  {
+    float* f = x + (i * channels);
+    for (int c = 0; c < channels; ++c)
+    {
+      float const in = f[c];
+      float const out = (b0 * in) + z1[c];
+      z1[c] = (b1 * in) - (a1 * out) + z2[c];
+      z2[c] = (b2 * in) - (a2 * out);
+      f[c] = out;
+    }
+  }
+
+  // decaying through silence the state would end up denormal, which is
+  // slow on most FPUs
+  for (int c = 0; c < channels; ++c)
+  {
+    s->z1[c] = (fabsf(z1[c]) < 1e-20f) ? 0 : z1[c];
+    s->z2[c] = (fabsf(z2[c]) < 1e-20f) ? 0 : z2[c];
+  }
+}
+
+// Every DSP_LIMIT_FRAMES frames get one gain, low enough to keep their
+// peak at the threshold, or back up toward unity by the release step when
+// that's low enough.
+static inline void
+dsp_limit(dsp_stage* s, float* x, size_t frames, int channels)
+{
+  size_t const step = static_cast<size_t>(DSP_LIMIT_FRAMES) * channels;
+  size_t const n = frames * channels;
+  for (size_t start = 0; start < n; start += step)
+  {
+    size_t const end = std::min(n, start + step);
+    size_t i = start;
+    simd_v4 m = simd_dup(0);
+    for (; (i + 4) <= end; i += 4)
+      m = simd_max(m, simd_abs(simd_load(x + i)));
+    float peak = simd_hmax(m);
+    for (; i < end; ++i)
+      peak = std::max(peak, fabsf(x[i]));
+
+    float gain = std::min(1.0f, s->gain + s->release);
+    if ((peak * gain) > s->threshold)
+      gain = s->threshold / peak;
+    s->gain = gain;
+    if (gain < 1.0f)
+      dsp_gain(x + start, end - start, gain);
+  }
+}
+
+// Runs the chain over frames of pcm, in place.
+static inline void
+dsp_run(dsp_chain* d, int16_t* pcm, size_t frames)
+{
+  int const channels = d->channels;
+  for (size_t done = 0; done < frames; done += DSP_BLOCK_FRAMES)
+  {
+    size_t const block_frames = std::min<size_t>(frames - done, DSP_BLOCK_FRAMES);
+    size_t const n = block_frames * channels;
+    int16_t* in = pcm + (done * channels);
+    float* x = d->block;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t i = 0;
+    for (; (i + 4) <= n; i += 4)
+      simd_store(x + i, simd_load_s16(in + i));
+    for (; i < n; ++i)
+      x[i] = in[i];
+    d->convert_ns += dsp_nanos_since(start);
+
+    for (int k = 0; k < d->count; ++k)
+    {
+      dsp_stage* s = &d->stages[k];
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      if (s->kind == DSP_GAIN)
+        dsp_gain(x, n, s->gain);
+      else if (s->kind == DSP_FILTER)
+        dsp_filter(s, x, block_frames, channels);
+      else
+        dsp_limit(s, x, block_frames, channels);
+      s->busy_ns += dsp_nanos_since(start);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    i = 0;
+    for (; (i + 4) <= n; i += 4)
+      simd_store_s16(in + i, simd_load(x + i));
+    for (; i < n; ++i)
+      in[i] = static_cast<int16_t>((x[i] > 32767.0f) ? 32767.0f : ((x[i] < -32768.0f) ? -32768.0f : x[i]));
+    d->convert_ns += dsp_nanos_since(start);
+  }
+  d->periods++;
+}
+
+#endif // DSP_H
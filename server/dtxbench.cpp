@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <vector>
+
+#include "../protocol.h"
+#include "vad.h"
+#include "wavfile.h"
+
+// Runs recordings through the VAD xaudio uses on its capture and reports
+// how much of each would go out as comfort noise and what the framed
+// stream costs against plain PCM. Takes 16 bit PCM WAV files, in periods
+// the size of xaudio's capture periods.
+
+static bool read_wav(char const* path, xaudio_wav* wav)
+{
+  int const err = xaudio_wav_read(path, wav);
+  if (err < 0)
+  {
+    printf("failed to read %s. %s\n", path, (err == -EINVAL) ? "not a 16 bit PCM WAV" : strerror(-err));
+    return false;
+  }
+  return true;
+}
+
+static double seconds_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void print_help()
+{
+  printf("\n");
+  printf("\tUsage xaudio-dtxbench [OPTIONS] <file.wav>...\n");
+  printf("\t\t--frames=<n>            Frames per period, xaudio's --capture-frames (128)\n");
+  printf("\t\t--hangover=<ms>         xaudio's --vad-hangover (200)\n");
+  printf("\t\t--help                  Print this help and exit\n");
+  printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+  int period_frames = 128;
+  int hangover_ms = 200;
+
+  struct option long_options[] =
+  {
+    { "frames", required_argument, NULL, 10000 },
+    { "hangover", required_argument, NULL, 10001 },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+  {
+    switch (c)
+    {
+      case 10000:
+        period_frames = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10001:
+        hangover_ms = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      default:
+        print_help();
+        exit(0);
+        break;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    printf("failed to provide a recording\n");
+    print_help();
+    exit(1);
+  }
+
+  uint64_t total_pcm = 0;
+  uint64_t total_wire = 0;
+  for (int i = optind; i < argc; ++i)
+  {
+    xaudio_wav wav;
+    if (!read_wav(argv[i], &wav))
+      continue;
+
+    vad v;
+    vad_init(&v, wav.channels, wav.sample_rate, period_frames, hangover_ms);
+
+    size_t const period_samples = period_frames * wav.channels;
+    uint64_t periods = 0;
+    uint64_t silent = 0;
+    uint64_t pcm = 0;
+    uint64_t wire = 0;
+    double busy = 0;
+    for (size_t pos = 0; (pos + period_samples) <= wav.samples.size(); pos += period_samples)
+    {
+      int level_db;
+      double const start = seconds_now();
+      bool const voice = vad_run(&v, &wav.samples[pos], period_frames, &level_db);
+      busy += seconds_now() - start;
+
+      periods++;
+      pcm += period_samples * 2;
+      wire += XAUDIO_DTX_HEADER_SIZE + (voice ? (period_samples * 2) : 0);
+      if (!voice)
+        silent++;
+    }
+
+    printf("%-32s %7.1fs silent:%5.1f%% pcm:%-8.1fKB dtx:%-8.1fKB saved:%5.1f%% vad/period:%.2fus\n", argv[i],
+      (static_cast<double>(periods) * period_frames) / wav.sample_rate, (100.0 * silent) / (periods ? periods : 1),
+      pcm / 1024.0, wire / 1024.0, pcm ? (100.0 - ((100.0 * wire) / pcm)) : 0, periods ? ((busy * 1e6) / periods) : 0);
+    total_pcm += pcm;
+    total_wire += wire;
+  }
+
+  if (total_pcm > 0)
+    printf("total saved:%.1f%%\n", 100.0 - ((100.0 * total_wire) / total_pcm));
+  return 0;
+}
@@ -0,0 +1,274 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "../protocol.h"
+
+// Forward error correction for audio packets on a link that drops them.
+//
+// Every packet gets an 8 byte header: its sequence number, its type, the
+// group size k and the payload length. After every k data packets the
+// encoder sends a parity packet for them, the XOR of their payloads padded
+// to the longest, after 2 bytes holding the XOR of their lengths. Any one
+// packet of a group can be rebuilt from the other k - 1 and the parity, for
+// 1/k more bandwidth and up to k packets more latency on a loss. k = 0 is
+// no parity at all, just the sequence numbers to tell losses apart.
+//
+// xaudio's streams all go over TCP, which never loses a packet, only
+// delays it, so none of them use this. Only fecbench builds it in, to weigh
+// the overhead against PLC alone for a datagram transport.
+
+enum
+{
+  XAUDIO_FEC_HEADER_SIZE = 8,
+  XAUDIO_FEC_MAX_K = 32,
+  XAUDIO_FEC_WINDOW = 256
+};
+
+enum
+{
+  XAUDIO_FEC_DATA = 0,
+  XAUDIO_FEC_PARITY = 1
+};
+
+struct xaudio_fec_encoder
+{
+  int k;
+  uint32_t seq;
+  int count;
+  uint16_t length_xor;
+  std::vector<uint8_t> parity;
+};
+
+static inline void
+xaudio_fec_put_header(uint8_t* packet, uint32_t seq, int type, int k, uint16_t length)
+{
+  xaudio_put_le(packet, seq, 4);
+  packet[4] = static_cast<uint8_t>(type);
+  packet[5] = static_cast<uint8_t>(k);
+  xaudio_put_le(packet + 6, length, 2);
+}
+
+static inline void
+xaudio_fec_encoder_init(xaudio_fec_encoder* e, int k)
+{
+  e->k = k;
+  e->seq = 0;
+  e->count = 0;
+  e->length_xor = 0;
+  e->parity.clear();
+}
+
+// The data packet for payload into packet, which has room for
+// XAUDIO_FEC_HEADER_SIZE + len bytes. Returns its size.
+static inline size_t
+xaudio_fec_encode(xaudio_fec_encoder* e, uint8_t const* payload, uint16_t len, uint8_t* packet)
+{
+  xaudio_fec_put_header(packet, e->seq, XAUDIO_FEC_DATA, e->k, len);
+  memcpy(packet + XAUDIO_FEC_HEADER_SIZE, payload, len);
+  e->seq++;
+
+  if (e->k > 0)
+  {
+    if (e->parity.size() < len)
+      e->parity.resize(len, 0);
+    for (uint16_t i = 0; i < len; ++i)
+      e->parity[i] ^= payload[i];
+    e->length_xor ^= len;
+    e->count++;
+  }
+  return XAUDIO_FEC_HEADER_SIZE + len;
+}
+
+// The parity packet into packet once a group is complete, which has room
+// for XAUDIO_FEC_HEADER_SIZE + 2 + the longest payload of the group.
+// Returns its size, 0 while there is nothing to send.
+static inline size_t
+xaudio_fec_parity(xaudio_fec_encoder* e, uint8_t* packet)
+{
+  if ((e->k <= 0) || (e->count < e->k))
+    return 0;
+
+  uint16_t const len = static_cast<uint16_t>(e->parity.size() + 2);
+  xaudio_fec_put_header(packet, e->seq - e->k, XAUDIO_FEC_PARITY, e->k, len);
+  xaudio_put_le(packet + XAUDIO_FEC_HEADER_SIZE, e->length_xor, 2);
+  if (!e->parity.empty())
+    memcpy(packet + XAUDIO_FEC_HEADER_SIZE + 2, &e->parity[0], e->parity.size());
+
+  e->count = 0;
+  e->length_xor = 0;
+  e->parity.clear();
+  return XAUDIO_FEC_HEADER_SIZE + len;
+}
+
+struct xaudio_fec_slot
+{
+  uint32_t seq;
+  bool present;
+  std::vector<uint8_t> data;
+};
+
+struct xaudio_fec_decoder
+{
+  int k;
+  bool started;
+  uint32_t next;
+  uint32_t highest;
+
+  // data by sequence number, parity by the first sequence number of its
+  // group, both modulo the window. Delivered data stays until its slot is
+  // reused, the rest of its group may still need it.
+  xaudio_fec_slot data[XAUDIO_FEC_WINDOW];
+  xaudio_fec_slot parity[XAUDIO_FEC_WINDOW];
+
+  uint64_t received;
+  uint64_t recovered;
+  uint64_t lost;
+};
+
+static inline void
+xaudio_fec_decoder_init(xaudio_fec_decoder* d)
+{
+  d->k = 0;
+  d->started = false;
+  d->next = 0;
+  d->highest = 0;
+  for (int i = 0; i < XAUDIO_FEC_WINDOW; ++i)
+  {
+    d->data[i].present = false;
+    d->parity[i].present = false;
+  }
+  d->received = 0;
+  d->recovered = 0;
+  d->lost = 0;
+}
+
+// A packet off the link. Ones too old to matter, malformed or from too far
+// ahead are dropped.
+static inline void
+xaudio_fec_receive(xaudio_fec_decoder* d, uint8_t const* packet, size_t len)
+{
+  if (len < XAUDIO_FEC_HEADER_SIZE)
+    return;
+
+  uint32_t const seq = static_cast<uint32_t>(xaudio_get_le(packet, 4));
+  int const type = packet[4];
+  int const k = packet[5];
+  size_t const length = static_cast<size_t>(xaudio_get_le(packet + 6, 2));
+  if (((XAUDIO_FEC_HEADER_SIZE + length) > len) || (k > XAUDIO_FEC_MAX_K)
+    || ((type == XAUDIO_FEC_PARITY) && ((k == 0) || (length < 2))))
+    return;
+
+  if (!d->started)
+  {
+    d->started = true;
+    d->next = seq;
+    d->highest = seq;
+  }
+  if ((static_cast<int32_t>(seq - d->next) < -static_cast<int32_t>(XAUDIO_FEC_MAX_K))
+    || (static_cast<int32_t>(seq - d->next) >= (XAUDIO_FEC_WINDOW - XAUDIO_FEC_MAX_K)))
+    return;
+
+  d->k = k;
+  uint32_t const last = (type == XAUDIO_FEC_PARITY) ? (seq + k - 1) : seq;
+  if (static_cast<int32_t>(last - d->highest) > 0)
+    d->highest = last;
+
+  xaudio_fec_slot* slot = (type == XAUDIO_FEC_PARITY) ? &d->parity[seq % XAUDIO_FEC_WINDOW] : &d->data[seq % XAUDIO_FEC_WINDOW];
+  if (slot->present && (slot->seq == seq))
+    return;
+  slot->seq = seq;
+  slot->present = true;
+  slot->data.assign(packet + XAUDIO_FEC_HEADER_SIZE, packet + XAUDIO_FEC_HEADER_SIZE + length);
+  if (type == XAUDIO_FEC_DATA)
+    d->received++;
+}
+
+static inline bool
+xaudio_fec_has(xaudio_fec_decoder const* d, uint32_t seq)
+{
+  xaudio_fec_slot const& slot = d->data[seq % XAUDIO_FEC_WINDOW];
+  return slot.present && (slot.seq == seq);
+}
+
+// Rebuilds seq from the parity and the rest of its group, if they are all
+// there.
+static inline bool
+xaudio_fec_recover(xaudio_fec_decoder* d, uint32_t seq)
+{
+  if (d->k <= 0)
+    return false;
+
+  uint32_t const first = seq - (seq % d->k);
+  xaudio_fec_slot const& parity = d->parity[first % XAUDIO_FEC_WINDOW];
+  if (!parity.present || (parity.seq != first))
+    return false;
+  for (uint32_t s = first; s != (first + d->k); ++s)
+  {
+    if ((s != seq) && !xaudio_fec_has(d, s))
+      return false;
+  }
+
+  uint16_t length = static_cast<uint16_t>(xaudio_get_le(&parity.data[0], 2));
+  std::vector<uint8_t> payload(parity.data.begin() + 2, parity.data.end());
+  for (uint32_t s = first; s != (first + d->k); ++s)
+  {
+    if (s == seq)
+      continue;
+    std::vector<uint8_t> const& other = d->data[s % XAUDIO_FEC_WINDOW].data;
+    length ^= static_cast<uint16_t>(other.size());
+    for (size_t i = 0; (i < other.size()) && (i < payload.size()); ++i)
+      payload[i] ^= other[i];
+  }
+  if (length > payload.size())
+    return false;
+
+  xaudio_fec_slot* slot = &d->data[seq % XAUDIO_FEC_WINDOW];
+  slot->seq = seq;
+  slot->present = true;
+  slot->data.assign(payload.begin(), payload.begin() + length);
+  d->recovered++;
+  return true;
+}
+
+// The next packet in order into out, which has room for the longest
+// payload, and its length into len. Returns 1 when it was delivered, 0
+// when it may still arrive or be rebuilt, -1 when it is lost for good and
+// has to be concealed.
+static inline int
+xaudio_fec_pop(xaudio_fec_decoder* d, uint8_t* out, size_t* len)
+{
+  if (!d->started || (static_cast<int32_t>(d->highest - d->next) < 0))
+    return 0;
+
+  uint32_t const seq = d->next;
+  if (xaudio_fec_has(d, seq) || xaudio_fec_recover(d, seq))
+  {
+    xaudio_fec_slot* slot = &d->data[seq % XAUDIO_FEC_WINDOW];
+    *len = slot->data.size();
+    if (!slot->data.empty())
+      memcpy(out, &slot->data[0], slot->data.size());
+    d->next++;
+    return 1;
+  }
+
+  // given up on once anything from a later group came, the group's parity
+  // is sent before any of it
+  bool gone;
+  if (d->k > 0)
+    gone = (d->highest / d->k) > (seq / d->k);
+  else
+    gone = static_cast<int32_t>(d->highest - seq) > 0;
+  if (!gone)
+    return 0;
+
+  d->lost++;
+  d->next++;
+  return -1;
+}
+
+#endif // FEC_H
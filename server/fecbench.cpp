@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "../plc.h"
+#include "../protocol.h"
+#include "fec.h"
+#include "wavfile.h"
+
+// Sends a recording over a simulated lossy link a period per packet and
+// reports what reaches the listener: with XOR parity over k packets (see
+// fec.h) and without, at a few loss rates, losses independent or in
+// bursts. For each it prints the bandwidth the parity and headers cost,
+// the packets still lost after it, how often the listener hears a gap and
+// how many of those are longer than the 20ms PLC (see plc.h) covers well,
+// the latency waiting for parity adds and how much closer the concealment
+// of the lost packets is to what was lost than plain silence. Takes a 16
+// bit PCM WAV file, --synthetic makes up a minute of voice at 16kHz.
+
+static bool read_wav(char const* path, xaudio_wav* wav)
+{
+  int const err = xaudio_wav_read(path, wav);
+  if (err < 0)
+  {
+    printf("failed to read %s. %s\n", path, (err == -EINVAL) ? "not a 16 bit PCM WAV" : strerror(-err));
+    return false;
+  }
+  if (wav->channels > 16)
+  {
+    printf("%s: more than 16 channels\n", path);
+    return false;
+  }
+  return true;
+}
+
+static double uniform(uint32_t* seed)
+{
+  *seed = (*seed * 1664525u) + 1013904223u;
+  return (*seed >> 8) / 16777216.0;
+}
+
+// syllables of a voice, harmonics of a wandering pitch under a 4Hz
+// envelope, with a pause every few seconds
+static void make_synthetic(uint32_t sample_rate, int seconds, xaudio_wav* wav)
+{
+  uint32_t seed = 7;
+  size_t const frames = static_cast<size_t>(sample_rate) * seconds;
+  wav->sample_rate = sample_rate;
+  wav->channels = 1;
+  wav->samples.resize(frames);
+
+  double phase = 0;
+  for (size_t i = 0; i < frames; ++i)
+  {
+    double const t = static_cast<double>(i) / sample_rate;
+    double const pitch = 120 + (40 * sin(2 * M_PI * 0.3 * t)) + (15 * sin(2 * M_PI * 2.1 * t));
+    phase += (2 * M_PI * pitch) / sample_rate;
+
+    double const envelope = (fmod(t, 5.0) < 4.0) ? pow(sin(M_PI * fmod(t * 4, 1.0)), 2) : 0;
+    double s = 0;
+    for (int h = 1; h <= 20; ++h)
+      s += (4000.0 / h) * sin((h * phase) + h);
+    s = (s * envelope) + ((uniform(&seed) - 0.5) * 40);
+    wav->samples[i] = static_cast<int16_t>((s > 32767) ? 32767 : ((s < -32768) ? -32768 : s));
+  }
+}
+
+// Losses for every packet sent: independent at rate, or Gilbert-Elliott
+// bursts of 3 packets on average at the same overall rate.
+struct loss_model
+{
+  double rate;
+  bool bursty;
+  bool bad;
+  uint32_t seed;
+};
+
+static bool lose(loss_model* m)
+{
+  if (!m->bursty)
+    return uniform(&m->seed) < m->rate;
+
+  double const leave = 1.0 / 3;
+  double const enter = (m->rate * leave) / (1 - m->rate);
+  m->bad = m->bad ? (uniform(&m->seed) >= leave) : (uniform(&m->seed) < enter);
+  return m->bad;
+}
+
+struct result
+{
+  double overhead;
+  double residual;
+  double gaps_per_min;
+  double long_gaps_per_min;
+  double plc_snr;
+};
+
+static void run(xaudio_wav const& wav, int period_frames, int k, loss_model model, result* r)
+{
+  int const channels = wav.channels;
+  size_t const period_samples = static_cast<size_t>(period_frames) * channels;
+  size_t const packets = wav.samples.size() / period_samples;
+  uint16_t const payload = static_cast<uint16_t>(period_samples * 2);
+
+  xaudio_fec_encoder enc;
+  xaudio_fec_encoder_init(&enc, k);
+  xaudio_fec_decoder* dec = new xaudio_fec_decoder;
+  xaudio_fec_decoder_init(dec);
+
+  std::vector<uint8_t> packet(XAUDIO_FEC_HEADER_SIZE + 2 + payload);
+  std::vector<uint8_t> out(payload);
+  std::vector<bool> lost(packets, false);
+  size_t popped = 0;
+  uint64_t sent = 0;
+
+  for (size_t i = 0; i < packets; ++i)
+  {
+    uint8_t const* pcm = reinterpret_cast<uint8_t const*>(&wav.samples[i * period_samples]);
+    size_t n = xaudio_fec_encode(&enc, pcm, payload, &packet[0]);
+    for (int pass = 0; n; ++pass)
+    {
+      sent += n;
+      if (!lose(&model))
+        xaudio_fec_receive(dec, &packet[0], n);
+      n = (pass == 0) ? xaudio_fec_parity(&enc, &packet[0]) : 0;
+    }
+
+    size_t len;
+    int got;
+    while ((got = xaudio_fec_pop(dec, &out[0], &len)) != 0)
+      lost[popped++] = (got < 0);
+  }
+
+  // whatever is still missing at the end never comes
+  while (popped < packets)
+  {
+    size_t len;
+    int const got = xaudio_fec_pop(dec, &out[0], &len);
+    lost[popped++] = (got <= 0);
+    if (got == 0)
+      dec->next++;
+  }
+  delete dec;
+
+  uint64_t const raw = static_cast<uint64_t>(packets) * payload;
+  r->overhead = (100.0 * (sent - raw)) / raw;
+
+  // play it out, concealing the losses, and compare the first 10ms of
+  // every gap with what was lost. Silence there would be 0dB.
+  xaudio_plc plc;
+  xaudio_plc_init(&plc, wav.sample_rate, channels);
+  std::vector<int16_t> played(period_samples);
+  size_t const compare = std::min(period_samples, static_cast<size_t>(wav.sample_rate / 100) * channels);
+  double signal = 0;
+  double plc_error = 0;
+  uint64_t losses = 0;
+  uint64_t gaps = 0;
+  uint64_t long_gaps = 0;
+  size_t run_length = 0;
+  for (size_t i = 0; i <= packets; ++i)
+  {
+    if ((i < packets) && lost[i])
+    {
+      losses++;
+      xaudio_plc_conceal(&plc, &played[0], period_frames);
+      if (run_length++ == 0)
+      {
+        int16_t const* orig = &wav.samples[i * period_samples];
+        for (size_t s = 0; s < compare; ++s)
+        {
+          double const e = orig[s] - played[s];
+          signal += static_cast<double>(orig[s]) * orig[s];
+          plc_error += e * e;
+        }
+      }
+      continue;
+    }
+
+    if (run_length)
+    {
+      gaps++;
+      if (((run_length * period_frames * 1000) / wav.sample_rate) > 20)
+        long_gaps++;
+      run_length = 0;
+    }
+    if (i < packets)
+    {
+      memcpy(&played[0], &wav.samples[i * period_samples], payload);
+      xaudio_plc_good(&plc, &played[0], period_frames);
+    }
+  }
+
+  double const minutes = (static_cast<double>(packets) * period_frames) / (wav.sample_rate * 60.0);
+  r->residual = (100.0 * losses) / packets;
+  r->gaps_per_min = gaps / minutes;
+  r->long_gaps_per_min = long_gaps / minutes;
+  r->plc_snr = ((signal > 0) && (plc_error > 0)) ? (10 * log10(signal / plc_error)) : 0;
+}
+
+static void print_help()
+{
+  printf("\n");
+  printf("\tUsage xaudio-fecbench [OPTIONS] <file.wav>\n");
+  printf("\t\t--synthetic             Make up a minute of voice at 16kHz instead of reading a file\n");
+  printf("\t\t--frames=<n>            Frames per packet (160)\n");
+  printf("\t\t--seed=<n>              Seed for the losses (1)\n");
+  printf("\t\t--help                  Print this help and exit\n");
+  printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+  int period_frames = 160;
+  uint32_t seed = 1;
+  bool synthetic = false;
+
+  struct option long_options[] =
+  {
+    { "frames", required_argument, NULL, 10000 },
+    { "seed", required_argument, NULL, 10001 },
+    { "synthetic", no_argument, NULL, 10002 },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+  {
+    switch (c)
+    {
+      case 10000:
+        period_frames = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10001:
+        seed = static_cast<uint32_t>(strtoul(optarg, NULL, 10));
+        break;
+      case 10002:
+        synthetic = true;
+        break;
+      default:
+        print_help();
+        exit(0);
+        break;
+    }
+  }
+
+  xaudio_wav wav;
+  if (synthetic)
+  {
+    make_synthetic(16000, 60, &wav);
+  }
+  else if (optind >= argc)
+  {
+    printf("failed to provide a recording\n");
+    print_help();
+    exit(1);
+  }
+  else if (!read_wav(argv[optind], &wav))
+  {
+    exit(1);
+  }
+
+  if ((period_frames <= 0) || ((static_cast<size_t>(period_frames) * wav.channels * 2) > 60000)
+    || (wav.samples.size() < (static_cast<size_t>(period_frames) * wav.channels)))
+  {
+    printf("--frames doesn't fit the recording\n");
+    exit(1);
+  }
+
+  double const period_ms = (period_frames * 1000.0) / wav.sample_rate;
+  printf("rate:%u channels:%d packet:%.1fms\n", wav.sample_rate, wav.channels, period_ms);
+
+  double const rates[] = { 0.01, 0.03, 0.05, 0.10 };
+  int const ks[] = { 0, 8, 4, 2 };
+  for (size_t ri = 0; ri < sizeof(rates) / sizeof(rates[0]); ++ri)
+  {
+    for (int bursty = 0; bursty < 2; ++bursty)
+    {
+      for (size_t ki = 0; ki < sizeof(ks) / sizeof(ks[0]); ++ki)
+      {
+        loss_model model = { rates[ri], bursty != 0, false, seed };
+        result r;
+        run(wav, period_frames, ks[ki], model, &r);
+
+        char fec[16];
+        if (ks[ki])
+          snprintf(fec, sizeof(fec), "k=%d", ks[ki]);
+        else
+          snprintf(fec, sizeof(fec), "none");
+        printf("loss:%4.1f%% %-6s fec:%-4s overhead:%5.1f%% residual:%5.2f%% gaps/min:%6.1f over 20ms/min:%6.1f"
+          " latency:+%5.1fms plc over silence:%+5.1fdB\n", rates[ri] * 100, bursty ? "bursty" : "random", fec,
+          r.overhead, r.residual, r.gaps_per_min, r.long_gaps_per_min, ks[ki] * period_ms, r.plc_snr);
+      }
+    }
+  }
+  return 0;
+}
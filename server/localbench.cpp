@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "cpuusage.h"
+#include "localring.h"
+
+// Compares what a consumer on the camera pays for xaudio's capture stream
+// over TCP loopback against the local ring. Both consumers do the same
+// work on every period, a sum of squares, so the difference is transport.
+
+struct bench_result
+{
+  char const* name;
+  uint64_t periods;
+  uint64_t bytes;
+  uint64_t wakeups;
+  uint64_t overruns;
+  double cpu_us;
+  double server_cpu_us;
+  double seconds;
+  std::vector<int64_t> latency_ns;
+};
+
+static volatile uint64_t sink = 0;
+
+static void consume(uint8_t const* data, size_t n)
+{
+  int16_t const* samples = reinterpret_cast<int16_t const *>(data);
+  uint64_t energy = 0;
+  for (size_t i = 0; i < n / 2; ++i)
+    energy += static_cast<int32_t>(samples[i]) * samples[i];
+  sink += energy;
+}
+
+static double seconds_now()
+{
+  return xaudio_local_now_ns() / 1e9;
+}
+
+static bool run_local(char const* path, int seconds, int server_pid, bench_result* r)
+{
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+  {
+    printf("failed to connect to %s. %s\n", path, strerror(errno));
+    return false;
+  }
+
+  int fd = xaudio_local_recv_fd(sock);
+  close(sock);
+
+  xaudio_local_ring ring;
+  if ((fd < 0) || (xaudio_local_attach(&ring, fd) < 0))
+  {
+    printf("failed to attach to the local ring\n");
+    return false;
+  }
+
+  uint64_t seq = xaudio_local_write_seq(&ring);
+  double const server_start = xaudio_cpu_process_us(server_pid);
+  double const cpu_start = xaudio_cpu_self_us();
+  double const start = seconds_now();
+  while ((seconds_now() - start) < seconds)
+  {
+    xaudio_local_wait(&ring, seq, 100);
+    r->wakeups++;
+
+    xaudio_local_slot const* slot;
+    int ret;
+    while ((ret = xaudio_local_peek(&ring, &seq, &slot)) != XAUDIO_LOCAL_AGAIN)
+    {
+      if (ret == XAUDIO_LOCAL_OVERRUN)
+      {
+        r->overruns++;
+        continue;
+      }
+
+      consume(xaudio_local_slot_data(slot), slot->bytes);
+      int64_t const latency = xaudio_local_now_ns() - slot->capture_ns;
+      uint32_t const bytes = slot->bytes;
+      if (!xaudio_local_still_valid(slot, seq))
+      {
+        r->overruns++;
+        continue;
+      }
+
+      r->latency_ns.push_back(latency);
+      r->bytes += bytes;
+      r->periods++;
+      seq++;
+    }
+  }
+  r->seconds = seconds_now() - start;
+  r->cpu_us = xaudio_cpu_self_us() - cpu_start;
+  r->server_cpu_us = (server_start < 0) ? -1 : (xaudio_cpu_process_us(server_pid) - server_start);
+
+  munmap(ring.base, ring.header->map_size);
+  close(fd);
+  return true;
+}
+
+static bool run_tcp(char const* host, int port, uint32_t period_bytes, int seconds, int server_pid,
+  bench_result* r)
+{
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_aton(host, &addr.sin_addr);
+  if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+  {
+    printf("failed to connect to %s:%d. %s\n", host, port, strerror(errno));
+    return false;
+  }
+
+  int enable = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+  // a plain PCM client, the same as the existing on-camera consumers
+  std::vector<uint8_t> buff(period_bytes * 16);
+  size_t pending = 0;
+  double const server_start = xaudio_cpu_process_us(server_pid);
+  double const cpu_start = xaudio_cpu_self_us();
+  double const start = seconds_now();
+  while ((seconds_now() - start) < seconds)
+  {
+    ssize_t n = recv(sock, &buff[pending], buff.size() - pending, 0);
+    if (n <= 0)
+    {
+      printf("tcp connection closed. %s\n", (n < 0) ? strerror(errno) : "eof");
+      break;
+    }
+
+    r->wakeups++;
+    r->bytes += n;
+    pending += n;
+
+    // consumed a period at a time, like the ring
+    size_t offset = 0;
+    for (; (pending - offset) >= period_bytes; offset += period_bytes)
+    {
+      consume(&buff[offset], period_bytes);
+      r->periods++;
+    }
+    memmove(&buff[0], &buff[offset], pending - offset);
+    pending -= offset;
+  }
+  r->seconds = seconds_now() - start;
+  r->cpu_us = xaudio_cpu_self_us() - cpu_start;
+  r->server_cpu_us = (server_start < 0) ? -1 : (xaudio_cpu_process_us(server_pid) - server_start);
+
+  close(sock);
+  return true;
+}
+
+static void print_result(bench_result* r)
+{
+  double const per_period = r->periods ? (r->cpu_us / r->periods) : 0;
+  printf("%-6s periods:%-8llu MB:%-8.2f wakeups/period:%-6.2f overruns:%-4llu cpu/period:%7.2fus (%.3f%% core)",
+    r->name, static_cast<unsigned long long>(r->periods), r->bytes / 1e6,
+    r->periods ? (static_cast<double>(r->wakeups) / r->periods) : 0,
+    static_cast<unsigned long long>(r->overruns), per_period, (r->cpu_us / (r->seconds * 1e6)) * 100);
+
+  if (r->server_cpu_us >= 0)
+    printf(" server:%.3f%% core", (r->server_cpu_us / (r->seconds * 1e6)) * 100);
+
+  if (!r->latency_ns.empty())
+  {
+    std::vector<int64_t>& l = r->latency_ns;
+    std::sort(l.begin(), l.end());
+    printf(" capture->consumer p50:%.1fus p99:%.1fus max:%.1fus", l[l.size() / 2] / 1e3,
+      l[(l.size() * 99) / 100] / 1e3, l.back() / 1e3);
+  }
+  printf("\n");
+}
+
+static void print_help()
+{
+  printf("\n");
+  printf("\tUsage xaudio-localbench [OPTIONS]\n");
+  printf("\t\t--local=<path>          The Unix socket xaudio was started with --local=\n");
+  printf("\t\t--tcp=<host:port>       xaudio's TCP port, leave out to only measure the ring\n");
+  printf("\t\t--seconds=<n>           How long to measure each transport (10)\n");
+  printf("\t\t--server-pid=<pid>      Also report xaudio's own CPU use\n");
+  printf("\t\t--help                  Print this help and exit\n");
+  printf("\n");
+  printf("Examples:\n");
+  printf("\txaudio-localbench --local=/tmp/xaudio.sock --tcp=127.0.0.1:10100 --server-pid=$(pidof xaudio)\n");
+  printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+  char const* local_path = NULL;
+  std::string tcp_host;
+  int tcp_port = -1;
+  int seconds = 10;
+  int server_pid = -1;
+
+  struct option long_options[] =
+  {
+    { "local", required_argument, NULL, 10000 },
+    { "tcp", required_argument, NULL, 10001 },
+    { "seconds", required_argument, NULL, 10002 },
+    { "server-pid", required_argument, NULL, 10003 },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+  {
+    switch (c)
+    {
+      case 10000:
+        local_path = optarg;
+        break;
+      case 10001:
+      {
+        std::string s(optarg);
+        size_t colon = s.rfind(':');
+        tcp_host = s.substr(0, colon);
+        tcp_port = (colon == std::string::npos) ? -1 : static_cast<int>(strtol(s.c_str() + colon + 1, NULL, 10));
+        break;
+      }
+      case 10002:
+        seconds = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10003:
+        server_pid = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      default:
+        print_help();
+        exit(0);
+        break;
+    }
+  }
+
+  if (!local_path)
+  {
+    printf("failed to provide the local socket with --local=<path>\n");
+    print_help();
+    exit(1);
+  }
+
+  bench_result local = bench_result();
+  local.name = "local";
+  if (!run_local(local_path, seconds, server_pid, &local))
+    exit(1);
+
+  // periods are measured in the ring's size on both transports
+  uint32_t const period_bytes = local.periods ? static_cast<uint32_t>(local.bytes / local.periods) : 256;
+
+  bench_result tcp = bench_result();
+  tcp.name = "tcp";
+  if ((tcp_port > 0) && !run_tcp(tcp_host.c_str(), tcp_port, period_bytes, seconds, server_pid, &tcp))
+    exit(1);
+
+  print_result(&local);
+  if (tcp_port > 0)
+    print_result(&tcp);
+  return 0;
+}
@@ -0,0 +1,364 @@
+#ifndef LOCALRING_H
+#define LOCALRING_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+
+// Local transport for consumers on the camera itself.
+//
+// xaudio publishes every capture period into a ring in a memfd sealed at
+// its size and hands a read only fd of it to anyone connecting to its Unix
+// domain socket. Consumers can only map it read only and work on the
+// periods in place, nothing is copied
+// and nothing goes through the network stack. There is one writer and any
+// number of readers, readers never hold the writer up: a reader that falls
+// more than a ring behind loses periods and is told so.
+//
+// Every slot is a seqlock. The writer invalidates the slot, fills it and
+// then stamps it with the period's sequence number. A reader checks the
+// stamp before and after using the data, if it changed the period was
+// overwritten underneath it. Readers sleep on a futex in the header that
+// the writer bumps and wakes once per period.
+
+#define XAUDIO_LOCAL_MAGIC 0x524c4158u // "XALR"
+#define XAUDIO_LOCAL_VERSION 1
+
+enum
+{
+  XAUDIO_LOCAL_HEADER_SIZE = 4096,
+  XAUDIO_LOCAL_SLOT_HEADER_SIZE = 64
+};
+
+struct xaudio_local_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sample_rate;
+  uint32_t channels;
+  uint32_t bytes_per_frame;
+  uint32_t period_bytes;
+  uint32_t slot_count;
+  uint32_t slot_stride;
+  uint64_t map_size;
+
+  // periods published so far, and the futex readers sleep on
+  uint64_t write_seq;
+  uint32_t notify;
+  uint32_t reserved;
+};
+
+struct xaudio_local_slot
+{
+  // seq + 1 of the period held, 0 while being written
+  uint64_t stamp;
+  // byte offset of the period in the capture stream
+  uint64_t stream_offset;
+  // CLOCK_MONOTONIC when the period was read from the device
+  int64_t capture_ns;
+  uint32_t bytes;
+  uint32_t reserved;
+};
+
+struct xaudio_local_ring
+{
+  int fd;
+  // the writer's read only reopening of fd, what consumers are handed
+  int consumer_fd;
+  uint8_t* base;
+  xaudio_local_header* header;
+};
+
+static inline int64_t
+xaudio_local_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (static_cast<int64_t>(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+static inline xaudio_local_slot*
+xaudio_local_slot_at(xaudio_local_ring const* ring, uint64_t seq)
+{
+  xaudio_local_header const* h = ring->header;
+  return reinterpret_cast<xaudio_local_slot *>(ring->base + XAUDIO_LOCAL_HEADER_SIZE
+    + ((seq % h->slot_count) * h->slot_stride));
+}
+
+static inline uint8_t const*
+xaudio_local_slot_data(xaudio_local_slot const* slot)
+{
+  return reinterpret_cast<uint8_t const *>(slot) + XAUDIO_LOCAL_SLOT_HEADER_SIZE;
+}
+
+static inline int
+xaudio_local_futex(uint32_t* word, int op, uint32_t value, struct timespec const* timeout)
+{
+  return static_cast<int>(syscall(SYS_futex, word, op, value, timeout, NULL, 0));
+}
+
+// writer side
+
+static inline int
+xaudio_local_memfd(char const* name)
+{
+#if defined(__NR_memfd_create)
+  // MFD_CLOEXEC | MFD_ALLOW_SEALING, the toolchain headers may predate them
+  return static_cast<int>(syscall(__NR_memfd_create, name, 0x0001u | 0x0002u));
+#else
+  char path[] = "/dev/shm/xaudio-XXXXXX";
+  (void) name;
+  int fd = mkstemp(path);
+  if (fd != -1)
+    unlink(path);
+  return fd;
+#endif
+}
+
+// returns 0 or -errno
+static inline int
+xaudio_local_create(xaudio_local_ring* ring, uint32_t sample_rate, uint32_t channels,
+  uint32_t bytes_per_frame, uint32_t period_bytes, uint32_t slot_count)
+{
+  uint32_t const stride = (XAUDIO_LOCAL_SLOT_HEADER_SIZE + period_bytes + 63) & ~63u;
+  uint64_t const size = XAUDIO_LOCAL_HEADER_SIZE + (static_cast<uint64_t>(stride) * slot_count);
+
+  ring->consumer_fd = -1;
+  ring->fd = xaudio_local_memfd("xaudio-capture");
+  if (ring->fd == -1)
+    return -errno;
+
+  if (ftruncate(ring->fd, static_cast<off_t>(size)) == -1)
+  {
+    int err = errno;
+    close(ring->fd);
+    ring->fd = -1;
+    return -err;
+  }
+
+#if defined(F_ADD_SEALS)
+  // the size can't change underneath the mappings
+  fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+  // a new open file of the same memory, without write access, so a
+  // consumer can neither write to it nor map it writable
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", ring->fd);
+  ring->consumer_fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (ring->consumer_fd == -1)
+  {
+    int err = errno;
+    close(ring->fd);
+    ring->fd = -1;
+    return -err;
+  }
+
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+  if (p == MAP_FAILED)
+  {
+    int err = errno;
+    close(ring->consumer_fd);
+    close(ring->fd);
+    ring->consumer_fd = -1;
+    ring->fd = -1;
+    return -err;
+  }
+
+  ring->base = static_cast<uint8_t *>(p);
+  ring->header = reinterpret_cast<xaudio_local_header *>(p);
+  memset(ring->header, 0, sizeof(xaudio_local_header));
+  ring->header->version = XAUDIO_LOCAL_VERSION;
+  ring->header->sample_rate = sample_rate;
+  ring->header->channels = channels;
+  ring->header->bytes_per_frame = bytes_per_frame;
+  ring->header->period_bytes = period_bytes;
+  ring->header->slot_count = slot_count;
+  ring->header->slot_stride = stride;
+  ring->header->map_size = size;
+  __atomic_store_n(&ring->header->magic, XAUDIO_LOCAL_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static inline void
+xaudio_local_publish(xaudio_local_ring* ring, void const* data, uint32_t bytes,
+  uint64_t stream_offset, int64_t capture_ns)
+{
+  xaudio_local_header* h = ring->header;
+  uint64_t const seq = h->write_seq;
+  xaudio_local_slot* slot = xaudio_local_slot_at(ring, seq);
+
+  __atomic_store_n(&slot->stamp, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  if (bytes > h->period_bytes)
+    bytes = h->period_bytes;
+  memcpy(reinterpret_cast<uint8_t *>(slot) + XAUDIO_LOCAL_SLOT_HEADER_SIZE, data, bytes);
+  slot->bytes = bytes;
+  slot->stream_offset = stream_offset;
+  slot->capture_ns = capture_ns;
+
+  __atomic_store_n(&slot->stamp, seq + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&h->write_seq, seq + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&h->notify, 1, __ATOMIC_RELEASE);
+  xaudio_local_futex(&h->notify, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+// hands the ring to a consumer connected on the Unix socket
+static inline int
+xaudio_local_send_fd(int sock, int fd)
+{
+  char byte = 0;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+
+  union
+  {
+    struct cmsghdr align;
+    char buff[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buff;
+  msg.msg_controllen = sizeof(control.buff);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  return (sendmsg(sock, &msg, MSG_NOSIGNAL) == 1) ? 0 : -errno;
+}
+
+// reader side
+
+static inline int
+xaudio_local_recv_fd(int sock)
+{
+  char byte;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+
+  union
+  {
+    struct cmsghdr align;
+    char buff[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buff;
+  msg.msg_controllen = sizeof(control.buff);
+
+  if (recvmsg(sock, &msg, 0) != 1)
+    return -1;
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+    return -1;
+
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+// maps a ring received with xaudio_local_recv_fd, read only
+static inline int
+xaudio_local_attach(xaudio_local_ring* ring, int fd)
+{
+  xaudio_local_header head;
+  if (pread(fd, &head, sizeof(head), 0) != static_cast<ssize_t>(sizeof(head)))
+    return -1;
+  if ((head.magic != XAUDIO_LOCAL_MAGIC) || (head.version != XAUDIO_LOCAL_VERSION))
+    return -1;
+
+  void* p = mmap(NULL, head.map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return -1;
+
+  ring->fd = fd;
+  ring->consumer_fd = -1;
+  ring->base = static_cast<uint8_t *>(p);
+  ring->header = reinterpret_cast<xaudio_local_header *>(p);
+  return 0;
+}
+
+static inline uint64_t
+xaudio_local_write_seq(xaudio_local_ring const* ring)
+{
+  return __atomic_load_n(&ring->header->write_seq, __ATOMIC_ACQUIRE);
+}
+
+// sleeps until a period past seq - 1 is published or timeout_ms passes
+static inline void
+xaudio_local_wait(xaudio_local_ring const* ring, uint64_t seq, int timeout_ms)
+{
+  uint32_t* word = &ring->header->notify;
+  uint32_t const notify = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+  if (xaudio_local_write_seq(ring) > seq)
+    return;
+
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  xaudio_local_futex(word, FUTEX_WAIT, notify, &timeout);
+}
+
+enum
+{
+  XAUDIO_LOCAL_OK = 0,
+  XAUDIO_LOCAL_AGAIN = 1,
+  XAUDIO_LOCAL_OVERRUN = 2
+};
+
+// Looks up period seq in place. On XAUDIO_LOCAL_OVERRUN *seq is moved to
+// the oldest period still safe to read. Whatever is done with the data
+// only counts if xaudio_local_still_valid() agrees afterwards.
+static inline int
+xaudio_local_peek(xaudio_local_ring const* ring, uint64_t* seq, xaudio_local_slot const** slot)
+{
+  uint64_t const written = xaudio_local_write_seq(ring);
+  if (*seq >= written)
+    return XAUDIO_LOCAL_AGAIN;
+
+  // keep a slot of distance, the writer may be busy with the oldest one
+  uint32_t const safe = ring->header->slot_count - 1;
+  xaudio_local_slot const* s = xaudio_local_slot_at(ring, *seq);
+  if (((written - *seq) > safe) || (__atomic_load_n(&s->stamp, __ATOMIC_ACQUIRE) != (*seq + 1)))
+  {
+    *seq = (written > safe) ? (written - safe) : written;
+    return XAUDIO_LOCAL_OVERRUN;
+  }
+
+  *slot = s;
+  return XAUDIO_LOCAL_OK;
+}
+
+static inline bool
+xaudio_local_still_valid(xaudio_local_slot const* slot, uint64_t seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&slot->stamp, __ATOMIC_RELAXED) == (seq + 1);
+}
+
+#endif // LOCALRING_H
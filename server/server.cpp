@@ -2,18 +2,40 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#ifdef XAUDIO_ALSA_STUB
+#include "alsastub.h"
+#else
 #include <alsa/asoundlib.h>
+#endif
+#include <sys/ioctl.h>
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/sockios.h>
 #include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
+#include "../plc.h"
+#include "../protocol.h"
+#include "../trace.h"
+#include "../wirelog.h"
+#include "localring.h"
+#include "transcoder.h"
+#include "vad.h"
+#include "archive.h"
+#include "clips.h"
+#include "aec.h"
+#include "dsp.h"
+
 static int capture_buffer_frames = 128;
 static snd_pcm_t* capture_handle = NULL;
 static uint32_t capture_sample_rate = 16000;
@@ -29,6 +51,253 @@ static int playback_buffer_size;
 static int playback_buffer_read = 0;
 static snd_pcm_uframes_t playback_frames = 1280;
 
+// capture keeps running while no client is connected, so a client that
+// comes back can be resumed out of a ring instead of re-priming
+static int capture_frame_bytes = 2;
+static int capture_ring_ms = 2000;
+
+struct period_mark
+{
+  uint64_t end;
+  bool voice;
+  uint8_t level;
+};
+
+// One ring per format clients asked for. Format 0 is the capture itself,
+// every other one is converted from it once per period and shared by all
+// the clients that asked for it.
+struct output_format
+{
+  xaudio_format format;
+  int frame_bytes;
+  std::vector<uint8_t> ring;
+  uint64_t head;
+  transcoder conv;
+  // live sessions, and live plus resumable ones
+  int clients;
+  int users;
+
+  // where each recent period ends in the ring and whether it was voice
+  std::vector<period_mark> marks;
+  uint64_t period_count;
+
+  // since the last report
+  uint64_t conversions;
+  uint64_t client_periods;
+  int64_t busy_ns;
+};
+static std::vector<output_format> formats;
+static std::vector<uint8_t> transcode_buffer;
+static int max_formats = 8;
+static int capture_ring_periods = 0;
+static int report_interval_ms = 10000;
+static struct timeval last_report;
+
+// capture periods for consumers on the camera, see localring.h
+static char const* local_path = NULL;
+static int local_fd = -1;
+static int local_ring_ms = 500;
+static xaudio_local_ring local_ring = { -1, -1, NULL, NULL };
+
+static int resume_window_ms = 5000;
+static int resume_backlog_ms = 200;
+static int hello_timeout_ms = 200;
+
+// connections that haven't finished their hello yet
+struct pending_client
+{
+  int fd;
+  uint8_t hello[XAUDIO_HELLO_SIZE + XAUDIO_FORMAT_SIZE + XAUDIO_REPLAY_SIZE];
+  int len;
+  struct timeval since;
+};
+
+static std::vector<pending_client> pending_clients;
+static const int max_pending_clients = 32;
+
+struct quality_switch
+{
+  int64_t at_ms;
+  int rung;
+  xaudio_format format;
+  int queue_ms;
+};
+
+// every client's stream, as offsets into the ring of its format. Dropped
+// sessions are kept with fd -1 for resume_window_ms.
+struct client_session
+{
+  int fd;
+  uint64_t token;
+  int format;
+  uint64_t base;
+  uint64_t sent;
+  struct timeval dropped_at;
+
+  // framed stream with silence suppressed, out holds the frame being sent
+  bool dtx;
+  std::vector<uint8_t> out;
+  size_t out_pos;
+
+  // formats the stream steps down through while the link can't keep up,
+  // ladder[0] is what the client asked for. next_rung is switched to at
+  // the next frame. rung is -1 while the session is on none of them,
+  // after the capture format changed under it.
+  bool adapt;
+  bool native;
+  std::vector<xaudio_format> ladder;
+  int rung;
+  int next_rung;
+  int switch_queue_ms;
+  bool switched;
+  struct timeval started_at;
+  struct timeval switched_at;
+  struct timeval clear_since;
+  int up_wait_ms;
+  std::vector<quality_switch> timeline;
+};
+static std::vector<client_session> sessions;
+static int max_clients = 8;
+
+// A client whose send queue holds more than adapt_down_ms of audio goes a
+// rung down. It goes back up once its queue stayed short for up_wait_ms,
+// which doubles every time a step up is undone within adapt_probe_ms.
+static bool adapt_enabled = true;
+static int adapt_down_ms = 250;
+static int adapt_up_wait_ms = 5000;
+static const int adapt_hold_ms = 1000;
+static const int adapt_probe_ms = 30000;
+static const int adapt_max_up_wait_ms = 60000;
+
+// Silent capture periods are sent to clients that take the framed stream
+// as comfort noise frames instead of PCM
+static bool dtx_enabled = true;
+static int vad_hangover_ms = 200;
+static vad capture_vad;
+static uint64_t vad_periods = 0;
+static uint64_t vad_silent_periods = 0;
+static uint64_t dtx_audio_bytes = 0;
+static uint64_t dtx_wire_bytes = 0;
+
+// capture kept on disk for replay, see archive.h
+static char const* archive_dir = NULL;
+static int archive_hours = 4;
+static int archive_segment_minutes = 10;
+static int archive_sync_ms = 60000;
+static bool archive_on = false;
+static xaudio_archive archive;
+
+// connections replaying the archive instead of the live capture
+struct replay_session
+{
+  int fd;
+  int file;
+  xaudio_archive_cursor cursor;
+  uint32_t speed_percent;
+  int64_t start_ns;
+  uint64_t periods;
+  std::vector<uint8_t> out;
+  size_t out_pos;
+};
+static std::vector<replay_session> replays;
+static const int replay_batch_periods = 32;
+
+// only one client is played at a time, the first one that sends audio
+static int playback_owner = -1;
+
+// announcements mixed into playback, triggered on the control socket, see
+// clips.h
+static char const* clip_dir = NULL;
+static bool clips_on = false;
+static xaudio_clip_mixer clips;
+static std::vector<int16_t> clip_buffer;
+
+// every byte exchanged with clients, for replaying the run, see wirelog.h
+static char const* wire_log_path = NULL;
+static xaudio_wire_log wire_log = { NULL, 0 };
+
+// where trace spans go on SIGUSR1, see trace.h
+static char const* trace_path = NULL;
+
+// echo cancellation of the capture with what was played as the reference,
+// see aec.h. The reference is kept at the capture rate, in mono, on its
+// own clock of frames written.
+static bool aec_requested = false;
+static int aec_tail_ms = 64;
+static bool aec_on = false;
+static aec capture_aec;
+static transcoder aec_ref_conv;
+static std::vector<int16_t> aec_ref_ring;
+static std::vector<uint8_t> aec_ref_converted;
+static std::vector<int16_t> aec_ref_block;
+static uint64_t aec_ref_written = 0;
+static uint64_t aec_ref_read = 0;
+static uint64_t aec_periods = 0;
+static int64_t aec_busy_ns = 0;
+static const int aec_ref_ring_ms = 2000;
+
+// concealment of the playback owner's audio when it runs late, see plc.h.
+// Below plc_low_ms queued the device is topped up with an extrapolation of
+// what was played instead of running dry.
+static bool plc_enabled = true;
+static bool plc_on = false;
+static xaudio_plc playback_plc;
+static std::vector<int16_t> plc_buffer;
+static uint64_t plc_gaps = 0;
+static uint64_t plc_frames = 0;
+static const int plc_low_ms = 20;
+
+// processing of the capture, right after echo cancellation, and of
+// everything played, see dsp.h
+static char const* capture_dsp_list = "";
+static char const* playback_dsp_list = "";
+static dsp_chain capture_dsp;
+static dsp_chain playback_dsp;
+
+// what play() hands to the device when it doesn't write the client's
+// audio as it came
+static std::vector<int16_t> play_buffer;
+
+// clips, device and format changes asked for on the control socket, see
+// handle_control_command
+static char const* control_path = NULL;
+static int control_fd = -1;
+static std::string capture_device_name;
+static std::string playback_device_name;
+
+// Clients always send playback in the format the device was opened with
+// at startup. A device switched to later may run another one, their audio
+// is converted on the way to it then.
+static uint32_t playback_device_rate = 16000;
+static int playback_device_channels = 1;
+static bool playback_convert = false;
+static transcoder playback_conv;
+static std::vector<uint8_t> playback_converted;
+
+// A PCM opened next to the one in use, running until it's primed and then
+// switched to at a period boundary. Cold when the device can't be opened
+// twice, the old one is closed first then.
+struct pcm_switch
+{
+  bool active;
+  bool cold;
+  snd_pcm_t* handle;
+  std::string device;
+  uint32_t sample_rate;
+  int channels;
+  int frames;
+  struct timespec started;
+  struct sockaddr_un from;
+  socklen_t from_len;
+};
+static pcm_switch capture_switch;
+static pcm_switch playback_switch;
+static const int switch_timeout_ms = 2000;
+
+// the playback device switched away from, playing out what it had queued
+static snd_pcm_t* retiring_playback = NULL;
+static struct timespec retire_at;
+
 #define D(FUNC) if ((err = FUNC) < 0) {\
     printf("[%s:%d] -- %s (%d):%s\n", __FILE__, (__LINE__ ), #FUNC, err, snd_strerror(err)); \
     exit(1);\
@@ -48,6 +317,32 @@ static snd_pcm_uframes_t playback_frames = 1280;
     printf("\n"); \
   } while (0)
 
+static ssize_t wire_send(int fd, void const* buff, size_t n, int flags)
+{
+  ssize_t sent = send(fd, buff, n, flags);
+  if (sent > 0)
+    xaudio_wire_write(&wire_log, fd, XAUDIO_WIRE_TX, buff, static_cast<uint32_t>(sent));
+  return sent;
+}
+
+static ssize_t wire_recv(int fd, void* buff, size_t n)
+{
+  ssize_t got = recv(fd, buff, n, 0);
+  if (got > 0)
+    xaudio_wire_write(&wire_log, fd, XAUDIO_WIRE_RX, buff, static_cast<uint32_t>(got));
+  return got;
+}
+
+static void close_client_fd(int fd)
+{
+  if (wire_log.f)
+  {
+    xaudio_wire_write(&wire_log, fd, XAUDIO_WIRE_CLOSE, NULL, 0);
+    fflush(wire_log.f);
+  }
+  close(fd);
+}
+
 static void setup_capture(char const* capture_handle_name)
 {
   int err;
@@ -56,6 +351,7 @@ static void setup_capture(char const* capture_handle_name)
   snd_pcm_format_t fmt = SND_PCM_FORMAT_S16_LE;
 
   LOG("setup_capture with device:%s", capture_handle_name);
+  capture_device_name = capture_handle_name;
 
   D( snd_pcm_open(&capture_handle, capture_handle_name, SND_PCM_STREAM_CAPTURE, 0) );
   D( snd_pcm_hw_params_malloc(&params) );
@@ -74,10 +370,21 @@ static void setup_capture(char const* capture_handle_name)
 
   D( snd_pcm_prepare(capture_handle) );
 
-  const uint32_t n = (capture_buffer_frames * (snd_pcm_format_width(fmt) / 8) * capture_num_channels);
+  capture_frame_bytes = (snd_pcm_format_width(fmt) / 8) * capture_num_channels;
+  const uint32_t n = (capture_buffer_frames * capture_frame_bytes);
   capture_buffer.reserve(n);
   capture_buffer.resize(n);
 
+  const uint32_t ring_frames = std::max<uint32_t>((capture_sample_rate * capture_ring_ms) / 1000, capture_buffer_frames);
+  formats[0].format.sample_rate = capture_sample_rate;
+  formats[0].frame_bytes = capture_frame_bytes;
+  formats[0].ring.resize(ring_frames * capture_frame_bytes);
+
+  // periods in a ring of any format, with room for the partial ones at the ends
+  capture_ring_periods = (ring_frames / capture_buffer_frames) + 2;
+  formats[0].marks.resize(capture_ring_periods);
+  vad_init(&capture_vad, capture_num_channels, capture_sample_rate, capture_buffer_frames, vad_hangover_ms);
+
   snd_pcm_dump(capture_handle, alsa_log);
 }
 
@@ -88,6 +395,7 @@ static void setup_playback(char const* playback_handle_name)
   snd_pcm_hw_params_t* params;
 
   LOG("setup_playback with device:%s", playback_handle_name);
+  playback_device_name = playback_handle_name;
 
   D( snd_pcm_open(&playback_handle, playback_handle_name, SND_PCM_STREAM_PLAYBACK, 0) );
   snd_pcm_hw_params_alloca(&params);
@@ -103,10 +411,39 @@ static void setup_playback(char const* playback_handle_name)
   playback_buffer.reserve(n);
   playback_buffer.resize(n);
   playback_buffer_size = n;
+  playback_device_rate = playback_sample_rate;
+  playback_device_channels = playback_num_channels;
 
   snd_pcm_dump(playback_handle, alsa_log);
 }
 
+// frames queued on the playback device, in the format clients send
+static int playback_delay(snd_pcm_sframes_t* queued)
+{
+  int const err = snd_pcm_delay(playback_handle, queued);
+  if ((err == 0) && playback_convert)
+    *queued = static_cast<snd_pcm_sframes_t>((static_cast<int64_t>(*queued) * playback_sample_rate) / playback_device_rate);
+  return err;
+}
+
+// Writes frames in the format clients send, converted if the device runs
+// another one. Returns how many of them were written, or the error.
+static snd_pcm_sframes_t playback_write(void const* pcm, size_t frames)
+{
+  if (!playback_convert)
+    return snd_pcm_writei(playback_handle, pcm, frames);
+
+  size_t const max_bytes = transcoder_max_output(&playback_conv, frames);
+  if (playback_converted.size() < max_bytes)
+    playback_converted.resize(max_bytes);
+  size_t const bytes = transcoder_run(&playback_conv, static_cast<int16_t const *>(pcm), frames, &playback_converted[0]);
+  snd_pcm_uframes_t const device_frames = bytes / (2 * playback_device_channels);
+  snd_pcm_sframes_t const err = snd_pcm_writei(playback_handle, &playback_converted[0], device_frames);
+  if ((err < 0) || (static_cast<snd_pcm_uframes_t>(err) == device_frames))
+    return (err < 0) ? err : static_cast<snd_pcm_sframes_t>(frames);
+  return static_cast<snd_pcm_sframes_t>((static_cast<uint64_t>(err) * frames) / device_frames);
+}
+
 static void timeval_subtract(timeval const& a, timeval const& b, timeval* result)
 {
   LOG("%ld.%ld - %ld.%ld", a.tv_sec, a.tv_usec, b.tv_sec, b.tv_usec);
@@ -164,235 +501,2492 @@ static void exception_handler(snd_pcm_t* h)
   exit(1);
 }
 
-static void print_help()
+static int64_t millis_since(timeval const& then)
 {
-  printf("\n");
-  printf("\tUsage xaudio [OPTIONS]\n");
-  printf("\t\t--port=<port>                     The port to listen on\n");
-  printf("\t\t--capture=<devname>     -c <name> The ALSA capture device. If unsure, use 'default'\n");
-  printf("\t\t--capture-channels=<n>  -d <n>    The number of channels. Use 1\n");
-  printf("\t\t--capture-rate=<KHZ>    -r <KHZ>  The capture rate in hertz. Use 16000\n");
-  printf("\t\t--capture-frames=<n>    -f <n>    Not sure, skip it.\n");
-  printf("\t\t--playback=<devnam>     -p <name> The playback device name. If unsure, use 'default'\n");
-  printf("\t\t--help                  -h        Print this help and exit\n");
-  printf("\n");
-  printf("Examples:\n");
-  printf("\txaudio --port=10100 --capture=default\n");
-  printf("\txaudio --port=10100 --capture=default --playback=default\n");
-  printf("\n");
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return ((now.tv_sec - then.tv_sec) * 1000) + ((now.tv_usec - then.tv_usec) / 1000);
 }
 
+static uint64_t ring_oldest(output_format const& f)
+{
+  return (f.head > f.ring.size()) ? (f.head - f.ring.size()) : 0;
+}
 
-int main(int argc, char* argv[])
+static void ring_append(output_format* f, uint8_t const* data, size_t n, bool voice, int level_db)
 {
-  int err = -1;
-  int server_fd = -1;
-  int port = -1;
-  char const* capture_device = NULL;
-  char const* playback_device = NULL;
-  struct sockaddr_in server_addr = {0};
-  std::vector<char> buff;
+  size_t const size = f->ring.size();
+  size_t const pos = f->head % size;
+  size_t const first = std::min(n, size - pos);
+  memcpy(&f->ring[pos], data, first);
+  memcpy(&f->ring[0], data + first, n - first);
+  f->head += n;
 
+  period_mark& mark = f->marks[f->period_count % f->marks.size()];
+  mark.end = f->head;
+  mark.voice = voice;
+  mark.level = static_cast<uint8_t>(std::min(127, std::max(0, -level_db)));
+  f->period_count++;
+}
 
-  struct option long_options[] =
+// index of the period holding byte offset, period_count if it's at the
+// head, the oldest one kept if it's too old
+static uint64_t period_index(output_format const& f, uint64_t offset)
+{
+  uint64_t lo = (f.period_count > f.marks.size()) ? (f.period_count - f.marks.size()) : 0;
+  uint64_t hi = f.period_count;
+  while (lo < hi)
   {
-    { "port", required_argument, NULL, 10000 },
+    uint64_t const mid = lo + ((hi - lo) / 2);
+    if (f.marks[mid % f.marks.size()].end > offset)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
 
-    { "capture", required_argument, NULL, 'c' },
-    { "capture-channels", required_argument, NULL, 'd' },
-    { "capture-rate", required_argument, NULL, 'r' },
-    { "capture-frames", required_argument, NULL, 'f' },
+// the period holding byte offset, NULL if it's at the head or too old
+static period_mark const* period_at(output_format const& f, uint64_t offset)
+{
+  uint64_t const i = period_index(f, offset);
+  return (i < f.period_count) ? &f.marks[i % f.marks.size()] : NULL;
+}
 
-    { "playback", required_argument, NULL, 'p' },
-    { "help", no_argument, NULL, 'h' },
-    { 0, 0, 0, 0 }
-  };
+// where the period that many before the head starts, as far back as the
+// marks and the ring go
+static uint64_t period_start(output_format const& f, uint64_t behind)
+{
+  uint64_t const oldest = (f.period_count > f.marks.size()) ? (f.period_count - f.marks.size() + 1) : 0;
+  uint64_t const i = std::max(oldest, (f.period_count > behind) ? (f.period_count - behind) : 0);
+  uint64_t const start = (i == 0) ? 0 : f.marks[(i - 1) % f.marks.size()].end;
+  return std::max(start, ring_oldest(f));
+}
 
-  int c;
-  while ((c = getopt_long(argc, argv, "f:c:p:d:r:h", long_options, NULL)) != -1)
+// the first offset at or after limit that is a whole number of frames
+// away from from, so skipping never shifts the client's sample alignment
+static uint64_t skip_to(output_format const& f, uint64_t from, uint64_t limit)
+{
+  if (from >= limit)
+    return from;
+
+  uint64_t const frames = ((limit - from) + f.frame_bytes - 1) / f.frame_bytes;
+  return from + (frames * f.frame_bytes);
+}
+
+static char const* format_name(xaudio_format const& format)
+{
+  static char buff[64];
+  snprintf(buff, sizeof(buff), "%uHz %dch %s", format.sample_rate, format.channels,
+    (format.sample_format == XAUDIO_F32LE) ? "f32le" : "s16le");
+  return buff;
+}
+
+// the ring for a format, set up on first use. Requests that can't be met
+// get the capture format.
+static int find_format(xaudio_format const& wanted)
+{
+  for (size_t i = 0; i < formats.size(); ++i)
   {
-    switch (c)
-    {
-      case 'h':
-        print_help();
-        exit(0);
-        break;
-      case 'f':
-        capture_buffer_frames = static_cast<int>(strtol(optarg, NULL, 10));
-        break;
-      case 'c':
-        capture_device = optarg;
-        break;
-      case 'd':
-        playback_num_channels = capture_num_channels = static_cast<int>(strtol(optarg, NULL, 10));
-        break;
-      case 'r':
-        capture_sample_rate = static_cast<int>(strtol(optarg, NULL, 10));
-        break;
-      case 'p':
-        playback_device = optarg;
-        break;
-      case 10000:
-        port = static_cast<int>(strtol(optarg, NULL, 10));
-        break;
-      case '?':
-        print_help();
-        exit(0);
-        break;
-    }
+    if (xaudio_format_equal(formats[i].format, wanted))
+      return static_cast<int>(i);
   }
 
-  buff.reserve(playback_frames);
-  buff.resize(playback_frames);
+  if (!capture_handle)
+    return 0;
 
-  if (port == -1)
+  if ((wanted.sample_rate < 8000) || (wanted.sample_rate > 192000) || (wanted.channels < 1) || (wanted.channels > 8)
+    || ((wanted.sample_format != XAUDIO_S16LE) && (wanted.sample_format != XAUDIO_F32LE)))
   {
-    printf("failed to provide listening port with --port=<port>\n");
-    print_help();
-    exit(0);
+    LOG("can't produce %s, sending the capture format", format_name(wanted));
+    return 0;
   }
 
-  LOG("sound library:%s", snd_asoundlib_version());
-  snd_output_stdio_attach(&alsa_log, stdout, 0);
+  // formats nobody uses any more are recycled before adding another
+  int slot = -1;
+  for (size_t i = 1; i < formats.size(); ++i)
+  {
+    if (formats[i].users == 0)
+      slot = static_cast<int>(i);
+  }
 
-  if (capture_device)
-    setup_capture(capture_device);
-  else
-    LOG("skipping capture, no device supplied with -c");
+  if ((slot == -1) && (static_cast<int>(formats.size()) >= max_formats))
+  {
+    LOG("already producing %d formats, sending the capture format instead of %s", max_formats, format_name(wanted));
+    return 0;
+  }
 
-  if (playback_device)
-    setup_playback(playback_device);
+  output_format f = output_format();
+  f.format = wanted;
+  f.frame_bytes = xaudio_format_frame_bytes(wanted);
+  f.ring.resize(((static_cast<uint64_t>(wanted.sample_rate) * capture_ring_ms) / 1000) * f.frame_bytes);
+  f.marks.resize(capture_ring_periods);
+  transcoder_init(&f.conv, capture_sample_rate, capture_num_channels, wanted);
+
+  size_t const needed = transcoder_max_output(&f.conv, capture_buffer_frames);
+  if (transcode_buffer.size() < needed)
+    transcode_buffer.resize(needed);
+
+  if (slot == -1)
+  {
+    slot = static_cast<int>(formats.size());
+    formats.push_back(f);
+  }
   else
-    LOG("skipping playback, no device supplied with  -p");
+  {
+    formats[slot] = f;
+  }
 
-  LOG("capture_buffer_frames:%d", capture_buffer_frames);
+  LOG("producing %s for clients", format_name(wanted));
+  return slot;
+}
 
-  server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(port);
+static int64_t nanos_since(struct timespec const& then)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - then.tv_sec) * 1000000000LL) + (now.tv_nsec - then.tv_nsec);
+}
 
-  int enable = 1;
-  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+// each format is converted once, however many clients share it
+static void transcode_period(bool voice, int level_db)
+{
+  XAUDIO_TRACE_SPAN("transcode");
+  int16_t const* in = reinterpret_cast<int16_t const *>(&capture_buffer[0]);
 
-  err = bind(server_fd, reinterpret_cast<struct sockaddr *>(&server_addr), sizeof(server_addr));
-  if (err < 0)
+  formats[0].client_periods += formats[0].clients;
+  for (size_t i = 1; i < formats.size(); ++i)
   {
-    LOG("failed to bind listen socket. %s", strerror(errno));
-    exit(1);
+    output_format& f = formats[i];
+    if (f.users == 0)
+      continue;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t const n = transcoder_run(&f.conv, in, capture_buffer_frames, &transcode_buffer[0]);
+    ring_append(&f, &transcode_buffer[0], n, voice, level_db);
+    f.busy_ns += nanos_since(start);
+    f.conversions++;
+    f.client_periods += f.clients;
   }
+}
 
-  listen(server_fd, 2);
-  LOG("listening for incoming connetions on:[%s:%d]",  inet_ntoa(server_addr.sin_addr), port);
+// Takes what was played while the period just read was captured out of it.
+// That's the reference written before whatever playback still has queued,
+// less what capture has waiting, both converted to capture frames.
+static void cancel_echo()
+{
+  XAUDIO_TRACE_SPAN("aec");
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-  while (true)
+  snd_pcm_sframes_t played = 0;
+  snd_pcm_sframes_t captured = 0;
+  if (playback_delay(&played) < 0)
+    played = 0;
+  if (snd_pcm_delay(capture_handle, &captured) < 0)
+    captured = 0;
+
+  // followed period by period, only jumps when the devices drift a period
+  // apart or playback ran dry and started over
+  int64_t const n = capture_buffer_frames;
+  int64_t const lag = ((static_cast<int64_t>(played) * capture_sample_rate) / playback_sample_rate) + captured;
+  int64_t const target = std::max<int64_t>(0, static_cast<int64_t>(aec_ref_written) - lag - n);
+  int64_t const drift = target - static_cast<int64_t>(aec_ref_read);
+  if ((drift > n) || (drift < -n) || ((aec_ref_written - aec_ref_read) > (aec_ref_ring.size() - n)))
+    aec_ref_read = target;
+
+  // nothing written for this period, the speaker is silent
+  size_t const ring = aec_ref_ring.size();
+  for (; aec_ref_written < (aec_ref_read + n); ++aec_ref_written)
+    aec_ref_ring[aec_ref_written % ring] = 0;
+
+  for (int64_t i = 0; i < n; ++i)
+    aec_ref_block[i] = aec_ref_ring[(aec_ref_read + i) % ring];
+  aec_ref_read += n;
+
+  aec_run(&capture_aec, reinterpret_cast<int16_t *>(&capture_buffer[0]), &aec_ref_block[0]);
+  aec_busy_ns += nanos_since(start);
+  aec_periods++;
+}
+
+static void capture_pump()
+{
+  int err;
+  {
+    XAUDIO_TRACE_SPAN("readi");
+    err = snd_pcm_readi(capture_handle, &capture_buffer[0], capture_buffer_frames);
+  }
+  if (err != capture_buffer_frames)
   {
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_length = sizeof(struct sockaddr);
+    exception_handler(capture_handle);
+    return;
+  }
+  xaudio_wire_write(&wire_log, 0, XAUDIO_WIRE_CAPTURE, NULL, capture_buffer_frames);
+
+  // before anything else sees the capture
+  if (aec_on)
+    cancel_echo();
+  if (capture_dsp.count > 0)
+  {
+    XAUDIO_TRACE_SPAN("dsp");
+    dsp_run(&capture_dsp, reinterpret_cast<int16_t *>(&capture_buffer[0]), capture_buffer_frames);
+  }
 
-    int client_fd = accept(server_fd, reinterpret_cast<struct sockaddr *>(&client_addr),
-      &client_addr_length);
+  XAUDIO_TRACE_SPAN("capture");
+  if (local_ring.header)
+    xaudio_local_publish(&local_ring, &capture_buffer[0], capture_buffer.size(), formats[0].head,
+      xaudio_local_now_ns());
 
-    if (client_fd < 0)
+  if (archive_on)
+  {
+    XAUDIO_TRACE_SPAN("archive");
+    int64_t const now = xaudio_archive_now_ns(CLOCK_REALTIME) - archive.period_ns;
+    int err = xaudio_archive_append(&archive, &capture_buffer[0], now);
+    if (err < 0)
     {
-      LOG("error accepting client connection. %s", strerror(errno));
-      continue;
+      LOG("failed to write the archive, not archiving any more. %s", strerror(-err));
+      archive_on = false;
     }
+  }
+
+  int level_db;
+  bool voice;
+  {
+    XAUDIO_TRACE_SPAN("vad");
+    voice = vad_run(&capture_vad, reinterpret_cast<int16_t const *>(&capture_buffer[0]), capture_buffer_frames,
+      &level_db);
+  }
+  vad_periods++;
+  if (!voice)
+    vad_silent_periods++;
 
-    LOG("accepted client connection from:[%s:%d]", inet_ntoa(client_addr.sin_addr),
-      ntohs(client_addr.sin_port));
+  ring_append(&formats[0], &capture_buffer[0], capture_buffer.size(), voice, level_db);
+  transcode_period(voice, level_db);
+}
 
-    while (true)
+// every stage's CPU on one line
+static void report_dsp(char const* direction, dsp_chain* d, int64_t elapsed)
+{
+  if (d->periods > 0)
+  {
+    char line[512];
+    int n = snprintf(line, sizeof(line), "%s dsp: conversion %.3f%% core, %.2fus", direction,
+      (100.0 * d->convert_ns) / (elapsed * 1e6), (d->convert_ns / 1e3) / d->periods);
+    for (int i = 0; (i < d->count) && (n < static_cast<int>(sizeof(line))); ++i)
     {
-      fd_set read_fds;
-      fd_set write_fds;
-      fd_set err_fds;
-      FD_ZERO(&write_fds);
-      FD_ZERO(&read_fds);
-      FD_ZERO(&err_fds);
+      dsp_stage const& s = d->stages[i];
+      n += snprintf(line + n, sizeof(line) - n, ", %s %.3f%% core, %.2fus", s.name,
+        (100.0 * s.busy_ns) / (elapsed * 1e6), (s.busy_ns / 1e3) / d->periods);
+    }
+    LOG("%s per period", line);
+  }
+  d->periods = 0;
+  d->convert_ns = 0;
+  for (int i = 0; i < d->count; ++i)
+    d->stages[i].busy_ns = 0;
+}
 
-      // std::fill(capture_buffer.begin(), capture_buffer.end(), 0);
-      if (capture_handle)
-      {
-        err = snd_pcm_readi(capture_handle, &capture_buffer[0], capture_buffer_frames);
-        if (err != capture_buffer_frames)
-        {
-          exception_handler(capture_handle);
-        }
+// per format CPU and how often a converted period was shared
+static void report_formats()
+{
+  int64_t const elapsed = millis_since(last_report);
+  if (elapsed < report_interval_ms)
+    return;
+  gettimeofday(&last_report, NULL);
 
-        // only care about writing if we're in capture mode, therefore, sending 
-        FD_SET(client_fd, &write_fds);
-      }
+  if (wire_log.f)
+    fflush(wire_log.f);
 
-      FD_SET(client_fd, &read_fds);
-      FD_SET(client_fd, &err_fds);
+  uint64_t conversions = 0;
+  uint64_t client_periods = 0;
+  for (size_t i = 1; i < formats.size(); ++i)
+  {
+    output_format& f = formats[i];
+    if (f.conversions > 0)
+    {
+      LOG("format %s: %d clients, %.3f%% core, %.2fus per period", format_name(f.format), f.clients,
+        (100.0 * f.busy_ns) / (elapsed * 1e6), (f.busy_ns / 1e3) / f.conversions);
+    }
 
-      struct timeval timeout;
-      timeout.tv_sec = 0;
-      timeout.tv_usec = 10;
+    conversions += f.conversions;
+    client_periods += f.client_periods;
+    f.conversions = 0;
+    f.client_periods = 0;
+    f.busy_ns = 0;
+  }
+  formats[0].client_periods = 0;
 
-      int ret = select(client_fd + 1, &read_fds, &write_fds, &err_fds, &timeout);
-      if (ret == 0)
-        continue;
+  if (dtx_audio_bytes > 0)
+  {
+    LOG("dtx: %.1f%% of periods silent, sent %lluKB for %lluKB of audio, %.1f%% saved",
+      (100.0 * vad_silent_periods) / std::max<uint64_t>(1, vad_periods),
+      static_cast<unsigned long long>(dtx_wire_bytes / 1024), static_cast<unsigned long long>(dtx_audio_bytes / 1024),
+      100.0 - ((100.0 * dtx_wire_bytes) / dtx_audio_bytes));
+  }
+  vad_periods = 0;
+  vad_silent_periods = 0;
+  dtx_audio_bytes = 0;
+  dtx_wire_bytes = 0;
 
-      if (FD_ISSET(client_fd, &err_fds))
-      {
-        LOG("socket error");
-        close(client_fd);
-        break;
-      }
+  if (aec_periods > 0)
+  {
+    bool const echo = (capture_aec.mic_energy > 0);
+    LOG("aec: %s%.1fdB erle, %.3f%% core, %.2fus per period", echo ? "" : "no reference, ", aec_take_erle(&capture_aec),
+      (100.0 * aec_busy_ns) / (elapsed * 1e6), (aec_busy_ns / 1e3) / aec_periods);
+  }
+  aec_periods = 0;
+  aec_busy_ns = 0;
 
-      if (capture_handle && FD_ISSET(client_fd, &write_fds))
-      {
-//        ssize_t n = write(client_fd, &capture_buffer[0], capture_buffer.size());
-        ssize_t n = send(client_fd, &capture_buffer[0], capture_buffer.size(), MSG_NOSIGNAL);
+  report_dsp("capture", &capture_dsp, elapsed);
+  report_dsp("playback", &playback_dsp, elapsed);
 
-        if (n != static_cast<ssize_t>(capture_buffer.size()))
-        {
-          if (n == -1)
-          {
-            LOG("error sending on socket: %s", strerror(errno));
-          }
-          else
-          {
-            LOG("failed to send all audio data. only sent %d of %d bytes.",
-                static_cast<int>(n), static_cast<int>(capture_buffer.size()));
-          }
-          close(client_fd);
-          break;
-        }
-      }
-      else
-      {
-        LOG("client isn't keeping up");
-      }
+  if (plc_gaps > 0)
+  {
+    LOG("plc: %llu gaps in playback, %.1fms concealed", static_cast<unsigned long long>(plc_gaps),
+      (1000.0 * plc_frames) / playback_sample_rate);
+  }
+  plc_gaps = 0;
+  plc_frames = 0;
 
-      if (FD_ISSET(client_fd, &read_fds))
-      {
-//        int n = read(client_fd, &playback_buffer[0], playback_buffer_size);
-        int n = read(client_fd, &buff[0], buff.capacity());
-        if (n > 0)
-        {
-          int bytes_per_frame = 2 * playback_num_channels;
-          int num_frames_to_write = n / bytes_per_frame;
-//          snd_pcm_writei(playback_handle, &playback_buffer[0], (n / bytes_per_frame));
-          err = snd_pcm_writei(playback_handle, &buff[0], num_frames_to_write);
-          if (err == -EPIPE)
-            exception_handler(playback_handle);
-          else if (err < 0)
-            LOG("snd_pcm_writei:%s", snd_strerror(err));
-          else if (err != num_frames_to_write)
-            LOG("short write wanted:%d got:%d", num_frames_to_write, err);
-        }
-        else if (n == -1)
-        {
-          LOG("read from socket failed. %s", strerror(errno));
-        }
-      }
-    }
+  if (client_periods > 0)
+  {
+    LOG("transcode cache: %llu conversions for %llu client periods, hit ratio %.1f%%",
+      static_cast<unsigned long long>(conversions), static_cast<unsigned long long>(client_periods),
+      (100.0 * (client_periods - std::min(conversions, client_periods))) / client_periods);
+  }
+}
 
-    close(client_fd);
+// the next frame of a framed stream into s->out, a period at most
+static void build_frame(output_format const& f, client_session* s)
+{
+  s->out.clear();
+  s->out_pos = 0;
+
+  period_mark const* mark = period_at(f, s->sent);
+  if (!mark)
+    return;
+
+  xaudio_dtx_header header;
+  uint64_t const sent = s->sent;
+  if (mark->voice || !dtx_enabled)
+  {
+    uint64_t const most = 0xffff - (0xffff % f.frame_bytes);
+    uint64_t const n = std::min(mark->end - s->sent, most);
+    header.type = XAUDIO_DTX_PCM;
+    header.level = 0;
+    header.length = static_cast<uint16_t>(n);
+
+    s->out.resize(XAUDIO_DTX_HEADER_SIZE + n);
+    size_t const pos = s->sent % f.ring.size();
+    size_t const first = std::min<uint64_t>(n, f.ring.size() - pos);
+    memcpy(s->out.data() + XAUDIO_DTX_HEADER_SIZE, &f.ring[pos], first);
+    memcpy(s->out.data() + XAUDIO_DTX_HEADER_SIZE + first, &f.ring[0], n - first);
+    s->sent += n;
+  }
+  else
+  {
+    header.type = XAUDIO_DTX_NOISE;
+    header.level = mark->level;
+    header.length = static_cast<uint16_t>((mark->end - s->sent) / f.frame_bytes);
+    s->out.resize(XAUDIO_DTX_HEADER_SIZE);
+    s->sent = mark->end;
+  }
+
+  xaudio_encode_dtx_header(header, &s->out[0]);
+  dtx_audio_bytes += s->sent - sent;
+  dtx_wire_bytes += s->out.size();
+}
+
+static void build_ladder(xaudio_format const& top, std::vector<xaudio_format>* ladder)
+{
+  static const uint32_t rates[] = { 16000, 8000 };
+
+  ladder->assign(1, top);
+  for (size_t i = 0; i < (sizeof(rates) / sizeof(rates[0])); ++i)
+  {
+    xaudio_format rung;
+    rung.sample_rate = std::min(top.sample_rate, rates[i]);
+    rung.channels = 1;
+    rung.sample_format = XAUDIO_S16LE;
+
+    xaudio_format const& last = ladder->back();
+    if ((static_cast<uint64_t>(rung.sample_rate) * xaudio_format_frame_bytes(rung))
+      < (static_cast<uint64_t>(last.sample_rate) * xaudio_format_frame_bytes(last)))
+      ladder->push_back(rung);
+  }
+}
+
+// what's waiting to go to the client, in the kernel and still in the ring,
+// as milliseconds of its audio
+static int queued_ms(client_session const* s)
+{
+  int queued = 0;
+  if (ioctl(s->fd, SIOCOUTQ, &queued) < 0)
+    queued = 0;
+
+  output_format const& f = formats[s->format];
+  uint64_t const backlog = queued + (f.head - std::min(f.head, s->sent)) + (s->out.size() - s->out_pos);
+  uint64_t const bytes_per_second = static_cast<uint64_t>(f.format.sample_rate) * f.frame_bytes;
+  return static_cast<int>((backlog * 1000) / bytes_per_second);
+}
+
+static void request_rung(client_session* s, int rung, int queue_ms)
+{
+  s->next_rung = rung;
+  s->switch_queue_ms = queue_ms;
+  gettimeofday(&s->switched_at, NULL);
+  memset(&s->clear_since, 0, sizeof(s->clear_since));
+}
+
+// down a rung as soon as the queue is too long, up a rung once it has been
+// short for long enough
+static void adapt_session(client_session* s)
+{
+  if (!s->adapt || (s->next_rung != s->rung))
+    return;
+
+  XAUDIO_TRACE_SPAN("adapt");
+  int const queue_ms = queued_ms(s);
+  int64_t const since_switch = millis_since(s->switched_at);
+  if (queue_ms > adapt_down_ms)
+  {
+    memset(&s->clear_since, 0, sizeof(s->clear_since));
+    if ((s->rung + 1 < static_cast<int>(s->ladder.size())) && (since_switch >= adapt_hold_ms))
+    {
+      // the last step up didn't hold, wait longer before the next one
+      size_t const n = s->timeline.size();
+      if ((n >= 2) && (s->timeline[n - 1].rung < s->timeline[n - 2].rung))
+      {
+        s->up_wait_ms = (since_switch < adapt_probe_ms) ? std::min(s->up_wait_ms * 2, adapt_max_up_wait_ms)
+          : adapt_up_wait_ms;
+      }
+      request_rung(s, s->rung + 1, queue_ms);
+    }
+    return;
+  }
+
+  if ((s->rung == 0) || (queue_ms > (adapt_down_ms / 4)))
+  {
+    memset(&s->clear_since, 0, sizeof(s->clear_since));
+    return;
+  }
+
+  if (s->clear_since.tv_sec == 0)
+    gettimeofday(&s->clear_since, NULL);
+  else if (millis_since(s->clear_since) >= s->up_wait_ms)
+    request_rung(s, s->rung - 1, queue_ms);
+}
+
+// Moves the session to the ring of its next rung, carrying on as many
+// periods behind the head as it was, and queues the format frame telling
+// the client. A ring nobody was using holds stale audio, that one is
+// joined at its head.
+static void switch_rung(client_session* s)
+{
+  int const format = find_format(s->ladder[s->next_rung]);
+  if (!xaudio_format_equal(formats[format].format, s->ladder[s->next_rung]))
+  {
+    LOG("session %016llx stays at %s, no room for another format", static_cast<unsigned long long>(s->token),
+      format_name(formats[s->format].format));
+    s->next_rung = s->rung;
+    return;
+  }
+
+  output_format& from = formats[s->format];
+  output_format& to = formats[format];
+  uint64_t const behind = from.period_count - period_index(from, s->sent);
+  s->sent = (to.users == 0) ? to.head : period_start(to, behind);
+  from.clients--;
+  from.users--;
+  to.clients++;
+  to.users++;
+
+  LOG("session %016llx %s to %s, %dms queued", static_cast<unsigned long long>(s->token),
+    (s->rung == -1) ? "follows the capture" : ((s->next_rung > s->rung) ? "steps down" : "steps up"),
+    format_name(to.format), s->switch_queue_ms);
+  s->format = format;
+  s->rung = s->next_rung;
+  s->switched = true;
+
+  quality_switch q;
+  q.at_ms = millis_since(s->started_at);
+  q.rung = s->rung;
+  q.format = to.format;
+  q.queue_ms = s->switch_queue_ms;
+  s->timeline.push_back(q);
+
+  xaudio_dtx_header header;
+  header.type = XAUDIO_DTX_FORMAT;
+  header.level = 0;
+  header.length = XAUDIO_FORMAT_SIZE;
+  s->out.resize(XAUDIO_DTX_HEADER_SIZE + XAUDIO_FORMAT_SIZE);
+  s->out_pos = 0;
+  xaudio_encode_dtx_header(header, &s->out[0]);
+  xaudio_encode_format(to.format, &s->out[XAUDIO_DTX_HEADER_SIZE]);
+}
+
+static int send_frames(client_session* s)
+{
+  if ((s->next_rung != s->rung) && (s->out_pos == s->out.size()))
+    switch_rung(s);
+
+  output_format const& f = formats[s->format];
+  while (true)
+  {
+    if (s->out_pos == s->out.size())
+    {
+      uint64_t const oldest = ring_oldest(f);
+      if (s->sent < oldest)
+      {
+        uint64_t const next = skip_to(f, s->sent, oldest);
+        LOG("client fell behind the capture ring, skipping %llu bytes",
+          static_cast<unsigned long long>(next - s->sent));
+        s->sent = next;
+      }
+
+      if (s->sent >= f.head)
+        return 0;
+      build_frame(f, s);
+      if (s->out.empty())
+        return 0;
+    }
+
+    size_t const n = s->out.size() - s->out_pos;
+    ssize_t sent = wire_send(s->fd, &s->out[s->out_pos], n, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0)
+    {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        return 0;
+      LOG("error sending on socket: %s", strerror(errno));
+      return -1;
+    }
+
+    s->out_pos += sent;
+    if (static_cast<size_t>(sent) < n)
+      return 0;
+  }
+}
+
+// sends whatever the client hasn't had yet without ever blocking the
+// capture loop, returns -1 when the connection is gone
+static int send_capture(client_session* s)
+{
+  XAUDIO_TRACE_SPAN("send");
+  if (s->dtx)
+    return send_frames(s);
+
+  output_format const& f = formats[s->format];
+  uint64_t const oldest = ring_oldest(f);
+  if (s->sent < oldest)
+  {
+    uint64_t const next = skip_to(f, s->sent, oldest);
+    LOG("client fell behind the capture ring, skipping %llu bytes",
+      static_cast<unsigned long long>(next - s->sent));
+    s->sent = next;
+  }
+
+  while (s->sent < f.head)
+  {
+    size_t const pos = s->sent % f.ring.size();
+    size_t const n = std::min<uint64_t>(f.head - s->sent, f.ring.size() - pos);
+    ssize_t sent = wire_send(s->fd, &f.ring[pos], n, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0)
+    {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        return 0;
+      LOG("error sending on socket: %s", strerror(errno));
+      return -1;
+    }
+
+    s->sent += sent;
+    if (static_cast<size_t>(sent) < n)
+      return 0;
+  }
+  return 0;
+}
+
+static uint64_t new_session_token()
+{
+  uint64_t token = 0;
+  FILE* f = fopen("/dev/urandom", "rb");
+  if (f)
+  {
+    if (fread(&token, sizeof(token), 1, f) != 1)
+      token = 0;
+    fclose(f);
+  }
+
+  if (token == 0)
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    token = (static_cast<uint64_t>(tv.tv_sec) << 32) ^ tv.tv_usec ^ (static_cast<uint64_t>(getpid()) << 16);
+  }
+  return token ? token : 1;
+}
+
+static int live_clients()
+{
+  int n = 0;
+  for (size_t i = 0; i < sessions.size(); ++i)
+  {
+    if (sessions[i].fd != -1)
+      n++;
+  }
+  return n;
+}
+
+static void log_timeline(client_session const* s)
+{
+  std::string line;
+  for (size_t i = 0; i < s->timeline.size(); ++i)
+  {
+    quality_switch const& q = s->timeline[i];
+    char buff[96];
+    snprintf(buff, sizeof(buff), "%s%.1fs %s", i ? ", " : "", q.at_ms / 1000.0, format_name(q.format));
+    line += buff;
+    if (i > 0)
+    {
+      snprintf(buff, sizeof(buff), " (%dms queued)", q.queue_ms);
+      line += buff;
+    }
+  }
+  LOG("session %016llx quality: %s", static_cast<unsigned long long>(s->token), line.c_str());
+}
+
+static void drop_client(client_session* s)
+{
+  if (s->timeline.size() > 1)
+    log_timeline(s);
+  close_client_fd(s->fd);
+  if (playback_owner == s->fd)
+    playback_owner = -1;
+  s->fd = -1;
+  formats[s->format].clients--;
+
+  gettimeofday(&s->dropped_at, NULL);
+  LOG("client dropped, session %016llx can be resumed for %dms",
+    static_cast<unsigned long long>(s->token), resume_window_ms);
+}
+
+static void erase_session(size_t i)
+{
+  if (sessions[i].fd != -1)
+    drop_client(&sessions[i]);
+  formats[sessions[i].format].users--;
+  sessions.erase(sessions.begin() + i);
+}
+
+static void expire_sessions()
+{
+  for (size_t i = 0; i < sessions.size();)
+  {
+    if ((sessions[i].fd == -1) && (millis_since(sessions[i].dropped_at) > resume_window_ms))
+    {
+      LOG("session %016llx expired", static_cast<unsigned long long>(sessions[i].token));
+      erase_session(i);
+    }
+    else
+    {
+      ++i;
+    }
+  }
+}
+
+// the ladder starts at the session's format, with a timeline that says so
+static void start_adapt(client_session* s, bool adapt)
+{
+  s->adapt = adapt;
+  s->rung = 0;
+  s->next_rung = 0;
+  s->switch_queue_ms = 0;
+  s->switched = false;
+  gettimeofday(&s->started_at, NULL);
+  s->switched_at = s->started_at;
+  memset(&s->clear_since, 0, sizeof(s->clear_since));
+  s->up_wait_ms = adapt_up_wait_ms;
+  s->timeline.clear();
+  s->ladder.clear();
+  if (!adapt)
+    return;
+
+  build_ladder(formats[s->format].format, &s->ladder);
+  quality_switch q;
+  q.at_ms = 0;
+  q.rung = 0;
+  q.format = s->ladder[0];
+  q.queue_ms = 0;
+  s->timeline.push_back(q);
+}
+
+// Decides where the stream for a new connection starts. A client that
+// presents the token of a recently dropped session, and wants the same
+// format, carries on where it left off, limited to resume_backlog_ms of
+// backlog. Everybody else starts at the live edge of its format's ring.
+// Returns false when there's no room for another client.
+static bool start_session(int fd, xaudio_hello const* client_hello, xaudio_format const* wanted,
+  xaudio_hello* reply, xaudio_format* granted)
+{
+  int const format = wanted ? find_format(*wanted) : 0;
+  output_format const& f = formats[format];
+  uint64_t const live = f.head;
+  uint32_t const flags = client_hello ? client_hello->version_or_flags : 0;
+  // stepping down needs format frames, so only framed streams adapt
+  bool const adapt = adapt_enabled && capture_handle && (flags & XAUDIO_HELLO_DTX) && (flags & XAUDIO_HELLO_ADAPT);
+  bool const dtx = (flags & XAUDIO_HELLO_DTX) && (dtx_enabled || adapt);
+
+  int found = -1;
+  for (size_t i = 0; client_hello && (client_hello->session_token != 0) && (i < sessions.size()); ++i)
+  {
+    if (sessions[i].token == client_hello->session_token)
+      found = static_cast<int>(i);
+  }
+
+  if (found != -1)
+  {
+    client_session& s = sessions[found];
+    if (s.fd != -1)
+    {
+      LOG("client is back on a new connection, replacing the old one");
+      drop_client(&s);
+    }
+
+    bool const resume = (s.format == format) && !s.switched
+      && (millis_since(s.dropped_at) <= resume_window_ms)
+      && ((s.base + client_hello->offset) <= s.sent);
+
+    if (resume)
+    {
+      uint64_t const backlog = ((static_cast<uint64_t>(f.format.sample_rate) * resume_backlog_ms) / 1000)
+        * f.frame_bytes;
+      uint64_t const limit = std::max(ring_oldest(f), (live > backlog) ? (live - backlog) : 0);
+      uint64_t const from = s.base + client_hello->offset;
+
+      s.sent = skip_to(f, from, limit);
+      s.fd = fd;
+      s.dtx = dtx;
+      s.out.clear();
+      s.out_pos = 0;
+      s.native = !wanted;
+      start_adapt(&s, adapt);
+      formats[format].clients++;
+      reply->version_or_flags = XAUDIO_FLAG_RESUMED;
+      reply->session_token = s.token;
+      reply->offset = s.sent - s.base;
+      LOG("resuming session %016llx after %lldms, skipped %llu bytes",
+        static_cast<unsigned long long>(s.token), static_cast<long long>(millis_since(s.dropped_at)),
+        static_cast<unsigned long long>(s.sent - from));
+    }
+    else
+    {
+      erase_session(found);
+      found = -1;
+    }
+  }
+
+  if (found == -1)
+  {
+    if (live_clients() >= max_clients)
+      return false;
+
+    client_session s;
+    s.fd = fd;
+    s.token = new_session_token();
+    s.format = format;
+    s.base = live;
+    s.sent = live;
+    memset(&s.dropped_at, 0, sizeof(s.dropped_at));
+    s.dtx = dtx;
+    s.out_pos = 0;
+    s.native = !wanted;
+    start_adapt(&s, adapt);
+    sessions.push_back(s);
+    formats[format].clients++;
+    formats[format].users++;
+
+    reply->version_or_flags = 0;
+    reply->session_token = s.token;
+    reply->offset = 0;
+    LOG("new session %016llx, %s", static_cast<unsigned long long>(s.token), format_name(f.format));
+  }
+
+  if (wanted)
+    reply->version_or_flags |= XAUDIO_FLAG_FORMAT;
+  if (dtx)
+    reply->version_or_flags |= XAUDIO_FLAG_DTX;
+  if (adapt)
+    reply->version_or_flags |= XAUDIO_FLAG_ADAPT;
+  *granted = f.format;
+  return true;
+}
+
+// the hello and the trailers its flags announce, returns -1 if it couldn't
+// be sent in one go
+static int send_server_hello(int fd, xaudio_hello const& reply, xaudio_format const& format,
+  xaudio_replay const* replay)
+{
+  uint8_t buff[XAUDIO_HELLO_SIZE + XAUDIO_FORMAT_SIZE + XAUDIO_REPLAY_SIZE];
+  size_t n = XAUDIO_HELLO_SIZE;
+  xaudio_encode_hello(reply, buff);
+  if (reply.version_or_flags & XAUDIO_FLAG_FORMAT)
+  {
+    xaudio_encode_format(format, buff + n);
+    n += XAUDIO_FORMAT_SIZE;
+  }
+  if (replay)
+  {
+    xaudio_encode_replay(*replay, buff + n);
+    n += XAUDIO_REPLAY_SIZE;
+  }
+  return (wire_send(fd, buff, n, MSG_NOSIGNAL) == static_cast<ssize_t>(n)) ? 0 : -1;
+}
+
+static client_session* find_session(int fd)
+{
+  for (size_t i = 0; i < sessions.size(); ++i)
+  {
+    if (sessions[i].fd == fd)
+      return &sessions[i];
+  }
+  return NULL;
+}
+
+static void setup_archive(char const* dir)
+{
+  uint32_t const segment_periods = ((capture_sample_rate * 60) / capture_buffer_frames) * archive_segment_minutes;
+  int const segments = (((archive_hours * 60) + archive_segment_minutes - 1) / archive_segment_minutes) + 1;
+
+  int err = xaudio_archive_open(&archive, dir, capture_sample_rate, capture_num_channels, capture_frame_bytes,
+    capture_buffer.size(), segment_periods, segments, archive_sync_ms);
+  if (err < 0)
+  {
+    LOG("failed to set up the archive in %s. %s", dir, strerror(-err));
+    exit(1);
+  }
+
+  archive_on = true;
+  LOG("archiving %dh of capture in:[%s] %d segments, %lluMB", archive_hours, dir, segments,
+    static_cast<unsigned long long>((archive.layout.file_size * segments) >> 20));
+}
+
+static bool open_replay_segment(replay_session* r)
+{
+  if (r->file != -1)
+    close(r->file);
+
+  std::string const path = xaudio_archive_path(&archive, r->cursor.segment);
+  r->file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (r->file == -1)
+    LOG("failed to open %s. %s", path.c_str(), strerror(errno));
+  return r->file != -1;
+}
+
+// Finds where a replay starts, false if it can't be served
+static bool start_replay(int fd, xaudio_replay const& request, xaudio_replay* granted)
+{
+  granted->from_ms = 0;
+  granted->speed_percent = request.speed_percent;
+  if (!archive_on)
+  {
+    LOG("replay asked for, but there's no archive");
+    return false;
+  }
+
+  if ((live_clients() + static_cast<int>(replays.size())) >= max_clients)
+  {
+    LOG("already serving %d clients, not replaying", max_clients);
+    return false;
+  }
+
+  replay_session r;
+  r.fd = fd;
+  r.file = -1;
+  if (!xaudio_archive_seek(&archive, request.from_ms * 1000000, &r.cursor) || !open_replay_segment(&r))
+  {
+    LOG("nothing archived after %lldms", static_cast<long long>(request.from_ms));
+    return false;
+  }
+
+  granted->from_ms = xaudio_archive_time(&archive, r.file, r.cursor.period) / 1000000;
+  r.speed_percent = request.speed_percent;
+  r.start_ns = xaudio_archive_now_ns(CLOCK_MONOTONIC);
+  r.periods = 0;
+  r.out_pos = 0;
+  replays.push_back(r);
+
+  LOG("replaying from %lldms at %u%% speed", static_cast<long long>(granted->from_ms), request.speed_percent);
+  return true;
+}
+
+// Sends the archive paced at the replay's speed. Returns 1 once it reached
+// the live edge, -1 when the connection is gone.
+static int send_replay(replay_session* r)
+{
+  while (true)
+  {
+    if (r->out_pos == r->out.size())
+    {
+      xaudio_archive_segment const& s = archive.segments[r->cursor.segment];
+      if (s.sequence != r->cursor.sequence)
+      {
+        LOG("replay fell behind the archive, skipping to the oldest audio");
+        r->cursor.segment = xaudio_archive_oldest(&archive);
+        r->cursor.sequence = archive.segments[r->cursor.segment].sequence;
+        r->cursor.period = 0;
+        if (!open_replay_segment(r))
+          return -1;
+        continue;
+      }
+
+      if (r->cursor.period >= s.periods)
+      {
+        if (!xaudio_archive_next_segment(&archive, &r->cursor))
+          return 1;
+        if (!open_replay_segment(r))
+          return -1;
+        continue;
+      }
+
+      uint64_t n = std::min<uint64_t>(replay_batch_periods, s.periods - r->cursor.period);
+      if (r->speed_percent > 0)
+      {
+        int64_t const elapsed = xaudio_archive_now_ns(CLOCK_MONOTONIC) - r->start_ns;
+        uint64_t const due = ((elapsed / archive.period_ns) * r->speed_percent) / 100 + 1;
+        if (r->periods >= due)
+          return 0;
+        n = std::min<uint64_t>(n, due - r->periods);
+      }
+
+      size_t const bytes = n * archive.layout.period_bytes;
+      off_t const at = archive.layout.data_offset + (r->cursor.period * archive.layout.period_bytes);
+      r->out.resize(bytes);
+      r->out_pos = 0;
+      if (pread(r->file, &r->out[0], bytes, at) != static_cast<ssize_t>(bytes))
+      {
+        LOG("failed to read the archive. %s", strerror(errno));
+        return -1;
+      }
+      r->cursor.period += n;
+      r->periods += n;
+    }
+
+    size_t const n = r->out.size() - r->out_pos;
+    ssize_t sent = wire_send(r->fd, &r->out[r->out_pos], n, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0)
+    {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        return 0;
+      LOG("error sending on socket: %s", strerror(errno));
+      return -1;
+    }
+
+    r->out_pos += sent;
+    if (static_cast<size_t>(sent) < n)
+      return 0;
+  }
+}
+
+static void setup_local(char const* path)
+{
+  uint32_t const period_bytes = capture_buffer.size();
+  uint32_t const period_ms = std::max(1, (capture_buffer_frames * 1000) / static_cast<int>(capture_sample_rate));
+  uint32_t const slots = std::max(4, local_ring_ms / static_cast<int>(period_ms));
+
+  int err = xaudio_local_create(&local_ring, capture_sample_rate, capture_num_channels, capture_frame_bytes,
+    period_bytes, slots);
+  if (err < 0)
+  {
+    LOG("failed to create the local ring. %s", strerror(-err));
+    exit(1);
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+
+  local_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ((bind(local_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) || (listen(local_fd, 8) < 0))
+  {
+    LOG("failed to listen on %s. %s", path, strerror(errno));
+    exit(1);
+  }
+
+  LOG("local consumers on:[%s] %u slots of %u bytes", path, slots, period_bytes);
+}
+
+// consumers only need the ring, they're done with the socket once they
+// have the fd
+static void accept_local()
+{
+  int fd = accept(local_fd, NULL, NULL);
+  if (fd < 0)
+  {
+    LOG("error accepting local consumer. %s", strerror(errno));
+    return;
+  }
+
+  int err = xaudio_local_send_fd(fd, local_ring.consumer_fd);
+  if (err < 0)
+    LOG("failed to pass the ring to a local consumer. %s", strerror(-err));
+  else
+    LOG("local consumer attached");
+  close(fd);
+}
+
+static void setup_clips(char const* dir, size_t max_block_bytes)
+{
+  std::vector<std::pair<std::string, int> > skipped;
+  int loaded = xaudio_clip_load_dir(&clips, dir, playback_sample_rate, playback_num_channels, &skipped);
+  if (loaded < 0)
+  {
+    LOG("failed to read the clips in %s. %s", dir, strerror(-loaded));
+    exit(1);
+  }
+  for (size_t i = 0; i < skipped.size(); ++i)
+  {
+    int const err = skipped[i].second;
+    LOG("skipping clip %s. %s", skipped[i].first.c_str(), (err == -EINVAL) ? "not a 16 bit PCM WAV" : strerror(-err));
+  }
+
+  // big enough for a client's block or a lead's worth of silence
+  size_t const lead_samples = 2 * playback_frames * playback_num_channels;
+  clip_buffer.resize(std::max(lead_samples, max_block_bytes / 2));
+  clips_on = true;
+
+  for (size_t i = 0; i < clips.clips.size(); ++i)
+    LOG("clip %s: %.2fs", clips.clips[i].name, static_cast<double>(clips.clips[i].frames) / playback_sample_rate);
+  LOG("%d clips from:[%s]", loaded, dir);
+}
+
+// play, stop and clock from the control socket, see handle_control_command
+static void clip_command(char const* msg, char* reply, size_t reply_size)
+{
+  char name[XAUDIO_CLIP_NAME_SIZE];
+  unsigned long long at = 0;
+  int const fields = sscanf(msg, "play %31s %llu", name, &at);
+  if (fields >= 1)
+  {
+    int const clip = xaudio_clip_find(&clips, name);
+    int64_t const start = (clip == -1) ? -1 : xaudio_clip_trigger(&clips, clip, (fields == 2) ? at : 0);
+    if (clip == -1)
+      snprintf(reply, reply_size, "error no clip %s", name);
+    else if (start < 0)
+      snprintf(reply, reply_size, "error all %d voices busy", XAUDIO_CLIP_VOICES);
+    else
+      snprintf(reply, reply_size, "ok %s %lld", name, static_cast<long long>(start));
+  }
+  else if (!strncmp(msg, "stop", 4))
+  {
+    xaudio_clip_stop_all(&clips);
+    snprintf(reply, reply_size, "ok");
+  }
+  else if (!strncmp(msg, "clock", 5))
+  {
+    snd_pcm_sframes_t queued = 0;
+    if (playback_delay(&queued) < 0)
+      queued = 0;
+    snprintf(reply, reply_size, "clock %llu %ld", static_cast<unsigned long long>(clips.position),
+      static_cast<long>(queued));
+  }
+  else
+  {
+    snprintf(reply, reply_size, "error unknown command");
+  }
+}
+
+static void setup_aec()
+{
+  if (capture_num_channels != 1)
+  {
+    LOG("skipping echo cancellation, it only works on a mono capture");
+    return;
+  }
+  if (!aec_init(&capture_aec, capture_buffer_frames, (aec_tail_ms * static_cast<int>(capture_sample_rate)) / 1000))
+  {
+    LOG("skipping echo cancellation, --capture-frames has to be a power of two of at least 8");
+    return;
+  }
+
+  xaudio_format reference;
+  reference.sample_rate = capture_sample_rate;
+  reference.channels = 1;
+  reference.sample_format = XAUDIO_S16LE;
+  transcoder_init(&aec_ref_conv, playback_sample_rate, playback_num_channels, reference);
+  aec_ref_ring.resize((capture_sample_rate * aec_ref_ring_ms) / 1000);
+  aec_ref_block.resize(capture_buffer_frames);
+  aec_on = true;
+  LOG("echo cancellation: %dms tail in %d partitions of %d frames, %s", aec_tail_ms, capture_aec.partitions,
+    capture_buffer_frames, XAUDIO_SIMD);
+}
+
+// what playback just took, for the echo canceller
+static void aec_reference(void const* pcm, size_t frames)
+{
+  if (!aec_on)
+    return;
+
+  size_t const max_bytes = transcoder_max_output(&aec_ref_conv, frames);
+  if (aec_ref_converted.size() < max_bytes)
+    aec_ref_converted.resize(max_bytes);
+  size_t const bytes = transcoder_run(&aec_ref_conv, static_cast<int16_t const *>(pcm), frames, &aec_ref_converted[0]);
+
+  int16_t const* in = reinterpret_cast<int16_t const *>(&aec_ref_converted[0]);
+  for (size_t i = 0; i < (bytes / 2); ++i)
+    aec_ref_ring[(aec_ref_written + i) % aec_ref_ring.size()] = in[i];
+  aec_ref_written += bytes / 2;
+}
+
+// the playback chain over what's about to be written
+static void process_playback(int16_t* pcm, size_t frames)
+{
+  if (playback_dsp.count == 0)
+    return;
+
+  XAUDIO_TRACE_SPAN("dsp");
+  dsp_run(&playback_dsp, pcm, frames);
+}
+
+// With nobody playing, clips go out over silence, kept two periods ahead
+// of the device
+static void pump_clips()
+{
+  if (!clips_on || (playback_owner != -1) || !xaudio_clip_active(&clips))
+    return;
+
+  XAUDIO_TRACE_SPAN("clips");
+  snd_pcm_sframes_t queued = 0;
+  if (playback_delay(&queued) < 0)
+  {
+    // ran dry since the last clip or client
+    snd_pcm_prepare(playback_handle);
+    queued = 0;
+  }
+
+  snd_pcm_sframes_t const lead = 2 * playback_frames;
+  while (queued < lead)
+  {
+    size_t const frames = std::min<size_t>(lead - queued, clip_buffer.size() / playback_num_channels);
+    memset(&clip_buffer[0], 0, frames * playback_num_channels * 2);
+    xaudio_clip_mix(&clips, &clip_buffer[0], frames);
+    process_playback(&clip_buffer[0], frames);
+    int err = playback_write(&clip_buffer[0], frames);
+    if (err < 0)
+    {
+      LOG("snd_pcm_writei:%s", snd_strerror(err));
+      return;
+    }
+    aec_reference(&clip_buffer[0], err);
+    queued += err;
+    if (static_cast<size_t>(err) < frames)
+      return;
+  }
+}
+
+static void setup_dsp(char const* direction, dsp_chain* d, char const* list, bool open, uint32_t sample_rate,
+  int channels)
+{
+  d->count = 0;
+  d->periods = 0;
+  if (!*list)
+    return;
+
+  if (!dsp_parse(d, list, sample_rate, channels))
+  {
+    LOG("failed to parse --%s-dsp=%s, the stages are gain:<dB>, dc, highpass:<Hz> and limit:<dBFS>, "
+      "on up to %d channels", direction, list, DSP_MAX_CHANNELS);
+    exit(1);
+  }
+  if (!open)
+  {
+    LOG("skipping %s processing, there's no %s", direction, direction);
+    d->count = 0;
+    return;
+  }
+  LOG("%s processing: %s, %s", direction, list, XAUDIO_SIMD);
+}
+
+static void setup_plc(size_t max_block_bytes)
+{
+  xaudio_plc_init(&playback_plc, playback_sample_rate, playback_num_channels);
+  plc_buffer.resize(std::max<size_t>((playback_sample_rate * plc_low_ms * playback_num_channels) / 1000, max_block_bytes / 2));
+  plc_on = true;
+  LOG("concealing gaps in playback below %dms queued", plc_low_ms);
+}
+
+// While the client that's played is late, playback goes on with an
+// extrapolation of its audio until that has faded out, mixed with clips
+// like the real thing. What's concealed stays queued ahead of the late
+// audio, a gap adds at most 60ms of latency.
+static void conceal_playback()
+{
+  if (!plc_on || (playback_owner == -1) || !playback_plc.primed || xaudio_plc_faded(&playback_plc))
+    return;
+
+  snd_pcm_sframes_t queued = 0;
+  if (playback_delay(&queued) < 0)
+    return;
+
+  snd_pcm_sframes_t const low = (playback_sample_rate * plc_low_ms) / 1000;
+  if (queued >= low)
+    return;
+
+  XAUDIO_TRACE_SPAN("conceal");
+  if (playback_plc.concealed == 0)
+    plc_gaps++;
+
+  size_t const frames = std::min<size_t>(low - queued, plc_buffer.size() / playback_num_channels);
+  xaudio_plc_conceal(&playback_plc, &plc_buffer[0], frames);
+  if (clips_on)
+    xaudio_clip_mix(&clips, &plc_buffer[0], frames);
+  process_playback(&plc_buffer[0], frames);
+  int err = playback_write(&plc_buffer[0], frames);
+  if (err < 0)
+  {
+    LOG("snd_pcm_writei:%s", snd_strerror(err));
+    return;
+  }
+  aec_reference(&plc_buffer[0], err);
+  plc_frames += err;
+}
+
+static void play(int fd, char const* data, int n)
+{
+  if (!playback_handle)
+    return;
+
+  if (playback_owner == -1)
+  {
+    LOG("playing audio from fd %d, other clients aren't played while it's connected", fd);
+    playback_owner = fd;
+  }
+  if (fd != playback_owner)
+    return;
+
+  XAUDIO_TRACE_SPAN("writei");
+  int err;
+  int bytes_per_frame = 2 * playback_num_channels;
+  int num_frames_to_write = n / bytes_per_frame;
+  if (clips_on || plc_on || (playback_dsp.count > 0))
+  {
+    // the concealment carries on from the client's audio, not the clips
+    // or the processing
+    int16_t* pcm = &play_buffer[0];
+    memcpy(pcm, data, num_frames_to_write * bytes_per_frame);
+    if (plc_on)
+      xaudio_plc_good(&playback_plc, pcm, num_frames_to_write);
+    if (clips_on)
+      xaudio_clip_mix(&clips, pcm, num_frames_to_write);
+    process_playback(pcm, num_frames_to_write);
+    data = reinterpret_cast<char const *>(pcm);
+  }
+  err = playback_write(data, num_frames_to_write);
+  if (err == -EPIPE)
+    exception_handler(playback_handle);
+  else if (err < 0)
+    LOG("snd_pcm_writei:%s", snd_strerror(err));
+  else if (err != num_frames_to_write)
+    LOG("short write wanted:%d got:%d", num_frames_to_write, err);
+  if (err > 0)
+    aec_reference(data, err);
+}
+
+static void setup_control(char const* path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+
+  control_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (control_fd < 0)
+  {
+    LOG("failed to create the control socket. %s", strerror(errno));
+    exit(1);
+  }
+  if (bind(control_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+  {
+    LOG("failed to bind %s. %s", path, strerror(errno));
+    exit(1);
+  }
+  LOG("control commands on:[%s]", path);
+}
+
+static void control_reply(struct sockaddr_un const& to, socklen_t to_len, char const* reply)
+{
+  if (to_len > sizeof(sa_family_t))
+    sendto(control_fd, reply, strlen(reply), MSG_DONTWAIT, reinterpret_cast<struct sockaddr const *>(&to), to_len);
+}
+
+// Opens and prepares a PCM, -EBUSY straight away when the device is in use
+// instead of waiting for it. The rate may come out other than asked for.
+static int open_pcm(char const* name, snd_pcm_stream_t stream, uint32_t* rate, int channels,
+  snd_pcm_uframes_t period_frames, snd_pcm_t** handle)
+{
+  *handle = NULL;
+  int err = snd_pcm_open(handle, name, stream, SND_PCM_NONBLOCK);
+  if (err < 0)
+    return err;
+
+  snd_pcm_hw_params_t* params;
+  snd_pcm_hw_params_alloca(&params);
+  if (((err = snd_pcm_hw_params_any(*handle, params)) < 0)
+    || ((err = snd_pcm_hw_params_set_access(*handle, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+    || ((period_frames > 0) && ((err = snd_pcm_hw_params_set_period_size(*handle, params, period_frames, 0)) < 0))
+    || ((err = snd_pcm_hw_params_set_format(*handle, params, SND_PCM_FORMAT_S16_LE)) < 0)
+    || ((err = snd_pcm_hw_params_set_channels(*handle, params, channels)) < 0)
+    || ((err = snd_pcm_hw_params_set_rate_near(*handle, params, rate, 0)) < 0)
+    || ((err = snd_pcm_hw_params(*handle, params)) < 0)
+    || ((err = snd_pcm_nonblock(*handle, 0)) < 0)
+    || ((err = snd_pcm_prepare(*handle)) < 0))
+  {
+    snd_pcm_close(*handle);
+    *handle = NULL;
+    return err;
+  }
+  return 0;
+}
+
+// what keeps the capture format from changing, NULL if nothing does
+static char const* capture_format_user()
+{
+  if (local_ring.header)
+    return "--local";
+  if (archive_on)
+    return "--archive";
+  if (wire_log.f)
+    return "--wire-log";
+  return NULL;
+}
+
+// whether --capture-dsp can run on a capture in that format
+static bool capture_dsp_fits(uint32_t sample_rate, int channels)
+{
+  dsp_chain* check = new dsp_chain;
+  bool const ok = dsp_parse(check, capture_dsp_list, sample_rate, channels);
+  delete check;
+  return ok;
+}
+
+static bool capture_format_changes(pcm_switch const* sw)
+{
+  return (sw->sample_rate != capture_sample_rate) || (sw->channels != capture_num_channels)
+    || (sw->frames != capture_buffer_frames);
+}
+
+static void describe_state(char* reply, size_t size)
+{
+  int n = snprintf(reply, size, "capture %s", capture_handle ? capture_device_name.c_str() : "none");
+  if (capture_handle)
+    n += snprintf(reply + n, size - n, " %uHz %dch %d frames", capture_sample_rate, capture_num_channels,
+      capture_buffer_frames);
+  n += snprintf(reply + n, size - n, ", playback %s", playback_handle ? playback_device_name.c_str() : "none");
+  if (playback_handle)
+    n += snprintf(reply + n, size - n, " %uHz %dch, clients send %uHz %dch", playback_device_rate,
+      playback_device_channels, playback_sample_rate, playback_num_channels);
+  snprintf(reply + n, size - n, ", %d clients%s%s", live_clients(), capture_switch.active ? ", switching capture" : "",
+    playback_switch.active ? ", switching playback" : "");
+}
+
+// Opens the device a capture or playback command asks for next to the one
+// in use. Returns false with the error in reply if it can't, true when the
+// switch is under way and will be answered once it's done.
+static bool start_switch(char const* msg, struct sockaddr_un const& from, socklen_t from_len, char* reply,
+  size_t size)
+{
+  bool const capture = !strncmp(msg, "capture", 7);
+  char const* direction = capture ? "capture" : "playback";
+  pcm_switch* sw = capture ? &capture_switch : &playback_switch;
+  if (!(capture ? capture_handle : playback_handle))
+  {
+    snprintf(reply, size, "error there's no %s to change", direction);
+    return false;
+  }
+  if (sw->active)
+  {
+    snprintf(reply, size, "error already switching %s", direction);
+    return false;
+  }
+
+  sw->device = capture ? capture_device_name : playback_device_name;
+  sw->sample_rate = capture ? capture_sample_rate : playback_device_rate;
+  sw->channels = capture ? capture_num_channels : playback_device_channels;
+  sw->frames = capture ? capture_buffer_frames : 0;
+
+  char settings[256];
+  snprintf(settings, sizeof(settings), "%s", msg);
+  char* save = NULL;
+  strtok_r(settings, " ", &save);
+  for (char* t = strtok_r(NULL, " ", &save); t; t = strtok_r(NULL, " ", &save))
+  {
+    if (!strncmp(t, "device=", 7))
+      sw->device = t + 7;
+    else if (!strncmp(t, "rate=", 5))
+      sw->sample_rate = static_cast<uint32_t>(strtoul(t + 5, NULL, 10));
+    else if (!strncmp(t, "channels=", 9))
+      sw->channels = static_cast<int>(strtol(t + 9, NULL, 10));
+    else if (capture && !strncmp(t, "frames=", 7))
+      sw->frames = static_cast<int>(strtol(t + 7, NULL, 10));
+    else
+    {
+      snprintf(reply, size, "error unknown setting %s", t);
+      return false;
+    }
+  }
+
+  if (sw->device.empty() || (sw->sample_rate < 8000) || (sw->sample_rate > 192000) || (sw->channels < 1)
+    || (sw->channels > 8) || (capture && ((sw->frames < 16) || (sw->frames > 8192))))
+  {
+    snprintf(reply, size, "error %s settings out of range", direction);
+    return false;
+  }
+
+  bool const dsp_ok = !capture || capture_dsp_fits(sw->sample_rate, sw->channels);
+  if (capture && capture_format_changes(sw) && capture_format_user())
+  {
+    snprintf(reply, size, "error the capture format can't change while %s uses it", capture_format_user());
+    return false;
+  }
+  if (!dsp_ok)
+  {
+    snprintf(reply, size, "error --capture-dsp doesn't fit %uHz %dch", sw->sample_rate, sw->channels);
+    return false;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &sw->started);
+  int const err = open_pcm(sw->device.c_str(), capture ? SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK,
+    &sw->sample_rate, sw->channels, capture ? 0 : playback_frames, &sw->handle);
+  sw->cold = (err == -EBUSY);
+  if ((err < 0) && !sw->cold)
+  {
+    snprintf(reply, size, "error failed to open %s. %s", sw->device.c_str(), snd_strerror(err));
+    return false;
+  }
+  if (!sw->cold && capture && capture_format_changes(sw) && capture_format_user())
+  {
+    snd_pcm_close(sw->handle);
+    snprintf(reply, size, "error %s runs at %uHz, the capture format can't change while %s uses it",
+      sw->device.c_str(), sw->sample_rate, capture_format_user());
+    return false;
+  }
+  if (!sw->cold && capture && !capture_dsp_fits(sw->sample_rate, sw->channels))
+  {
+    snd_pcm_close(sw->handle);
+    snprintf(reply, size, "error %s runs at %uHz, --capture-dsp doesn't fit it", sw->device.c_str(), sw->sample_rate);
+    return false;
+  }
+  if (!sw->cold && capture)
+    snd_pcm_start(sw->handle);
+
+  sw->from = from;
+  sw->from_len = from_len;
+  sw->active = true;
+  LOG("switching %s to %s%s", direction, sw->device.c_str(),
+    sw->cold ? ", it's busy, closing the old one first" : "");
+  return true;
+}
+
+// The old device back after the new one failed to open in its place, or
+// no device at all if that fails too.
+static snd_pcm_t* reopen_old(char const* direction, std::string const& device, snd_pcm_stream_t stream,
+  uint32_t rate, int channels, snd_pcm_uframes_t period_frames)
+{
+  snd_pcm_t* h = NULL;
+  int const err = open_pcm(device.c_str(), stream, &rate, channels, period_frames, &h);
+  if (err < 0)
+  {
+    LOG("failed to reopen %s %s. %s, exiting", direction, device.c_str(), snd_strerror(err));
+    exit(1);
+  }
+  if (stream == SND_PCM_STREAM_CAPTURE)
+    snd_pcm_start(h);
+  return h;
+}
+
+// Keeps the newest marks of a ring, in order, when the number of periods
+// it holds changes with the capture period.
+static void resize_marks(output_format* f, size_t periods)
+{
+  std::vector<period_mark> marks(periods);
+  uint64_t const keep = std::min<uint64_t>(f->period_count, std::min(periods, f->marks.size()));
+  for (uint64_t i = f->period_count - keep; i < f->period_count; ++i)
+    marks[i % periods] = f->marks[i % f->marks.size()];
+  f->marks.swap(marks);
+}
+
+// Everything that depends on the capture format, after it changed. The
+// ring of the old format becomes one converted from the new capture like
+// those clients asked for, so its sessions carry on in the format they
+// had. If clients already had the new format converted for them, that
+// ring is fed by the capture from now on. Adapt sessions that took the
+// capture format without asking for one follow it instead, told by a
+// format frame like a rung switch. Returns false when --capture-dsp
+// doesn't fit the new format and was turned off.
+static bool reformat_capture(xaudio_format const& old)
+{
+  capture_frame_bytes = 2 * capture_num_channels;
+  capture_buffer.resize(capture_buffer_frames * capture_frame_bytes);
+  uint32_t const ring_frames = std::max<uint32_t>((capture_sample_rate * capture_ring_ms) / 1000, capture_buffer_frames);
+  capture_ring_periods = (ring_frames / capture_buffer_frames) + 2;
+
+  xaudio_format now = old;
+  now.sample_rate = capture_sample_rate;
+  now.channels = capture_num_channels;
+  int moved = 0;
+  if (!xaudio_format_equal(old, now))
+  {
+    int merged = -1;
+    int free_slot = -1;
+    for (size_t i = 1; i < formats.size(); ++i)
+    {
+      if (xaudio_format_equal(formats[i].format, now))
+        merged = static_cast<int>(i);
+      else if (formats[i].users == 0)
+        free_slot = static_cast<int>(i);
+    }
+
+    moved = (merged != -1) ? merged : free_slot;
+    if (moved == -1)
+    {
+      moved = static_cast<int>(formats.size());
+      formats.push_back(output_format());
+    }
+
+    std::swap(formats[0], formats[moved]);
+    for (size_t i = 0; i < sessions.size(); ++i)
+    {
+      if (sessions[i].format == 0)
+        sessions[i].format = moved;
+      else if (sessions[i].format == moved)
+        sessions[i].format = 0;
+    }
+
+    if (merged == -1)
+    {
+      output_format f = output_format();
+      f.format = now;
+      f.frame_bytes = capture_frame_bytes;
+      f.ring.resize(ring_frames * capture_frame_bytes);
+      f.marks.resize(capture_ring_periods);
+      formats[0] = f;
+    }
+    else
+    {
+      LOG("sessions in %s are served from the capture again", format_name(now));
+    }
+    LOG("sessions in %s carry on converted from the new capture", format_name(old));
+  }
+
+  for (size_t i = 0; i < formats.size(); ++i)
+  {
+    output_format& f = formats[i];
+    if (f.marks.size() != static_cast<size_t>(capture_ring_periods))
+      resize_marks(&f, capture_ring_periods);
+    if (i == 0)
+      continue;
+    transcoder_init(&f.conv, capture_sample_rate, capture_num_channels, f.format);
+    size_t const needed = transcoder_max_output(&f.conv, capture_buffer_frames);
+    if (transcode_buffer.size() < needed)
+      transcode_buffer.resize(needed);
+  }
+
+  for (size_t i = 0; moved && (i < sessions.size()); ++i)
+  {
+    client_session& s = sessions[i];
+    if ((s.fd == -1) || !s.adapt || !s.native || (s.format != moved))
+      continue;
+    build_ladder(now, &s.ladder);
+    s.rung = -1;
+    s.next_rung = 0;
+    s.switch_queue_ms = 0;
+  }
+
+  vad_init(&capture_vad, capture_num_channels, capture_sample_rate, capture_buffer_frames, vad_hangover_ms);
+  bool dsp_ok = true;
+  if (*capture_dsp_list && !dsp_parse(&capture_dsp, capture_dsp_list, capture_sample_rate, capture_num_channels))
+  {
+    LOG("--capture-dsp=%s doesn't fit %s, capture processing is off", capture_dsp_list, format_name(now));
+    capture_dsp.count = 0;
+    dsp_ok = false;
+  }
+  if (aec_requested && playback_handle)
+  {
+    aec_on = false;
+    aec_ref_written = 0;
+    aec_ref_read = 0;
+    setup_aec();
+  }
+  return dsp_ok;
+}
+
+// Right after a period was read: once the new capture has a period
+// waiting, switches to it, keeping what it captured after the last frame
+// read from the old one.
+static void step_capture_switch()
+{
+  pcm_switch* sw = &capture_switch;
+  if (!sw->active)
+    return;
+
+  snd_pcm_sframes_t avail = 0;
+  if (!sw->cold)
+  {
+    if (snd_pcm_delay(sw->handle, &avail) < 0)
+    {
+      // overran while priming
+      snd_pcm_prepare(sw->handle);
+      snd_pcm_start(sw->handle);
+      avail = 0;
+    }
+    if (avail < sw->frames)
+    {
+      if (nanos_since(sw->started) > (switch_timeout_ms * 1000000LL))
+      {
+        char reply[128];
+        snprintf(reply, sizeof(reply), "error %s delivered nothing in %dms", sw->device.c_str(), switch_timeout_ms);
+        LOG("capture switch: %s", reply);
+        control_reply(sw->from, sw->from_len, reply);
+        snd_pcm_close(sw->handle);
+        sw->active = false;
+      }
+      return;
+    }
+  }
+
+  XAUDIO_TRACE_SPAN("switch");
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  snd_pcm_sframes_t pending = 0;
+  if (snd_pcm_delay(capture_handle, &pending) < 0)
+    pending = 0;
+
+  std::string const old_device = capture_device_name;
+  uint32_t const old_rate = capture_sample_rate;
+  int const old_channels = capture_num_channels;
+  int64_t skip = 0;
+  double gap_ms = 0;
+  sw->active = false;
+  if (sw->cold)
+  {
+    // what the old one captured after the last read is lost, and so is
+    // what happens while the new one opens
+    snd_pcm_close(capture_handle);
+    capture_handle = NULL;
+    int const err = open_pcm(sw->device.c_str(), SND_PCM_STREAM_CAPTURE, &sw->sample_rate, sw->channels, 0,
+      &sw->handle);
+    bool const unfit = (err == 0) && capture_format_changes(sw) && capture_format_user();
+    if (unfit)
+    {
+      snd_pcm_close(sw->handle);
+      sw->handle = NULL;
+    }
+    if ((err < 0) || unfit)
+    {
+      char reply[160];
+      snprintf(reply, sizeof(reply), "error failed to open %s in place of %s. %s", sw->device.c_str(),
+        old_device.c_str(), (err < 0) ? snd_strerror(err) : "its rate doesn't fit");
+      LOG("capture switch: %s", reply);
+      capture_handle = reopen_old("capture", old_device, SND_PCM_STREAM_CAPTURE, old_rate, old_channels, 0);
+      control_reply(sw->from, sw->from_len, reply);
+      return;
+    }
+    snd_pcm_start(sw->handle);
+    gap_ms = ((1000.0 * pending) / old_rate) + (nanos_since(start) / 1e6);
+  }
+  else
+  {
+    // the last frame read from the old one was captured pending frames ago
+    int64_t const keep = (static_cast<int64_t>(pending) * sw->sample_rate) / old_rate;
+    skip = std::max<int64_t>(0, avail - keep);
+    gap_ms = (keep > avail) ? ((1000.0 * (keep - avail)) / sw->sample_rate) : 0;
+    snd_pcm_close(capture_handle);
+  }
+
+  xaudio_format const old = formats[0].format;
+  int const old_frames = capture_buffer_frames;
+  capture_handle = sw->handle;
+  capture_device_name = sw->device;
+  capture_sample_rate = sw->sample_rate;
+  capture_num_channels = sw->channels;
+  capture_buffer_frames = sw->frames;
+  bool dsp_ok = true;
+  if ((capture_sample_rate != old.sample_rate) || (capture_num_channels != old.channels)
+    || (capture_buffer_frames != old_frames))
+    dsp_ok = reformat_capture(old);
+
+  for (int64_t n = 0; skip > 0; skip -= n)
+  {
+    n = std::min<int64_t>(skip, capture_buffer_frames);
+    if (snd_pcm_readi(capture_handle, &capture_buffer[0], n) != n)
+      break;
+  }
+
+  char reply[224];
+  snprintf(reply, sizeof(reply), "ok capture %s %uHz %dch %d frames, %.1fms gap, %.1fms switching%s",
+    capture_device_name.c_str(), capture_sample_rate, capture_num_channels, capture_buffer_frames, gap_ms,
+    nanos_since(start) / 1e6, dsp_ok ? "" : ", --capture-dsp doesn't fit it and is off");
+  LOG("capture switch: %s", reply);
+  control_reply(sw->from, sw->from_len, reply);
+}
+
+// Switches playback to the new device between two writes. The new one
+// starts with silence for as long as the old one still has audio queued,
+// so what's written next follows on where the old one stops, and the old
+// one is closed once it played that out.
+static void step_playback_switch()
+{
+  if (retiring_playback && (nanos_since(retire_at) >= 0))
+  {
+    snd_pcm_close(retiring_playback);
+    retiring_playback = NULL;
+  }
+
+  pcm_switch* sw = &playback_switch;
+  if (!sw->active)
+    return;
+
+  XAUDIO_TRACE_SPAN("switch");
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  snd_pcm_sframes_t queued = 0;
+  if (snd_pcm_delay(playback_handle, &queued) < 0)
+    queued = 0;
+
+  uint32_t const old_rate = playback_device_rate;
+  double const queued_ms = (1000.0 * queued) / old_rate;
+  double gap_ms = 0;
+  sw->active = false;
+  if (sw->cold)
+  {
+    // what the old one had queued is lost, and the speaker is silent
+    // while the new one opens
+    snd_pcm_close(playback_handle);
+    playback_handle = NULL;
+    int const err = open_pcm(sw->device.c_str(), SND_PCM_STREAM_PLAYBACK, &sw->sample_rate, sw->channels,
+      playback_frames, &sw->handle);
+    if (err < 0)
+    {
+      char reply[160];
+      snprintf(reply, sizeof(reply), "error failed to open %s in place of %s. %s", sw->device.c_str(),
+        playback_device_name.c_str(), snd_strerror(err));
+      LOG("playback switch: %s", reply);
+      playback_handle = reopen_old("playback", playback_device_name, SND_PCM_STREAM_PLAYBACK, playback_device_rate,
+        playback_device_channels, playback_frames);
+      control_reply(sw->from, sw->from_len, reply);
+      return;
+    }
+    gap_ms = queued_ms + (nanos_since(start) / 1e6);
+    queued = 0;
+  }
+  else
+  {
+    if (retiring_playback)
+      snd_pcm_close(retiring_playback);
+    retiring_playback = playback_handle;
+    clock_gettime(CLOCK_MONOTONIC, &retire_at);
+    int64_t const ns = retire_at.tv_nsec + (static_cast<int64_t>(queued_ms + 50) * 1000000);
+    retire_at.tv_sec += ns / 1000000000;
+    retire_at.tv_nsec = ns % 1000000000;
+  }
+
+  playback_handle = sw->handle;
+  playback_device_name = sw->device;
+  playback_device_rate = sw->sample_rate;
+  playback_device_channels = sw->channels;
+  playback_convert = (playback_device_rate != playback_sample_rate) || (playback_device_channels != playback_num_channels);
+  if (playback_convert)
+  {
+    xaudio_format device;
+    device.sample_rate = playback_device_rate;
+    device.channels = playback_device_channels;
+    device.sample_format = XAUDIO_S16LE;
+    transcoder_init(&playback_conv, playback_sample_rate, playback_num_channels, device);
+  }
+
+  // the same stretch of silence for the echo canceller
+  size_t lead = (static_cast<uint64_t>(queued) * playback_sample_rate) / old_rate;
+  size_t const chunk = play_buffer.size() / playback_num_channels;
+  memset(&play_buffer[0], 0, play_buffer.size() * 2);
+  while (lead > 0)
+  {
+    snd_pcm_sframes_t const err = playback_write(&play_buffer[0], std::min(lead, chunk));
+    if (err <= 0)
+      break;
+    aec_reference(&play_buffer[0], err);
+    lead -= err;
+  }
+  gap_ms += (1000.0 * lead) / playback_sample_rate;
+
+  char reply[192];
+  snprintf(reply, sizeof(reply), "ok playback %s %uHz %dch%s, %.1fms gap, %.1fms switching",
+    playback_device_name.c_str(), playback_device_rate, playback_device_channels,
+    playback_convert ? " converted" : "", gap_ms, nanos_since(start) / 1e6);
+  LOG("playback switch: %s", reply);
+  control_reply(sw->from, sw->from_len, reply);
+}
+
+// One command per datagram, answered if the sender has an address:
+//   status                            -> the devices, formats and clients
+//   capture [device=<name>] [rate=<Hz>] [channels=<n>] [frames=<n>]
+//   playback [device=<name>] [rate=<Hz>] [channels=<n>]
+//                                     -> ok <what it runs now>, <gap>ms gap
+//   play <clip> [<frame>]             -> ok <clip> <frame it starts at>
+//   stop                              -> ok
+//   clock                             -> clock <frames written> <frames still queued>
+// Settings left out stay as they are. A switch is answered once it's
+// done, with how long a stretch of audio it cost, the gap. Clip frames
+// count on the playback clock, what's heard now is written minus queued.
+static void handle_control_command()
+{
+  char msg[256];
+  struct sockaddr_un from;
+  socklen_t from_len = sizeof(from);
+  ssize_t n = recvfrom(control_fd, msg, sizeof(msg) - 1, 0, reinterpret_cast<struct sockaddr *>(&from), &from_len);
+  if (n <= 0)
+    return;
+  msg[n] = '\0';
+  msg[strcspn(msg, "\n")] = '\0';
+
+  char reply[256];
+  if (!strcmp(msg, "status"))
+  {
+    describe_state(reply, sizeof(reply));
+  }
+  else if (!strncmp(msg, "capture", 7) || !strncmp(msg, "playback", 8))
+  {
+    if (start_switch(msg, from, from_len, reply, sizeof(reply)))
+      return;
+  }
+  else if (!strncmp(msg, "play", 4) || !strncmp(msg, "stop", 4) || !strncmp(msg, "clock", 5))
+  {
+    if (clips_on)
+      clip_command(msg, reply, sizeof(reply));
+    else
+      snprintf(reply, sizeof(reply), "error no clips");
+  }
+  else
+  {
+    snprintf(reply, sizeof(reply), "error unknown command");
+  }
+
+  LOG("control command: %s -> %s", msg, reply);
+  control_reply(from, from_len, reply);
+}
+
+static void print_help()
+{
+  printf("\n");
+  printf("\tUsage xaudio [OPTIONS]\n");
+  printf("\t\t--port=<port>                     The port to listen on\n");
+  printf("\t\t--capture=<devname>     -c <name> The ALSA capture device. If unsure, use 'default'\n");
+  printf("\t\t--capture-channels=<n>  -d <n>    The number of channels. Use 1\n");
+  printf("\t\t--capture-rate=<KHZ>    -r <KHZ>  The capture rate in hertz. Use 16000\n");
+  printf("\t\t--capture-frames=<n>    -f <n>    Not sure, skip it.\n");
+  printf("\t\t--playback=<devnam>     -p <name> The playback device name. If unsure, use 'default'\n");
+  printf("\t\t--resume-window=<ms>              How long a dropped client can resume its session (5000)\n");
+  printf("\t\t--resume-backlog=<ms>             Most capture backlog sent to a resumed client (200)\n");
+  printf("\t\t--local=<path>                     Unix socket handing capture to local consumers\n");
+  printf("\t\t--local-ring=<ms>                  Capture kept for local consumers (500)\n");
+  printf("\t\t--max-clients=<n>                 Clients served at once, each in the format it asks for (8)\n");
+  printf("\t\t--no-dtx                          Always send PCM, even to clients that take comfort noise\n");
+  printf("\t\t--vad-hangover=<ms>               Audio kept going after the last voice before silence (200)\n");
+  printf("\t\t--archive=<dir>                   Keep the capture on disk for clients to replay\n");
+  printf("\t\t--archive-hours=<n>               Hours of capture kept in the archive (4)\n");
+  printf("\t\t--archive-sync=<s>                Seconds between archive writes to the flash (60)\n");
+  printf("\t\t--wire-log=<file>                 Record everything sent to and received from clients\n");
+  printf("\t\t--no-adapt                        Never step a client's stream down when its link can't keep up\n");
+  printf("\t\t--adapt-down=<ms>                 Audio queued for a client before its stream steps down (250)\n");
+  printf("\t\t--adapt-up=<s>                    Seconds the queue has to stay short before stepping back up (5)\n");
+  printf("\t\t--clips=<dir>                     WAV clips to mix into playback, needs --playback\n");
+  printf("\t\t--clip-socket=<path>              The same as --control\n");
+  printf("\t\t--trace=<file>                    Where SIGUSR1 writes the last trace spans, needs -DXAUDIO_TRACE\n");
+  printf("\t\t--aec                             Cancel the echo of playback in the capture, needs a mono capture\n");
+  printf("\t\t--aec-tail=<ms>                   Longest echo the canceller follows (64)\n");
+  printf("\t\t--no-plc                          Let playback run dry when the client that's played is late\n");
+  printf("\t\t--capture-dsp=<stages>            Processing of the capture, e.g. dc,highpass:80,gain:6,limit:-1\n");
+  printf("\t\t--playback-dsp=<stages>           Processing of playback, the same stages\n");
+  printf("\t\t--control=<path>                  Unix datagram socket to trigger clips, query and switch devices and formats\n");
+  printf("\t\t--help                  -h        Print this help and exit\n");
+  printf("\n");
+  printf("Examples:\n");
+  printf("\txaudio --port=10100 --capture=default\n");
+  printf("\txaudio --port=10100 --capture=default --playback=default\n");
+  printf("\txaudio --port=10100 --capture=default --local=/tmp/xaudio.sock\n");
+  printf("\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+  int err = -1;
+  int server_fd = -1;
+  int port = -1;
+  char const* capture_device = NULL;
+  char const* playback_device = NULL;
+  struct sockaddr_in server_addr = {0};
+  std::vector<char> buff;
+
+
+  struct option long_options[] =
+  {
+    { "port", required_argument, NULL, 10000 },
+
+    { "capture", required_argument, NULL, 'c' },
+    { "capture-channels", required_argument, NULL, 'd' },
+    { "capture-rate", required_argument, NULL, 'r' },
+    { "capture-frames", required_argument, NULL, 'f' },
+
+    { "playback", required_argument, NULL, 'p' },
+    { "resume-window", required_argument, NULL, 10001 },
+    { "resume-backlog", required_argument, NULL, 10002 },
+    { "local", required_argument, NULL, 10003 },
+    { "local-ring", required_argument, NULL, 10004 },
+    { "max-clients", required_argument, NULL, 10005 },
+    { "no-dtx", no_argument, NULL, 10006 },
+    { "vad-hangover", required_argument, NULL, 10007 },
+    { "archive", required_argument, NULL, 10008 },
+    { "archive-hours", required_argument, NULL, 10009 },
+    { "archive-sync", required_argument, NULL, 10010 },
+    { "wire-log", required_argument, NULL, 10011 },
+    { "no-adapt", no_argument, NULL, 10012 },
+    { "adapt-down", required_argument, NULL, 10013 },
+    { "adapt-up", required_argument, NULL, 10014 },
+    { "trace", required_argument, NULL, 10015 },
+    { "clips", required_argument, NULL, 10016 },
+    { "clip-socket", required_argument, NULL, 10017 },
+    { "aec", no_argument, NULL, 10018 },
+    { "aec-tail", required_argument, NULL, 10019 },
+    { "no-plc", no_argument, NULL, 10020 },
+    { "capture-dsp", required_argument, NULL, 10021 },
+    { "playback-dsp", required_argument, NULL, 10022 },
+    { "control", required_argument, NULL, 10023 },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "f:c:p:d:r:h", long_options, NULL)) != -1)
+  {
+    switch (c)
+    {
+      case 'h':
+        print_help();
+        exit(0);
+        break;
+      case 'f':
+        capture_buffer_frames = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 'c':
+        capture_device = optarg;
+        break;
+      case 'd':
+        playback_num_channels = capture_num_channels = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 'r':
+        capture_sample_rate = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 'p':
+        playback_device = optarg;
+        break;
+      case 10000:
+        port = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10001:
+        resume_window_ms = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10002:
+        resume_backlog_ms = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10003:
+        local_path = optarg;
+        break;
+      case 10004:
+        local_ring_ms = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10005:
+        max_clients = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10006:
+        dtx_enabled = false;
+        break;
+      case 10007:
+        vad_hangover_ms = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10008:
+        archive_dir = optarg;
+        break;
+      case 10009:
+        archive_hours = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10010:
+        archive_sync_ms = static_cast<int>(strtol(optarg, NULL, 10)) * 1000;
+        break;
+      case 10011:
+        wire_log_path = optarg;
+        break;
+      case 10012:
+        adapt_enabled = false;
+        break;
+      case 10013:
+        adapt_down_ms = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10014:
+        adapt_up_wait_ms = static_cast<int>(strtol(optarg, NULL, 10)) * 1000;
+        break;
+      case 10015:
+        trace_path = optarg;
+        break;
+      case 10016:
+        clip_dir = optarg;
+        break;
+      case 10017:
+        control_path = optarg;
+        break;
+      case 10018:
+        aec_requested = true;
+        break;
+      case 10019:
+        aec_tail_ms = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      case 10020:
+        plc_enabled = false;
+        break;
+      case 10021:
+        capture_dsp_list = optarg;
+        break;
+      case 10022:
+        playback_dsp_list = optarg;
+        break;
+      case 10023:
+        control_path = optarg;
+        break;
+      case '?':
+        print_help();
+        exit(0);
+        break;
+    }
+  }
+
+  buff.reserve(playback_frames);
+  buff.resize(playback_frames);
+
+  if (port == -1)
+  {
+    printf("failed to provide listening port with --port=<port>\n");
+    print_help();
+    exit(0);
+  }
+
+  LOG("sound library:%s", snd_asoundlib_version());
+  snd_output_stdio_attach(&alsa_log, stdout, 0);
+
+  // format 0 is what's captured, sessions have it even without capture
+  formats.resize(1);
+  formats[0].format.sample_rate = capture_sample_rate;
+  formats[0].format.channels = capture_num_channels;
+  formats[0].format.sample_format = XAUDIO_S16LE;
+  formats[0].frame_bytes = capture_frame_bytes;
+
+  if (capture_device)
+    setup_capture(capture_device);
+  else
+    LOG("skipping capture, no device supplied with -c");
+
+  if (archive_dir && capture_handle)
+    setup_archive(archive_dir);
+  else if (archive_dir)
+    LOG("skipping the archive, there's no capture to keep");
+
+  if (local_path && capture_handle)
+    setup_local(local_path);
+  else if (local_path)
+    LOG("skipping local consumers, there's no capture to share");
+
+  if (playback_device)
+    setup_playback(playback_device);
+  else
+    LOG("skipping playback, no device supplied with  -p");
+
+  if (clip_dir && playback_handle)
+    setup_clips(clip_dir, buff.capacity());
+  else if (clip_dir)
+    LOG("skipping clips, there's no playback to mix them into");
+
+  if (plc_enabled && playback_handle)
+    setup_plc(buff.capacity());
+
+  if (playback_handle)
+    play_buffer.resize(buff.capacity() / 2);
+
+  setup_dsp("capture", &capture_dsp, capture_dsp_list, capture_handle != NULL, capture_sample_rate,
+    capture_num_channels);
+  setup_dsp("playback", &playback_dsp, playback_dsp_list, playback_handle != NULL, playback_sample_rate,
+    playback_num_channels);
+
+  if (aec_requested && capture_handle && playback_handle)
+    setup_aec();
+  else if (aec_requested)
+    LOG("skipping echo cancellation, it needs both capture and playback");
+
+  if (control_path)
+    setup_control(control_path);
+
+  LOG("capture_buffer_frames:%d", capture_buffer_frames);
+
+  if (wire_log_path)
+  {
+    if (!xaudio_wire_create(&wire_log, wire_log_path, formats[0].format, capture_buffer_frames))
+    {
+      LOG("failed to create the wire log %s. %s", wire_log_path, strerror(errno));
+      exit(1);
+    }
+    LOG("recording the wire to:[%s]", wire_log_path);
+  }
+
+  if (trace_path)
+  {
+#ifndef XAUDIO_TRACE
+    LOG("built without -DXAUDIO_TRACE, the trace at %s will be empty", trace_path);
+#endif
+    XAUDIO_TRACE_THREAD("xaudio");
+    xaudio_trace_dump_on(SIGUSR1);
+    LOG("kill -USR1 %d writes the trace to:[%s]", getpid(), trace_path);
+  }
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+  server_addr.sin_port = htons(port);
+
+  int enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+
+  err = bind(server_fd, reinterpret_cast<struct sockaddr *>(&server_addr), sizeof(server_addr));
+  if (err < 0)
+  {
+    LOG("failed to bind listen socket. %s", strerror(errno));
+    exit(1);
+  }
+
+  // connections that arrive together are all accepted in one pass
+  ioctl(server_fd, FIONBIO, &enable);
+  listen(server_fd, SOMAXCONN);
+  LOG("listening for incoming connetions on:[%s:%d]",  inet_ntoa(server_addr.sin_addr), port);
+
+  // A new connection first has to say whether it speaks the handshake,
+  // only then does it get a session. Up to max_clients are served at once,
+  // any number of them can be in their hello at the same time.
+  gettimeofday(&last_report, NULL);
+
+  while (true)
+  {
+    XAUDIO_TRACE_SPAN("loop");
+
+    // the capture device paces the loop and keeps running without a client
+    if (capture_handle)
+    {
+      capture_pump();
+      step_capture_switch();
+    }
+
+    expire_sessions();
+    report_formats();
+    pump_clips();
+    conceal_playback();
+    if (playback_handle)
+      step_playback_switch();
+
+    if (trace_path && xaudio_trace_take_request())
+    {
+      long const spans = xaudio_trace_dump(trace_path);
+      if (spans < 0)
+        LOG("failed to write the trace to %s. %s", trace_path, strerror(errno));
+      else
+        LOG("wrote %ld trace spans to:[%s]", spans, trace_path);
+    }
+
+    fd_set read_fds;
+    fd_set write_fds;
+    fd_set err_fds;
+    FD_ZERO(&write_fds);
+    FD_ZERO(&read_fds);
+    FD_ZERO(&err_fds);
+
+    int max_fd = server_fd;
+    if (local_fd != -1)
+    {
+      FD_SET(local_fd, &read_fds);
+      max_fd = std::max(max_fd, local_fd);
+    }
+    if (control_fd != -1)
+    {
+      FD_SET(control_fd, &read_fds);
+      max_fd = std::max(max_fd, control_fd);
+    }
+
+    if (pending_clients.size() < static_cast<size_t>(max_pending_clients))
+      FD_SET(server_fd, &read_fds);
+    for (size_t i = 0; i < pending_clients.size(); ++i)
+    {
+      FD_SET(pending_clients[i].fd, &read_fds);
+      max_fd = std::max(max_fd, pending_clients[i].fd);
+    }
+
+    for (size_t i = 0; i < sessions.size(); ++i)
+    {
+      client_session const& s = sessions[i];
+      if (s.fd == -1)
+        continue;
+
+      FD_SET(s.fd, &read_fds);
+      FD_SET(s.fd, &err_fds);
+
+      // only care about writing if we're in capture mode, therefore, sending
+      if (capture_handle && ((s.sent < formats[s.format].head) || (s.out_pos < s.out.size()) || (s.next_rung != s.rung)))
+        FD_SET(s.fd, &write_fds);
+      max_fd = std::max(max_fd, s.fd);
+    }
+
+    for (size_t i = 0; i < replays.size(); ++i)
+    {
+      FD_SET(replays[i].fd, &read_fds);
+      FD_SET(replays[i].fd, &write_fds);
+      FD_SET(replays[i].fd, &err_fds);
+      max_fd = std::max(max_fd, replays[i].fd);
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = capture_handle ? 0 : 10000;
+
+    int ret;
+    {
+      XAUDIO_TRACE_SPAN("select");
+      ret = select(max_fd + 1, &read_fds, &write_fds, &err_fds, &timeout);
+    }
+    if (ret < 0)
+    {
+      if (errno != EINTR)
+        LOG("select failed. %s", strerror(errno));
+      continue;
+    }
+
+    if ((local_fd != -1) && FD_ISSET(local_fd, &read_fds))
+      accept_local();
+
+    if ((control_fd != -1) && FD_ISSET(control_fd, &read_fds))
+    {
+      handle_control_command();
+      pump_clips();
+    }
+
+    while (FD_ISSET(server_fd, &read_fds) && (pending_clients.size() < static_cast<size_t>(max_pending_clients)))
+    {
+      struct sockaddr_in client_addr;
+      socklen_t client_addr_length = sizeof(struct sockaddr);
+
+      int fd = accept(server_fd, reinterpret_cast<struct sockaddr *>(&client_addr),
+        &client_addr_length);
+
+      if (fd < 0)
+      {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+          LOG("error accepting client connection. %s", strerror(errno));
+        break;
+      }
+      else
+      {
+        LOG("accepted client connection from:[%s:%d]", inet_ntoa(client_addr.sin_addr),
+          ntohs(client_addr.sin_port));
+        if (wire_log.f)
+        {
+          char peer[32];
+          int len = snprintf(peer, sizeof(peer), "%s:%d", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+          xaudio_wire_write(&wire_log, fd, XAUDIO_WIRE_OPEN, peer, len);
+          fflush(wire_log.f);
+        }
+        pending_client p;
+        p.fd = fd;
+        p.len = 0;
+        gettimeofday(&p.since, NULL);
+        pending_clients.push_back(p);
+      }
+    }
+
+    for (size_t i = 0; i < pending_clients.size();)
+    {
+      pending_client* p = &pending_clients[i];
+      if (FD_ISSET(p->fd, &read_fds))
+      {
+        XAUDIO_TRACE_SPAN("hello");
+        // the hello first, then whatever its flags say follows it
+        int const want = xaudio_client_hello_size(p->hello, p->len) - p->len;
+        ssize_t n = wire_recv(p->fd, p->hello + p->len, want);
+        if (n <= 0)
+        {
+          LOG("client went away before starting its session");
+          FD_CLR(p->fd, &read_fds);
+          close_client_fd(p->fd);
+          pending_clients.erase(pending_clients.begin() + i);
+          continue;
+        }
+        p->len += static_cast<int>(n);
+      }
+
+      // anything that doesn't start with the magic, or nothing at all for
+      // a while, is a legacy client and what it sent is already audio
+      int const hello_len = xaudio_client_hello_size(p->hello, p->len);
+      bool const hello = (p->len >= XAUDIO_HELLO_SIZE) && (p->len == hello_len)
+        && xaudio_is_hello_prefix(p->hello, p->len);
+      bool const legacy = !xaudio_is_hello_prefix(p->hello, p->len)
+        || ((p->len < XAUDIO_HELLO_SIZE) && (millis_since(p->since) > hello_timeout_ms));
+      if (!hello && !legacy)
+      {
+        ++i;
+        continue;
+      }
+
+      xaudio_hello client_hello;
+      xaudio_format wanted;
+      xaudio_replay request;
+      uint32_t flags = 0;
+      if (hello)
+      {
+        xaudio_decode_hello(p->hello, &client_hello);
+        flags = client_hello.version_or_flags;
+      }
+
+      uint8_t const* trailer = p->hello + XAUDIO_HELLO_SIZE;
+      if (flags & XAUDIO_HELLO_FORMAT)
+      {
+        xaudio_decode_format(trailer, &wanted);
+        trailer += XAUDIO_FORMAT_SIZE;
+      }
+      if (flags & XAUDIO_HELLO_REPLAY)
+        xaudio_decode_replay(trailer, &request);
+
+      // its hello was already consumed, don't read it again below
+      FD_CLR(p->fd, &read_fds);
+
+      xaudio_hello reply;
+      xaudio_format granted;
+      if (flags & XAUDIO_HELLO_REPLAY)
+      {
+        // replays are always in the capture format
+        xaudio_replay replay;
+        bool const ok = start_replay(p->fd, request, &replay);
+        reply.version_or_flags = XAUDIO_FLAG_REPLAY | ((flags & XAUDIO_HELLO_FORMAT) ? XAUDIO_FLAG_FORMAT : 0);
+        reply.session_token = 0;
+        reply.offset = 0;
+        if (send_server_hello(p->fd, reply, formats[0].format, &replay) < 0)
+        {
+          if (ok)
+            replays.pop_back();
+          close_client_fd(p->fd);
+        }
+        else if (!ok)
+        {
+          close_client_fd(p->fd);
+        }
+      }
+      else if (!start_session(p->fd, hello ? &client_hello : NULL,
+        (flags & XAUDIO_HELLO_FORMAT) ? &wanted : NULL, &reply, &granted))
+      {
+        LOG("already serving %d clients, closing the new connection", max_clients);
+        close_client_fd(p->fd);
+      }
+      else if (hello)
+      {
+        if (send_server_hello(p->fd, reply, granted, NULL) < 0)
+          drop_client(find_session(p->fd));
+      }
+      else if (p->len > 0)
+      {
+        play(p->fd, reinterpret_cast<char const *>(p->hello), p->len);
+      }
+      pending_clients.erase(pending_clients.begin() + i);
+    }
+
+    for (size_t i = 0; i < replays.size();)
+    {
+      replay_session* r = &replays[i];
+      int ret = 0;
+      if (FD_ISSET(r->fd, &err_fds))
+      {
+        ret = -1;
+      }
+      else if (FD_ISSET(r->fd, &read_fds))
+      {
+        // nothing is expected from a replaying client but its goodbye
+        char discard[256];
+        ssize_t n = wire_recv(r->fd, discard, sizeof(discard));
+        if ((n == 0) || ((n < 0) && (errno != EINTR) && (errno != EAGAIN)))
+          ret = -1;
+      }
+
+      if ((ret == 0) && FD_ISSET(r->fd, &write_fds))
+      {
+        XAUDIO_TRACE_SPAN("replay");
+        ret = send_replay(r);
+      }
+
+      if (ret == 0)
+      {
+        ++i;
+        continue;
+      }
+
+      LOG((ret > 0) ? "replay reached the live capture" : "replaying client went away");
+      close_client_fd(r->fd);
+      if (r->file != -1)
+        close(r->file);
+      replays.erase(replays.begin() + i);
+    }
+
+    for (size_t i = 0; i < sessions.size(); ++i)
+    {
+      client_session* s = &sessions[i];
+      if (s->fd == -1)
+        continue;
+
+      if (FD_ISSET(s->fd, &err_fds))
+      {
+        LOG("socket error");
+        drop_client(s);
+        continue;
+      }
+
+      adapt_session(s);
+      if (FD_ISSET(s->fd, &write_fds) && (send_capture(s) < 0))
+      {
+        drop_client(s);
+        continue;
+      }
+
+      if (FD_ISSET(s->fd, &read_fds))
+      {
+        XAUDIO_TRACE_SPAN("recv");
+        int n = wire_recv(s->fd, &buff[0], buff.capacity());
+        if (n > 0)
+        {
+          play(s->fd, &buff[0], n);
+        }
+        else if (n == 0)
+        {
+          LOG("client closed the connection");
+          drop_client(s);
+        }
+        else if ((errno != EINTR) && (errno != EAGAIN))
+        {
+          LOG("read from socket failed. %s", strerror(errno));
+          drop_client(s);
+        }
+      }
+    }
   }
 
   snd_pcm_close(capture_handle);
@@ -0,0 +1,149 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Four floats at a time for xaudio's signal processing, with NEON on armv7
+// (-mfpu=neon), SSE on x86, plain C elsewhere. Loads and stores are
+// unaligned. 16 bit samples convert to and from floats in the same units,
+// stores clamp to the 16 bit range and truncate toward zero.
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define XAUDIO_SIMD "neon"
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#define XAUDIO_SIMD "sse"
+#else
+#define XAUDIO_SIMD "scalar"
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+typedef float32x4_t simd_v4;
+static inline simd_v4 simd_load(float const* p) { return vld1q_f32(p); }
+static inline void simd_store(float* p, simd_v4 v) { vst1q_f32(p, v); }
+static inline simd_v4 simd_dup(float f) { return vdupq_n_f32(f); }
+static inline simd_v4 simd_add(simd_v4 a, simd_v4 b) { return vaddq_f32(a, b); }
+static inline simd_v4 simd_sub(simd_v4 a, simd_v4 b) { return vsubq_f32(a, b); }
+static inline simd_v4 simd_mul(simd_v4 a, simd_v4 b) { return vmulq_f32(a, b); }
+static inline simd_v4 simd_min(simd_v4 a, simd_v4 b) { return vminq_f32(a, b); }
+static inline simd_v4 simd_max(simd_v4 a, simd_v4 b) { return vmaxq_f32(a, b); }
+static inline simd_v4 simd_abs(simd_v4 a) { return vabsq_f32(a); }
+// a + b * c and a - b * c
+static inline simd_v4 simd_madd(simd_v4 a, simd_v4 b, simd_v4 c) { return vmlaq_f32(a, b, c); }
+static inline simd_v4 simd_msub(simd_v4 a, simd_v4 b, simd_v4 c) { return vmlsq_f32(a, b, c); }
+static inline simd_v4 simd_load_s16(int16_t const* p) { return vcvtq_f32_s32(vmovl_s16(vld1_s16(p))); }
+// 1 where a and b are on different sides of zero, zero itself counting as
+// positive, 0 elsewhere
+static inline simd_v4 simd_sign_differs(simd_v4 a, simd_v4 b)
+{
+  uint32x4_t const d = veorq_u32(vcltq_f32(a, vdupq_n_f32(0)), vcltq_f32(b, vdupq_n_f32(0)));
+  return vreinterpretq_f32_u32(vandq_u32(d, vreinterpretq_u32_f32(vdupq_n_f32(1.0f))));
+}
+static inline void simd_store_s16(int16_t* p, simd_v4 v)
+{
+  v = vmaxq_f32(vminq_f32(v, vdupq_n_f32(32767.0f)), vdupq_n_f32(-32768.0f));
+  vst1_s16(p, vmovn_s32(vcvtq_s32_f32(v)));
+}
+#elif defined(__SSE__)
+typedef __m128 simd_v4;
+static inline simd_v4 simd_load(float const* p) { return _mm_loadu_ps(p); }
+static inline void simd_store(float* p, simd_v4 v) { _mm_storeu_ps(p, v); }
+static inline simd_v4 simd_dup(float f) { return _mm_set1_ps(f); }
+static inline simd_v4 simd_add(simd_v4 a, simd_v4 b) { return _mm_add_ps(a, b); }
+static inline simd_v4 simd_sub(simd_v4 a, simd_v4 b) { return _mm_sub_ps(a, b); }
+static inline simd_v4 simd_mul(simd_v4 a, simd_v4 b) { return _mm_mul_ps(a, b); }
+static inline simd_v4 simd_min(simd_v4 a, simd_v4 b) { return _mm_min_ps(a, b); }
+static inline simd_v4 simd_max(simd_v4 a, simd_v4 b) { return _mm_max_ps(a, b); }
+static inline simd_v4 simd_abs(simd_v4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+static inline simd_v4 simd_madd(simd_v4 a, simd_v4 b, simd_v4 c) { return _mm_add_ps(a, _mm_mul_ps(b, c)); }
+static inline simd_v4 simd_msub(simd_v4 a, simd_v4 b, simd_v4 c) { return _mm_sub_ps(a, _mm_mul_ps(b, c)); }
+static inline simd_v4 simd_sign_differs(simd_v4 a, simd_v4 b)
+{
+  __m128 const d = _mm_xor_ps(_mm_cmplt_ps(a, _mm_setzero_ps()), _mm_cmplt_ps(b, _mm_setzero_ps()));
+  return _mm_and_ps(d, _mm_set1_ps(1.0f));
+}
+#if defined(__SSE2__)
+static inline simd_v4 simd_load_s16(int16_t const* p)
+{
+  __m128i const x = _mm_loadl_epi64(reinterpret_cast<__m128i const *>(p));
+  return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+}
+static inline void simd_store_s16(int16_t* p, simd_v4 v)
+{
+  v = _mm_max_ps(_mm_min_ps(v, _mm_set1_ps(32767.0f)), _mm_set1_ps(-32768.0f));
+  __m128i const x = _mm_cvttps_epi32(v);
+  _mm_storel_epi64(reinterpret_cast<__m128i *>(p), _mm_packs_epi32(x, x));
+}
+#else
+static inline simd_v4 simd_load_s16(int16_t const* p) { return _mm_setr_ps(p[0], p[1], p[2], p[3]); }
+static inline void simd_store_s16(int16_t* p, simd_v4 v)
+{
+  float f[4];
+  _mm_storeu_ps(f, _mm_max_ps(_mm_min_ps(v, _mm_set1_ps(32767.0f)), _mm_set1_ps(-32768.0f)));
+  for (int i = 0; i < 4; ++i)
+    p[i] = static_cast<int16_t>(f[i]);
+}
+#endif
+#else
+struct simd_v4 { float v[4]; };
+static inline simd_v4 simd_load(float const* p) { simd_v4 r; memcpy(r.v, p, sizeof(r.v)); return r; }
+static inline void simd_store(float* p, simd_v4 v) { memcpy(p, v.v, sizeof(v.v)); }
+static inline simd_v4 simd_dup(float f) { simd_v4 r = { { f, f, f, f } }; return r; }
+#define SIMD_V4_OP(NAME, EXPR) \
+  static inline simd_v4 NAME(simd_v4 a, simd_v4 b) { simd_v4 r; for (int i = 0; i < 4; ++i) r.v[i] = (EXPR); return r; }
+SIMD_V4_OP(simd_add, a.v[i] + b.v[i])
+SIMD_V4_OP(simd_sub, a.v[i] - b.v[i])
+SIMD_V4_OP(simd_mul, a.v[i] * b.v[i])
+SIMD_V4_OP(simd_min, (a.v[i] < b.v[i]) ? a.v[i] : b.v[i])
+SIMD_V4_OP(simd_max, (a.v[i] > b.v[i]) ? a.v[i] : b.v[i])
+#undef SIMD_V4_OP
+static inline simd_v4 simd_abs(simd_v4 a) { for (int i = 0; i < 4; ++i) a.v[i] = (a.v[i] < 0) ? -a.v[i] : a.v[i]; return a; }
+static inline simd_v4 simd_madd(simd_v4 a, simd_v4 b, simd_v4 c) { return simd_add(a, simd_mul(b, c)); }
+static inline simd_v4 simd_msub(simd_v4 a, simd_v4 b, simd_v4 c) { return simd_sub(a, simd_mul(b, c)); }
+static inline simd_v4 simd_sign_differs(simd_v4 a, simd_v4 b)
+{
+  simd_v4 r;
+  for (int i = 0; i < 4; ++i)
+    r.v[i] = ((a.v[i] < 0) != (b.v[i] < 0)) ? 1.0f : 0.0f;
+  return r;
+}
+static inline simd_v4 simd_load_s16(int16_t const* p)
+{
+  simd_v4 r;
+  for (int i = 0; i < 4; ++i)
+    r.v[i] = p[i];
+  return r;
+}
+static inline void simd_store_s16(int16_t* p, simd_v4 v)
+{
+  for (int i = 0; i < 4; ++i)
+    p[i] = static_cast<int16_t>((v.v[i] > 32767.0f) ? 32767.0f : ((v.v[i] < -32768.0f) ? -32768.0f : v.v[i]));
+}
+#endif
+
+// the largest of the four
+static inline float
+simd_hmax(simd_v4 v)
+{
+  float f[4];
+  simd_store(f, v);
+  float const a = (f[0] > f[1]) ? f[0] : f[1];
+  float const b = (f[2] > f[3]) ? f[2] : f[3];
+  return (a > b) ? a : b;
+}
+
+// the sum of the four
+static inline float
+simd_hsum(simd_v4 v)
+{
+  float f[4];
+  simd_store(f, v);
+  return (f[0] + f[1]) + (f[2] + f[3]);
+}
+
+#endif // SIMD_H
@@ -0,0 +1,122 @@
+#ifndef TRANSCODER_H
+#define TRANSCODER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "../protocol.h"
+
+// Converts the 16 bit capture into a format a client asked for: channels
+// are mixed down or duplicated, the rate is changed by linear
+// interpolation, and the result is written as 16 bit or float. Fed one
+// capture period at a time, the interpolation carries across periods.
+struct transcoder
+{
+  int in_channels;
+  int out_channels;
+  int sample_format;
+
+  // resampler position in 32.32 fixed point, relative to last
+  uint64_t step;
+  uint64_t phase;
+  std::vector<float> last;
+  std::vector<float> mixed;
+};
+
+static inline int
+xaudio_format_frame_bytes(xaudio_format const& format)
+{
+  return format.channels * ((format.sample_format == XAUDIO_F32LE) ? 4 : 2);
+}
+
+static inline void
+transcoder_init(transcoder* t, uint32_t in_rate, int in_channels, xaudio_format const& out)
+{
+  t->in_channels = in_channels;
+  t->out_channels = out.channels;
+  t->sample_format = out.sample_format;
+  t->step = (static_cast<uint64_t>(in_rate) << 32) / out.sample_rate;
+  t->phase = 0;
+  t->last.assign(out.channels, 0.0f);
+  t->mixed.clear();
+}
+
+// worst case bytes for in_frames of capture
+static inline size_t
+transcoder_max_output(transcoder const* t, size_t in_frames)
+{
+  size_t const frames = static_cast<size_t>(((static_cast<uint64_t>(in_frames) << 32) / t->step) + 2);
+  return frames * t->out_channels * ((t->sample_format == XAUDIO_F32LE) ? 4 : 2);
+}
+
+// returns the bytes written to out
+static inline size_t
+transcoder_run(transcoder* t, int16_t const* in, size_t frames, uint8_t* out)
+{
+  if (frames == 0)
+    return 0;
+
+  int const ic = t->in_channels;
+  int const oc = t->out_channels;
+  if (t->mixed.size() < frames * oc)
+    t->mixed.resize(frames * oc);
+
+  // channels first, at the input rate
+  float* mixed = &t->mixed[0];
+  float const scale = 1.0f / 32768.0f;
+  for (size_t i = 0; i < frames; ++i)
+  {
+    int16_t const* f = in + (i * ic);
+    if (oc == 1)
+    {
+      int32_t sum = 0;
+      for (int c = 0; c < ic; ++c)
+        sum += f[c];
+      mixed[i] = (static_cast<float>(sum) / ic) * scale;
+    }
+    else
+    {
+      for (int c = 0; c < oc; ++c)
+        mixed[(i * oc) + c] = f[c % ic] * scale;
+    }
+  }
+
+  // the input is seen as the last frame of the previous period followed
+  // by this one, so interpolation is continuous across periods
+  uint64_t const end = static_cast<uint64_t>(frames) << 32;
+  float const* last = &t->last[0];
+  float* out_f32 = reinterpret_cast<float *>(out);
+  int16_t* out_s16 = reinterpret_cast<int16_t *>(out);
+  size_t produced = 0;
+
+  for (; t->phase < end; t->phase += t->step, ++produced)
+  {
+    size_t const i = static_cast<size_t>(t->phase >> 32);
+    float const frac = static_cast<float>(t->phase & 0xffffffffu) * (1.0f / 4294967296.0f);
+    float const* a = (i == 0) ? last : (mixed + ((i - 1) * oc));
+    float const* b = mixed + (i * oc);
+
+    for (int c = 0; c < oc; ++c)
+    {
+      float const v = a[c] + (frac * (b[c] - a[c]));
+      if (t->sample_format == XAUDIO_F32LE)
+      {
+        out_f32[(produced * oc) + c] = v;
+      }
+      else
+      {
+        float const s = v * 32768.0f;
+        float const r = (s >= 0.0f) ? (s + 0.5f) : (s - 0.5f);
+        out_s16[(produced * oc) + c] = static_cast<int16_t>((r > 32767.0f) ? 32767.0f : ((r < -32768.0f) ? -32768.0f : r));
+      }
+    }
+  }
+
+  t->phase -= end;
+  memcpy(&t->last[0], mixed + ((frames - 1) * oc), oc * sizeof(float));
+  return produced * oc * ((t->sample_format == XAUDIO_F32LE) ? 4 : 2);
+}
+
+#endif // TRANSCODER_H
@@ -0,0 +1,125 @@
+#ifndef VAD_H
+#define VAD_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "simd.h"
+
+// Voice activity detection on the 16 bit capture, one period at a time.
+//
+// A period is active when its energy stands well above the noise floor,
+// or somewhat above it with a high zero crossing rate, which is what
+// unvoiced speech like "s" and "f" looks like. The floor follows quiet
+// periods down quickly and creeps up slowly, so it settles on a new
+// background without swallowing speech. After the last active period the
+// stream stays active for the hangover, so word endings and short pauses
+// aren't cut.
+//
+// The per sample loops run four samples at a time with simd.h, everything
+// else is done once per period.
+
+enum
+{
+  VAD_LOUD_DB = 9,
+  VAD_FRICATIVE_DB = 4,
+  VAD_MIN_DB = -70
+};
+
+// fraction of samples changing sign above which quiet sound is unvoiced
+// speech rather than background
+static const float kVadFricativeZcr = 0.3f;
+static const float kVadFloorRiseDbPerSecond = 1.0f;
+
+struct vad
+{
+  int channels;
+  int hangover_periods;
+  float floor_rise_db;
+
+  int hangover;
+  bool primed;
+  float floor_db;
+  float last_db;
+  float last_zcr;
+};
+
+static inline void
+vad_init(vad* v, int channels, uint32_t sample_rate, uint32_t period_frames, int hangover_ms)
+{
+  float const period_ms = (1000.0f * period_frames) / sample_rate;
+  v->channels = channels;
+  v->hangover_periods = static_cast<int>(ceilf(hangover_ms / period_ms));
+  v->floor_rise_db = (kVadFloorRiseDbPerSecond * period_ms) / 1000.0f;
+  v->hangover = 0;
+  v->primed = false;
+  v->floor_db = VAD_MIN_DB;
+  v->last_db = VAD_MIN_DB;
+  v->last_zcr = 0;
+}
+
+// true while the period should be sent as audio
+static inline bool
+vad_run(vad* v, int16_t const* in, size_t frames, int* level_db)
+{
+  size_t const n = frames * v->channels;
+  int const step = v->channels;
+  if (n <= static_cast<size_t>(step))
+  {
+    *level_db = static_cast<int>(v->floor_db);
+    return v->hangover > 0;
+  }
+
+  // floats are plenty for a level in dB
+  simd_v4 e = simd_dup(0);
+  size_t i = 0;
+  for (; (i + 4) <= n; i += 4)
+  {
+    simd_v4 const x = simd_load_s16(in + i);
+    e = simd_madd(e, x, x);
+  }
+  float energy = simd_hsum(e);
+  for (; i < n; ++i)
+    energy += static_cast<float>(in[i]) * in[i];
+
+  // sign changes between consecutive samples of the same channel, each
+  // lane counts exactly up to 2^24 of them
+  size_t const pairs = n - step;
+  simd_v4 z = simd_dup(0);
+  for (i = 0; (i + 4) <= pairs; i += 4)
+    z = simd_add(z, simd_sign_differs(simd_load_s16(in + i), simd_load_s16(in + i + step)));
+  uint32_t crossings = static_cast<uint32_t>(simd_hsum(z));
+  for (; i < pairs; ++i)
+    crossings += static_cast<uint16_t>(in[i] ^ in[i + step]) >> 15;
+
+  float const mean = energy / (static_cast<float>(n) * 32768.0f * 32768.0f);
+  float const db = 10.0f * log10f(mean + 1e-10f);
+  float const zcr = static_cast<float>(crossings) / pairs;
+  v->last_db = db;
+  v->last_zcr = zcr;
+
+  if (!v->primed)
+  {
+    v->primed = true;
+    v->floor_db = db;
+  }
+
+  bool const active = (db > VAD_MIN_DB)
+    && ((db > (v->floor_db + VAD_LOUD_DB)) || ((zcr > kVadFricativeZcr) && (db > (v->floor_db + VAD_FRICATIVE_DB))));
+
+  if (db < v->floor_db)
+    v->floor_db += 0.2f * (db - v->floor_db);
+  else
+    v->floor_db += fminf(db - v->floor_db, v->floor_rise_db);
+
+  if (active)
+    v->hangover = v->hangover_periods + 1;
+  else if (v->hangover > 0)
+    v->hangover--;
+
+  *level_db = static_cast<int>(floorf(v->floor_db + 0.5f));
+  return v->hangover > 0;
+}
+
+#endif // VAD_H
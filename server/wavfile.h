@@ -0,0 +1,112 @@
+#ifndef WAVFILE_H
+#define WAVFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "../protocol.h"
+
+// 16 bit PCM WAV files, as xaudio's clips and the benches read them. The
+// format is plain PCM or WAVE_FORMAT_EXTENSIBLE with the PCM subformat.
+// The data chunk is never taken to be longer than what is left of the
+// file: a streamed WAV leaves its size at 0xffffffff.
+
+enum
+{
+  XAUDIO_WAV_PCM = 1,
+  XAUDIO_WAV_EXTENSIBLE = 0xfffe
+};
+
+struct xaudio_wav
+{
+  uint32_t sample_rate;
+  int channels;
+  std::vector<int16_t> samples;
+};
+
+// Reads path into wav. Returns 0, -errno when it can't be read, -EINVAL
+// when it isn't a 16 bit PCM WAV or has no audio.
+static inline int
+xaudio_wav_read(char const* path, xaudio_wav* wav)
+{
+  // what every standard subformat GUID has after its format tag
+  static uint8_t const guid_tail[14] =
+    { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
+
+  wav->sample_rate = 0;
+  wav->channels = 0;
+  wav->samples.clear();
+  FILE* f = fopen(path, "rb");
+  if (!f)
+    return -errno;
+
+  struct stat st;
+  uint8_t riff[12];
+  if (fstat(fileno(f), &st) < 0)
+  {
+    int const err = -errno;
+    fclose(f);
+    return err;
+  }
+  if ((fread(riff, 1, sizeof(riff), f) != sizeof(riff)) || memcmp(riff, "RIFF", 4) || memcmp(riff + 8, "WAVE", 4))
+  {
+    fclose(f);
+    return -EINVAL;
+  }
+
+  int tag = 0;
+  int bits = 0;
+  while (true)
+  {
+    uint8_t chunk[8];
+    if (fread(chunk, 1, sizeof(chunk), f) != sizeof(chunk))
+      break;
+
+    uint32_t const size = static_cast<uint32_t>(xaudio_get_le(chunk + 4, 4));
+    if (!memcmp(chunk, "fmt ", 4))
+    {
+      // 16 bytes of plain PCM, 40 with the extensible subformat
+      uint8_t fmt[40];
+      size_t const n = std::min<size_t>(size, sizeof(fmt));
+      if ((n < 16) || (fread(fmt, 1, n, f) != n))
+        break;
+      tag = static_cast<int>(xaudio_get_le(fmt, 2));
+      wav->channels = static_cast<int>(xaudio_get_le(fmt + 2, 2));
+      wav->sample_rate = static_cast<uint32_t>(xaudio_get_le(fmt + 4, 4));
+      bits = static_cast<int>(xaudio_get_le(fmt + 14, 2));
+      if ((tag == XAUDIO_WAV_EXTENSIBLE) && (n == sizeof(fmt)) && !memcmp(fmt + 26, guid_tail, 14))
+        tag = static_cast<int>(xaudio_get_le(fmt + 24, 2));
+      fseek(f, static_cast<long>(size - n) + (size & 1), SEEK_CUR);
+    }
+    else if (!memcmp(chunk, "data", 4))
+    {
+      long const at = ftell(f);
+      uint64_t const left = ((at >= 0) && (st.st_size > at)) ? static_cast<uint64_t>(st.st_size - at) : 0;
+      size_t const samples = static_cast<size_t>(std::min<uint64_t>(size, left) / 2);
+      if (samples > 0)
+      {
+        wav->samples.resize(samples);
+        wav->samples.resize(fread(&wav->samples[0], 2, samples, f));
+      }
+      break;
+    }
+    else
+    {
+      fseek(f, static_cast<long>(size) + (size & 1), SEEK_CUR);
+    }
+  }
+  fclose(f);
+
+  if ((tag != XAUDIO_WAV_PCM) || (bits != 16) || (wav->channels < 1) || (wav->sample_rate == 0)
+    || (wav->samples.size() < static_cast<size_t>(wav->channels)))
+    return -EINVAL;
+  return 0;
+}
+
+#endif // WAVFILE_H
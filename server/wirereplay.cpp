@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../protocol.h"
+#include "../wirelog.h"
+#include "cpuusage.h"
+
+// Replays a wire log recorded with xaudio --wire-log against a running
+// xaudio: every recorded connection is opened again when it was, sends
+// what the client sent when it sent it and is closed when it was. What
+// comes back is measured the same way the recorded stream is, so the two
+// can be put side by side, keeping in mind that the recording has when
+// xaudio handed bytes to the socket and the replay when they arrived. For
+// runs that compare, point it at an xaudio built with -DXAUDIO_ALSA_STUB,
+// whose capture is the same every time.
+
+struct stream_stats
+{
+  // the client started with a hello, so the stream starts with the reply
+  bool hello;
+  std::string head;
+  size_t head_size;
+
+  int64_t hello_us;
+  int64_t first_audio_us;
+  int64_t last_us;
+  int64_t max_gap_us;
+  uint64_t glitches;
+  uint64_t bytes;
+  std::vector<int64_t> gaps;
+};
+
+struct rx_event
+{
+  int64_t t_us;
+  size_t offset;
+  uint32_t length;
+};
+
+struct wire_conn
+{
+  std::string peer;
+  int64_t open_us;
+  int64_t close_us;
+  std::vector<rx_event> rx;
+  std::string rx_data;
+  stream_stats recorded;
+  stream_stats replayed;
+
+  int fd;
+  size_t next_rx;
+  size_t rx_pos;
+  int64_t connect_us;
+  bool done;
+};
+
+struct capture_stats
+{
+  uint64_t periods;
+  uint64_t late;
+  int64_t max_interval_us;
+  int64_t last_us;
+};
+
+static int64_t glitch_us = 50000;
+
+static void stats_init(stream_stats* s, bool hello)
+{
+  s->hello = hello;
+  s->head.clear();
+  s->head_size = hello ? XAUDIO_HELLO_SIZE : 0;
+  s->hello_us = -1;
+  s->first_audio_us = -1;
+  s->last_us = -1;
+  s->max_gap_us = 0;
+  s->glitches = 0;
+  s->bytes = 0;
+  s->gaps.clear();
+}
+
+// n bytes arriving t_us after the connection was opened
+static void stats_arrival(stream_stats* s, int64_t t_us, uint8_t const* data, size_t n)
+{
+  while ((n > 0) && (s->head.size() < s->head_size))
+  {
+    size_t const take = std::min(n, s->head_size - s->head.size());
+    s->head.append(reinterpret_cast<char const *>(data), take);
+    data += take;
+    n -= take;
+
+    if (s->head.size() == XAUDIO_HELLO_SIZE)
+    {
+      uint32_t const flags = static_cast<uint32_t>(xaudio_get_le(reinterpret_cast<uint8_t const *>(s->head.data()) + 4, 4));
+      s->head_size += ((flags & XAUDIO_FLAG_FORMAT) ? XAUDIO_FORMAT_SIZE : 0)
+        + ((flags & XAUDIO_FLAG_REPLAY) ? XAUDIO_REPLAY_SIZE : 0);
+    }
+    if (s->head.size() == s->head_size)
+      s->hello_us = t_us;
+  }
+
+  if (n == 0)
+    return;
+
+  if (s->first_audio_us < 0)
+  {
+    s->first_audio_us = t_us;
+  }
+  else
+  {
+    int64_t const gap = t_us - s->last_us;
+    s->gaps.push_back(gap);
+    s->max_gap_us = std::max(s->max_gap_us, gap);
+    if (gap > glitch_us)
+      s->glitches++;
+  }
+  s->last_us = t_us;
+  s->bytes += n;
+}
+
+static int64_t percentile(std::vector<int64_t> v, double p)
+{
+  if (v.empty())
+    return 0;
+  size_t const i = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+static bool load_log(char const* path, xaudio_wire_header* header, std::vector<wire_conn>* conns,
+  capture_stats* capture, int64_t* end_us)
+{
+  FILE* f = fopen(path, "rb");
+  if (!f)
+  {
+    printf("failed to open %s. %s\n", path, strerror(errno));
+    return false;
+  }
+  if (!xaudio_wire_read_header(f, header))
+  {
+    printf("%s isn't a wire log\n", path);
+    fclose(f);
+    return false;
+  }
+
+  int64_t const period_us = (static_cast<int64_t>(header->period_frames) * 1000000) / header->capture.sample_rate;
+  memset(capture, 0, sizeof(*capture));
+  capture->last_us = -1;
+
+  xaudio_wire_conns open;
+  std::vector<uint8_t> payload;
+  xaudio_wire_record r;
+  r.t_us = 0;
+  while (xaudio_wire_read_record(f, &r))
+  {
+    payload.resize(r.length);
+    if (xaudio_wire_has_payload(r) && (r.length > 0) && (fread(&payload[0], 1, r.length, f) != r.length))
+      break;
+    *end_us = r.t_us;
+
+    if (r.type == XAUDIO_WIRE_CAPTURE)
+    {
+      if (capture->last_us >= 0)
+      {
+        int64_t const interval = r.t_us - capture->last_us;
+        capture->max_interval_us = std::max(capture->max_interval_us, interval);
+        if (interval > ((period_us * 3) / 2))
+          capture->late++;
+      }
+      capture->periods++;
+      capture->last_us = r.t_us;
+      continue;
+    }
+
+    int const index = xaudio_wire_conn_of(&open, r, static_cast<int>(conns->size()));
+    if (r.type == XAUDIO_WIRE_OPEN)
+    {
+      wire_conn c;
+      c.peer.assign(payload.begin(), payload.end());
+      c.open_us = r.t_us;
+      c.close_us = -1;
+      c.fd = -1;
+      c.next_rx = 0;
+      c.rx_pos = 0;
+      c.connect_us = -1;
+      c.done = false;
+      stats_init(&c.recorded, false);
+      stats_init(&c.replayed, false);
+      conns->push_back(c);
+      continue;
+    }
+
+    if (index < 0)
+      continue;
+    wire_conn& c = (*conns)[index];
+
+    if (r.type == XAUDIO_WIRE_RX)
+    {
+      if (c.rx.empty() && c.recorded.bytes == 0)
+        stats_init(&c.recorded, xaudio_is_hello_prefix(&payload[0], std::min<int>(r.length, XAUDIO_HELLO_MAGIC_SIZE)));
+      rx_event e = { r.t_us - c.open_us, c.rx_data.size(), r.length };
+      c.rx.push_back(e);
+      c.rx_data.append(reinterpret_cast<char const *>(&payload[0]), r.length);
+    }
+    else if (r.type == XAUDIO_WIRE_TX)
+    {
+      stats_arrival(&c.recorded, r.t_us - c.open_us, &payload[0], r.length);
+    }
+    else if (r.type == XAUDIO_WIRE_CLOSE)
+    {
+      c.close_us = r.t_us;
+    }
+  }
+  fclose(f);
+
+  for (size_t i = 0; i < conns->size(); ++i)
+  {
+    wire_conn& c = (*conns)[i];
+    if (c.close_us < 0)
+      c.close_us = *end_us;
+    stats_init(&c.replayed, (c.rx_data.size() >= XAUDIO_HELLO_MAGIC_SIZE)
+      && xaudio_is_hello_prefix(reinterpret_cast<uint8_t const *>(c.rx_data.data()), XAUDIO_HELLO_MAGIC_SIZE));
+  }
+  return true;
+}
+
+static void close_conn(wire_conn* c)
+{
+  if (c->fd != -1)
+    close(c->fd);
+  c->fd = -1;
+  c->done = true;
+}
+
+static bool open_conn(wire_conn* c, struct sockaddr_in const& addr, int64_t now)
+{
+  c->connect_us = now;
+  c->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(c->fd, reinterpret_cast<struct sockaddr const *>(&addr), sizeof(addr)) < 0)
+  {
+    printf("failed to connect for %s. %s\n", c->peer.c_str(), strerror(errno));
+    close_conn(c);
+    return false;
+  }
+  fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+// sends whatever uplink is due, false if the connection broke
+static bool send_due(wire_conn* c, int64_t since_open, bool fast)
+{
+  while (c->next_rx < c->rx.size())
+  {
+    rx_event const& e = c->rx[c->next_rx];
+    if (!fast && (e.t_us > since_open))
+      return true;
+
+    ssize_t n = send(c->fd, c->rx_data.data() + e.offset + c->rx_pos, e.length - c->rx_pos, MSG_NOSIGNAL);
+    if (n < 0)
+      return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+
+    c->rx_pos += n;
+    if (c->rx_pos < e.length)
+      return true;
+    c->rx_pos = 0;
+    c->next_rx++;
+  }
+  return true;
+}
+
+static void replay(std::vector<wire_conn>* conns, struct sockaddr_in const& addr, bool fast)
+{
+  int64_t const start = xaudio_wire_now_us();
+  std::vector<uint8_t> buff(64 * 1024);
+
+  while (true)
+  {
+    int64_t const now = xaudio_wire_now_us() - start;
+    int64_t next = now + 10000;
+    std::vector<struct pollfd> fds;
+    std::vector<wire_conn *> polled;
+    bool busy = false;
+
+    for (size_t i = 0; i < conns->size(); ++i)
+    {
+      wire_conn* c = &(*conns)[i];
+      if (c->done)
+        continue;
+      busy = true;
+
+      if (c->fd == -1)
+      {
+        if (c->open_us > now)
+        {
+          next = std::min(next, c->open_us);
+          continue;
+        }
+        if (!open_conn(c, addr, now))
+          continue;
+      }
+
+      int64_t const since_open = now - c->connect_us;
+      if ((since_open >= (c->close_us - c->open_us)) || !send_due(c, since_open, fast))
+      {
+        close_conn(c);
+        continue;
+      }
+      next = std::min(next, c->connect_us + (c->close_us - c->open_us));
+      if (!fast && (c->next_rx < c->rx.size()))
+        next = std::min(next, c->connect_us + c->rx[c->next_rx].t_us);
+
+      struct pollfd p;
+      p.fd = c->fd;
+      p.events = POLLIN | ((fast && (c->next_rx < c->rx.size())) ? POLLOUT : 0);
+      p.revents = 0;
+      fds.push_back(p);
+      polled.push_back(c);
+    }
+
+    if (!busy)
+      break;
+
+    int const timeout = static_cast<int>(std::max<int64_t>(0, (next - now + 999) / 1000));
+    if (poll(fds.empty() ? NULL : &fds[0], fds.size(), timeout) < 0)
+      continue;
+
+    int64_t const at = xaudio_wire_now_us() - start;
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+      wire_conn* c = polled[i];
+      if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+
+      ssize_t n = recv(c->fd, &buff[0], buff.size(), 0);
+      if (n > 0)
+        stats_arrival(&c->replayed, at - c->connect_us, &buff[0], n);
+      else if ((n == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+        close_conn(c);
+    }
+  }
+}
+
+// a time in ms, or - if it never happened
+static char const* millis(int64_t us, char* buff, size_t n)
+{
+  if (us < 0)
+    snprintf(buff, n, "-");
+  else
+    snprintf(buff, n, "%.1fms", us / 1e3);
+  return buff;
+}
+
+static void print_stats(char const* what, stream_stats const& s, int64_t duration_us)
+{
+  char hello[32];
+  char first_audio[32];
+  double const seconds = std::max<int64_t>(duration_us, 1) / 1e6;
+  printf("  %-9s hello:%9s first audio:%9s rx:%8.1fkB/s gap p50:%6.1fms p99:%6.1fms max:%7.1fms glitches:%llu\n",
+    what, millis(s.hello_us, hello, sizeof(hello)), millis(s.first_audio_us, first_audio, sizeof(first_audio)),
+    (s.bytes / 1024.0) / seconds, percentile(s.gaps, 0.5) / 1e3, percentile(s.gaps, 0.99) / 1e3, s.max_gap_us / 1e3,
+    static_cast<unsigned long long>(s.glitches));
+}
+
+static void print_help()
+{
+  printf("\n");
+  printf("\tUsage xaudio-wirereplay [OPTIONS] <wire log>\n");
+  printf("\t\t--host=<host:port>      xaudio to replay against, without it only the recording is measured\n");
+  printf("\t\t--fast                  Send what clients sent as fast as xaudio takes it\n");
+  printf("\t\t--glitch=<ms>           Gap in the received stream counted as a glitch (50)\n");
+  printf("\t\t--server-pid=<pid>      Also report xaudio's CPU during the replay\n");
+  printf("\t\t--help                  Print this help and exit\n");
+  printf("\n");
+  printf("Examples:\n");
+  printf("\txaudio-wirereplay --host=127.0.0.1:10100 --server-pid=$(pidof xaudio) field.xawl\n");
+  printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+  std::string host;
+  int port = -1;
+  bool fast = false;
+  int server_pid = -1;
+
+  struct option long_options[] =
+  {
+    { "host", required_argument, NULL, 10000 },
+    { "fast", no_argument, NULL, 10001 },
+    { "glitch", required_argument, NULL, 10002 },
+    { "server-pid", required_argument, NULL, 10003 },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+  {
+    switch (c)
+    {
+      case 10000:
+      {
+        std::string s(optarg);
+        size_t colon = s.rfind(':');
+        host = s.substr(0, colon);
+        port = (colon == std::string::npos) ? -1 : static_cast<int>(strtol(s.c_str() + colon + 1, NULL, 10));
+        break;
+      }
+      case 10001:
+        fast = true;
+        break;
+      case 10002:
+        glitch_us = strtoll(optarg, NULL, 10) * 1000;
+        break;
+      case 10003:
+        server_pid = static_cast<int>(strtol(optarg, NULL, 10));
+        break;
+      default:
+        print_help();
+        exit(0);
+        break;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    printf("failed to provide a wire log\n");
+    print_help();
+    exit(1);
+  }
+
+  xaudio_wire_header header;
+  std::vector<wire_conn> conns;
+  capture_stats capture;
+  int64_t end_us = 0;
+  if (!load_log(argv[optind], &header, &conns, &capture, &end_us))
+    exit(1);
+
+  printf("%s: %.1fs, %zu connections, capture %uHz %dch %u frames\n", argv[optind], end_us / 1e6, conns.size(),
+    header.capture.sample_rate, header.capture.channels, header.period_frames);
+  if (capture.periods > 0)
+  {
+    printf("capture: %llu periods, %llu late, longest interval %.1fms\n", static_cast<unsigned long long>(capture.periods),
+      static_cast<unsigned long long>(capture.late), capture.max_interval_us / 1e3);
+  }
+
+  double cpu_us = 0;
+  double server_cpu_us = -1;
+  if (port > 0)
+  {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_aton(host.c_str(), &addr.sin_addr);
+
+    double const server_start = xaudio_cpu_process_us(server_pid);
+    double const cpu_start = xaudio_cpu_self_us();
+    replay(&conns, addr, fast);
+    cpu_us = xaudio_cpu_self_us() - cpu_start;
+    server_cpu_us = (server_start < 0) ? -1 : (xaudio_cpu_process_us(server_pid) - server_start);
+  }
+
+  uint64_t recorded_glitches = 0;
+  uint64_t replayed_glitches = 0;
+  for (size_t i = 0; i < conns.size(); ++i)
+  {
+    wire_conn const& w = conns[i];
+    int64_t const duration = w.close_us - w.open_us;
+    printf("%zu %s at %.1fs for %.1fs, %s\n", i, w.peer.c_str(), w.open_us / 1e6, duration / 1e6,
+      w.recorded.hello ? "hello" : "legacy");
+    print_stats("recorded", w.recorded, duration);
+    recorded_glitches += w.recorded.glitches;
+    if (port > 0)
+    {
+      print_stats("replayed", w.replayed, duration);
+      replayed_glitches += w.replayed.glitches;
+    }
+  }
+
+  printf("glitches recorded:%llu", static_cast<unsigned long long>(recorded_glitches));
+  if (port > 0)
+  {
+    printf(" replayed:%llu cpu:%.3f%% core", static_cast<unsigned long long>(replayed_glitches),
+      (cpu_us / std::max<int64_t>(end_us, 1)) * 100);
+    if (server_cpu_us >= 0)
+      printf(" server:%.3f%% core", (server_cpu_us / std::max<int64_t>(end_us, 1)) * 100);
+  }
+  printf("\n");
+  return 0;
+}
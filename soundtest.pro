@@ -5,10 +5,31 @@ QT += multimedia
 
 
 CONFIG += debug
+# qmake CONFIG+=trace records trace spans, kill -USR1 dumps them
+CONFIG(trace): DEFINES += XAUDIO_TRACE
 TARGET = soundtest
 TEMPLATE = app
 
 SOURCES += main.cpp mainwindow.cpp \
-    logwindow.cpp
+    logwindow.cpp \
+    audioengine.cpp \
+    jitterbuffer.cpp \
+    filesource.cpp \
+    formatconverter.cpp \
+    levelmeter.cpp \
+    monitorengine.cpp \
+    monitorwindow.cpp \
+    wavrecorder.cpp
 HEADERS  += mainwindow.h \
-    logwindow.h
+    logwindow.h \
+    audioengine.h \
+    jitterbuffer.h \
+    filesource.h \
+    formatconverter.h \
+    levelmeter.h \
+    monitorengine.h \
+    monitorwindow.h \
+    plc.h \
+    spscring.h \
+    trace.h \
+    wavrecorder.h
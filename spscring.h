@@ -0,0 +1,74 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <string.h>
+
+// Single producer / single consumer byte ring. Neither side ever blocks or
+// locks; a producer that finds the ring full gets a short write and decides
+// itself what to do with the rest.
+class SpscRing
+{
+public:
+  explicit SpscRing(size_t minCapacity)
+    : m_data()
+    , m_mask(0)
+    , m_head(0)
+    , m_tail(0)
+  {
+    size_t capacity = 1;
+    while (capacity < minCapacity)
+      capacity <<= 1;
+    m_data.resize(capacity);
+    m_mask = capacity - 1;
+  }
+
+  size_t capacity() const
+    { return m_data.size(); }
+
+  size_t available() const
+    { return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_relaxed); }
+
+  // producer side
+  size_t write(char const* data, size_t len)
+  {
+    size_t const head = m_head.load(std::memory_order_relaxed);
+    size_t const tail = m_tail.load(std::memory_order_acquire);
+    size_t const n = std::min(len, m_data.size() - (head - tail));
+
+    size_t const pos = head & m_mask;
+    size_t const first = std::min(n, m_data.size() - pos);
+    memcpy(&m_data[pos], data, first);
+    memcpy(&m_data[0], data + first, n - first);
+
+    m_head.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+  // consumer side
+  size_t read(char* data, size_t len)
+  {
+    size_t const tail = m_tail.load(std::memory_order_relaxed);
+    size_t const head = m_head.load(std::memory_order_acquire);
+    size_t const n = std::min(len, head - tail);
+
+    size_t const pos = tail & m_mask;
+    size_t const first = std::min(n, m_data.size() - pos);
+    memcpy(data, &m_data[pos], first);
+    memcpy(data + first, &m_data[0], n - first);
+
+    m_tail.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+private:
+  std::vector<char>   m_data;
+  size_t              m_mask;
+  std::atomic<size_t> m_head;
+  std::atomic<size_t> m_tail;
+};
+
+#endif // SPSCRING_H
@@ -0,0 +1,210 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <atomic>
+
+// Trace spans: where each millisecond of a period goes, in xaudio's loop and
+// the client's socket and device handlers. Built with -DXAUDIO_TRACE,
+// XAUDIO_TRACE_SPAN("name") times the rest of its scope; without it the
+// macro is empty and nothing is recorded.
+//
+// Every thread records into its own ring of the last XAUDIO_TRACE_EVENTS
+// spans, written only by that thread and never locked. A dump, usually on
+// SIGUSR1, writes all rings as a Chrome trace (chrome://tracing or
+// ui.perfetto.dev). Spans a thread overwrote while the dump read them are
+// left out rather than written torn. Names must be string literals.
+
+enum
+{
+  XAUDIO_TRACE_EVENTS = 1 << 16,
+  XAUDIO_TRACE_NAME_SIZE = 16
+};
+
+struct xaudio_trace_event
+{
+  char const* name;
+  int64_t begin_ns;
+  int64_t end_ns;
+};
+
+struct xaudio_trace_buffer
+{
+  long tid;
+  char name[XAUDIO_TRACE_NAME_SIZE];
+  std::atomic<uint64_t> head;
+  xaudio_trace_event events[XAUDIO_TRACE_EVENTS];
+  xaudio_trace_buffer* next;
+};
+
+// Shared by every translation unit, hence inline rather than static, and
+// never freed: a thread's spans outlive it until the process exits.
+inline std::atomic<xaudio_trace_buffer *>&
+xaudio_trace_buffers()
+{
+  static std::atomic<xaudio_trace_buffer *> buffers(NULL);
+  return buffers;
+}
+
+inline volatile sig_atomic_t&
+xaudio_trace_requested()
+{
+  static volatile sig_atomic_t requested = 0;
+  return requested;
+}
+
+static inline int64_t
+xaudio_trace_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (static_cast<int64_t>(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+inline xaudio_trace_buffer*
+xaudio_trace_thread_buffer()
+{
+  static thread_local xaudio_trace_buffer* buffer = NULL;
+  if (buffer)
+    return buffer;
+
+  buffer = new xaudio_trace_buffer;
+  buffer->tid = syscall(SYS_gettid);
+  memset(buffer->name, 0, sizeof(buffer->name));
+  if (prctl(PR_GET_NAME, buffer->name) != 0)
+    snprintf(buffer->name, sizeof(buffer->name), "%ld", buffer->tid);
+  buffer->head.store(0, std::memory_order_relaxed);
+
+  std::atomic<xaudio_trace_buffer *>& buffers = xaudio_trace_buffers();
+  buffer->next = buffers.load(std::memory_order_relaxed);
+  while (!buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release, std::memory_order_relaxed))
+    ;
+  return buffer;
+}
+
+// how the calling thread shows up in the trace, its system name otherwise
+static inline void
+xaudio_trace_thread_name(char const* name)
+{
+  xaudio_trace_buffer* buffer = xaudio_trace_thread_buffer();
+  snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+}
+
+static inline void
+xaudio_trace_record(char const* name, int64_t begin_ns, int64_t end_ns)
+{
+  xaudio_trace_buffer* buffer = xaudio_trace_thread_buffer();
+  uint64_t const head = buffer->head.load(std::memory_order_relaxed);
+  xaudio_trace_event& e = buffer->events[head & (XAUDIO_TRACE_EVENTS - 1)];
+  e.name = name;
+  e.begin_ns = begin_ns;
+  e.end_ns = end_ns;
+  buffer->head.store(head + 1, std::memory_order_release);
+}
+
+struct xaudio_trace_span
+{
+  explicit xaudio_trace_span(char const* name)
+    : name(name)
+    , begin_ns(xaudio_trace_now_ns())
+  {
+  }
+
+  ~xaudio_trace_span()
+  {
+    xaudio_trace_record(name, begin_ns, xaudio_trace_now_ns());
+  }
+
+  char const* name;
+  int64_t begin_ns;
+};
+
+#ifdef XAUDIO_TRACE
+#define XAUDIO_TRACE_CONCAT2(a, b) a##b
+#define XAUDIO_TRACE_CONCAT(a, b) XAUDIO_TRACE_CONCAT2(a, b)
+#define XAUDIO_TRACE_SPAN(NAME) xaudio_trace_span XAUDIO_TRACE_CONCAT(xaudio_trace_span_, __LINE__)(NAME)
+#define XAUDIO_TRACE_THREAD(NAME) xaudio_trace_thread_name(NAME)
+#else
+#define XAUDIO_TRACE_SPAN(NAME) do {} while (0)
+#define XAUDIO_TRACE_THREAD(NAME) do {} while (0)
+#endif
+
+static inline void
+xaudio_trace_on_signal(int)
+{
+  xaudio_trace_requested() = 1;
+}
+
+// dumps are only asked for here, the handler can't write them itself
+static inline void
+xaudio_trace_dump_on(int sig)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = xaudio_trace_on_signal;
+  sa.sa_flags = SA_RESTART;
+  sigaction(sig, &sa, NULL);
+}
+
+// true once per signal
+static inline bool
+xaudio_trace_take_request()
+{
+  if (!xaudio_trace_requested())
+    return false;
+  xaudio_trace_requested() = 0;
+  return true;
+}
+
+// Writes every thread's ring to path, returns the number of spans written
+// or -1 if the file couldn't be written.
+static inline long
+xaudio_trace_dump(char const* path)
+{
+  FILE* f = fopen(path, "w");
+  if (!f)
+    return -1;
+
+  static xaudio_trace_event copy[XAUDIO_TRACE_EVENTS];
+  long const pid = getpid();
+  long spans = 0;
+  char const* sep = "";
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (xaudio_trace_buffer* b = xaudio_trace_buffers().load(std::memory_order_acquire); b; b = b->next)
+  {
+    fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}", sep, pid,
+      b->tid, b->name);
+    sep = ",";
+
+    // copy first, then keep only what the thread can't have overwritten
+    uint64_t const head = b->head.load(std::memory_order_acquire);
+    uint64_t first = (head > XAUDIO_TRACE_EVENTS) ? (head - XAUDIO_TRACE_EVENTS) : 0;
+    for (uint64_t i = first; i < head; ++i)
+      copy[i & (XAUDIO_TRACE_EVENTS - 1)] = b->events[i & (XAUDIO_TRACE_EVENTS - 1)];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t const after = b->head.load(std::memory_order_relaxed);
+    if (after > XAUDIO_TRACE_EVENTS)
+      first = std::max(first, after - XAUDIO_TRACE_EVENTS + 1);
+
+    for (uint64_t i = first; i < head; ++i)
+    {
+      xaudio_trace_event const& e = copy[i & (XAUDIO_TRACE_EVENTS - 1)];
+      fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}", e.name, pid, b->tid,
+        e.begin_ns / 1e3, (e.end_ns - e.begin_ns) / 1e3);
+      spans++;
+    }
+  }
+  fprintf(f, "\n]}\n");
+  return (fclose(f) == 0) ? spans : -1;
+}
+
+#endif // TRACE_H
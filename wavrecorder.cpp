@@ -0,0 +1,138 @@
+#include "wavrecorder.h"
+
+#include <QDataStream>
+
+#include <limits>
+
+static const int kRingMillis = 4000;
+static const int kMinRingBytes = 256 * 1024;
+static const int kBatchBytes = 64 * 1024;
+static const int kWriteIntervalMillis = 100;
+static const int kWavHeaderBytes = 44;
+
+static char const* const kTrackSuffix[] = { "_from_camera.wav", "_to_camera.wav" };
+
+WavRecorder::WavRecorder(QString const& prefix, QAudioFormat const& receivedFormat, QAudioFormat const& sentFormat)
+  : QThread()
+  , m_stop(0)
+{
+  QAudioFormat const formats[NumDirections] = { receivedFormat, sentFormat };
+
+  for (int i = 0; i < NumDirections; ++i)
+  {
+    Track& track = m_tracks[i];
+    track.format = formats[i];
+    track.file.setFileName(prefix + kTrackSuffix[i]);
+    track.ring.reset(new SpscRing(qMax(kMinRingBytes, formats[i].bytesForDuration(kRingMillis * 1000))));
+    track.dataBytes = 0;
+    track.dropped = 0;
+  }
+}
+
+WavRecorder::~WavRecorder()
+{
+  requestStop();
+  wait();
+}
+
+void
+WavRecorder::write(Direction direction, char const* data, qint64 len)
+{
+  Track& track = m_tracks[direction];
+  size_t n = track.ring->write(data, static_cast<size_t>(len));
+  if (n < static_cast<size_t>(len))
+    track.dropped += (len - n);
+}
+
+void
+WavRecorder::requestStop()
+{
+  m_stop.storeRelease(1);
+}
+
+void
+WavRecorder::run()
+{
+  for (Track& track : m_tracks)
+  {
+    if (!track.file.open(QFile::WriteOnly | QFile::Truncate))
+    {
+      emit logMessage(QString("recording: failed to open %1: %2").arg(track.file.fileName(), track.file.errorString()));
+      continue;
+    }
+
+    // placeholder, sizes are patched in on close
+    writeHeader(&track);
+    emit logMessage(QString("recording to %1").arg(track.file.fileName()));
+  }
+
+  QByteArray batch(kBatchBytes, 0);
+  while (!m_stop.loadAcquire())
+  {
+    msleep(kWriteIntervalMillis);
+    for (Track& track : m_tracks)
+      drain(&track, &batch, false);
+  }
+
+  for (Track& track : m_tracks)
+  {
+    drain(&track, &batch, true);
+    if (!track.file.isOpen())
+      continue;
+
+    writeHeader(&track);
+    track.file.close();
+
+    qint64 millis = track.format.durationForBytes(static_cast<qint32>(qMin<quint64>(track.dataBytes, std::numeric_limits<qint32>::max()))) / 1000;
+    emit logMessage(QString("recorded %1 ms to %2 (%3 bytes dropped)").arg(QString::number(millis),
+      track.file.fileName(), QString::number(track.dropped.load())));
+  }
+}
+
+void
+WavRecorder::drain(Track* track, QByteArray* batch, bool all)
+{
+  // hold off until there is a large write worth doing, unless closing
+  while ((track->ring->available() >= static_cast<size_t>(kBatchBytes))
+    || (all && (track->ring->available() > 0)))
+  {
+    size_t n = track->ring->read(batch->data(), kBatchBytes);
+    if (track->file.isOpen())
+    {
+      track->file.write(batch->constData(), static_cast<qint64>(n));
+      track->dataBytes += n;
+    }
+  }
+}
+
+void
+WavRecorder::writeHeader(Track* track)
+{
+  QAudioFormat const& format = track->format;
+  quint32 const dataBytes = static_cast<quint32>(qMin<quint64>(track->dataBytes, 0xffffffffu - kWavHeaderBytes));
+  quint16 const formatTag = (format.sampleType() == QAudioFormat::Float) ? 3 : 1;
+
+  QByteArray header;
+  QDataStream stream(&header, QIODevice::WriteOnly);
+  stream.setByteOrder(QDataStream::LittleEndian);
+
+  stream.writeRawData("RIFF", 4);
+  stream << quint32(kWavHeaderBytes - 8 + dataBytes);
+  stream.writeRawData("WAVE", 4);
+  stream.writeRawData("fmt ", 4);
+  stream << quint32(16);
+  stream << formatTag;
+  stream << quint16(format.channelCount());
+  stream << quint32(format.sampleRate());
+  stream << quint32(format.sampleRate() * format.bytesPerFrame());
+  stream << quint16(format.bytesPerFrame());
+  stream << quint16(format.sampleSize());
+  stream.writeRawData("data", 4);
+  stream << dataBytes;
+
+  qint64 const pos = track->file.pos();
+  track->file.seek(0);
+  track->file.write(header);
+  if (pos > kWavHeaderBytes)
+    track->file.seek(pos);
+}
@@ -0,0 +1,60 @@
+#ifndef WAVRECORDER_H
+#define WAVRECORDER_H
+
+#include <QThread>
+
+#include <QAtomicInteger>
+#include <QAudioFormat>
+#include <QFile>
+#include <QScopedPointer>
+
+#include "spscring.h"
+
+// Records both directions of a session to a pair of WAV files. write() is
+// called from the audio thread and only copies into a lock-free ring; the
+// recorder's own thread drains the rings in large batches and patches the
+// WAV headers when it finishes. Stopping never waits for the disk, the
+// thread finishes and cleans up on its own.
+class WavRecorder : public QThread
+{
+  Q_OBJECT
+
+public:
+  enum Direction
+  {
+    Received = 0,
+    Sent = 1,
+    NumDirections = 2
+  };
+
+  WavRecorder(QString const& prefix, QAudioFormat const& receivedFormat, QAudioFormat const& sentFormat);
+  ~WavRecorder();
+
+  void write(Direction direction, char const* data, qint64 len);
+  void requestStop();
+
+signals:
+  void logMessage(QString const& message);
+
+protected:
+  void run() override;
+
+private:
+  struct Track
+  {
+    QAudioFormat                format;
+    QFile                       file;
+    QScopedPointer<SpscRing>    ring;
+    quint64                     dataBytes;
+    QAtomicInteger<quint64>     dropped;
+  };
+
+  void drain(Track* track, QByteArray* batch, bool all);
+  static void writeHeader(Track* track);
+
+private:
+  Track             m_tracks[NumDirections];
+  QAtomicInt        m_stop;
+};
+
+#endif // WAVRECORDER_H
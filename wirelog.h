@@ -0,0 +1,196 @@
+#ifndef WIRELOG_H
+#define WIRELOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+
+#include "protocol.h"
+
+// Wire log: everything xaudio exchanged with its clients and when, so a
+// run can be replayed later, against a server or through the client's
+// playout, and measured the same way every time.
+//
+// The file starts with a header describing the capture, then one record
+// per event. A record is 12 bytes followed by its payload: microseconds
+// since the previous record, the connection, the type and the payload
+// length. Connections are numbered by their socket, an OPEN starts a new
+// one on that number. RX is what a client sent, TX what xaudio managed to
+// send it, both exactly as they went over the wire. CAPTURE marks each
+// period read from the device and carries no payload, its length is the
+// number of frames. Gaps too long for a record are bridged with TICKs.
+
+#define XAUDIO_WIRE_MAGIC "XAWL"
+#define XAUDIO_WIRE_VERSION 1
+
+enum
+{
+  XAUDIO_WIRE_HEADER_SIZE = 32,
+  XAUDIO_WIRE_RECORD_SIZE = 12
+};
+
+enum
+{
+  XAUDIO_WIRE_TICK = 0,
+  XAUDIO_WIRE_OPEN = 1,
+  XAUDIO_WIRE_RX = 2,
+  XAUDIO_WIRE_TX = 3,
+  XAUDIO_WIRE_CLOSE = 4,
+  XAUDIO_WIRE_CAPTURE = 5
+};
+
+// magic, version, capture format, frames per period, wall clock when the
+// log was started in unix ms, then 4 reserved bytes
+struct xaudio_wire_header
+{
+  xaudio_format capture;
+  uint32_t period_frames;
+  int64_t start_ms;
+};
+
+struct xaudio_wire_record
+{
+  // since the log was started
+  int64_t t_us;
+  uint16_t conn;
+  uint8_t type;
+  uint32_t length;
+};
+
+struct xaudio_wire_log
+{
+  FILE* f;
+  int64_t last_us;
+};
+
+static inline int64_t
+xaudio_wire_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (static_cast<int64_t>(ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static inline bool
+xaudio_wire_create(xaudio_wire_log* log, char const* path, xaudio_format const& capture, uint32_t period_frames)
+{
+  log->f = fopen(path, "wb");
+  if (!log->f)
+    return false;
+
+  // records are small and many, let them pile up before they hit the disk
+  setvbuf(log->f, NULL, _IOFBF, 256 * 1024);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  int64_t const start_ms = (static_cast<int64_t>(ts.tv_sec) * 1000) + (ts.tv_nsec / 1000000);
+  log->last_us = xaudio_wire_now_us();
+
+  uint8_t h[XAUDIO_WIRE_HEADER_SIZE];
+  memcpy(h, XAUDIO_WIRE_MAGIC, 4);
+  xaudio_put_le(h + 4, XAUDIO_WIRE_VERSION, 4);
+  xaudio_encode_format(capture, h + 8);
+  xaudio_put_le(h + 16, period_frames, 4);
+  xaudio_put_le(h + 20, static_cast<uint64_t>(start_ms), 8);
+  xaudio_put_le(h + 28, 0, 4);
+  return fwrite(h, 1, sizeof(h), log->f) == sizeof(h);
+}
+
+static inline void
+xaudio_wire_write(xaudio_wire_log* log, int conn, int type, void const* data, uint32_t length)
+{
+  if (!log->f)
+    return;
+
+  int64_t const now = xaudio_wire_now_us();
+  int64_t delta = now - log->last_us;
+  log->last_us = now;
+
+  uint8_t r[XAUDIO_WIRE_RECORD_SIZE];
+  while (delta > UINT32_MAX)
+  {
+    memset(r, 0, sizeof(r));
+    xaudio_put_le(r, UINT32_MAX, 4);
+    fwrite(r, 1, sizeof(r), log->f);
+    delta -= UINT32_MAX;
+  }
+
+  xaudio_put_le(r, static_cast<uint64_t>(delta), 4);
+  xaudio_put_le(r + 4, static_cast<uint16_t>(conn), 2);
+  r[6] = static_cast<uint8_t>(type);
+  r[7] = 0;
+  xaudio_put_le(r + 8, length, 4);
+  fwrite(r, 1, sizeof(r), log->f);
+  if (data && length)
+    fwrite(data, 1, length, log->f);
+}
+
+static inline bool
+xaudio_wire_read_header(FILE* f, xaudio_wire_header* header)
+{
+  uint8_t h[XAUDIO_WIRE_HEADER_SIZE];
+  if ((fread(h, 1, sizeof(h), f) != sizeof(h)) || memcmp(h, XAUDIO_WIRE_MAGIC, 4)
+    || (xaudio_get_le(h + 4, 4) != XAUDIO_WIRE_VERSION))
+    return false;
+
+  xaudio_decode_format(h + 8, &header->capture);
+  header->period_frames = static_cast<uint32_t>(xaudio_get_le(h + 16, 4));
+  header->start_ms = static_cast<int64_t>(xaudio_get_le(h + 20, 8));
+  return true;
+}
+
+// The next record, its payload is left for the caller to read or skip.
+// t_us carries on from the previous record, start it at 0.
+static inline bool
+xaudio_wire_read_record(FILE* f, xaudio_wire_record* record)
+{
+  uint8_t r[XAUDIO_WIRE_RECORD_SIZE];
+  while (fread(r, 1, sizeof(r), f) == sizeof(r))
+  {
+    record->t_us += static_cast<int64_t>(xaudio_get_le(r, 4));
+    record->conn = static_cast<uint16_t>(xaudio_get_le(r + 4, 2));
+    record->type = r[6];
+    record->length = static_cast<uint32_t>(xaudio_get_le(r + 8, 4));
+    if (record->type != XAUDIO_WIRE_TICK)
+      return true;
+  }
+  return false;
+}
+
+static inline bool
+xaudio_wire_has_payload(xaudio_wire_record const& record)
+{
+  return (record.type == XAUDIO_WIRE_OPEN) || (record.type == XAUDIO_WIRE_RX) || (record.type == XAUDIO_WIRE_TX);
+}
+
+// Which connection each record belongs to while reading a log, by socket.
+typedef std::map<uint16_t, int> xaudio_wire_conns;
+
+// Returns the index of record's connection, counted in the order they were
+// opened: an OPEN is given opened, the number seen so far, and replaces
+// whatever had the socket before. Capture and records on a socket that
+// isn't open get -1. A CLOSE is the last record of its connection.
+static inline int
+xaudio_wire_conn_of(xaudio_wire_conns* conns, xaudio_wire_record const& record, int opened)
+{
+  if (record.type == XAUDIO_WIRE_OPEN)
+  {
+    (*conns)[record.conn] = opened;
+    return opened;
+  }
+  if (record.type == XAUDIO_WIRE_CAPTURE)
+    return -1;
+
+  xaudio_wire_conns::iterator it = conns->find(record.conn);
+  if (it == conns->end())
+    return -1;
+  int const index = it->second;
+  if (record.type == XAUDIO_WIRE_CLOSE)
+    conns->erase(it);
+  return index;
+}
+
+#endif // WIRELOG_H